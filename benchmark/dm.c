@@ -37,9 +37,30 @@
 #include <string.h>
 #include <errno.h>
 #include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
 
 #define min(a,b) ( (a) < (b) ? (a) : (b) )
 
+/* async mode, see stream_thread() */
+struct stream {
+	pthread_t thread;
+	int in_fd, out_fd;
+	unsigned long long in_offs, out_offs, len;
+	volatile unsigned long long done;	/* bytes written */
+	unsigned long long flushes, flush_ns, max_flush_ns;
+	int pattern;
+	int error;
+};
+
+unsigned long buffer_size = 65536;
+unsigned int queue_depth = 1;
+unsigned long flush_every = 0;
+int use_pattern = 0;
+volatile int streams_running;
+
 unsigned long long fsize(int in_fd)
 {
 	struct stat dm_stat;
@@ -112,6 +133,12 @@ void usage(char *prgname)
 		"   --progress          -m\n"
 		"   --performance       -p\n"
 		"   --dialog            -d\n"
+		"   --streams val       -n val\n"
+		"   --queue-depth val   -q val\n"
+		"     with more than one stream or a queue depth above one,\n"
+		"     -o is written with native AIO, each stream its own slice\n"
+		"   --flush-every val   -f val  fdatasync after that many writes\n"
+		"   --time-series       -t      print MB/sec every second\n"
 		"   --help              -h\n", prgname);
 	exit(20);
 
@@ -142,6 +169,231 @@ int connect_to (char *ip, int port)
 	return fd;
 }
 
+unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Linux native AIO, without depending on libaio */
+int io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+int io_getevents(aio_context_t ctx, long min_nr, long nr,
+		 struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/* Keeps queue_depth writes of buffer_size in flight on its slice of the
+ * output. Data comes from the pattern, or is pread() from the input.
+ * With flush_every, the queue is drained every that many writes, and
+ * the fdatasync() that follows is timed. */
+void *stream_thread(void *arg)
+{
+	struct stream *st = arg;
+	unsigned long long pos = 0, t;
+	unsigned long since_flush = 0;
+	struct io_event *events;
+	struct iocb *iocbs, *iocbp;
+	aio_context_t ctx = 0;
+	int *free_slots, nr_free = queue_depth;
+	int in_flight = 0, r, slot;
+	unsigned int i;
+	size_t n;
+	char *bufs = NULL;
+
+	events = calloc(queue_depth, sizeof(*events));
+	iocbs = calloc(queue_depth, sizeof(*iocbs));
+	free_slots = calloc(queue_depth, sizeof(*free_slots));
+	if (!events || !iocbs || !free_slots ||
+	    posix_memalign((void **)&bufs, sysconf(_SC_PAGESIZE),
+			   buffer_size * queue_depth)) {
+		st->error = ENOMEM;
+		goto out;
+	}
+	if (io_setup(queue_depth, &ctx)) {
+		st->error = errno;
+		goto out;
+	}
+
+	if (use_pattern)
+		memset(bufs, st->pattern, buffer_size * queue_depth);
+	for (i = 0; i < queue_depth; i++) {
+		free_slots[i] = i;
+		iocbs[i].aio_data = i;
+		iocbs[i].aio_fildes = st->out_fd;
+		iocbs[i].aio_lio_opcode = IOCB_CMD_PWRITE;
+		iocbs[i].aio_buf = (unsigned long)(bufs + i * buffer_size);
+	}
+
+	for (;;) {
+		if (flush_every && since_flush >= flush_every && !in_flight) {
+			t = now_ns();
+			if (fdatasync(st->out_fd)) {
+				st->error = errno;
+				break;
+			}
+			t = now_ns() - t;
+			st->flushes++;
+			st->flush_ns += t;
+			if (t > st->max_flush_ns)
+				st->max_flush_ns = t;
+			since_flush = 0;
+		}
+
+		while (nr_free && pos < st->len && !st->error &&
+		       (!flush_every || since_flush + in_flight < flush_every)) {
+			slot = free_slots[--nr_free];
+			n = min(buffer_size, st->len - pos);
+			if (!use_pattern &&
+			    pread(st->in_fd, bufs + slot * buffer_size, n,
+				  st->in_offs + pos) != n) {
+				st->error = errno ?: EIO;
+				break;
+			}
+			iocbs[slot].aio_nbytes = n;
+			iocbs[slot].aio_offset = st->out_offs + pos;
+			iocbp = &iocbs[slot];
+			if (io_submit(ctx, 1, &iocbp) != 1) {
+				st->error = errno;
+				break;
+			}
+			pos += n;
+			in_flight++;
+		}
+
+		if (!in_flight)
+			break;
+
+		r = io_getevents(ctx, 1, queue_depth, events, NULL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			st->error = errno;
+			break;
+		}
+		for (i = 0; i < r; i++) {
+			slot = events[i].data;
+			in_flight--;
+			free_slots[nr_free++] = slot;
+			if (events[i].res != iocbs[slot].aio_nbytes) {
+				st->error = events[i].res < 0 ? -events[i].res : EIO;
+				continue;
+			}
+			st->done += events[i].res;
+			since_flush++;
+		}
+	}
+	io_destroy(ctx);
+out:
+	free(bufs);
+	free(free_slots);
+	free(iocbs);
+	free(events);
+	__sync_fetch_and_sub(&streams_running, 1);
+	return NULL;
+}
+
+int run_streams(int in_fd, int out_fd, unsigned long long seek_offs_i,
+		unsigned long long seek_offs_o, unsigned long long size,
+		int nr_streams, int pattern, int time_series,
+		int show_performance)
+{
+	struct stream *streams;
+	unsigned long long slice, t0, now, next, last, done, last_done = 0;
+	unsigned long long flushes = 0, flush_ns = 0, max_flush_ns = 0;
+	double secs;
+	int i, err = 0;
+
+	streams = calloc(nr_streams, sizeof(*streams));
+	if (!streams) {
+		fprintf(stderr, "Can not allocate the stream memory\n");
+		exit(20);
+	}
+
+	/* slices are multiples of the buffer size, so O_DIRECT stays aligned */
+	slice = size / nr_streams / buffer_size * buffer_size;
+	for (i = 0; i < nr_streams; i++) {
+		streams[i].in_fd = in_fd;
+		streams[i].out_fd = out_fd;
+		streams[i].in_offs = seek_offs_i + i * slice;
+		streams[i].out_offs = seek_offs_o + i * slice;
+		streams[i].len = i == nr_streams - 1 ? size - i * slice : slice;
+		streams[i].pattern = pattern;
+	}
+
+	streams_running = nr_streams;
+	t0 = now_ns();
+	last = t0;
+	next = t0 + 1000000000ULL;
+	for (i = 0; i < nr_streams; i++)
+		pthread_create(&streams[i].thread, NULL, stream_thread,
+			       &streams[i]);
+
+	if (time_series)
+		printf("# seconds MB/sec\n");
+	while (streams_running) {
+		poll(NULL, 0, 50);
+		now = now_ns();
+		if (!time_series || now < next)
+			continue;
+		for (done = 0, i = 0; i < nr_streams; i++)
+			done += streams[i].done;
+		printf("%llu %.2f\n", (next - t0) / 1000000000ULL,
+		       (done - last_done) / ((now - last) / 1e9) / (1 << 20));
+		fflush(stdout);
+		last_done = done;
+		last = now;
+		next += 1000000000ULL;
+	}
+
+	for (done = 0, i = 0; i < nr_streams; i++) {
+		pthread_join(streams[i].thread, NULL);
+		if (streams[i].error) {
+			fprintf(stderr, "stream %d: %s\n", i,
+				strerror(streams[i].error));
+			err = 20;
+		}
+		done += streams[i].done;
+		flushes += streams[i].flushes;
+		flush_ns += streams[i].flush_ns;
+		if (streams[i].max_flush_ns > max_flush_ns)
+			max_flush_ns = streams[i].max_flush_ns;
+	}
+	secs = (now_ns() - t0) / 1e9;
+
+	if (show_performance) {
+		printf("%.2f MB/sec (%llu B / %.3f sec, %d streams, "
+		       "queue depth %u)\n",
+		       done / secs / (1 << 20), done, secs, nr_streams,
+		       queue_depth);
+		if (flushes)
+			printf("%llu flushes, avg %.3f ms, max %.3f ms\n",
+			       flushes, flush_ns / 1e6 / flushes,
+			       max_flush_ns / 1e6);
+	}
+	if (done != size)
+		fprintf(stderr, "Could transfer only %lld Byte.\n", done);
+
+	free(streams);
+	return err;
+}
+
 
 int main(int argc, char **argv)
 {
@@ -151,15 +403,14 @@ int main(int argc, char **argv)
 	unsigned long long seek_offs_o = 0;
 	unsigned long long size = -1, rsize;
 	int in_fd = 0, out_fd = 1;
-	unsigned long buffer_size = 65536;
 	unsigned long long target_bw = 0;
 	int o_direct = 0;
 	int do_sync = 0;
 	int show_progress = 0;
 	int show_performance = 0;
 	struct timeval tv1, tv2;
-	int use_pattern = 0;
-	int pattern;
+	int pattern = 0;
+	int nr_streams = 1, time_series = 0;
 	int dialog = 0, show_input_size = 0;
 	int last_percentage = 0;
 
@@ -187,6 +438,10 @@ int main(int argc, char **argv)
 		{"dialog", no_argument, 0, 'd'},
 		{"help", no_argument, 0, 'h'},
 		{"show-input-size", no_argument, 0, 'z'},
+		{"streams", required_argument, 0, 'n'},
+		{"queue-depth", required_argument, 0, 'q'},
+		{"flush-every", required_argument, 0, 'f'},
+		{"time-series", no_argument, 0, 't'},
 		{0, 0, 0, 0}
 	};
 
@@ -194,7 +449,7 @@ int main(int argc, char **argv)
 		usage(argv[0]);
 
 	while (1) {
-		c = getopt_long(argc, argv, "i:o:c:P:b:k:l:s:w:xympha:dz", options, 0);
+		c = getopt_long(argc, argv, "i:o:c:P:b:k:l:s:w:xympha:dzn:q:f:t", options, 0);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -250,6 +505,18 @@ int main(int argc, char **argv)
 		case 'w':
 			target_bw = m_strtol(optarg);
 			break;
+		case 'n':
+			nr_streams = m_strtol(optarg);
+			break;
+		case 'q':
+			queue_depth = m_strtol(optarg);
+			break;
+		case 'f':
+			flush_every = m_strtol(optarg);
+			break;
+		case 't':
+			time_series = 1;
+			break;
 
 		}
 	}
@@ -296,8 +563,7 @@ int main(int argc, char **argv)
 		out_fd = connect_to (connect_target, connect_port);
 	}
 
-	(void)posix_memalign(&buffer, sysconf(_SC_PAGESIZE), buffer_size);
-	if (!buffer) {
+	if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), buffer_size)) {
 		fprintf(stderr, "Can not allocate the Buffer memory\n");
 		exit(20);
 	}
@@ -344,6 +610,29 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
+	if (nr_streams > 1 || queue_depth > 1 || flush_every || time_series) {
+		if (!output_file_name || !nr_streams || !queue_depth ||
+		    target_bw || dialog || show_progress) {
+			fprintf(stderr,
+				"Async mode needs --output-file, and does not do "
+				"--bandwidth, --dialog or --progress.\n");
+			exit(20);
+		}
+		if (size == -1)
+			size = use_pattern ? fsize(out_fd) :
+				min(fsize(in_fd), fsize(out_fd));
+		if (size == -1 || size == 0) {
+			fprintf(stderr, "Can not determine the size, use --size\n");
+			exit(20);
+		}
+		c = run_streams(in_fd, out_fd, seek_offs_i, seek_offs_o, size,
+				nr_streams, pattern, time_series,
+				show_performance);
+		if (do_sync)
+			fsync(out_fd);
+		return c;
+	}
+
 	rsize = size;
 	gettimeofday(&tv1, NULL);
 	while (1) {
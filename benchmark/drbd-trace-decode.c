@@ -0,0 +1,381 @@
+/*
+   drbd-trace-decode.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   drbd is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with drbd; see the file COPYING.  If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ */
+
+/* Decodes the binary event rings of drbd_trace.ko
+ * (modprobe drbd_trace trace_mask=0x713 trace_devs=1)
+ * and prints per stage latency breakdowns, or the raw events.
+ *
+ * compile with gcc -I../drbd -o drbd-trace-decode drbd-trace-decode.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <getopt.h>
+#include <linux/drbd.h>
+
+#define DEFAULT_GLOB "/sys/kernel/debug/drbd_trace/cpu*"
+
+/* wire protocol packet numbers, see enum drbd_packets in drbd_int.h */
+#define P_BARRIER     0x03
+#define P_BARRIER_ACK 0x1c
+
+enum stage {
+	S_AL_SUBMIT,  /* request start -> local submit, includes AL wait */
+	S_LOCAL_DISK, /* local submit -> local completion */
+	S_NET_SEND,   /* request start -> handed over to the network */
+	S_PEER_ACK,   /* handed over to the network -> P_*_ACK received */
+	S_TOTAL,      /* request start -> master bio completion */
+	S_PEER_RECV,  /* secondary: epoch entry allocated -> submitted */
+	S_PEER_DISK,  /* secondary: submitted -> completed */
+	S_PEER_QUEUE, /* secondary: completed -> ack queued */
+	S_BARRIER,    /* P_BARRIER sent -> P_BARRIER_ACK received */
+	S_STAGES
+};
+
+static const char *stage_name[S_STAGES] = {
+	[S_AL_SUBMIT]  = "al+submit",
+	[S_LOCAL_DISK] = "local-disk",
+	[S_NET_SEND]   = "net-send",
+	[S_PEER_ACK]   = "peer-ack",
+	[S_TOTAL]      = "total",
+	[S_PEER_RECV]  = "peer-recv",
+	[S_PEER_DISK]  = "peer-disk",
+	[S_PEER_QUEUE] = "peer-ack-queue",
+	[S_BARRIER]    = "barrier",
+};
+
+struct samples {
+	unsigned long long *v;
+	size_t n, alloc;
+};
+
+#define MAX_MINORS 256
+static struct samples samples[MAX_MINORS][S_STAGES];
+
+/* what we remember about an object in flight */
+enum obj_kind { K_REQ, K_EE, K_BARRIER };
+
+struct obj {
+	unsigned long long block_id;
+	unsigned short minor;
+	unsigned char kind;
+	unsigned char used;
+	unsigned long long ts[TRQ_COMPLETED + 1];
+};
+
+#define OBJ_HASH_SIZE (1 << 16)
+static struct obj objs[OBJ_HASH_SIZE];
+
+static struct obj *obj_lookup(unsigned long long block_id, int minor,
+			      int kind, int create)
+{
+	unsigned long long h = block_id * 0x9e37fffffffc0001ULL ^ minor ^ kind;
+	unsigned int i, n;
+
+	for (n = 0; n < OBJ_HASH_SIZE; n++) {
+		struct obj *o = objs + ((h + n) & (OBJ_HASH_SIZE - 1));
+
+		if (!o->used) {
+			if (!create)
+				return NULL;
+			o->used = 1;
+			o->block_id = block_id;
+			o->minor = minor;
+			o->kind = kind;
+			return o;
+		}
+		if (o->block_id == block_id && o->minor == minor &&
+		    o->kind == kind) {
+			if (create)
+				for (i = 0; i <= TRQ_COMPLETED; i++)
+					o->ts[i] = 0;
+			return o;
+		}
+	}
+	return NULL;
+}
+
+static void add_sample(int minor, enum stage s,
+		       unsigned long long from, unsigned long long to)
+{
+	struct samples *sa = &samples[minor][s];
+
+	if (!from || to < from)
+		return;
+	if (sa->n == sa->alloc) {
+		sa->alloc = sa->alloc ? sa->alloc * 2 : 1024;
+		sa->v = realloc(sa->v, sa->alloc * sizeof(*sa->v));
+		if (!sa->v) {
+			perror("realloc");
+			exit(20);
+		}
+	}
+	sa->v[sa->n++] = to - from;
+}
+
+static void account_req(struct drbd_trace_event *ev)
+{
+	struct obj *o;
+
+	o = obj_lookup(ev->block_id, ev->minor, K_REQ, ev->sub == TRQ_START);
+	if (!o || ev->sub > TRQ_COMPLETED)
+		return;
+	o->ts[ev->sub] = ev->ts_ns;
+
+	switch (ev->sub) {
+	case TRQ_LOCAL_SUBMIT:
+		add_sample(ev->minor, S_AL_SUBMIT, o->ts[TRQ_START], ev->ts_ns);
+		break;
+	case TRQ_LOCAL_DONE:
+		add_sample(ev->minor, S_LOCAL_DISK, o->ts[TRQ_LOCAL_SUBMIT], ev->ts_ns);
+		break;
+	case TRQ_NET_SENT:
+		add_sample(ev->minor, S_NET_SEND, o->ts[TRQ_START], ev->ts_ns);
+		break;
+	case TRQ_NET_ACKED:
+		add_sample(ev->minor, S_PEER_ACK, o->ts[TRQ_NET_SENT], ev->ts_ns);
+		break;
+	case TRQ_COMPLETED:
+		add_sample(ev->minor, S_TOTAL, o->ts[TRQ_START], ev->ts_ns);
+		break;
+	}
+}
+
+static void account_ee(struct drbd_trace_event *ev)
+{
+	struct obj *o;
+
+	o = obj_lookup(ev->block_id, ev->minor, K_EE, ev->sub == TEE_ALLOC);
+	if (!o || ev->sub > TEE_FREE)
+		return;
+	o->ts[ev->sub] = ev->ts_ns;
+
+	switch (ev->sub) {
+	case TEE_SUBMIT:
+		add_sample(ev->minor, S_PEER_RECV, o->ts[TEE_ALLOC], ev->ts_ns);
+		break;
+	case TEE_DONE:
+		add_sample(ev->minor, S_PEER_DISK, o->ts[TEE_SUBMIT], ev->ts_ns);
+		break;
+	case TEE_ACKED:
+		add_sample(ev->minor, S_PEER_QUEUE, o->ts[TEE_DONE], ev->ts_ns);
+		break;
+	}
+}
+
+static void account_barrier(struct drbd_trace_event *ev)
+{
+	struct obj *o;
+
+	if (ev->type == TEV_PACKET_SEND && ev->sub == P_BARRIER) {
+		o = obj_lookup(ev->block_id, ev->minor, K_BARRIER, 1);
+		if (o)
+			o->ts[0] = ev->ts_ns;
+	} else if (ev->type == TEV_PACKET_RECV && ev->sub == P_BARRIER_ACK) {
+		o = obj_lookup(ev->block_id, ev->minor, K_BARRIER, 0);
+		if (o)
+			add_sample(ev->minor, S_BARRIER, o->ts[0], ev->ts_ns);
+	}
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_ev(const void *a, const void *b)
+{
+	const struct drbd_trace_event *x = a, *y = b;
+
+	return x->ts_ns < y->ts_ns ? -1 : x->ts_ns > y->ts_ns;
+}
+
+static unsigned long long percentile(struct samples *sa, double p)
+{
+	size_t i = (size_t)(p / 100.0 * (sa->n - 1) + 0.5);
+
+	return sa->v[i];
+}
+
+static void print_breakdown(void)
+{
+	unsigned long long sum;
+	struct samples *sa;
+	int minor, s;
+	size_t i;
+
+	printf("%5s %-15s %10s %10s %10s %10s %10s %10s\n", "minor", "stage",
+	       "count", "avg[us]", "p50[us]", "p99[us]", "p99.9[us]", "max[us]");
+
+	for (minor = 0; minor < MAX_MINORS; minor++) {
+		for (s = 0; s < S_STAGES; s++) {
+			sa = &samples[minor][s];
+			if (!sa->n)
+				continue;
+			qsort(sa->v, sa->n, sizeof(*sa->v), cmp_ull);
+			for (sum = 0, i = 0; i < sa->n; i++)
+				sum += sa->v[i];
+			printf("%5d %-15s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			       minor, stage_name[s], sa->n,
+			       sum / 1000.0 / sa->n,
+			       percentile(sa, 50) / 1000.0,
+			       percentile(sa, 99) / 1000.0,
+			       percentile(sa, 99.9) / 1000.0,
+			       sa->v[sa->n - 1] / 1000.0);
+		}
+	}
+}
+
+static void print_raw(struct drbd_trace_event *ev, size_t n)
+{
+	static const char *type_name[] = {
+		[TEV_PACKET_SEND] = "send",
+		[TEV_PACKET_RECV] = "recv",
+		[TEV_REQ] = "req",
+		[TEV_BIO] = "bio",
+		[TEV_EE] = "ee",
+		[TEV_AL] = "al",
+		[TEV_EPOCH] = "epoch",
+	};
+	unsigned long long t0 = n ? ev[0].ts_ns : 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		printf("%14.3f %3u %-5s %3u sec %12llu size %7u id %llx\n",
+		       (ev[i].ts_ns - t0) / 1000.0, ev[i].minor,
+		       ev[i].type <= TEV_EPOCH ? type_name[ev[i].type] : "?",
+		       ev[i].sub, (unsigned long long)ev[i].sector,
+		       ev[i].size, (unsigned long long)ev[i].block_id);
+}
+
+static struct drbd_trace_event *read_events(const char *file,
+					    struct drbd_trace_event *ev,
+					    size_t *n, size_t *alloc)
+{
+	ssize_t rr;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open(%s): %m\n", file);
+		exit(20);
+	}
+	for (;;) {
+		if (*alloc - *n < 1024) {
+			*alloc = *alloc ? *alloc * 2 : 65536;
+			ev = realloc(ev, *alloc * sizeof(*ev));
+			if (!ev) {
+				perror("realloc");
+				exit(20);
+			}
+		}
+		rr = read(fd, ev + *n, (*alloc - *n) * sizeof(*ev));
+		if (rr < 0) {
+			fprintf(stderr, "read(%s): %m\n", file);
+			exit(20);
+		}
+		if (rr == 0)
+			break;
+		*n += rr / sizeof(*ev);
+	}
+	close(fd);
+	return ev;
+}
+
+static void usage(const char *prgname)
+{
+	fprintf(stderr,
+		"Usage: %s [-r] [file...]\n"
+		"  Reads drbd_trace events from the given files, or from\n"
+		"  " DEFAULT_GLOB ", and prints per stage\n"
+		"  latencies per minor.\n"
+		"  -r  print the raw events, ordered by time, instead\n",
+		prgname);
+	exit(20);
+}
+
+int main(int argc, char **argv)
+{
+	struct drbd_trace_event *ev = NULL;
+	size_t n = 0, alloc = 0, i;
+	int raw = 0, c;
+	glob_t g;
+
+	while ((c = getopt(argc, argv, "rh")) != -1) {
+		switch (c) {
+		case 'r':
+			raw = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind < argc) {
+		for (; optind < argc; optind++)
+			ev = read_events(argv[optind], ev, &n, &alloc);
+	} else {
+		if (glob(DEFAULT_GLOB, 0, NULL, &g)) {
+			fprintf(stderr, "no %s, is drbd_trace loaded?\n",
+				DEFAULT_GLOB);
+			exit(20);
+		}
+		for (i = 0; i < g.gl_pathc; i++)
+			ev = read_events(g.gl_pathv[i], ev, &n, &alloc);
+		globfree(&g);
+	}
+
+	/* the per cpu rings are each in order, but not with each other */
+	qsort(ev, n, sizeof(*ev), cmp_ev);
+
+	if (raw) {
+		print_raw(ev, n);
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (ev[i].minor >= MAX_MINORS)
+			continue;
+		switch (ev[i].type) {
+		case TEV_REQ:
+			account_req(ev + i);
+			break;
+		case TEV_EE:
+			account_ee(ev + i);
+			break;
+		case TEV_PACKET_SEND:
+		case TEV_PACKET_RECV:
+			account_barrier(ev + i);
+			break;
+		}
+	}
+	print_breakdown();
+	return 0;
+}
@@ -28,16 +28,22 @@
 
 // compile with gcc -pthread -o io-latency-test io-latency-test.c
 
-#include <sys/poll.h>
-#include <sys/time.h>
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
 #include <getopt.h>
-#include <math.h>
 
 #define MONITOR_TIME 300000
 // Check every 300 milliseconds. (3.33 times per second)
@@ -45,278 +51,629 @@
 #define RECORD_TIME 20000
 // Try to write a record every 20 milliseconds (50 per second)
 
-#define PERCENTILE 90
+/* HDR style histogram: values below 2^(SUB_BITS+1) ns are exact, above
+   that every power of two is split into 2^SUB_BITS linear buckets, so
+   the reported percentiles are off by less than 1%. */
+#define SUB_BITS 7
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_SHIFT (40 - SUB_BITS) // up to 2^40 ns, ~18 minutes
+#define HIST_BUCKETS ((MAX_SHIFT + 2) * SUB_COUNT)
 
+enum output_format { OUT_TEXT, OUT_CSV, OUT_JSON };
 
 unsigned int monitor_time=MONITOR_TIME;
 unsigned int record_time=RECORD_TIME;
-unsigned long records=0;
-
-struct shared_data {
-	pthread_mutex_t mutex;
-	unsigned long record_nr;
-	unsigned int write_duration_us;
-	unsigned int write_duration_records;
-	unsigned int max_write_duration_us;
-	double avg_write_duration;
+unsigned long records=0;       // per thread, 0 = unlimited
+unsigned int run_time=0;       // seconds, 0 = unlimited
+unsigned int threads=1;
+unsigned int queue_depth=1;
+unsigned int block_size=4096;
+unsigned long long file_size=64ULL << 20;
+int random_io=0;
+int o_direct=0;
+int o_dsync=0;
+enum output_format output=OUT_TEXT;
+
+volatile int stop=0;
+volatile int finished=0;
+
+struct thread_data {
+	pthread_t thread;
+	int id;
+	int fd;
+	unsigned long long base, len; // region for sequential writes
+	unsigned long long seed;
+
+	// read by the watch dog without locking
+	volatile unsigned long long ios;
+	volatile unsigned long long lat_sum_ns;
+
+	unsigned long long min_ns, max_ns;
+	unsigned long long hist[HIST_BUCKETS];
+	int error;
 };
 
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_index(unsigned long long v)
+{
+	int msb = 63 - __builtin_clzll(v | 1);
+	int shift = msb > SUB_BITS ? msb - SUB_BITS : 0;
+
+	if (shift > MAX_SHIFT)
+		return HIST_BUCKETS - 1;
+	return shift * SUB_COUNT + (v >> shift);
+}
+
+/* highest value that falls into bucket i */
+static unsigned long long hist_value(int i)
+{
+	int shift = i < 2 * SUB_COUNT ? 0 : i / SUB_COUNT - 1;
+
+	return ((unsigned long long)(i - shift * SUB_COUNT) << shift) +
+		(1ULL << shift) - 1;
+}
+
+static void record_latency(struct thread_data *td, unsigned long long lat)
+{
+	td->hist[hist_index(lat)]++;
+	if (lat < td->min_ns)
+		td->min_ns = lat;
+	if (lat > td->max_ns)
+		td->max_ns = lat;
+	td->lat_sum_ns += lat;
+	td->ios++;
+}
+
+static unsigned long long hist_percentile(unsigned long long *hist,
+					  unsigned long long total, double p)
+{
+	unsigned long long want = (unsigned long long)(p / 100.0 * total + 0.5);
+	unsigned long long seen = 0;
+	int i;
+
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= want)
+			return hist_value(i);
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+/* the bucket's highest value may be above the exact maximum */
+static double percentile_us(unsigned long long *hist, unsigned long long total,
+			    double p, unsigned long long max_ns)
+{
+	unsigned long long v = hist_percentile(hist, total, p);
+
+	return (v < max_ns ? v : max_ns) / 1000.0;
+}
+
+static unsigned long long next_offset(struct thread_data *td, unsigned long long n)
+{
+	unsigned long long blocks;
+
+	if (!random_io)
+		return td->base + (n * block_size) % td->len;
+
+	// xorshift64*
+	td->seed ^= td->seed >> 12;
+	td->seed ^= td->seed << 25;
+	td->seed ^= td->seed >> 27;
+	blocks = file_size / block_size;
+	return (td->seed * 2685821657736338717ULL) % blocks * block_size;
+}
+
+/* Each block starts with a text line, so that after a freeze you can
+   still see which record was completely written. */
+static void fill_record(struct thread_data *td, char *buf, unsigned long long n)
+{
+	struct timespec ts;
+	struct tm now_tm;
+	int l;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	localtime_r(&ts.tv_sec, &now_tm);
+	memset(buf, ' ', block_size);
+	l = snprintf(buf, block_size,
+		     "%04d-%02d-%02d %02d:%02d:%02d.%06ld: "
+		     "Record number: %-6llu thread: %d",
+		     1900+ now_tm.tm_year, 1+ now_tm.tm_mon, now_tm.tm_mday,
+		     now_tm.tm_hour, now_tm.tm_min, now_tm.tm_sec,
+		     ts.tv_nsec / 1000, n, td->id);
+	if (l < (int)block_size)
+		buf[l] = ' ';
+	buf[block_size - 1] = '\n';
+}
+
+static void pace(unsigned long long *next)
+{
+	unsigned long long now;
+
+	if (!record_time)
+		return;
+	now = now_ns();
+	if (*next > now)
+		usleep((*next - now) / 1000);
+	*next += record_time * 1000ULL;
+}
+
+static int more(unsigned long long n)
+{
+	return !stop && (!records || n < records);
+}
+
+static void *write_sync(struct thread_data *td)
+{
+	unsigned long long n, t, next = now_ns();
+	char *buf;
+
+	if (posix_memalign((void **)&buf, 4096, block_size)) {
+		td->error = ENOMEM;
+		return NULL;
+	}
+
+	for (n = 0; more(n); n++) {
+		pace(&next);
+		fill_record(td, buf, n);
+		t = now_ns();
+		if (pwrite(td->fd, buf, block_size, next_offset(td, n)) != block_size) {
+			td->error = errno ?: EIO;
+			break;
+		}
+		// from buffer cache to disk, unless O_DSYNC does it for us.
+		if (!o_dsync && fdatasync(td->fd)) {
+			td->error = errno;
+			break;
+		}
+		record_latency(td, now_ns() - t);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Linux native AIO, without depending on libaio */
+static int io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long nr,
+			struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static void *write_aio(struct thread_data *td)
+{
+	unsigned long long submitted = 0, next = now_ns();
+	unsigned long long *start;
+	struct io_event *events;
+	struct iocb *iocbs, *iocbp;
+	aio_context_t ctx = 0;
+	char *bufs;
+	int in_flight = 0, i, r;
+
+	start = calloc(queue_depth, sizeof(*start));
+	events = calloc(queue_depth, sizeof(*events));
+	iocbs = calloc(queue_depth, sizeof(*iocbs));
+	if (!start || !events || !iocbs ||
+	    posix_memalign((void **)&bufs, 4096, (size_t)block_size * queue_depth)) {
+		td->error = ENOMEM;
+		return NULL;
+	}
+	if (io_setup(queue_depth, &ctx)) {
+		td->error = errno;
+		return NULL;
+	}
+
+	for (i = 0; i < (int)queue_depth && more(submitted); i++) {
+		iocbs[i].aio_data = i;
+		iocbs[i].aio_fildes = td->fd;
+		iocbs[i].aio_lio_opcode = IOCB_CMD_PWRITE;
+		iocbs[i].aio_buf = (unsigned long)(bufs + (size_t)i * block_size);
+		iocbs[i].aio_nbytes = block_size;
+	}
+
+	for (i = 0; i < (int)queue_depth && more(submitted); i++) {
+		pace(&next);
+		fill_record(td, bufs + (size_t)i * block_size, submitted);
+		iocbs[i].aio_offset = next_offset(td, submitted++);
+		iocbp = &iocbs[i];
+		start[i] = now_ns();
+		if (io_submit(ctx, 1, &iocbp) != 1) {
+			td->error = errno;
+			goto out;
+		}
+		in_flight++;
+	}
+
+	while (in_flight) {
+		r = io_getevents(ctx, 1, queue_depth, events, NULL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			td->error = errno;
+			break;
+		}
+		for (i = 0; i < r; i++) {
+			int slot = events[i].data;
+
+			in_flight--;
+			if (events[i].res != block_size) {
+				td->error = events[i].res < 0 ? -events[i].res : EIO;
+				stop = 1;
+				continue;
+			}
+			record_latency(td, now_ns() - start[slot]);
+
+			if (!more(submitted))
+				continue;
+			pace(&next);
+			fill_record(td, bufs + (size_t)slot * block_size, submitted);
+			iocbs[slot].aio_offset = next_offset(td, submitted++);
+			iocbp = &iocbs[slot];
+			start[slot] = now_ns();
+			if (io_submit(ctx, 1, &iocbp) != 1) {
+				td->error = errno;
+				stop = 1;
+				continue;
+			}
+			in_flight++;
+		}
+	}
+out:
+	io_destroy(ctx);
+	free(bufs);
+	free(iocbs);
+	free(events);
+	free(start);
+	return NULL;
+}
+
+void* io_thread(void *arg)
+{
+	struct thread_data *td = arg;
+
+	return queue_depth > 1 ? write_aio(td) : write_sync(td);
+}
+
 void* wd_thread(void *arg)
 {
-	struct shared_data *data = (struct shared_data*) arg;
-	unsigned long last_record_nr=-1, current_record_nr=0;
-	unsigned int avg_write,wd,wr,mwd;
-	double avg_write_duration;
+	struct thread_data *tds = arg;
+	unsigned long long ios, lat_sum, last_ios = 0, last_lat_sum = 0;
+	unsigned long long blocked_since = 0;
+	FILE *out = output == OUT_TEXT ? stdout : stderr;
+	unsigned int i;
 
 	enum { IO_RUNNING, IO_BLOCKED } io_state = IO_RUNNING;
 
-	while(1) {
+	while(!finished) {
 		usleep(monitor_time); // sleep some milliseconds
 
-		pthread_mutex_lock(&data->mutex);
-		current_record_nr = data->record_nr;
-		wd = data->write_duration_us;
-		wr = data->write_duration_records;
-		mwd = data->max_write_duration_us;
-		data->write_duration_us = 0;
-		data->write_duration_records = 0;
-		data->max_write_duration_us = 0;
-		avg_write_duration = data->avg_write_duration;
-		pthread_mutex_unlock(&data->mutex);
-
-		if( records && current_record_nr == records) break;
+		for (ios = 0, lat_sum = 0, i = 0; i < threads; i++) {
+			ios += tds[i].ios;
+			lat_sum += tds[i].lat_sum_ns;
+		}
 
 		switch(io_state) {
 		case IO_RUNNING:
-			if(current_record_nr == last_record_nr) {
-				printf("IO got frozen. Last completely "
-				       "written record: %lu"
-				       "                        \n",
-				       last_record_nr);
+			if(ios == last_ios) {
+				if (finished || stop)
+					break;
+				fprintf(out, "IO got frozen. Last completely "
+					"written record: %llu"
+					"                        \n",
+					ios);
 				io_state = IO_BLOCKED;
-			} else {
-				if(wr==0) wr=1;
-				avg_write = wd/wr;
-
-				printf("Current record: %lu "
-				       "( cur. write duration %d.%02dms; "
-				       "avg. wd. %.2fms)\r",
-				       current_record_nr,
-				       avg_write/1000,(avg_write%1000)/10,
-				       avg_write_duration/1000);
+				blocked_since = now_ns();
+			} else if (output == OUT_TEXT) {
+				printf("Current record: %llu "
+				       "( cur. write duration %.2fms)   \r",
+				       ios, (double)(lat_sum - last_lat_sum) /
+				       (ios - last_ios) / 1000000);
 				fflush(stdout);
 			}
-			last_record_nr = current_record_nr;
+			break;
 		case IO_BLOCKED:
-			if(current_record_nr != last_record_nr) {
-				printf("IO just resumed. Blocked for %d.%02dms\n",
-				       mwd/1000, (mwd%1000)/10);
+			if(ios != last_ios) {
+				fprintf(out, "IO just resumed. Blocked for %.2fms\n",
+					(double)(now_ns() - blocked_since) / 1000000);
 				io_state = IO_RUNNING;
 			}
 		}
+		last_ios = ios;
+		last_lat_sum = lat_sum;
 	}
-	if(io_state == IO_RUNNING) printf("\n");
+	if(output == OUT_TEXT) printf("\n");
+	return NULL;
 }
 
 void usage(char *prgname)
 {
 	fprintf(stderr, "USAGE: %s [options] recordfile\n"
 		"  Available options:\n"
-		"   --records val         -n val\n"
-		"   --record-interval-ms  -r val\n"
-		"   --monitor-interval-ms -m val\n",
+		"   --records val          -n val  records per thread, 0: unlimited\n"
+		"   --time sec             -T val  stop after that many seconds\n"
+		"   --record-interval-ms   -r val  per thread and queue slot, 0: no pause\n"
+		"   --monitor-interval-ms  -m val\n"
+		"   --threads val          -t val\n"
+		"   --queue-depth val      -q val  >1 uses Linux native AIO\n"
+		"   --block-size val       -b val  in bytes, default 4096\n"
+		"   --size val             -s val  in MiB, region to write into\n"
+		"   --random               -R\n"
+		"   --direct               -d      O_DIRECT\n"
+		"   --dsync                -D      O_DSYNC instead of fdatasync()\n"
+		"   --output text|csv|json -o val\n"
+		"  With queue depth 1 every write is followed by fdatasync(),\n"
+		"  unless --dsync is given. With a higher queue depth, use --dsync\n"
+		"  to measure up to stable storage, and --direct, because buffered\n"
+		"  AIO is synchronous.\n",
 		prgname);
 	exit(20);
 }
 
-int cmp_int(const void *v1, const void *v2)
+static void sigint(int sig)
 {
-	const int *i1 = (int *) v1;
-	const int *i2 = (int *) v2;
-
-	return *i1 == *i2 ? 0 : ( *i1 < *i2 ? -1 : +1 );
+	stop = 1;
 }
 
 int main(int argc, char** argv)
 {
 	pthread_t watch_dog;
-	unsigned long record_nr=0;
-	FILE* record_f;
-
-	struct timeval now_tv, then_tv;
-	struct tm now_tm;
-	int write_duration_us=0;
-	int min_wd=(1<<30), max_wd=0;
-	double avg_write_duration;
-	int avg_wd_nr=0,c;
-	int *all_write_durations = NULL;
-
-	int median=0;
-	double std_deviation=0;
-	int rp;
-
-	struct shared_data data;
+	struct thread_data *tds;
+	unsigned long long *hist, total = 0, lat_sum = 0;
+	unsigned long long min_ns = ~0ULL, max_ns = 0, t0, t1;
+	double secs, p50, p90, p99, p999;
+	sigset_t sigs;
+	struct sigaction sa;
+	unsigned int i;
+	int c, j, flags, err = 0;
 
 	static struct option options[] = {
 		{"records", required_argument, 0, 'n'},
+		{"time", required_argument, 0, 'T'},
 		{"record-interval-ms", required_argument, 0, 'r'},
 		{"monitor-interval-ms", required_argument, 0, 'm'},
+		{"threads", required_argument, 0, 't'},
+		{"queue-depth", required_argument, 0, 'q'},
+		{"block-size", required_argument, 0, 'b'},
+		{"size", required_argument, 0, 's'},
+		{"random", no_argument, 0, 'R'},
+		{"direct", no_argument, 0, 'd'},
+		{"dsync", no_argument, 0, 'D'},
+		{"output", required_argument, 0, 'o'},
 		{0, 0, 0, 0 }
 	};
 
 	while (1) {
-		c = getopt_long(argc, argv, "n:r:m:", options, 0);
+		c = getopt_long(argc, argv, "n:T:r:m:t:q:b:s:RdDo:", options, 0);
 		if (c == -1)
 			break;
 		switch (c) {
 		case 'n':
 			records = atol(optarg);
 			break;
+		case 'T':
+			run_time = atoi(optarg);
+			break;
 		case 'r':
 			record_time = atoi(optarg) * 1000;
 			break;
 		case 'm':
 			monitor_time = atoi(optarg) * 1000;
 			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			break;
+		case 'b':
+			block_size = atoi(optarg);
+			break;
+		case 's':
+			file_size = strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'R':
+			random_io = 1;
+			break;
+		case 'd':
+			o_direct = 1;
+			break;
+		case 'D':
+			o_dsync = 1;
+			break;
+		case 'o':
+			if (!strcmp(optarg, "text"))
+				output = OUT_TEXT;
+			else if (!strcmp(optarg, "csv"))
+				output = OUT_CSV;
+			else if (!strcmp(optarg, "json"))
+				output = OUT_JSON;
+			else
+				usage(argv[0]);
+			break;
 		default:
 			usage(argv[0]);
 		}
 	}
 
-	if(optind != argc-1) {
+	if(optind != argc-1 || !threads || !queue_depth || block_size < 512 ||
+	   file_size < (unsigned long long)block_size * threads) {
 		usage(argv[0]);
 	}
 
-	if(!(record_f = fopen(argv[optind],"w"))) {
-		perror("fopen:");
-		fprintf(stderr,"Failed to open '%s' for writing\n",
-			argv[optind]);
+	tds = calloc(threads, sizeof(*tds));
+	hist = calloc(HIST_BUCKETS, sizeof(*hist));
+	if (!tds || !hist) {
+		fprintf(stderr, "Malloc failed\n");
 		return 10;
 	}
 
-	if (records) {
-		all_write_durations = calloc(records, sizeof(int));
-		if (all_write_durations == NULL) {
-			fprintf(stderr, "Malloc failed\n");
+	flags = O_WRONLY | O_CREAT;
+	if (o_direct)
+		flags |= O_DIRECT;
+	if (o_dsync)
+		flags |= O_DSYNC;
+
+	for (i = 0; i < threads; i++) {
+		tds[i].id = i;
+		tds[i].fd = open(argv[optind], flags, 0644);
+		if (tds[i].fd < 0) {
+			perror("open:");
+			fprintf(stderr,"Failed to open '%s' for writing\n",
+				argv[optind]);
 			return 10;
 		}
+		tds[i].len = file_size / threads / block_size * block_size;
+		tds[i].base = tds[i].len * i;
+		tds[i].seed = 0x2545f4914f6cdd1dULL * (i + 1);
+		tds[i].min_ns = ~0ULL;
 	}
 
-	printf("\n"
-	       "This programm writes records to a file, shows the write latency\n"
-	       "of the file system and block device combination and informs\n"
-	       "you in case IO completely stalls.\n\n"
-	       "  Due to the nature of the 'D' process state on Linux\n"
-	       "  (and other Unix operating systems) you can not kill this\n"
-	       "  test programm while IO is frozen. You have to kill it with\n"
-	       "  Ctrl-C (SIGINT) while IO is running.\n\n"
-	       "In case the record file's block device freezes, this "
-	       "program will\n"
-	       "inform you here which record was completely written before it "
-	       "freezed.\n\n"
-	       );
-
-	pthread_mutex_init(&data.mutex,NULL);
-	data.record_nr = record_nr;
-	data.write_duration_us = 0;
-	data.write_duration_records = 1;
-	data.max_write_duration_us = 0;
-	pthread_create(&watch_dog,NULL,wd_thread,&data);
-
-	for( ; !records || record_nr < records ; record_nr++) {
-		gettimeofday(&now_tv, NULL);
-		localtime_r(&now_tv.tv_sec,&now_tm);
-
-		fprintf(record_f,
-			"%04d-%02d-%02d %02d:%02d:%02d.%06ld: "
-			"Record number: %-6lu "
-			"(L.r.w.t.: %d.%02dms)\n",
-			1900+ now_tm.tm_year,
-			1+ now_tm.tm_mon,
-			now_tm.tm_mday,
-			now_tm.tm_hour,
-			now_tm.tm_min,
-			now_tm.tm_sec,
-			now_tv.tv_usec,
-			record_nr,
-			write_duration_us/1000,
-			(write_duration_us%1000)/10);
-
-		if(fflush(record_f)) { // flush it from glibc to the kernel.
-			perror("fflush:");
-			return 10;
-		}
-		if(fdatasync(fileno(record_f))) { // from buffer cache to disk.
-			perror("fdatasync:");
-			return 10;
-		}
-		// eventually wait for full record_time
-		gettimeofday(&then_tv, NULL);
-		write_duration_us =
-			( (then_tv.tv_sec  - now_tv.tv_sec ) * 1000000 +
-			  (then_tv.tv_usec - now_tv.tv_usec) );
-
-		if (write_duration_us < monitor_time) {
-			if(write_duration_us < min_wd) min_wd = write_duration_us;
-			if(write_duration_us > max_wd) max_wd = write_duration_us;
-
-			avg_write_duration =
-				(avg_write_duration * avg_wd_nr +
-				 write_duration_us) / (++avg_wd_nr);
-
-			if (all_write_durations)
-				all_write_durations[record_nr] = write_duration_us;
-		}
+	if (output == OUT_TEXT)
+		printf("\n"
+		       "This programm writes records to a file, shows the write latency\n"
+		       "of the file system and block device combination and informs\n"
+		       "you in case IO completely stalls.\n\n"
+		       "  Due to the nature of the 'D' process state on Linux\n"
+		       "  (and other Unix operating systems) you can not kill this\n"
+		       "  test programm while IO is frozen. You have to kill it with\n"
+		       "  Ctrl-C (SIGINT) while IO is running.\n\n"
+		       "In case the record file's block device freezes, this "
+		       "program will\n"
+		       "inform you here which record was completely written before it "
+		       "freezed.\n\n"
+		       );
+
+	/* Only the main thread handles SIGINT, and then lets the
+	   io threads finish their in flight requests. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGALRM, &sa, NULL);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	t0 = now_ns();
+	for (i = 0; i < threads; i++)
+		pthread_create(&tds[i].thread, NULL, io_thread, &tds[i]);
+	pthread_create(&watch_dog,NULL,wd_thread,tds);
+
+	pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+	if (run_time)
+		alarm(run_time);
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tds[i].thread, NULL);
+	t1 = now_ns();
+	finished = 1;
+	pthread_join(watch_dog,NULL);
 
-		pthread_mutex_lock(&data.mutex);
-		data.record_nr = record_nr;
-		data.write_duration_us += write_duration_us;
-		data.write_duration_records++;
-		data.avg_write_duration = avg_write_duration;
-		if (write_duration_us > data.max_write_duration_us)
-			data.max_write_duration_us = write_duration_us;
-		pthread_mutex_unlock(&data.mutex);
-
-		if(write_duration_us < record_time ) {
-			usleep(record_time - write_duration_us);
+	for (i = 0; i < threads; i++) {
+		if (tds[i].error) {
+			fprintf(stderr, "thread %u: %s\n", i, strerror(tds[i].error));
+			err = 10;
 		}
+		for (j = 0; j < HIST_BUCKETS; j++)
+			hist[j] += tds[i].hist[j];
+		total += tds[i].ios;
+		lat_sum += tds[i].lat_sum_ns;
+		if (tds[i].min_ns < min_ns)
+			min_ns = tds[i].min_ns;
+		if (tds[i].max_ns > max_ns)
+			max_ns = tds[i].max_ns;
+	}
+	if (!total) {
+		fprintf(stderr, "No records written\n");
+		return err ?: 10;
 	}
 
-	pthread_mutex_lock(&data.mutex);
-	data.record_nr = record_nr;
-	pthread_mutex_unlock(&data.mutex);
-
-	pthread_join(watch_dog,NULL);
-
-	if (all_write_durations) {
-		qsort(all_write_durations, records, sizeof(int), &cmp_int);
-
-		median = all_write_durations[records/2];
-		printf("median = %5.2f\n", (double)median/1000);
-
-		rp = records * (100-PERCENTILE) / 100;
-
-		for (record_nr = rp/2;
-		     record_nr < records - rp/2;
-		     record_nr++) {
-			/* printf("records[%lu] = %5.2f \n", record_nr,
-			   (double)all_write_durations[record_nr]/1000); */
-			std_deviation += pow((double)(all_write_durations[record_nr] - median)/1000, 2);
+	secs = (t1 - t0) / 1e9;
+	p50 = percentile_us(hist, total, 50, max_ns);
+	p90 = percentile_us(hist, total, 90, max_ns);
+	p99 = percentile_us(hist, total, 99, max_ns);
+	p999 = percentile_us(hist, total, 99.9, max_ns);
+
+	switch (output) {
+	case OUT_TEXT:
+		printf( "STATS: %u thread(s), queue depth %u, %u byte %s writes%s%s\n"
+			"  +---------------------------------< records written [ 1 ]\n"
+			"  |         +------------------------< IOPS [ 1/s ]\n"
+			"  |         |         +---------------< average (arithmetic) [ ms ]\n"
+			"  |         |         |       +-------< shortest write [ ms ]\n"
+			"  |         |         |       |       +-< p50, p90, p99, p99.9, longest write [ ms ]\n"
+			"  ^         ^         ^       ^       ^\n"
+			" %-9llu %-9.1f %-7.3f %-7.3f %.3f, %.3f, %.3f, %.3f, %.3f\n",
+			threads, queue_depth, block_size,
+			random_io ? "random" : "sequential",
+			o_direct ? ", O_DIRECT" : "", o_dsync ? ", O_DSYNC" : "",
+			total, total / secs, (double)lat_sum / total / 1000000,
+			min_ns / 1000000.0, p50 / 1000, p90 / 1000, p99 / 1000,
+			p999 / 1000, max_ns / 1000000.0);
+		break;
+	case OUT_CSV:
+		printf("threads,queue_depth,block_size,pattern,direct,dsync,records,"
+		       "seconds,iops,mb_per_sec,min_us,avg_us,p50_us,p90_us,"
+		       "p99_us,p99_9_us,max_us\n");
+		printf("%u,%u,%u,%s,%d,%d,%llu,%.3f,%.1f,%.2f,%.1f,%.1f,%.1f,"
+		       "%.1f,%.1f,%.1f,%.1f\n",
+		       threads, queue_depth, block_size,
+		       random_io ? "random" : "sequential", o_direct, o_dsync,
+		       total, secs, total / secs,
+		       total * block_size / secs / (1 << 20),
+		       min_ns / 1000.0, (double)lat_sum / total / 1000,
+		       p50, p90, p99, p999, max_ns / 1000.0);
+		break;
+	case OUT_JSON:
+		printf("{\n"
+		       "  \"threads\": %u,\n  \"queue_depth\": %u,\n"
+		       "  \"block_size\": %u,\n  \"pattern\": \"%s\",\n"
+		       "  \"direct\": %s,\n  \"dsync\": %s,\n"
+		       "  \"records\": %llu,\n  \"seconds\": %.3f,\n"
+		       "  \"iops\": %.1f,\n  \"mb_per_sec\": %.2f,\n"
+		       "  \"latency_us\": { \"min\": %.1f, \"avg\": %.1f, "
+		       "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+		       "\"p99.9\": %.1f, \"max\": %.1f },\n"
+		       "  \"histogram_us\": [",
+		       threads, queue_depth, block_size,
+		       random_io ? "random" : "sequential",
+		       o_direct ? "true" : "false", o_dsync ? "true" : "false",
+		       total, secs, total / secs,
+		       total * block_size / secs / (1 << 20),
+		       min_ns / 1000.0, (double)lat_sum / total / 1000,
+		       p50, p90, p99, p999, max_ns / 1000.0);
+		for (c = 0, j = 0; j < HIST_BUCKETS; j++) {
+			if (!hist[j])
+				continue;
+			// [ highest value in bucket, count ]
+			printf("%s\n    [%.3f, %llu]", c++ ? "," : "",
+			       hist_value(j) / 1000.0, hist[j]);
 		}
-
-		std_deviation = sqrt(std_deviation / (records - rp) );
+		printf("\n  ]\n}\n");
+		break;
 	}
 
-	printf( "STATS:\n"
-		"  +---------------------------------< records written [ 1 ]\n"
-		"  |      +----------------------------< average (arithmetic) [ ms ]\n"
-		"  |      |      +-----------------------< shortes write [ ms ]\n"
-		"  |      |      |      +------------------< longes write (<%dms) [ ms ]\n"
-		"  |      |      |      |      +-------------< %d%% percentile median [ ms ]\n"
-		"  |      |      |      |      |      +--------< %d%% percentile standard deviation [ ms ]\n"
-		"  ^      ^      ^      ^      ^      ^\n"
-                " %4lu, %5.2f, %5.2f, %5.2f, %5.2f, %5.2f\n",
-		monitor_time/1000, PERCENTILE, PERCENTILE, records, avg_write_duration/1000,
-		(double)min_wd/1000, (double)max_wd/1000, (double)median/1000, std_deviation);
+	return err;
 }
-
@@ -24,8 +24,10 @@
  */
 
 #include <linux/slab.h>
+#include <linux/kref.h>
 #include <linux/drbd.h>
 #include <linux/dynamic_debug.h>
+#include <linux/rcupdate.h>
 #include "drbd_int.h"
 #include "drbd_tracing.h"
 #include "drbd_wrappers.h"
@@ -59,6 +61,8 @@ struct update_al_work {
 
 
 int w_al_write_transaction(struct drbd_conf *, struct drbd_work *, int);
+STATIC void drbd_al_write_transaction(struct drbd_conf *, struct lc_element *,
+				      const unsigned int, const unsigned int);
 
 /* The actual tracepoint needs to have constant number of known arguments...
  */
@@ -71,21 +75,58 @@ void trace_drbd_resync(struct drbd_conf *mdev, int level, const char *fmt, ...)
 	va_end(ap);
 }
 
+static struct drbd_md_io *_drbd_md_try_get(struct drbd_conf *mdev)
+{
+	int i;
+
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++)
+		if (atomic_cmpxchg(&mdev->md_io[i].in_use, 0, 1) == 0)
+			return &mdev->md_io[i];
+	return NULL;
+}
+
+static struct drbd_md_io *md_io_of(struct drbd_conf *mdev, void *buffer)
+{
+	int i;
+
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++)
+		if (page_address(mdev->md_io[i].page) == buffer)
+			return &mdev->md_io[i];
+	return NULL;
+}
+
+/**
+ * drbd_md_get_buffer() - Get one of the meta data IO buffers
+ * @mdev:	DRBD device.
+ *
+ * Waits for a free buffer, returns NULL if the disk failed meanwhile.
+ * Independent meta data updates may each hold a buffer, and have their IO
+ * in flight at the same time.
+ */
 void *drbd_md_get_buffer(struct drbd_conf *mdev)
 {
-	int r;
+	struct drbd_md_io *md_io;
 
 	wait_event(mdev->misc_wait,
-		   (r = atomic_cmpxchg(&mdev->md_io_in_use, 0, 1)) == 0 ||
+		   (md_io = _drbd_md_try_get(mdev)) != NULL ||
 		   mdev->state.disk <= D_FAILED);
 
-	return r ? NULL : page_address(mdev->md_io_page);
+	return md_io ? page_address(md_io->page) : NULL;
 }
 
-void drbd_md_put_buffer(struct drbd_conf *mdev)
+void drbd_md_io_put(struct drbd_md_io *md_io)
 {
-	if (atomic_dec_and_test(&mdev->md_io_in_use))
-		wake_up(&mdev->misc_wait);
+	if (atomic_dec_and_test(&md_io->in_use))
+		wake_up(&md_io->mdev->misc_wait);
+}
+
+void drbd_md_put_buffer(struct drbd_conf *mdev, void *buffer)
+{
+	struct drbd_md_io *md_io = md_io_of(mdev, buffer);
+
+	ERR_IF(!md_io)
+		return;
+	drbd_md_io_put(md_io);
 }
 
 void wait_until_done_or_force_detached(struct drbd_conf *mdev, struct drbd_backing_dev *bdev,
@@ -105,6 +146,7 @@ void wait_until_done_or_force_detached(struct drbd_conf *mdev, struct drbd_backi
 
 STATIC int _drbd_md_sync_page_io(struct drbd_conf *mdev,
 				 struct drbd_backing_dev *bdev,
+				 struct drbd_md_io *md_io,
 				 struct page *page, sector_t sector,
 				 int rw, int size)
 {
@@ -119,8 +161,8 @@ STATIC int _drbd_md_sync_page_io(struct drbd_conf *mdev,
 	/* < 2.6.36, "barrier" semantic may fail with EOPNOTSUPP */
  retry:
 #endif
-	mdev->md_io.done = 0;
-	mdev->md_io.error = -ENODEV;
+	md_io->done = 0;
+	md_io->error = -ENODEV;
 
 	bio = bio_alloc_drbd(GFP_NOIO);
 	bio->bi_bdev = bdev->md_bdev;
@@ -128,7 +170,7 @@ STATIC int _drbd_md_sync_page_io(struct drbd_conf *mdev,
 	ok = (bio_add_page(bio, page, size, 0) == size);
 	if (!ok)
 		goto out;
-	bio->bi_private = &mdev->md_io;
+	bio->bi_private = md_io;
 	bio->bi_end_io = drbd_md_io_complete;
 	bio->bi_rw = rw;
 
@@ -141,19 +183,19 @@ STATIC int _drbd_md_sync_page_io(struct drbd_conf *mdev,
 	}
 
 	bio_get(bio); /* one bio_put() is in the completion handler */
-	atomic_inc(&mdev->md_io_in_use); /* drbd_md_put_buffer() is in the completion handler */
+	atomic_inc(&md_io->in_use); /* drbd_md_io_put() is in the completion handler */
 	if (drbd_insert_fault(mdev, (rw & WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD))
 		bio_endio(bio, -EIO);
 	else
 		submit_bio(rw, bio);
-	wait_until_done_or_force_detached(mdev, bdev, &mdev->md_io.done);
-	ok = bio_flagged(bio, BIO_UPTODATE) && mdev->md_io.error == 0;
+	wait_until_done_or_force_detached(mdev, bdev, &md_io->done);
+	ok = bio_flagged(bio, BIO_UPTODATE) && md_io->error == 0;
 
 #ifndef REQ_FLUSH
 	/* check for unsupported barrier op.
 	 * would rather check on EOPNOTSUPP, but that is not reliable.
 	 * don't try again for ANY return value != 0 */
-	if (mdev->md_io.done && unlikely((bio->bi_rw & DRBD_REQ_HARDBARRIER) && !ok)) {
+	if (md_io->done && unlikely((bio->bi_rw & DRBD_REQ_HARDBARRIER) && !ok)) {
 		/* Try again with no barrier */
 		dev_warn(DEV, "Barriers not supported on meta data device - disabling\n");
 		drbd_set_flag(mdev, MD_NO_BARRIER);
@@ -168,13 +210,17 @@ STATIC int _drbd_md_sync_page_io(struct drbd_conf *mdev,
 }
 
 int drbd_md_sync_page_io(struct drbd_conf *mdev, struct drbd_backing_dev *bdev,
-			 sector_t sector, int rw)
+			 void *buffer, sector_t sector, int rw)
 {
 	int logical_block_size, mask, ok;
 	int offset = 0;
-	struct page *iop = mdev->md_io_page;
+	struct drbd_md_io *md_io = md_io_of(mdev, buffer);
+	struct page *iop;
 
-	D_ASSERT(atomic_read(&mdev->md_io_in_use) == 1);
+	ERR_IF(!md_io)
+		return 0;
+	iop = md_io->page;
+	D_ASSERT(atomic_read(&md_io->in_use) == 1);
 
 	if (!bdev->md_bdev) {
 		if (DRBD_ratelimit(5*HZ, 5)) {
@@ -195,15 +241,15 @@ int drbd_md_sync_page_io(struct drbd_conf *mdev, struct drbd_backing_dev *bdev,
 		D_ASSERT(logical_block_size == (mask+1) * MD_SECTOR_SIZE);
 		offset = sector & mask;
 		sector = sector & ~mask;
-		iop = mdev->md_io_tmpp;
+		iop = md_io->tmpp;
 
 		if (rw & WRITE) {
 			/* these are GFP_KERNEL pages, pre-allocated
 			 * on device initialization */
-			void *p = page_address(mdev->md_io_page);
-			void *hp = page_address(mdev->md_io_tmpp);
+			void *p = page_address(md_io->page);
+			void *hp = page_address(md_io->tmpp);
 
-			ok = _drbd_md_sync_page_io(mdev, bdev, iop, sector,
+			ok = _drbd_md_sync_page_io(mdev, bdev, md_io, iop, sector,
 					READ, logical_block_size);
 
 			if (unlikely(!ok)) {
@@ -229,7 +275,7 @@ int drbd_md_sync_page_io(struct drbd_conf *mdev, struct drbd_backing_dev *bdev,
 		     current->comm, current->pid, __func__,
 		     (unsigned long long)sector, (rw & WRITE) ? "WRITE" : "READ");
 
-	ok = _drbd_md_sync_page_io(mdev, bdev, iop, sector, rw, logical_block_size);
+	ok = _drbd_md_sync_page_io(mdev, bdev, md_io, iop, sector, rw, logical_block_size);
 	if (unlikely(!ok)) {
 		dev_err(DEV, "drbd_md_sync_page_io(,%llus,%s) failed!\n",
 		    (unsigned long long)sector, (rw & WRITE) ? "WRITE" : "READ");
@@ -237,8 +283,8 @@ int drbd_md_sync_page_io(struct drbd_conf *mdev, struct drbd_backing_dev *bdev,
 	}
 
 	if (logical_block_size != MD_SECTOR_SIZE && !(rw & WRITE)) {
-		void *p = page_address(mdev->md_io_page);
-		void *hp = page_address(mdev->md_io_tmpp);
+		void *p = page_address(md_io->page);
+		void *hp = page_address(md_io->tmpp);
 
 		memcpy(p, hp + offset*MD_SECTOR_SIZE, MD_SECTOR_SIZE);
 	}
@@ -246,8 +292,10 @@ int drbd_md_sync_page_io(struct drbd_conf *mdev, struct drbd_backing_dev *bdev,
 	return ok;
 }
 
+/* With try_only, only get a reference if @enr is in the activity log already,
+ * never start a change of the active set. */
 static
-struct lc_element *_al_get(struct drbd_conf *mdev, unsigned int enr)
+struct lc_element *_al_get(struct drbd_conf *mdev, unsigned int enr, int try_only)
 {
 	struct lc_element *al_ext;
 	struct lc_element *tmp;
@@ -255,7 +303,7 @@ struct lc_element *_al_get(struct drbd_conf *mdev, unsigned int enr)
 	int wake;
 
 	spin_lock_irq(&mdev->al_lock);
-	tmp = lc_find(mdev->resync, enr/AL_EXT_PER_BM_SECT);
+	tmp = lc_find(mdev->resync, enr/AL_EXT_PER_BM_SECT(mdev));
 	if (unlikely(tmp != NULL)) {
 		struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
 		if (test_bit(BME_NO_WRITES, &bm_ext->flags)) {
@@ -266,7 +314,10 @@ struct lc_element *_al_get(struct drbd_conf *mdev, unsigned int enr)
 			return NULL;
 		}
 	}
-	al_ext   = lc_get(mdev->act_log, enr);
+	if (try_only)
+		al_ext = lc_try_get(mdev->act_log, enr);
+	else
+		al_ext = lc_get(mdev->act_log, enr);
 	al_flags = mdev->act_log->flags;
 	spin_unlock_irq(&mdev->al_lock);
 
@@ -282,9 +333,97 @@ struct lc_element *_al_get(struct drbd_conf *mdev, unsigned int enr)
 	return al_ext;
 }
 
+/* drop a reference we got from lc_try_get_lockless(), but must not keep */
+static void _al_put(struct drbd_conf *mdev, struct lc_element *al_ext)
+{
+	unsigned long flags;
+
+	if (lc_put_lockless(mdev->act_log, al_ext))
+		return;
+
+	spin_lock_irqsave(&mdev->al_lock, flags);
+	if (lc_put(mdev->act_log, al_ext) == 0)
+		wake_up(&mdev->al_wait);
+	spin_unlock_irqrestore(&mdev->al_lock, flags);
+}
+
+/* Lockless fast path of _al_get(), for extents that are in use already.
+ * Only while no resync extent is locked against application writes;
+ * everything else is left to _al_get() under the al_lock. */
+static struct lc_element *_al_get_hot(struct drbd_conf *mdev, unsigned int enr)
+{
+	struct lru_cache *al;
+	struct lc_element *al_ext;
+
+	/* drbd_check_al_size() may replace the act_log under us; once we
+	 * hold a reference, it cannot, and the rcu section may end */
+	rcu_read_lock();
+	al = rcu_dereference(mdev->act_log);
+	al_ext = lc_try_get_lockless(al, enr);
+	rcu_read_unlock();
+	if (!al_ext)
+		return NULL;
+
+	/* the full barrier implied by lc_try_get_lockless() pairs with
+	 * the smp_mb() in _is_in_al() and drbd_try_rs_begin_io() */
+	if (likely(lc_lockless_hit(al, al_ext, enr) &&
+		   !ACCESS_ONCE(mdev->resync_locked))) {
+		lc_touch_lockless(al, al_ext);
+		return al_ext;
+	}
+
+	_al_put(mdev, al_ext);
+	return NULL;
+}
+
+/* A write is part of a stream, if it starts at most that far (in sectors)
+ * after the previous one.  Tolerates some reordering by concurrent
+ * submitters.  After that many of them, we look ahead. */
+#define AL_STREAM_GAP 2048
+#define AL_STREAM_MIN 8
+
+/* Sequential write streams: once a stream is past the middle of its extent,
+ * have the worker activate the next one, so the stream finds it active when
+ * it gets there, instead of waiting for the transaction itself. */
+static void al_stream_detect(struct drbd_conf *mdev, sector_t sector, unsigned int enr)
+{
+	const sector_t ext_sect = 1U << (mdev->al_ext_shift - 9);
+	sector_t last = mdev->al_stream_sector;
+	bool found;
+
+	mdev->al_stream_sector = sector;
+	if (sector <= last || sector - last > AL_STREAM_GAP) {
+		mdev->al_stream_len = 0;
+		return;
+	}
+	if (++mdev->al_stream_len < AL_STREAM_MIN)
+		return;
+	if ((sector & (ext_sect - 1)) < ext_sect / 2)
+		return;
+	if (mdev->al_prefetch_enr == enr + 1)
+		return;
+	mdev->al_prefetch_enr = enr + 1;
+	rcu_read_lock();
+	found = lc_find_lockless(rcu_dereference(mdev->act_log), enr + 1) != NULL;
+	rcu_read_unlock();
+	if (found)
+		return;
+
+	if (!drbd_test_and_set_flag(mdev, AL_PREFETCH_QUEUED))
+		drbd_queue_work(&mdev->data.work, &mdev->al_prefetch_work);
+}
+
+/* first write to an extent that al_prefetch_work activated for it */
+static void al_count_prefetch_hit(struct drbd_conf *mdev, unsigned int enr)
+{
+	if (unlikely(ACCESS_ONCE(mdev->al_prefetched) == enr) &&
+	    cmpxchg(&mdev->al_prefetched, enr, LC_FREE) == enr)
+		drbd_stat_add(mdev, STAT_AL_PREFETCH_HITS, 1);
+}
+
 void drbd_al_begin_io(struct drbd_conf *mdev, sector_t sector)
 {
-	unsigned int enr = (sector >> (AL_EXTENT_SHIFT-9));
+	unsigned int enr = AL_SECT_TO_EXT(mdev, sector);
 	struct lc_element *al_ext;
 	struct update_al_work al_work;
 
@@ -292,7 +431,19 @@ void drbd_al_begin_io(struct drbd_conf *mdev, sector_t sector)
 
 	trace_drbd_actlog(mdev, sector, "al_begin_io");
 
-	wait_event(mdev->al_wait, (al_ext = _al_get(mdev, enr)));
+	al_stream_detect(mdev, sector, enr);
+
+	if (_al_get_hot(mdev, enr)) {
+		drbd_stat_add(mdev, STAT_AL_HITS, 1);
+		al_count_prefetch_hit(mdev, enr);
+		return;
+	}
+
+	wait_event(mdev->al_wait, (al_ext = _al_get(mdev, enr, 0)));
+
+	drbd_stat_add(mdev, al_ext->lc_number == enr ? STAT_AL_HITS : STAT_AL_MISSES, 1);
+	if (al_ext->lc_number == enr)
+		al_count_prefetch_hit(mdev, enr);
 
 	if (al_ext->lc_number != enr) {
 		/* drbd_al_write_transaction(mdev,al_ext,enr);
@@ -309,7 +460,7 @@ void drbd_al_begin_io(struct drbd_conf *mdev, sector_t sector)
 		drbd_queue_work_front(&mdev->data.work, &al_work.w);
 		wait_for_completion(&al_work.event);
 
-		mdev->al_writ_cnt++;
+		drbd_stat_add(mdev, STAT_AL_WRITES, 1);
 
 		/*
 		DUMPI(al_ext->lc_number);
@@ -322,14 +473,153 @@ void drbd_al_begin_io(struct drbd_conf *mdev, sector_t sector)
 	}
 }
 
+/**
+ * drbd_al_begin_io_nonblock() - Like drbd_al_begin_io(), but never sleeps
+ * @mdev:	DRBD device.
+ * @req:	The application write.
+ *
+ * Returns true if the extent of @req is in the activity log, and we got
+ * a reference on it.  Otherwise @req has been parked, and the worker will
+ * submit it once its extent is active, see w_al_submit_pending().
+ */
+bool drbd_al_begin_io_nonblock(struct drbd_conf *mdev, struct drbd_request *req)
+{
+	unsigned int enr = AL_SECT_TO_EXT(mdev, req->sector);
+
+	D_ASSERT(atomic_read(&mdev->local_cnt) > 0);
+
+	trace_drbd_actlog(mdev, req->sector, "al_begin_io_nonblock");
+
+	al_stream_detect(mdev, req->sector, enr);
+
+	if (_al_get_hot(mdev, enr) || _al_get(mdev, enr, 1)) {
+		drbd_stat_add(mdev, STAT_AL_HITS, 1);
+		al_count_prefetch_hit(mdev, enr);
+		return true;
+	}
+
+	/* not yet on the transfer log, so we may use tl_requests */
+	spin_lock_irq(&mdev->al_lock);
+	list_add_tail(&req->tl_requests, &mdev->al_pending);
+	spin_unlock_irq(&mdev->al_lock);
+
+	drbd_kick_al_pending(mdev);
+	return false;
+}
+
+/**
+ * drbd_al_get_pending() - Activate the extent of the oldest parked write
+ * @mdev:	DRBD device.
+ *
+ * Worker context only, we write the activity log transaction ourselves.
+ * Returns the request, which now holds a reference on its extent, or NULL
+ * if nothing is parked, or the oldest parked write cannot get its extent
+ * yet.  The next wake_up() of al_wait kicks us again in that case.
+ */
+struct drbd_request *drbd_al_get_pending(struct drbd_conf *mdev)
+{
+	struct drbd_request *req;
+	struct lc_element *al_ext;
+	unsigned int enr;
+
+	spin_lock_irq(&mdev->al_lock);
+	if (list_empty(&mdev->al_pending)) {
+		spin_unlock_irq(&mdev->al_lock);
+		return NULL;
+	}
+	/* only we take requests off this list */
+	req = list_entry(mdev->al_pending.next, struct drbd_request, tl_requests);
+	spin_unlock_irq(&mdev->al_lock);
+
+	enr = AL_SECT_TO_EXT(mdev, req->sector);
+	al_ext = _al_get(mdev, enr, 0);
+	if (!al_ext)
+		return NULL;
+
+	drbd_stat_add(mdev, al_ext->lc_number == enr ? STAT_AL_HITS : STAT_AL_MISSES, 1);
+
+	if (al_ext->lc_number != enr) {
+		drbd_al_write_transaction(mdev, al_ext, enr, al_ext->lc_number);
+		drbd_stat_add(mdev, STAT_AL_WRITES, 1);
+
+		spin_lock_irq(&mdev->al_lock);
+		lc_changed(mdev->act_log, al_ext);
+		spin_unlock_irq(&mdev->al_lock);
+		wake_up(&mdev->al_wait);
+	} else
+		al_count_prefetch_hit(mdev, enr);
+
+	spin_lock_irq(&mdev->al_lock);
+	list_del_init(&req->tl_requests);
+	spin_unlock_irq(&mdev->al_lock);
+
+	return req;
+}
+
+/**
+ * w_al_prefetch() - Activate the extent a sequential write stream goes to next
+ * @mdev:	DRBD device.
+ * @w:		work object.
+ * @cancel:	The connection will be closed anyways (unused in this callback)
+ *
+ * The extent is activated in a transaction of its own, without a reference
+ * held, so it is the most recently used unused extent afterwards.  We do not
+ * wait for anything; if the activity log is starving, or the extent is locked
+ * by resync, the stream goes through the usual miss path later.
+ */
+int w_al_prefetch(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
+{
+	unsigned int enr = ACCESS_ONCE(mdev->al_prefetch_enr);
+	struct lc_element *al_ext;
+
+	/* detections from now on queue us again */
+	drbd_clear_flag(mdev, AL_PREFETCH_QUEUED);
+
+	if (!get_ldev(mdev))
+		return 1;
+	if (drbd_test_flag(mdev, AL_SUSPENDED) ||
+	    ((sector_t)enr << (mdev->al_ext_shift - 9)) >= drbd_get_capacity(mdev->this_bdev))
+		goto out;
+
+	al_ext = _al_get(mdev, enr, 0);
+	if (!al_ext)
+		goto out;
+
+	if (al_ext->lc_number != enr) {
+		drbd_al_write_transaction(mdev, al_ext, enr, al_ext->lc_number);
+		drbd_stat_add(mdev, STAT_AL_WRITES, 1);
+		drbd_stat_add(mdev, STAT_AL_PREFETCHES, 1);
+		mdev->al_prefetched = enr;
+
+		spin_lock_irq(&mdev->al_lock);
+		lc_changed(mdev->act_log, al_ext);
+		spin_unlock_irq(&mdev->al_lock);
+	}
+
+	spin_lock_irq(&mdev->al_lock);
+	lc_put(mdev->act_log, al_ext);
+	spin_unlock_irq(&mdev->al_lock);
+	wake_up(&mdev->al_wait);
+out:
+	put_ldev(mdev);
+	return 1;
+}
+
 void drbd_al_complete_io(struct drbd_conf *mdev, sector_t sector)
 {
-	unsigned int enr = (sector >> (AL_EXTENT_SHIFT-9));
+	unsigned int enr = AL_SECT_TO_EXT(mdev, sector);
 	struct lc_element *extent;
 	unsigned long flags;
 
 	trace_drbd_actlog(mdev, sector, "al_complete_io");
 
+	/* We hold a reference, so it cannot change its label under us,
+	 * nor can the act_log be replaced.
+	 * Only the last reference needs the lock, to move it to the lru. */
+	extent = lc_find_lockless(mdev->act_log, enr);
+	if (extent && lc_put_lockless(mdev->act_log, extent))
+		return;
+
 	spin_lock_irqsave(&mdev->al_lock, flags);
 
 	extent = lc_find(mdev->act_log, enr);
@@ -346,7 +636,7 @@ void drbd_al_complete_io(struct drbd_conf *mdev, sector_t sector)
 	spin_unlock_irqrestore(&mdev->al_lock, flags);
 }
 
-#if (PAGE_SHIFT + 3) < (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT)
+#if (PAGE_SHIFT + 3) < (AL_EXTENT_SHIFT_MAX - BM_BLOCK_SHIFT)
 /* Currently BM_BLOCK_SHIFT, BM_EXT_SHIFT and AL_EXTENT_SHIFT
  * are still coupled, or assume too much about their relation.
  * Code below will not work if this is violated.
@@ -355,13 +645,14 @@ void drbd_al_complete_io(struct drbd_conf *mdev, sector_t sector)
 # error FIXME
 #endif
 
-static unsigned int al_extent_to_bm_page(unsigned int al_enr)
+static unsigned int al_extent_to_bm_page(struct drbd_conf *mdev,
+					 unsigned int al_enr)
 {
 	return al_enr >>
 		/* bit to page */
 		((PAGE_SHIFT + 3) -
 		/* al extent number to bit */
-		 (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT));
+		 (mdev->al_ext_shift - BM_BLOCK_SHIFT));
 }
 
 static unsigned int rs_extent_to_bm_page(unsigned int rs_enr)
@@ -373,25 +664,22 @@ static unsigned int rs_extent_to_bm_page(unsigned int rs_enr)
 		 (BM_EXT_SHIFT - BM_BLOCK_SHIFT));
 }
 
-int
-w_al_write_transaction(struct drbd_conf *mdev, struct drbd_work *w, int unused)
+/* writes the transaction activating new_enr in the slot of updated, worker context only */
+STATIC void drbd_al_write_transaction(struct drbd_conf *mdev, struct lc_element *updated,
+				      const unsigned int new_enr, const unsigned int evicted)
 {
-	struct update_al_work *aw = container_of(w, struct update_al_work, w);
-	struct lc_element *updated = aw->al_ext;
-	const unsigned int new_enr = aw->enr;
-	const unsigned int evicted = aw->old_enr;
 	struct al_transaction *buffer;
 	sector_t sector;
 	int i, n, mx;
 	unsigned int extent_nr;
 	u32 xor_sum = 0;
+	u64 start_ns = drbd_lat_now();
 
 	if (!get_ldev(mdev)) {
 		dev_err(DEV,
 			"disk is %s, cannot start al transaction (-%d +%d)\n",
 			drbd_disk_str(mdev->state.disk), evicted, new_enr);
-		complete(&((struct update_al_work *)w)->event);
-		return 1;
+		return;
 	}
 	/* do we have to do a bitmap write, first?
 	 * TODO reduce maximum latency:
@@ -400,24 +688,23 @@ w_al_write_transaction(struct drbd_conf *mdev, struct drbd_work *w, int unused)
 	 * For now, we must not write the transaction,
 	 * if we cannot write out the bitmap of the evicted extent. */
 	if (mdev->state.conn < C_CONNECTED && evicted != LC_FREE)
-		drbd_bm_write_page(mdev, al_extent_to_bm_page(evicted));
+		drbd_bm_write_page(mdev, al_extent_to_bm_page(mdev, evicted));
 
 	/* The bitmap write may have failed, causing a state change. */
 	if (mdev->state.disk < D_INCONSISTENT) {
 		dev_err(DEV,
 			"disk is %s, cannot write al transaction (-%d +%d)\n",
 			drbd_disk_str(mdev->state.disk), evicted, new_enr);
-		complete(&((struct update_al_work *)w)->event);
 		put_ldev(mdev);
-		return 1;
+		return;
 	}
 
-	buffer = drbd_md_get_buffer(mdev); /* protects md_io_buffer, al_tr_cycle, ... */
+	/* al_tr_cycle, al_tr_pos, ... are only touched by the worker */
+	buffer = drbd_md_get_buffer(mdev);
 	if (!buffer) {
 		dev_err(DEV, "disk failed while waiting for md_io buffer\n");
-		complete(&((struct update_al_work *)w)->event);
 		put_ldev(mdev);
-		return 1;
+		return;
 	}
 
 	buffer->magic = __constant_cpu_to_be32(DRBD_MAGIC);
@@ -453,24 +740,49 @@ w_al_write_transaction(struct drbd_conf *mdev, struct drbd_work *w, int unused)
 	sector =  mdev->ldev->md.md_offset
 		+ mdev->ldev->md.al_offset + mdev->al_tr_pos;
 
-	if (!drbd_md_sync_page_io(mdev, mdev->ldev, sector, WRITE))
+	if (!drbd_md_sync_page_io(mdev, mdev->ldev, buffer, sector, WRITE))
 		drbd_chk_io_error(mdev, 1, DRBD_META_IO_ERROR);
 
 	if (++mdev->al_tr_pos >
 	    div_ceil(mdev->act_log->nr_elements, AL_EXTENTS_PT))
 		mdev->al_tr_pos = 0;
 
-	D_ASSERT(mdev->al_tr_pos < MD_AL_MAX_SIZE);
+	D_ASSERT(mdev->al_tr_pos < drbd_md_al_size(mdev->ldev));
 	mdev->al_tr_number++;
 
-	drbd_md_put_buffer(mdev);
+	drbd_md_put_buffer(mdev, buffer);
+
+	drbd_lat_account(mdev, LAT_AL_WRITE, start_ns);
 
-	complete(&((struct update_al_work *)w)->event);
 	put_ldev(mdev);
+}
+
+int
+w_al_write_transaction(struct drbd_conf *mdev, struct drbd_work *w, int unused)
+{
+	struct update_al_work *aw = container_of(w, struct update_al_work, w);
+
+	drbd_al_write_transaction(mdev, aw->al_ext, aw->enr, aw->old_enr);
+	complete(&aw->event);
 
 	return 1;
 }
 
+/* checks magic and checksum of a transaction, 1 if valid, 0 otherwise */
+static int al_tr_valid(struct al_transaction *b)
+{
+	u32 xor_sum = 0;
+	int i;
+
+	if (be32_to_cpu(b->magic) != DRBD_MAGIC)
+		return 0;
+
+	for (i = 0; i < AL_EXTENTS_PT + 1; i++)
+		xor_sum ^= be32_to_cpu(b->updates[i].extent);
+
+	return xor_sum == be32_to_cpu(b->xor_sum);
+}
+
 /**
  * drbd_al_read_tr() - Read a single transaction from the on disk activity log
  * @mdev:	DRBD device.
@@ -486,23 +798,177 @@ STATIC int drbd_al_read_tr(struct drbd_conf *mdev,
 			   int index)
 {
 	sector_t sector;
-	int rv, i;
-	u32 xor_sum = 0;
 
 	sector = bdev->md.md_offset + bdev->md.al_offset + index;
 
 	/* Dont process error normally,
 	 * as this is done before disk is attached! */
-	if (!drbd_md_sync_page_io(mdev, bdev, sector, READ))
+	if (!drbd_md_sync_page_io(mdev, bdev, b, sector, READ))
 		return -1;
 
-	rv = (be32_to_cpu(b->magic) == DRBD_MAGIC);
+	return al_tr_valid(b);
+}
 
-	for (i = 0; i < AL_EXTENTS_PT + 1; i++)
-		xor_sum ^= be32_to_cpu(b->updates[i].extent);
-	rv &= (xor_sum == be32_to_cpu(b->xor_sum));
+/* In memory copy of the on disk AL ring, read with a few large requests
+ * at attach time, instead of one synchronous request per transaction. */
+struct al_ring_ctx {
+	struct drbd_conf *mdev;
+	atomic_t in_flight;
+	unsigned int done;
+	int error;
+	struct kref kref;
+	int nr_pages;
+	struct page *pages[0];
+};
 
-	return rv;
+static void al_ring_free_pages(struct al_ring_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->nr_pages; i++)
+		if (ctx->pages[i])
+			__free_page(ctx->pages[i]);
+	kfree(ctx);
+}
+
+static void al_ring_ctx_destroy(struct kref *kref)
+{
+	struct al_ring_ctx *ctx = container_of(kref, struct al_ring_ctx, kref);
+
+	put_ldev(ctx->mdev);
+	al_ring_free_pages(ctx);
+}
+
+static BIO_ENDIO_TYPE al_ring_io_complete BIO_ENDIO_ARGS(struct bio *bio, int error)
+{
+	struct al_ring_ctx *ctx = bio->bi_private;
+	struct drbd_conf *mdev = ctx->mdev;
+	int uptodate = bio_flagged(bio, BIO_UPTODATE);
+
+	BIO_ENDIO_FN_START;
+
+	if (!error && !uptodate)
+		error = -EIO;
+	if (error)
+		ctx->error = error;
+
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&ctx->in_flight)) {
+		ctx->done = 1;
+		wake_up(&mdev->misc_wait);
+		kref_put(&ctx->kref, &al_ring_ctx_destroy);
+	}
+
+	BIO_ENDIO_FN_RETURN;
+}
+
+static struct al_transaction *al_ring_tr(struct al_ring_ctx *ctx, int index)
+{
+	return page_address(ctx->pages[index >> (PAGE_SHIFT - 9)]) +
+		((index << 9) & ~PAGE_MASK);
+}
+
+/**
+ * drbd_al_read_ring() - Read slots 0 to @slots-1 of the on disk activity log
+ * @mdev:	DRBD device.
+ * @bdev:	Block device to read form.
+ * @slots:	Number of transaction slots to read.
+ *
+ * Submits one bio per page and waits once for all of them; the block layer
+ * merges them into as few requests as the device allows.
+ * Returns NULL if we could not allocate the buffer, an ERR_PTR on IO error.
+ * The caller has to kref_put() the returned context.
+ */
+STATIC struct al_ring_ctx *drbd_al_read_ring(struct drbd_conf *mdev,
+					     struct drbd_backing_dev *bdev,
+					     int slots)
+{
+	struct al_ring_ctx *ctx;
+	sector_t sector = bdev->md.md_offset + bdev->md.al_offset;
+	/* whole 4k blocks, so this works for 4k logical block size as well.
+	 * The AL area is a multiple of 8 sectors, so we stay inside of it. */
+	unsigned int size = ALIGN(slots, 8) << 9;
+	int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	int i, err;
+
+	if (bdev_logical_block_size(bdev->md_bdev) > 4096)
+		return NULL;
+
+	ctx = kzalloc(sizeof(*ctx) + nr_pages * sizeof(struct page *), GFP_NOIO);
+	if (!ctx)
+		return NULL;
+	ctx->nr_pages = nr_pages;
+	for (i = 0; i < nr_pages; i++) {
+		ctx->pages[i] = alloc_page(GFP_NOIO);
+		if (!ctx->pages[i]) {
+			al_ring_free_pages(ctx);
+			return NULL;
+		}
+	}
+
+	if (!get_ldev_if_state(mdev, D_ATTACHING)) {  /* put is in al_ring_ctx_destroy() */
+		dev_err(DEV, "ASSERT FAILED: get_ldev_if_state() == 1 in drbd_al_read_ring()\n");
+		al_ring_free_pages(ctx);
+		return ERR_PTR(-ENODEV);
+	}
+
+	ctx->mdev = mdev;
+	atomic_set(&ctx->in_flight, 1);
+	/* one for us, one for the "in_flight reached zero" event */
+	kref_init(&ctx->kref);
+	kref_get(&ctx->kref);
+
+	for (i = 0; i < nr_pages; i++) {
+		struct bio *bio = bio_alloc_drbd(GFP_NOIO);
+		unsigned int len = min_t(unsigned int, PAGE_SIZE, size);
+
+		bio->bi_bdev = bdev->md_bdev;
+		bio->bi_sector = sector;
+		bio_add_page(bio, ctx->pages[i], len, 0);
+		bio->bi_private = ctx;
+		bio->bi_end_io = al_ring_io_complete;
+
+		atomic_inc(&ctx->in_flight);
+		if (drbd_insert_fault(mdev, DRBD_FAULT_MD_RD)) {
+			bio->bi_rw |= READ;
+			bio_endio(bio, -EIO);
+		} else {
+			submit_bio(READ, bio);
+		}
+
+		sector += len >> 9;
+		size -= len;
+	}
+
+	if (!atomic_dec_and_test(&ctx->in_flight)) {
+		drbd_blk_run_queue(bdev_get_queue(bdev->md_bdev));
+		wait_until_done_or_force_detached(mdev, bdev, &ctx->done);
+	} else
+		kref_put(&ctx->kref, &al_ring_ctx_destroy);
+
+	err = ctx->error;
+	if (atomic_read(&ctx->in_flight))
+		err = -EIO; /* Disk timeout/force-detach during IO... */
+	if (err) {
+		kref_put(&ctx->kref, &al_ring_ctx_destroy);
+		return ERR_PTR(err);
+	}
+
+	return ctx;
+}
+
+/* from the in memory ring, if we have it, or read a single sector */
+STATIC int drbd_al_get_tr(struct drbd_conf *mdev, struct drbd_backing_dev *bdev,
+			  struct al_ring_ctx *ring, struct al_transaction *buffer,
+			  int index, struct al_transaction **b)
+{
+	if (ring) {
+		*b = al_ring_tr(ring, index);
+		return al_tr_valid(*b);
+	}
+	*b = buffer;
+	return drbd_al_read_tr(mdev, bdev, buffer, index);
 }
 
 /**
@@ -514,7 +980,9 @@ STATIC int drbd_al_read_tr(struct drbd_conf *mdev,
  */
 int drbd_al_read_log(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 {
-	struct al_transaction *buffer;
+	struct al_ring_ctx *ring;
+	struct al_transaction *buffer = NULL;
+	struct al_transaction *b;
 	int i;
 	int rv;
 	int mx;
@@ -529,23 +997,33 @@ int drbd_al_read_log(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 
 	mx = div_ceil(mdev->act_log->nr_elements, AL_EXTENTS_PT);
 
-	/* lock out all other meta data io for now,
-	 * and make sure the page is mapped.
-	 */
-	buffer = drbd_md_get_buffer(mdev);
-	if (!buffer)
+	/* Read the whole ring at once, and parse it in memory.
+	 * If we cannot get the memory for that, fall back to
+	 * reading it sector by sector through the meta data buffer. */
+	ring = drbd_al_read_ring(mdev, bdev, mx + 1);
+	if (IS_ERR(ring)) {
+		dev_err(DEV, "reading the activity log failed: %ld\n", PTR_ERR(ring));
 		return 0;
+	}
+	if (!ring) {
+		/* lock out all other meta data io for now,
+		 * and make sure the page is mapped.
+		 */
+		buffer = drbd_md_get_buffer(mdev);
+		if (!buffer)
+			return 0;
+	}
 
 	/* Find the valid transaction in the log */
 	for (i = 0; i <= mx; i++) {
-		rv = drbd_al_read_tr(mdev, bdev, buffer, i);
+		rv = drbd_al_get_tr(mdev, bdev, ring, buffer, i, &b);
 		if (rv == 0)
 			continue;
 		if (rv == -1) {
-			drbd_md_put_buffer(mdev);
-			return 0;
+			rv = 0;
+			goto out;
 		}
-		cnr = be32_to_cpu(buffer->tr_number);
+		cnr = be32_to_cpu(b->tr_number);
 
 		if (++found_valid == 1) {
 			from = i;
@@ -568,8 +1046,8 @@ int drbd_al_read_log(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 
 	if (!found_valid) {
 		dev_warn(DEV, "No usable activity log found.\n");
-		drbd_md_put_buffer(mdev);
-		return 1;
+		rv = 1;
+		goto out;
 	}
 
 	/* Read the valid transactions.
@@ -578,17 +1056,14 @@ int drbd_al_read_log(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 	while (1) {
 		int j, pos;
 		unsigned int extent_nr;
-		unsigned int trn;
 
-		rv = drbd_al_read_tr(mdev, bdev, buffer, i);
+		rv = drbd_al_get_tr(mdev, bdev, ring, buffer, i, &b);
 		ERR_IF(rv == 0) goto cancel;
 		if (rv == -1) {
-			drbd_md_put_buffer(mdev);
-			return 0;
+			rv = 0;
+			goto out;
 		}
 
-		trn = be32_to_cpu(buffer->tr_number);
-
 		spin_lock_irq(&mdev->al_lock);
 
 		/* This loop runs backwards because in the cyclic
@@ -596,8 +1071,8 @@ int drbd_al_read_log(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 		   updated element (in slot 0). So the element in slot 0
 		   can overwrite old versions. */
 		for (j = AL_EXTENTS_PT; j >= 0; j--) {
-			pos = be32_to_cpu(buffer->updates[j].pos);
-			extent_nr = be32_to_cpu(buffer->updates[j].extent);
+			pos = be32_to_cpu(b->updates[j].pos);
+			extent_nr = be32_to_cpu(b->updates[j].extent);
 
 			if (extent_nr == LC_FREE)
 				continue;
@@ -623,13 +1098,17 @@ cancel:
 	    div_ceil(mdev->act_log->nr_elements, AL_EXTENTS_PT))
 		mdev->al_tr_pos = 0;
 
-	/* ok, we are done with it */
-	drbd_md_put_buffer(mdev);
-
 	dev_info(DEV, "Found %d transactions (%d active extents) in activity log.\n",
 	     transactions, active_extents);
+	rv = 1;
 
-	return 1;
+ out:
+	/* ok, we are done with it */
+	if (ring)
+		kref_put(&ring->kref, &al_ring_ctx_destroy);
+	else
+		drbd_md_put_buffer(mdev, buffer);
+	return rv;
 }
 
 /**
@@ -666,7 +1145,7 @@ static int _try_lc_del(struct drbd_conf *mdev, struct lc_element *al_ext)
 	int rv;
 
 	spin_lock_irq(&mdev->al_lock);
-	rv = (al_ext->refcnt == 0);
+	rv = (atomic_read(&al_ext->refcnt) == 0);
 	if (likely(rv))
 		lc_del(mdev->act_log, al_ext);
 	spin_unlock_irq(&mdev->al_lock);
@@ -732,8 +1211,8 @@ STATIC int w_update_odbm(struct drbd_conf *mdev, struct drbd_work *w, int unused
 }
 
 
-/* ATTENTION. The AL's extents are 4MB each, while the extents in the
- * resync LRU-cache are 16MB each.
+/* ATTENTION. The AL's extents are 4MB each (by default, see
+ * mdev->al_ext_shift), while the extents in the resync LRU-cache are 16MB each.
  * The caller of this function has to hold an get_ldev() reference.
  *
  * TODO will be obsoleted once we have a caching lru of the on disk bitmap
@@ -1001,7 +1480,7 @@ struct bm_extent *_bme_get(struct drbd_conf *mdev, unsigned int enr)
 			lc_changed(mdev->resync, &bm_ext->lce);
 			wakeup = 1;
 		}
-		if (bm_ext->lce.refcnt == 1)
+		if (atomic_read(&bm_ext->lce.refcnt) == 1)
 			mdev->resync_locked++;
 		set_bit(BME_NO_WRITES, &bm_ext->flags);
 	}
@@ -1020,18 +1499,53 @@ struct bm_extent *_bme_get(struct drbd_conf *mdev, unsigned int enr)
 	return bm_ext;
 }
 
+/**
+ * drbd_rs_extent_is_hot() - Is the application using this resync extent?
+ * @mdev:	DRBD device.
+ * @enr:	Resync extent number, BM_SECT_TO_EXT().
+ *
+ * Hot means an application request touched it within DRBD_APP_HOT_TIME,
+ * or one of its activity log extents is in use right now. An extent that
+ * application IO is already waiting for (BME_PRIORITY) is never hot,
+ * we rather want to get it done.
+ */
+bool drbd_rs_extent_is_hot(struct drbd_conf *mdev, unsigned int enr)
+{
+	struct drbd_app_hot *h = &mdev->app_hot[enr % DRBD_APP_HOT_SLOTS];
+	unsigned int al_enr = enr * AL_EXT_PER_BM_SECT(mdev);
+	struct lc_element *e;
+	bool hot;
+	int i;
+
+	hot = h->enr == enr && time_before(jiffies, h->when + DRBD_APP_HOT_TIME);
+
+	spin_lock_irq(&mdev->al_lock);
+	for (i = 0; !hot && i < AL_EXT_PER_BM_SECT(mdev); i++)
+		hot = al_enr + i == mdev->act_log->new_number ||
+			lc_is_used(mdev->act_log, al_enr + i);
+	e = lc_find(mdev->resync, enr);
+	if (e && test_bit(BME_PRIORITY, &lc_entry(e, struct bm_extent, lce)->flags))
+		hot = false;
+	spin_unlock_irq(&mdev->al_lock);
+
+	return hot;
+}
+
 static int _is_in_al(struct drbd_conf *mdev, unsigned int enr)
 {
 	struct lc_element *al_ext;
 	int rv = 0;
 
 	spin_lock_irq(&mdev->al_lock);
+	/* resync_locked was raised before we get here,
+	 * pairs with the lockless path in _al_get_hot() */
+	smp_mb();
 	if (unlikely(enr == mdev->act_log->new_number))
 		rv = 1;
 	else {
 		al_ext = lc_find(mdev->act_log, enr);
 		if (al_ext) {
-			if (al_ext->refcnt)
+			if (atomic_read(&al_ext->refcnt))
 				rv = 1;
 		}
 	}
@@ -1074,9 +1588,9 @@ retry:
 	/* step aside only while we are above c-min-rate; unless disabled. */
 	sa = drbd_rs_c_min_rate_throttle(mdev);
 
-	for (i = 0; i < AL_EXT_PER_BM_SECT; i++) {
+	for (i = 0; i < AL_EXT_PER_BM_SECT(mdev); i++) {
 		sig = wait_event_interruptible(mdev->al_wait,
-					       !_is_in_al(mdev, enr * AL_EXT_PER_BM_SECT + i) ||
+					       !_is_in_al(mdev, enr * AL_EXT_PER_BM_SECT(mdev) + i) ||
 					       (sa && test_bit(BME_PRIORITY, &bm_ext->flags)));
 
 		if (sig || (sa && test_bit(BME_PRIORITY, &bm_ext->flags))) {
@@ -1110,7 +1624,7 @@ retry:
 int drbd_try_rs_begin_io(struct drbd_conf *mdev, sector_t sector)
 {
 	unsigned int enr = BM_SECT_TO_EXT(sector);
-	const unsigned int al_enr = enr*AL_EXT_PER_BM_SECT;
+	const unsigned int al_enr = enr*AL_EXT_PER_BM_SECT(mdev);
 	struct lc_element *e;
 	struct bm_extent *bm_ext;
 	int i;
@@ -1168,8 +1682,8 @@ int drbd_try_rs_begin_io(struct drbd_conf *mdev, sector_t sector)
 			trace_drbd_resync(mdev, TRACE_LVL_ALL,
 					  "dropping extra reference on %u\n", enr);
 
-			bm_ext->lce.refcnt--;
-			D_ASSERT(bm_ext->lce.refcnt > 0);
+			atomic_dec(&bm_ext->lce.refcnt);
+			D_ASSERT(atomic_read(&bm_ext->lce.refcnt) > 0);
 		}
 		goto check_al;
 	} else {
@@ -1199,14 +1713,17 @@ int drbd_try_rs_begin_io(struct drbd_conf *mdev, sector_t sector)
 			D_ASSERT(test_bit(BME_LOCKED, &bm_ext->flags) == 0);
 		}
 		set_bit(BME_NO_WRITES, &bm_ext->flags);
-		D_ASSERT(bm_ext->lce.refcnt == 1);
+		D_ASSERT(atomic_read(&bm_ext->lce.refcnt) == 1);
 		mdev->resync_locked++;
 		goto check_al;
 	}
 check_al:
 	trace_drbd_resync(mdev, TRACE_LVL_ALL, "checking al for %u\n", enr);
 
-	for (i = 0; i < AL_EXT_PER_BM_SECT; i++) {
+	/* pairs with the lockless path in _al_get_hot() */
+	smp_mb();
+
+	for (i = 0; i < AL_EXT_PER_BM_SECT(mdev); i++) {
 		if (unlikely(al_enr+i == mdev->act_log->new_number))
 			goto try_again;
 		if (lc_is_used(mdev->act_log, al_enr+i))
@@ -1247,7 +1764,7 @@ void drbd_rs_complete_io(struct drbd_conf *mdev, sector_t sector)
 		return;
 	}
 
-	if (bm_ext->lce.refcnt == 0) {
+	if (atomic_read(&bm_ext->lce.refcnt) == 0) {
 		spin_unlock_irqrestore(&mdev->al_lock, flags);
 		dev_err(DEV, "drbd_rs_complete_io(,%llu [=%u]) called, "
 		    "but refcnt is 0!?\n",
@@ -1318,9 +1835,9 @@ int drbd_rs_del_all(struct drbd_conf *mdev)
 				mdev->resync_wenr = LC_FREE;
 				lc_put(mdev->resync, &bm_ext->lce);
 			}
-			if (bm_ext->lce.refcnt != 0) {
+			if (atomic_read(&bm_ext->lce.refcnt) != 0) {
 				dev_info(DEV, "Retrying drbd_rs_del_all() later. "
-				     "refcnt=%d\n", bm_ext->lce.refcnt);
+				     "refcnt=%d\n", atomic_read(&bm_ext->lce.refcnt));
 				put_ldev(mdev);
 				spin_unlock_irq(&mdev->al_lock);
 				return -EAGAIN;
@@ -87,21 +87,36 @@
 
 /*
  * NOTE
- *  Access to the *bm_pages is protected by bm_lock.
- *  It is safe to read the other members within the lock.
+ *  The content of a bitmap page is protected by the lock of its shard,
+ *  page_nr % BM_LOCK_SHARDS, so set_out_of_sync and set_in_sync on
+ *  different parts of the device do not serialize on a single spinlock.
+ *  Changing bm_pages, bm_bits, bm_words or bm_number_of_pages, and any
+ *  operation on the whole bitmap, takes bm_lock and then all shard locks,
+ *  see bm_lock_all().  So it is safe to read those members while holding
+ *  any one of the shard locks.
+ *
+ *  bm_set is changed with atomic_long_add() while holding the shard lock
+ *  of the page the bits are in, so it stays exact, and reading the total
+ *  weight needs no lock at all.
  *
  *  drbd_bm_set_bits is called from bio_endio callbacks,
  *  We may be called with irq already disabled,
  *  so we need spin_lock_irqsave().
  *  And we need the kmap_atomic.
  */
+#define BM_LOCK_SHARDS	16
+
+struct bm_shard {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
 struct drbd_bitmap {
 	struct page **bm_pages;
 	spinlock_t bm_lock;
 
 	/* see LIMITATIONS: above */
 
-	unsigned long bm_set;       /* nr of set bits; THINK maybe atomic_t? */
+	atomic_long_t bm_set;       /* nr of set bits */
 	unsigned long bm_bits;
 	size_t   bm_words;
 	size_t   bm_number_of_pages;
@@ -115,8 +130,34 @@ struct drbd_bitmap {
 	/* debugging aid, in case we are still racy somewhere */
 	char          *bm_why;
 	struct task_struct *bm_task;
+
+	struct bm_shard bm_shard[BM_LOCK_SHARDS];
 };
 
+static spinlock_t *bm_page_lock(struct drbd_bitmap *b, unsigned long page_nr)
+{
+	return &b->bm_shard[page_nr % BM_LOCK_SHARDS].lock;
+}
+
+/* bm_lock first, then the shards in ascending order */
+static void bm_lock_all(struct drbd_bitmap *b)
+{
+	int i;
+
+	spin_lock_irq(&b->bm_lock);
+	for (i = 0; i < BM_LOCK_SHARDS; i++)
+		spin_lock_nest_lock(&b->bm_shard[i].lock, &b->bm_lock);
+}
+
+static void bm_unlock_all(struct drbd_bitmap *b)
+{
+	int i;
+
+	for (i = BM_LOCK_SHARDS - 1; i >= 0; i--)
+		spin_unlock(&b->bm_shard[i].lock);
+	spin_unlock_irq(&b->bm_lock);
+}
+
 #define bm_print_lock_info(m) __bm_print_lock_info(m, __func__)
 static void __bm_print_lock_info(struct drbd_conf *mdev, const char *func)
 {
@@ -431,11 +472,14 @@ STATIC struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 int drbd_bm_init(struct drbd_conf *mdev)
 {
 	struct drbd_bitmap *b = mdev->bitmap;
+	int i;
 	WARN_ON(b != NULL);
 	b = kzalloc(sizeof(struct drbd_bitmap), GFP_KERNEL);
 	if (!b)
 		return -ENOMEM;
 	spin_lock_init(&b->bm_lock);
+	for (i = 0; i < BM_LOCK_SHARDS; i++)
+		spin_lock_init(&b->bm_shard[i].lock);
 	mutex_init(&b->bm_change);
 	init_waitqueue_head(&b->bm_io_wait);
 
@@ -630,17 +674,17 @@ int drbd_bm_resize(struct drbd_conf *mdev, sector_t capacity, int set_new_bits)
 	opages_vmalloced = (BM_P_VMALLOCED & b->bm_flags);
 
 	if (capacity == 0) {
-		spin_lock_irq(&b->bm_lock);
+		bm_lock_all(b);
 		opages = b->bm_pages;
 		onpages = b->bm_number_of_pages;
 		owords = b->bm_words;
 		b->bm_pages = NULL;
 		b->bm_number_of_pages =
-		b->bm_set   =
 		b->bm_bits  =
 		b->bm_words =
 		b->bm_dev_capacity = 0;
-		spin_unlock_irq(&b->bm_lock);
+		atomic_long_set(&b->bm_set, 0);
+		bm_unlock_all(b);
 		bm_free_pages(opages, onpages);
 		bm_vk_free(opages, opages_vmalloced);
 		goto out;
@@ -655,7 +699,8 @@ int drbd_bm_resize(struct drbd_conf *mdev, sector_t capacity, int set_new_bits)
 	words = ALIGN(bits, 64) >> LN2_BPL;
 
 	if (get_ldev(mdev)) {
-		u64 bits_on_disk = ((u64)mdev->ldev->md.md_size_sect-MD_BM_OFFSET) << 12;
+		u64 bits_on_disk = ((u64)mdev->ldev->md.md_size_sect - MD_AL_OFFSET
+				    - drbd_md_al_size(mdev->ldev)) << 12;
 		put_ldev(mdev);
 		if (bits > bits_on_disk) {
 			DUMPLLU(bits);
@@ -682,7 +727,7 @@ int drbd_bm_resize(struct drbd_conf *mdev, sector_t capacity, int set_new_bits)
 		goto out;
 	}
 
-	spin_lock_irq(&b->bm_lock);
+	bm_lock_all(b);
 	opages = b->bm_pages;
 	owords = b->bm_words;
 	obits  = b->bm_bits;
@@ -700,7 +745,7 @@ int drbd_bm_resize(struct drbd_conf *mdev, sector_t capacity, int set_new_bits)
 	if (growing) {
 		if (set_new_bits) {
 			bm_memset(b, owords, 0xff, words-owords);
-			b->bm_set += bits - obits;
+			atomic_long_add(bits - obits, &b->bm_set);
 		} else
 			bm_memset(b, owords, 0x00, words-owords);
 
@@ -713,11 +758,11 @@ int drbd_bm_resize(struct drbd_conf *mdev, sector_t capacity, int set_new_bits)
 
 	(void)bm_clear_surplus(b);
 
-	spin_unlock_irq(&b->bm_lock);
+	bm_unlock_all(b);
 	if (opages != npages)
 		bm_vk_free(opages, opages_vmalloced);
 	if (!growing)
-		b->bm_set = bm_count_bits(b);
+		atomic_long_set(&b->bm_set, bm_count_bits(b));
 	dev_info(DEV, "resync bitmap: bits=%lu words=%lu pages=%lu\n", bits, words, want);
 
  out:
@@ -728,25 +773,17 @@ int drbd_bm_resize(struct drbd_conf *mdev, sector_t capacity, int set_new_bits)
 /* inherently racy:
  * if not protected by other means, return value may be out of date when
  * leaving this function...
- * we still need to lock it, since it is important that this returns
- * bm_set == 0 precisely.
- *
- * maybe bm_set should be atomic_t ?
+ * bm_set is only ever changed atomically together with the bits,
+ * so this still returns bm_set == 0 precisely, without taking any lock.
  */
 unsigned long _drbd_bm_total_weight(struct drbd_conf *mdev)
 {
 	struct drbd_bitmap *b = mdev->bitmap;
-	unsigned long s;
-	unsigned long flags;
 
 	ERR_IF(!b) return 0;
 	ERR_IF(!b->bm_pages) return 0;
 
-	spin_lock_irqsave(&b->bm_lock, flags);
-	s = b->bm_set;
-	spin_unlock_irqrestore(&b->bm_lock, flags);
-
-	return s;
+	return atomic_long_read(&b->bm_set);
 }
 
 unsigned long drbd_bm_total_weight(struct drbd_conf *mdev)
@@ -789,7 +826,9 @@ void drbd_bm_merge_lel(struct drbd_conf *mdev, size_t offset, size_t number,
 	unsigned long *p_addr, *bm;
 	unsigned long word, bits;
 	unsigned int idx;
+	spinlock_t *lock;
 	size_t end, do_now;
+	long changed;
 
 	end = offset + number;
 
@@ -800,30 +839,33 @@ void drbd_bm_merge_lel(struct drbd_conf *mdev, size_t offset, size_t number,
 	WARN_ON(offset >= b->bm_words);
 	WARN_ON(end    >  b->bm_words);
 
-	spin_lock_irq(&b->bm_lock);
 	while (offset < end) {
 		do_now = min_t(size_t, ALIGN(offset+1, LWPP), end) - offset;
 		idx = bm_word_to_page_idx(b, offset);
+		lock = bm_page_lock(b, idx);
+		spin_lock_irq(lock);
 		p_addr = bm_map_pidx(b, idx);
 		bm = p_addr + MLPP(offset);
 		offset += do_now;
+		changed = 0;
 		while (do_now--) {
 			bits = hweight_long(*bm);
 			word = *bm | *buffer++;
 			*bm++ = word;
-			b->bm_set += hweight_long(word) - bits;
+			changed += hweight_long(word) - bits;
 		}
 		bm_unmap(p_addr);
 		bm_set_page_need_writeout(b->bm_pages[idx]);
+		/* with 32bit <-> 64bit cross-platform connect
+		 * this is only correct for current usage,
+		 * where we _know_ that we are 64 bit aligned,
+		 * and know that this function is used in this way, too...
+		 */
+		if (offset == b->bm_words)
+			changed -= bm_clear_surplus(b);
+		atomic_long_add(changed, &b->bm_set);
+		spin_unlock_irq(lock);
 	}
-	/* with 32bit <-> 64bit cross-platform connect
-	 * this is only correct for current usage,
-	 * where we _know_ that we are 64 bit aligned,
-	 * and know that this function is used in this way, too...
-	 */
-	if (end == b->bm_words)
-		b->bm_set -= bm_clear_surplus(b);
-	spin_unlock_irq(&b->bm_lock);
 }
 
 /* copy number words from the bitmap starting at offset into the buffer.
@@ -834,6 +876,8 @@ void drbd_bm_get_lel(struct drbd_conf *mdev, size_t offset, size_t number,
 {
 	struct drbd_bitmap *b = mdev->bitmap;
 	unsigned long *p_addr, *bm;
+	unsigned int idx;
+	spinlock_t *lock;
 	size_t end, do_now;
 
 	end = offset + number;
@@ -841,26 +885,30 @@ void drbd_bm_get_lel(struct drbd_conf *mdev, size_t offset, size_t number,
 	ERR_IF(!b) return;
 	ERR_IF(!b->bm_pages) return;
 
-	spin_lock_irq(&b->bm_lock);
+	/* bm_words does not change while the bitmap is locked,
+	 * which it is for the bitmap exchange */
 	if ((offset >= b->bm_words) ||
 	    (end    >  b->bm_words) ||
-	    (number <= 0))
+	    (number <= 0)) {
 		dev_err(DEV, "offset=%lu number=%lu bm_words=%lu\n",
 			(unsigned long)	offset,
 			(unsigned long)	number,
 			(unsigned long) b->bm_words);
-	else {
-		while (offset < end) {
-			do_now = min_t(size_t, ALIGN(offset+1, LWPP), end) - offset;
-			p_addr = bm_map_pidx(b, bm_word_to_page_idx(b, offset));
-			bm = p_addr + MLPP(offset);
-			offset += do_now;
-			while (do_now--)
-				*buffer++ = *bm++;
-			bm_unmap(p_addr);
-		}
+		return;
+	}
+	while (offset < end) {
+		do_now = min_t(size_t, ALIGN(offset+1, LWPP), end) - offset;
+		idx = bm_word_to_page_idx(b, offset);
+		lock = bm_page_lock(b, idx);
+		spin_lock_irq(lock);
+		p_addr = bm_map_pidx(b, idx);
+		bm = p_addr + MLPP(offset);
+		offset += do_now;
+		while (do_now--)
+			*buffer++ = *bm++;
+		bm_unmap(p_addr);
+		spin_unlock_irq(lock);
 	}
-	spin_unlock_irq(&b->bm_lock);
 }
 
 /* set all bits in the bitmap */
@@ -870,11 +918,11 @@ void drbd_bm_set_all(struct drbd_conf *mdev)
 	ERR_IF(!b) return;
 	ERR_IF(!b->bm_pages) return;
 
-	spin_lock_irq(&b->bm_lock);
+	bm_lock_all(b);
 	bm_memset(b, 0, 0xff, b->bm_words);
 	(void)bm_clear_surplus(b);
-	b->bm_set = b->bm_bits;
-	spin_unlock_irq(&b->bm_lock);
+	atomic_long_set(&b->bm_set, b->bm_bits);
+	bm_unlock_all(b);
 }
 
 /* clear all bits in the bitmap */
@@ -884,10 +932,10 @@ void drbd_bm_clear_all(struct drbd_conf *mdev)
 	ERR_IF(!b) return;
 	ERR_IF(!b->bm_pages) return;
 
-	spin_lock_irq(&b->bm_lock);
+	bm_lock_all(b);
 	bm_memset(b, 0, 0, b->bm_words);
-	b->bm_set = 0;
-	spin_unlock_irq(&b->bm_lock);
+	atomic_long_set(&b->bm_set, 0);
+	bm_unlock_all(b);
 }
 
 struct bm_aio_ctx {
@@ -909,14 +957,39 @@ static void bm_aio_ctx_destroy(struct kref *kref)
 	kfree(ctx);
 }
 
+/* Contiguous bitmap pages are read and written with one bio, of at most
+ * that many pages.  And we keep at most that many bios in flight.
+ *
+ * With BM_AIO_COPY_PAGES, each page of a bio is a copy taken from
+ * drbd_md_io_page_pool, which has only DRBD_MIN_POOL_PAGES, shared by all
+ * minors.  Such bios are smaller, and fewer of them are in flight, so one
+ * context holds at most a quarter of that pool. */
+#define BM_AIO_MAX_PAGES	32
+#define BM_AIO_MAX_IN_FLIGHT	16
+#define BM_AIO_MAX_COPY_PAGES	8
+#define BM_AIO_MAX_COPY_IN_FLIGHT	4
+
+static int bm_aio_max_pages(struct bm_aio_ctx *ctx)
+{
+	return (ctx->flags & BM_AIO_COPY_PAGES) ?
+		BM_AIO_MAX_COPY_PAGES : BM_AIO_MAX_PAGES;
+}
+
+static int bm_aio_max_in_flight(struct bm_aio_ctx *ctx)
+{
+	return (ctx->flags & BM_AIO_COPY_PAGES) ?
+		BM_AIO_MAX_COPY_IN_FLIGHT : BM_AIO_MAX_IN_FLIGHT;
+}
+
 /* bv_page may be a copy, or may be the original */
 static BIO_ENDIO_TYPE bm_async_io_complete BIO_ENDIO_ARGS(struct bio *bio, int error)
 {
 	struct bm_aio_ctx *ctx = bio->bi_private;
 	struct drbd_conf *mdev = ctx->mdev;
 	struct drbd_bitmap *b = mdev->bitmap;
-	unsigned int idx = bm_page_to_idx(bio->bi_io_vec[0].bv_page);
 	int uptodate = bio_flagged(bio, BIO_UPTODATE);
+	unsigned int idx;
+	int i, in_flight;
 
 	BIO_ENDIO_FN_START;
 
@@ -927,79 +1000,140 @@ static BIO_ENDIO_TYPE bm_async_io_complete BIO_ENDIO_ARGS(struct bio *bio, int e
 	if (!error && !uptodate)
 		error = -EIO;
 
-	if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
-	    !bm_test_page_unchanged(b->bm_pages[idx]))
-		dev_warn(DEV, "bitmap page idx %u changed during IO!\n", idx);
-
 	if (error) {
 		/* ctx error will hold the completed-last non-zero error code,
 		 * in case error codes differ. */
 		ctx->error = error;
-		bm_set_page_io_err(b->bm_pages[idx]);
-		/* Not identical to on disk version of it.
-		 * Is BM_PAGE_IO_ERROR enough? */
 		if (DRBD_ratelimit(5*HZ, 5))
-			dev_err(DEV, "IO ERROR %d on bitmap page idx %u\n",
-					error, idx);
-	} else {
-		bm_clear_page_io_err(b->bm_pages[idx]);
-		dynamic_dev_dbg(DEV, "bitmap page idx %u completed\n", idx);
+			dev_err(DEV, "IO ERROR %d on bitmap page idx %u, %u pages\n",
+					error, bm_page_to_idx(bio->bi_io_vec[0].bv_page),
+					bio->bi_vcnt);
 	}
 
-	bm_page_unlock_io(mdev, idx);
+	for (i = 0; i < bio->bi_vcnt; i++) {
+		struct page *page = bio->bi_io_vec[i].bv_page;
+
+		idx = bm_page_to_idx(page);
+
+		if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
+		    !bm_test_page_unchanged(b->bm_pages[idx]))
+			dev_warn(DEV, "bitmap page idx %u changed during IO!\n", idx);
+
+		if (error) {
+			bm_set_page_io_err(b->bm_pages[idx]);
+			/* Not identical to on disk version of it.
+			 * Is BM_PAGE_IO_ERROR enough? */
+		} else {
+			bm_clear_page_io_err(b->bm_pages[idx]);
+			dynamic_dev_dbg(DEV, "bitmap page idx %u completed\n", idx);
+		}
 
-	if (ctx->flags & BM_AIO_COPY_PAGES)
-		mempool_free(bio->bi_io_vec[0].bv_page, drbd_md_io_page_pool);
+		bm_page_unlock_io(mdev, idx);
+
+		if (ctx->flags & BM_AIO_COPY_PAGES)
+			mempool_free(page, drbd_md_io_page_pool);
+	}
 
 	bio_put(bio);
 
-	if (atomic_dec_and_test(&ctx->in_flight)) {
+	in_flight = atomic_dec_return(&ctx->in_flight);
+	if (in_flight == 0) {
 		ctx->done = 1;
 		wake_up(&mdev->misc_wait);
 		kref_put(&ctx->kref, &bm_aio_ctx_destroy);
-	}
+	} else if (in_flight == bm_aio_max_in_flight(ctx))
+		wake_up(&mdev->misc_wait); /* see bm_aio_throttle() */
 
 	BIO_ENDIO_FN_RETURN;
 }
 
-STATIC void bm_page_io_async(struct bm_aio_ctx *ctx, int page_nr, int rw) __must_hold(local)
+/*
+ * Submits one bio for up to @nr bitmap pages, starting at @page_nr.
+ * Returns the number of pages it took, at least one.  Fewer than @nr,
+ * if the queue of the meta data device does not take larger bios,
+ * or if drbd_md_io_page_pool has no more copies for us right now.
+ */
+STATIC int bm_page_io_async(struct bm_aio_ctx *ctx, int page_nr, int nr, int rw) __must_hold(local)
 {
-	struct bio *bio = bio_alloc_drbd(GFP_NOIO);
+	struct page *copies[BM_AIO_MAX_COPY_PAGES];
 	struct drbd_conf *mdev = ctx->mdev;
 	struct drbd_bitmap *b = mdev->bitmap;
+	struct bio *bio;
 	struct page *page;
-	unsigned int len;
-
-	sector_t on_disk_sector =
-		mdev->ldev->md.md_offset + mdev->ldev->md.bm_offset;
-	on_disk_sector += ((sector_t)page_nr) << (PAGE_SHIFT-9);
+	unsigned int len, size = 0;
+	sector_t first_sector, on_disk_sector;
+	int i, nr_copies = 0;
+
+	/* Take all copies before we lock any page.  Only the first one may
+	 * wait for the pool, while we hold no page lock and no copy yet;
+	 * whoever holds copies has submitted them, and gives them back on
+	 * completion.  For the others, we just submit a smaller bio. */
+	if (ctx->flags & BM_AIO_COPY_PAGES) {
+		nr = min_t(int, nr, BM_AIO_MAX_COPY_PAGES);
+		copies[0] = mempool_alloc(drbd_md_io_page_pool, __GFP_HIGHMEM|__GFP_WAIT);
+		for (nr_copies = 1; nr_copies < nr; nr_copies++) {
+			copies[nr_copies] = mempool_alloc(drbd_md_io_page_pool,
+					__GFP_HIGHMEM|__GFP_NOWARN);
+			if (!copies[nr_copies])
+				break;
+		}
+		nr = nr_copies;
+	}
 
-	/* this might happen with very small
-	 * flexible external meta data device,
-	 * or with PAGE_SIZE > 4k */
-	len = min_t(unsigned int, PAGE_SIZE,
-		(drbd_md_last_sector(mdev->ldev) - on_disk_sector + 1)<<9);
+	bio = bio_alloc_drbd_vecs(GFP_NOIO, nr);
 
-	/* serialize IO on this page */
-	bm_page_lock_io(mdev, page_nr);
-	/* before memcpy and submit,
-	 * so it can be redirtied any time */
-	bm_set_page_unchanged(b->bm_pages[page_nr]);
+	first_sector = mdev->ldev->md.md_offset + mdev->ldev->md.bm_offset;
+	first_sector += ((sector_t)page_nr) << (PAGE_SHIFT-9);
 
-	if (ctx->flags & BM_AIO_COPY_PAGES) {
-		page = mempool_alloc(drbd_md_io_page_pool, __GFP_HIGHMEM|__GFP_WAIT);
-		copy_highpage(page, b->bm_pages[page_nr]);
-		bm_store_page_idx(page, page_nr);
-	} else
-		page = b->bm_pages[page_nr];
 	bio->bi_bdev = mdev->ldev->md_bdev;
-	bio->bi_sector = on_disk_sector;
-	/* bio_add_page of a single page to an empty bio will always succeed,
-	 * according to api.  Do we want to assert that? */
-	bio_add_page(bio, page, len, 0);
+	bio->bi_sector = first_sector;
 	bio->bi_private = ctx;
 	bio->bi_end_io = bm_async_io_complete;
 
+	for (i = 0; i < nr; i++) {
+		on_disk_sector = first_sector + (((sector_t)i) << (PAGE_SHIFT-9));
+
+		/* this might happen with very small
+		 * flexible external meta data device,
+		 * or with PAGE_SIZE > 4k */
+		len = min_t(unsigned int, PAGE_SIZE,
+			(drbd_md_last_sector(mdev->ldev) - on_disk_sector + 1)<<9);
+
+		if (ctx->flags & BM_AIO_COPY_PAGES) {
+			page = copies[i];
+			bm_store_page_idx(page, page_nr + i);
+		} else
+			page = b->bm_pages[page_nr + i];
+
+		/* bio_add_page of a single page to an empty bio will always
+		 * succeed, according to api.  Add before we lock the page,
+		 * so we have nothing to undo if the queue refuses. */
+		if (bio_add_page(bio, page, len, 0) != len) {
+			D_ASSERT(i > 0);
+			break;
+		}
+		size += len;
+
+		/* serialize IO on this page.
+		 * In ascending page order, as everyone. */
+		bm_page_lock_io(mdev, page_nr + i);
+		/* before memcpy and submit,
+		 * so it can be redirtied any time */
+		bm_set_page_unchanged(b->bm_pages[page_nr + i]);
+
+		if (ctx->flags & BM_AIO_COPY_PAGES)
+			copy_highpage(page, b->bm_pages[page_nr + i]);
+
+		if (len < PAGE_SIZE) {
+			i++;
+			break;
+		}
+	}
+
+	/* copies the bio did not take */
+	while (nr_copies > i)
+		mempool_free(copies[--nr_copies], drbd_md_io_page_pool);
+
 	if (drbd_insert_fault(mdev, (rw & WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
 		bio->bi_rw |= rw;
 		bio_endio(bio, -EIO);
@@ -1007,8 +1141,60 @@ STATIC void bm_page_io_async(struct bm_aio_ctx *ctx, int page_nr, int rw) __must
 		submit_bio(rw, bio);
 		/* this should not count as user activity and cause the
 		 * resync to throttle -- see drbd_rs_should_slow_down(). */
-		atomic_add(len >> 9, &mdev->rs_sect_ev);
+		atomic_add(size >> 9, &mdev->rs_sect_ev);
+	}
+	return i;
+}
+
+/* Waits while too many bitmap bios are in flight.
+ * Returns false if we got force-detached meanwhile. */
+static bool bm_aio_throttle(struct bm_aio_ctx *ctx)
+{
+	struct drbd_conf *mdev = ctx->mdev;
+	long dt;
+
+	if (atomic_read(&ctx->in_flight) <= bm_aio_max_in_flight(ctx))
+		return true;
+
+	dt = mdev->ldev->dc.disk_timeout * HZ / 10;
+	if (dt == 0)
+		dt = MAX_SCHEDULE_TIMEOUT;
+
+	drbd_blk_run_queue(bdev_get_queue(mdev->ldev->md_bdev));
+	dt = wait_event_timeout(mdev->misc_wait,
+			atomic_read(&ctx->in_flight) <= bm_aio_max_in_flight(ctx) ||
+			drbd_test_flag(mdev, FORCE_DETACH), dt);
+	if (dt == 0) {
+		dev_err(DEV, "meta-data IO operation timed out\n");
+		drbd_chk_io_error(mdev, 1, DRBD_FORCE_DETACH);
 	}
+	return !drbd_test_flag(mdev, FORCE_DETACH);
+}
+
+/* whether bm_rw() has to read or write bitmap page @i */
+static bool bm_page_needs_io(struct drbd_conf *mdev, int rw, unsigned flags,
+			     unsigned lazy_writeout_upper_idx, int i)
+{
+	struct drbd_bitmap *b = mdev->bitmap;
+
+	if (lazy_writeout_upper_idx && i >= lazy_writeout_upper_idx)
+		return false;
+	if (!(rw & WRITE))
+		return true;
+	/* ignore completely unchanged pages */
+	if (!(flags & BM_WRITE_ALL_PAGES) &&
+	    bm_test_page_unchanged(b->bm_pages[i])) {
+		dynamic_dev_dbg(DEV, "skipped bm write for idx %u\n", i);
+		return false;
+	}
+	/* during lazy writeout,
+	 * ignore those pages not marked for lazy writeout. */
+	if (lazy_writeout_upper_idx &&
+	    !bm_test_page_lazy_writeout(b->bm_pages[i])) {
+		dynamic_dev_dbg(DEV, "skipped bm lazy write for idx %u\n", i);
+		return false;
+	}
+	return true;
 }
 
 /*
@@ -1018,7 +1204,7 @@ STATIC int bm_rw(struct drbd_conf *mdev, int rw, unsigned flags, unsigned lazy_w
 {
 	struct bm_aio_ctx *ctx;
 	struct drbd_bitmap *b = mdev->bitmap;
-	int num_pages, i, count = 0;
+	int num_pages, i, nr, count = 0, bios = 0;
 	unsigned long now;
 	char ppb[10];
 	int err = 0;
@@ -1058,28 +1244,21 @@ STATIC int bm_rw(struct drbd_conf *mdev, int rw, unsigned flags, unsigned lazy_w
 
 	now = jiffies;
 
-	/* let the layers below us try to merge these bios... */
-	for (i = 0; i < num_pages; i++) {
-		/* ignore completely unchanged pages */
-		if (lazy_writeout_upper_idx && i == lazy_writeout_upper_idx)
+	/* merge runs of pages that need IO into one bio each */
+	for (i = 0; i < num_pages; i += nr) {
+		nr = 1;
+		if (!bm_page_needs_io(mdev, rw, flags, lazy_writeout_upper_idx, i))
+			continue;
+		while (nr < bm_aio_max_pages(ctx) && i + nr < num_pages &&
+		       bm_page_needs_io(mdev, rw, flags, lazy_writeout_upper_idx, i + nr))
+			nr++;
+
+		if (!bm_aio_throttle(ctx))
 			break;
-		if (rw & WRITE) {
-			if (!(flags & BM_WRITE_ALL_PAGES) &&
-			    bm_test_page_unchanged(b->bm_pages[i])) {
-				dynamic_dev_dbg(DEV, "skipped bm write for idx %u\n", i);
-				continue;
-			}
-			/* during lazy writeout,
-			 * ignore those pages not marked for lazy writeout. */
-			if (lazy_writeout_upper_idx &&
-			    !bm_test_page_lazy_writeout(b->bm_pages[i])) {
-				dynamic_dev_dbg(DEV, "skipped bm lazy write for idx %u\n", i);
-				continue;
-			}
-		}
 		atomic_inc(&ctx->in_flight);
-		bm_page_io_async(ctx, i, rw);
-		++count;
+		nr = bm_page_io_async(ctx, i, nr, rw);
+		count += nr;
+		++bios;
 		cond_resched();
 	}
 
@@ -1097,9 +1276,9 @@ STATIC int bm_rw(struct drbd_conf *mdev, int rw, unsigned flags, unsigned lazy_w
 	} else
 		kref_put(&ctx->kref, &bm_aio_ctx_destroy);
 
-	dev_info(DEV, "bitmap %s of %u pages took %lu jiffies\n",
+	dev_info(DEV, "bitmap %s of %u pages in %u bios took %lu jiffies\n",
 			rw == WRITE ? "WRITE" : "READ",
-			count, jiffies - now);
+			count, bios, jiffies - now);
 
 	if (ctx->error) {
 		dev_alert(DEV, "we had at least one MD IO ERROR during bitmap IO\n");
@@ -1114,11 +1293,11 @@ STATIC int bm_rw(struct drbd_conf *mdev, int rw, unsigned flags, unsigned lazy_w
 	if (rw == WRITE) {
 		drbd_md_flush(mdev);
 	} else /* rw == READ */ {
-		b->bm_set = bm_count_bits(b);
+		atomic_long_set(&b->bm_set, bm_count_bits(b));
 		dev_info(DEV, "recounting of set bits took additional %lu jiffies\n",
 		     jiffies - now);
 	}
-	now = b->bm_set;
+	now = atomic_long_read(&b->bm_set);
 
 	dev_info(DEV, "%s (%lu bits) marked out-of-sync by on disk bit-map.\n",
 	     ppsize(ppb, now << (BM_BLOCK_SHIFT-10)), now);
@@ -1196,17 +1375,30 @@ int drbd_bm_write_copy_pages(struct drbd_conf *mdev) __must_hold(local)
  *
  * In case this becomes an issue on systems with larger PAGE_SIZE,
  * we may want to change this again to write 4k aligned 4k pieces.
+ *
+ * Changed pages right before and after @idx go into the same bio,
+ * they would have to be written some time later anyways.
  */
 int drbd_bm_write_page(struct drbd_conf *mdev, unsigned int idx) __must_hold(local)
 {
+	struct drbd_bitmap *b = mdev->bitmap;
 	struct bm_aio_ctx *ctx;
-	int err;
+	unsigned int first, last, i;
+	int nr, err;
 
-	if (bm_test_page_unchanged(mdev->bitmap->bm_pages[idx])) {
+	if (bm_test_page_unchanged(b->bm_pages[idx])) {
 		dynamic_dev_dbg(DEV, "skipped bm page write for idx %u\n", idx);
 		return 0;
 	}
 
+	first = last = idx;
+	while (first > 0 && last - first + 1 < BM_AIO_MAX_COPY_PAGES / 2 &&
+	       !bm_test_page_unchanged(b->bm_pages[first - 1]))
+		first--;
+	while (last + 1 < b->bm_number_of_pages && last - first + 1 < BM_AIO_MAX_COPY_PAGES &&
+	       !bm_test_page_unchanged(b->bm_pages[last + 1]))
+		last++;
+
 	ctx = kmalloc(sizeof(struct bm_aio_ctx), GFP_NOIO);
 	if (!ctx)
 		return -ENOMEM;
@@ -1226,20 +1418,47 @@ int drbd_bm_write_page(struct drbd_conf *mdev, unsigned int idx) __must_hold(loc
 		return -ENODEV;
 	}
 
-	bm_page_io_async(ctx, idx, WRITE_SYNC);
-	wait_until_done_or_force_detached(mdev, mdev->ldev, &ctx->done);
+	for (i = first; i <= last; i += nr) {
+		atomic_inc(&ctx->in_flight);
+		nr = bm_page_io_async(ctx, i, last - i + 1, WRITE_SYNC);
+	}
+	if (!atomic_dec_and_test(&ctx->in_flight))
+		wait_until_done_or_force_detached(mdev, mdev->ldev, &ctx->done);
+	else
+		kref_put(&ctx->kref, &bm_aio_ctx_destroy);
 
 	if (ctx->error)
 		drbd_chk_io_error(mdev, 1, DRBD_META_IO_ERROR);
 		/* that causes us to detach, so the in memory bitmap will be
 		 * gone in a moment as well. */
 
-	mdev->bm_writ_cnt++;
+	drbd_stat_add(mdev, STAT_BM_WRITES, 1);
 	err = atomic_read(&ctx->in_flight) ? -EIO : ctx->error;
 	kref_put(&ctx->kref, &bm_aio_ctx_destroy);
 	return err;
 }
 
+/* offset within the page of the next set (or cleared) bit
+ * at or after bm_fo, PAGE_SIZE*8 if there is none in this page */
+static unsigned bm_find_in_page(struct drbd_bitmap *b, unsigned long bm_fo,
+	const int find_zero_bit, const enum km_type km)
+{
+	unsigned long *p_addr;
+	unsigned i;
+
+	p_addr = __bm_map_pidx(b, bm_bit_to_page_idx(b, bm_fo), km);
+
+	if (find_zero_bit)
+		i = find_next_zero_bit_le(p_addr,
+				PAGE_SIZE*8, bm_fo & BITS_PER_PAGE_MASK);
+	else
+		i = find_next_bit_le(p_addr,
+				PAGE_SIZE*8, bm_fo & BITS_PER_PAGE_MASK);
+
+	__bm_unmap(p_addr, km);
+	return i;
+}
+
 /* NOTE
  * find_first_bit returns int, we return unsigned long.
  * For this to work on 32bit arch with bitnumbers > (1<<32),
@@ -1252,7 +1471,6 @@ static unsigned long __bm_find_next(struct drbd_conf *mdev, unsigned long bm_fo,
 	const int find_zero_bit, const enum km_type km)
 {
 	struct drbd_bitmap *b = mdev->bitmap;
-	unsigned long *p_addr;
 	unsigned long bit_offset;
 	unsigned i;
 
@@ -1264,16 +1482,7 @@ static unsigned long __bm_find_next(struct drbd_conf *mdev, unsigned long bm_fo,
 		while (bm_fo < b->bm_bits) {
 			/* bit offset of the first bit in the page */
 			bit_offset = bm_fo & ~BITS_PER_PAGE_MASK;
-			p_addr = __bm_map_pidx(b, bm_bit_to_page_idx(b, bm_fo), km);
-
-			if (find_zero_bit)
-				i = find_next_zero_bit_le(p_addr,
-						PAGE_SIZE*8, bm_fo & BITS_PER_PAGE_MASK);
-			else
-				i = find_next_bit_le(p_addr,
-						PAGE_SIZE*8, bm_fo & BITS_PER_PAGE_MASK);
-
-			__bm_unmap(p_addr, km);
+			i = bm_find_in_page(b, bm_fo, find_zero_bit, km);
 			if (i < PAGE_SIZE*8) {
 				bm_fo = bit_offset + i;
 				if (bm_fo >= b->bm_bits)
@@ -1292,19 +1501,42 @@ static unsigned long bm_find_next(struct drbd_conf *mdev,
 	unsigned long bm_fo, const int find_zero_bit)
 {
 	struct drbd_bitmap *b = mdev->bitmap;
-	unsigned long i = DRBD_END_OF_BITMAP;
+	unsigned long bit_offset;
+	spinlock_t *lock;
+	unsigned i;
 
-	ERR_IF(!b) return i;
-	ERR_IF(!b->bm_pages) return i;
+	ERR_IF(!b) return DRBD_END_OF_BITMAP;
+	ERR_IF(!b->bm_pages) return DRBD_END_OF_BITMAP;
 
-	spin_lock_irq(&b->bm_lock);
 	if (BM_DONT_TEST & b->bm_flags)
 		bm_print_lock_info(mdev);
 
-	i = __bm_find_next(mdev, bm_fo, find_zero_bit, KM_IRQ1);
+	if (bm_fo > b->bm_bits) {
+		dev_err(DEV, "bm_fo=%lu bm_bits=%lu\n", bm_fo, b->bm_bits);
+		return DRBD_END_OF_BITMAP;
+	}
 
-	spin_unlock_irq(&b->bm_lock);
-	return i;
+	/* only hold the lock of the page we are currently looking at,
+	 * bm_bits may only change while we hold none of them */
+	for (;;) {
+		bit_offset = bm_fo & ~BITS_PER_PAGE_MASK;
+		lock = bm_page_lock(b, bm_fo >> (PAGE_SHIFT + 3));
+		spin_lock_irq(lock);
+		if (bm_fo >= b->bm_bits) {
+			spin_unlock_irq(lock);
+			return DRBD_END_OF_BITMAP;
+		}
+		i = bm_find_in_page(b, bm_fo, find_zero_bit, KM_IRQ1);
+		if (i < PAGE_SIZE*8) {
+			bm_fo = bit_offset + i;
+			if (bm_fo >= b->bm_bits)
+				bm_fo = DRBD_END_OF_BITMAP;
+			spin_unlock_irq(lock);
+			return bm_fo;
+		}
+		spin_unlock_irq(lock);
+		bm_fo = bit_offset + PAGE_SIZE*8;
+	}
 }
 
 unsigned long drbd_bm_find_next(struct drbd_conf *mdev, unsigned long bm_fo)
@@ -1334,12 +1566,24 @@ unsigned long _drbd_bm_find_next_zero(struct drbd_conf *mdev, unsigned long bm_f
 	return __bm_find_next(mdev, bm_fo, 1, KM_USER1);
 }
 
+/* mark the page for writeout, and account for the changed bits.
+ * must hold the lock of that page */
+static void bm_account_page(struct drbd_bitmap *b, unsigned int page_nr, int c)
+{
+	if (c < 0)
+		bm_set_page_lazy_writeout(b->bm_pages[page_nr]);
+	else if (c > 0)
+		bm_set_page_need_writeout(b->bm_pages[page_nr]);
+	if (c)
+		atomic_long_add(c, &b->bm_set);
+}
+
 /* returns number of bits actually changed.
  * for val != 0, we change 0 -> 1, return code positive
  * for val == 0, we change 1 -> 0, return code negative
  * wants bitnr, not sector.
  * expected to be called for only a few bits (e - s about BITS_PER_LONG).
- * Must hold bitmap lock already. */
+ * Takes the lock of each page it touches. */
 STATIC int __bm_change_bits_to(struct drbd_conf *mdev, const unsigned long s,
 	unsigned long e, int val)
 {
@@ -1347,6 +1591,8 @@ STATIC int __bm_change_bits_to(struct drbd_conf *mdev, const unsigned long s,
 	unsigned long *p_addr = NULL;
 	unsigned long bitnr;
 	unsigned int last_page_nr = -1U;
+	spinlock_t *lock = NULL;
+	unsigned long flags;
 	int c = 0;
 	int changed_total = 0;
 
@@ -1356,16 +1602,23 @@ STATIC int __bm_change_bits_to(struct drbd_conf *mdev, const unsigned long s,
 		e = b->bm_bits ? b->bm_bits -1 : 0;
 	}
 	for (bitnr = s; bitnr <= e; bitnr++) {
-		unsigned int page_nr = bm_bit_to_page_idx(b, bitnr);
+		unsigned int page_nr = bitnr >> (PAGE_SHIFT + 3);
 		if (page_nr != last_page_nr) {
-			if (p_addr)
+			if (p_addr) {
 				__bm_unmap(p_addr, KM_IRQ1);
-			if (c < 0)
-				bm_set_page_lazy_writeout(b->bm_pages[last_page_nr]);
-			else if (c > 0)
-				bm_set_page_need_writeout(b->bm_pages[last_page_nr]);
+				bm_account_page(b, last_page_nr, c);
+				spin_unlock_irqrestore(lock, flags);
+				p_addr = NULL;
+			}
 			changed_total += c;
 			c = 0;
+			lock = bm_page_lock(b, page_nr);
+			spin_lock_irqsave(lock, flags);
+			/* we did not hold any lock when checking e above */
+			if (bitnr >= b->bm_bits) {
+				spin_unlock_irqrestore(lock, flags);
+				break;
+			}
 			p_addr = __bm_map_pidx(b, page_nr, KM_IRQ1);
 			last_page_nr = page_nr;
 		}
@@ -1374,14 +1627,12 @@ STATIC int __bm_change_bits_to(struct drbd_conf *mdev, const unsigned long s,
 		else
 			c -= (0 != __test_and_clear_bit_le(bitnr & BITS_PER_PAGE_MASK, p_addr));
 	}
-	if (p_addr)
+	if (p_addr) {
 		__bm_unmap(p_addr, KM_IRQ1);
-	if (c < 0)
-		bm_set_page_lazy_writeout(b->bm_pages[last_page_nr]);
-	else if (c > 0)
-		bm_set_page_need_writeout(b->bm_pages[last_page_nr]);
-	changed_total += c;
-	b->bm_set += changed_total;
+		bm_account_page(b, last_page_nr, c);
+		spin_unlock_irqrestore(lock, flags);
+		changed_total += c;
+	}
 	return changed_total;
 }
 
@@ -1392,21 +1643,15 @@ STATIC int __bm_change_bits_to(struct drbd_conf *mdev, const unsigned long s,
 STATIC int bm_change_bits_to(struct drbd_conf *mdev, const unsigned long s,
 	const unsigned long e, int val)
 {
-	unsigned long flags;
 	struct drbd_bitmap *b = mdev->bitmap;
-	int c = 0;
 
 	ERR_IF(!b) return 1;
 	ERR_IF(!b->bm_pages) return 0;
 
-	spin_lock_irqsave(&b->bm_lock, flags);
 	if ((val ? BM_DONT_SET : BM_DONT_CLEAR) & b->bm_flags)
 		bm_print_lock_info(mdev);
 
-	c = __bm_change_bits_to(mdev, s, e, val);
-
-	spin_unlock_irqrestore(&b->bm_lock, flags);
-	return c;
+	return __bm_change_bits_to(mdev, s, e, val);
 }
 
 /* returns number of bits changed 0 -> 1 */
@@ -1422,14 +1667,19 @@ int drbd_bm_clear_bits(struct drbd_conf *mdev, const unsigned long s, const unsi
 }
 
 /* sets all bits in full words,
- * from first_word up to, but not including, last_word */
+ * from first_word up to, but not including, last_word.
+ * Takes the lock of that page. */
 static inline void bm_set_full_words_within_one_page(struct drbd_bitmap *b,
 		int page_nr, int first_word, int last_word)
 {
+	spinlock_t *lock = bm_page_lock(b, page_nr);
+	unsigned long *paddr;
 	int i;
 	int bits;
 	int changed = 0;
-	unsigned long *paddr = drbd_kmap_atomic(b->bm_pages[page_nr], KM_IRQ1);
+
+	spin_lock_irq(lock);
+	paddr = drbd_kmap_atomic(b->bm_pages[page_nr], KM_IRQ1);
 	for (i = first_word; i < last_word; i++) {
 		bits = hweight_long(paddr[i]);
 		paddr[i] = ~0UL;
@@ -1441,8 +1691,9 @@ static inline void bm_set_full_words_within_one_page(struct drbd_bitmap *b,
 		 * remote bitmap as well, and is reconstructed during the next
 		 * bitmap exchange, if lost locally due to a crash. */
 		bm_set_page_lazy_writeout(b->bm_pages[page_nr]);
-		b->bm_set += changed;
+		atomic_long_add(changed, &b->bm_set);
 	}
+	spin_unlock_irq(lock);
 }
 
 /* Same thing as drbd_bm_set_bits,
@@ -1460,7 +1711,6 @@ void _drbd_bm_set_bits(struct drbd_conf *mdev, const unsigned long s, const unsi
 	 * Do not use memset, because we must account for changes,
 	 * so we need to loop over the words with hweight() anyways.
 	 */
-	struct drbd_bitmap *b = mdev->bitmap;
 	unsigned long sl = ALIGN(s,BITS_PER_LONG);
 	unsigned long el = (e+1) & ~((unsigned long)BITS_PER_LONG-1);
 	int first_page;
@@ -1471,16 +1721,12 @@ void _drbd_bm_set_bits(struct drbd_conf *mdev, const unsigned long s, const unsi
 
 	if (e - s <= 3*BITS_PER_LONG) {
 		/* don't bother; el and sl may even be wrong. */
-		spin_lock_irq(&b->bm_lock);
 		__bm_change_bits_to(mdev, s, e, 1);
-		spin_unlock_irq(&b->bm_lock);
 		return;
 	}
 
 	/* difference is large enough that we can trust sl and el */
 
-	spin_lock_irq(&b->bm_lock);
-
 	/* bits filling the current long */
 	if (sl)
 		__bm_change_bits_to(mdev, s, sl-1, 1);
@@ -1496,10 +1742,8 @@ void _drbd_bm_set_bits(struct drbd_conf *mdev, const unsigned long s, const unsi
 	/* first and full pages, unless first page == last page */
 	for (page_nr = first_page; page_nr < last_page; page_nr++) {
 		bm_set_full_words_within_one_page(mdev->bitmap, page_nr, first_word, last_word);
-		spin_unlock_irq(&b->bm_lock);
 		cond_resched();
 		first_word = 0;
-		spin_lock_irq(&b->bm_lock);
 	}
 	/* last page (respectively only page, for first page == last page) */
 	last_word = MLPP(el >> LN2_BPL);
@@ -1520,7 +1764,6 @@ void _drbd_bm_set_bits(struct drbd_conf *mdev, const unsigned long s, const unsi
 	 */
 	if (el <= e)
 		__bm_change_bits_to(mdev, el, e, 1);
-	spin_unlock_irq(&b->bm_lock);
 }
 
 /* returns bit state
@@ -1534,13 +1777,15 @@ int drbd_bm_test_bit(struct drbd_conf *mdev, const unsigned long bitnr)
 {
 	unsigned long flags;
 	struct drbd_bitmap *b = mdev->bitmap;
+	spinlock_t *lock;
 	unsigned long *p_addr;
 	int i;
 
 	ERR_IF(!b) return 0;
 	ERR_IF(!b->bm_pages) return 0;
 
-	spin_lock_irqsave(&b->bm_lock, flags);
+	lock = bm_page_lock(b, bitnr >> (PAGE_SHIFT + 3));
+	spin_lock_irqsave(lock, flags);
 	if (BM_DONT_TEST & b->bm_flags)
 		bm_print_lock_info(mdev);
 	if (bitnr < b->bm_bits) {
@@ -1554,7 +1799,7 @@ int drbd_bm_test_bit(struct drbd_conf *mdev, const unsigned long bitnr)
 		i = 0;
 	}
 
-	spin_unlock_irqrestore(&b->bm_lock, flags);
+	spin_unlock_irqrestore(lock, flags);
 	return i;
 }
 
@@ -1566,6 +1811,7 @@ int drbd_bm_count_bits(struct drbd_conf *mdev, const unsigned long s, const unsi
 	unsigned long *p_addr = NULL;
 	unsigned long bitnr;
 	unsigned int page_nr = -1U;
+	spinlock_t *lock = NULL;
 	int c = 0;
 
 	/* If this is called without a bitmap, that is a bug.  But just to be
@@ -1575,16 +1821,19 @@ int drbd_bm_count_bits(struct drbd_conf *mdev, const unsigned long s, const unsi
 	ERR_IF(!b) return 1;
 	ERR_IF(!b->bm_pages) return 1;
 
-	spin_lock_irqsave(&b->bm_lock, flags);
 	if (BM_DONT_TEST & b->bm_flags)
 		bm_print_lock_info(mdev);
 	for (bitnr = s; bitnr <= e; bitnr++) {
-		unsigned int idx = bm_bit_to_page_idx(b, bitnr);
+		unsigned int idx = bitnr >> (PAGE_SHIFT + 3);
 		if (page_nr != idx) {
 			page_nr = idx;
-			if (p_addr)
+			if (p_addr) {
 				bm_unmap(p_addr);
-			p_addr = bm_map_pidx(b, idx);
+				spin_unlock_irqrestore(lock, flags);
+			}
+			lock = bm_page_lock(b, idx);
+			spin_lock_irqsave(lock, flags);
+			p_addr = bm_map_pidx(b, bm_bit_to_page_idx(b, bitnr));
 		}
 		ERR_IF (bitnr >= b->bm_bits) {
 			dev_err(DEV, "bitnr=%lu bm_bits=%lu\n", bitnr, b->bm_bits);
@@ -1592,9 +1841,10 @@ int drbd_bm_count_bits(struct drbd_conf *mdev, const unsigned long s, const unsi
 			c += (0 != test_bit_le(bitnr - (page_nr << (PAGE_SHIFT+3)), p_addr));
 		}
 	}
-	if (p_addr)
+	if (p_addr) {
 		bm_unmap(p_addr);
-	spin_unlock_irqrestore(&b->bm_lock, flags);
+		spin_unlock_irqrestore(lock, flags);
+	}
 	return c;
 }
 
@@ -1619,15 +1869,18 @@ int drbd_bm_e_weight(struct drbd_conf *mdev, unsigned long enr)
 	int count, s, e;
 	unsigned long flags;
 	unsigned long *p_addr, *bm;
+	spinlock_t *lock;
 
 	ERR_IF(!b) return 0;
 	ERR_IF(!b->bm_pages) return 0;
 
-	spin_lock_irqsave(&b->bm_lock, flags);
+	s = S2W(enr);
+	/* one bitmap extent never crosses a page boundary */
+	lock = bm_page_lock(b, s >> (PAGE_SHIFT - LN2_BPL + 3));
+	spin_lock_irqsave(lock, flags);
 	if (BM_DONT_TEST & b->bm_flags)
 		bm_print_lock_info(mdev);
 
-	s = S2W(enr);
 	e = min((size_t)S2W(enr+1), b->bm_words);
 	count = 0;
 	if (s < b->bm_words) {
@@ -1640,7 +1893,7 @@ int drbd_bm_e_weight(struct drbd_conf *mdev, unsigned long enr)
 	} else {
 		dev_err(DEV, "start offset (%d) too large in drbd_bm_e_weight\n", s);
 	}
-	spin_unlock_irqrestore(&b->bm_lock, flags);
+	spin_unlock_irqrestore(lock, flags);
 #if DUMP_MD >= 3
 	dev_info(DEV, "enr=%lu weight=%d e=%d s=%d\n", enr, count, e, s);
 #endif
@@ -1653,19 +1906,20 @@ unsigned long drbd_bm_ALe_set_all(struct drbd_conf *mdev, unsigned long al_enr)
 {
 	struct drbd_bitmap *b = mdev->bitmap;
 	unsigned long *p_addr, *bm;
-	unsigned long weight;
+	unsigned long weight = 0;
 	unsigned long s, e;
+	spinlock_t *lock;
 	int count, i, do_now;
 	ERR_IF(!b) return 0;
 	ERR_IF(!b->bm_pages) return 0;
 
-	spin_lock_irq(&b->bm_lock);
+	s = al_enr * BM_WORDS_PER_AL_EXT(mdev);
+	lock = bm_page_lock(b, s >> (PAGE_SHIFT - LN2_BPL + 3));
+	spin_lock_irq(lock);
 	if (BM_DONT_SET & b->bm_flags)
 		bm_print_lock_info(mdev);
-	weight = b->bm_set;
 
-	s = al_enr * BM_WORDS_PER_AL_EXT;
-	e = min_t(size_t, s + BM_WORDS_PER_AL_EXT, b->bm_words);
+	e = min_t(size_t, s + BM_WORDS_PER_AL_EXT(mdev), b->bm_words);
 	/* assert that s and e are on the same page */
 	D_ASSERT((e-1) >> (PAGE_SHIFT - LN2_BPL + 3)
 	      ==  s    >> (PAGE_SHIFT - LN2_BPL + 3));
@@ -1680,13 +1934,14 @@ unsigned long drbd_bm_ALe_set_all(struct drbd_conf *mdev, unsigned long al_enr)
 			bm++;
 		}
 		bm_unmap(p_addr);
-		b->bm_set += do_now*BITS_PER_LONG - count;
+		weight = do_now*BITS_PER_LONG - count;
+		/* same page, see the assert above */
 		if (e == b->bm_words)
-			b->bm_set -= bm_clear_surplus(b);
+			weight -= bm_clear_surplus(b);
+		atomic_long_add(weight, &b->bm_set);
 	} else {
 		dev_err(DEV, "start offset (%lu) too large in drbd_bm_ALe_set_all\n", s);
 	}
-	weight = b->bm_set - weight;
-	spin_unlock_irq(&b->bm_lock);
+	spin_unlock_irq(lock);
 	return weight;
 }
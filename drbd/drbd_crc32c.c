@@ -0,0 +1,149 @@
+/*
+   drbd_crc32c.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Copyright (C) 2011, LINBIT Information Technologies GmbH.
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   drbd is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with drbd; see the file COPYING.  If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ */
+
+/*
+ * CRC32C (Castagnoli), as used for the "crc32c" data-integrity, csums and
+ * verify algorithms. The result is bit for bit the one of the kernel's
+ * crc32c digest, so a peer using the crypto API interoperates with us.
+ *
+ * On x86 with SSE4.2 we use the crc32 instruction, one word at a time.
+ * Otherwise we fall back to a table driven slicing-by-8 implementation.
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#endif
+
+#include "drbd_int.h"
+
+#define CRC32C_POLY_LE 0x82f63b78
+
+static u32 crc32c_table[8][256];
+
+#if defined(CONFIG_X86) && defined(X86_FEATURE_XMM4_2)
+#define DRBD_CRC32C_HW 1
+
+/* open coded instruction bytes, older binutils do not know crc32 */
+#ifdef CONFIG_X86_64
+#define REX_PRE "0x48, "
+#else
+#define REX_PRE
+#endif
+
+static int crc32c_have_hw;
+
+static u32 crc32c_hw(u32 crc, const unsigned char *p, size_t len)
+{
+	const unsigned long *w = (const unsigned long *)p;
+	size_t words = len / sizeof(unsigned long);
+
+	len &= sizeof(unsigned long) - 1;
+	while (words--) {
+		/* crc32 %ecx/%rcx, %esi/%rsi */
+		__asm__ __volatile__(
+			".byte 0xf2, " REX_PRE "0xf, 0x38, 0xf1, 0xf1;"
+			: "=S" (crc)
+			: "0" (crc), "c" (*w));
+		w++;
+	}
+	p = (const unsigned char *)w;
+	while (len--) {
+		/* crc32b %cl, %esi */
+		__asm__ __volatile__(
+			".byte 0xf2, 0xf, 0x38, 0xf0, 0xf1"
+			: "=S" (crc)
+			: "0" (crc), "c" (*p));
+		p++;
+	}
+	return crc;
+}
+#endif
+
+static u32 crc32c_sw(u32 crc, const unsigned char *p, size_t len)
+{
+	while (len && ((unsigned long)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		/* byte wise loads, so this does not depend on endianness */
+		u32 lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24);
+		u32 hi = p[4] | p[5] << 8 | p[6] << 16 | p[7] << 24;
+
+		crc = crc32c_table[7][lo & 0xff] ^
+		      crc32c_table[6][(lo >> 8) & 0xff] ^
+		      crc32c_table[5][(lo >> 16) & 0xff] ^
+		      crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][hi & 0xff] ^
+		      crc32c_table[2][(hi >> 8) & 0xff] ^
+		      crc32c_table[1][(hi >> 16) & 0xff] ^
+		      crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/**
+ * drbd_crc32c() - Continue a CRC32C over @len bytes at @data
+ * @crc:	Running crc, start with ~0.
+ *
+ * The digest is the little endian representation of ~crc,
+ * see drbd_digest_final().
+ */
+u32 drbd_crc32c(u32 crc, const void *data, size_t len)
+{
+#ifdef DRBD_CRC32C_HW
+	if (crc32c_have_hw)
+		return crc32c_hw(crc, data, len);
+#endif
+	return crc32c_sw(crc, data, len);
+}
+
+void drbd_crc32c_init(void)
+{
+	u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY_LE : 0);
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+#ifdef DRBD_CRC32C_HW
+	crc32c_have_hw = boot_cpu_has(X86_FEATURE_XMM4_2);
+#endif
+}
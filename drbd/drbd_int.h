@@ -34,12 +34,14 @@
 #include <linux/bitops.h>
 #include <linux/slab.h>
 #include <linux/crypto.h>
+#include <linux/scatterlist.h>
 #include <linux/tcp.h>
 #include <linux/mutex.h>
 #include <linux/genhd.h>
 #include <net/tcp.h>
 #include <linux/lru_cache.h>
 #include <linux/prefetch.h>
+#include <linux/percpu.h>
 #include <linux/drbd_config.h>
 
 #ifdef __CHECKER__
@@ -292,6 +294,12 @@ drbd_insert_fault(struct drbd_conf *mdev, unsigned int type) {
 # define HAVE_KERNEL_SENDMSG 0
 #endif
 
+/* kvecs drbd_sendv() is called with at most, see drbd_send_dblock() */
+#define DRBD_SENDV_MAX 16
+/* highmem pages kmap()ed at the same time for one drbd_sendv(),
+ * kmap slots are shared by the whole system */
+#define DRBD_SENDV_KMAPS 4
+
 /*
  * our structs
  *************************/
@@ -306,6 +314,12 @@ drbd_insert_fault(struct drbd_conf *mdev, unsigned int type) {
 /* drbd_meta-data.c (still in drbd_main.c) */
 /* 4th incarnation of the disk layout. */
 #define DRBD_MD_MAGIC (DRBD_MAGIC+4)
+/* same layout, but with an activity log extent size other than 4M.
+ * Older modules do not know this magic, so they refuse to attach,
+ * instead of replaying the activity log with the wrong extent size. */
+#define DRBD_MD_MAGIC_AL_EXT (DRBD_MAGIC+0x41)
+/* valid online verify checkpoint in the super block */
+#define DRBD_OV_CKPT_MAGIC (DRBD_MAGIC+0x40)
 
 extern struct drbd_conf **minor_table;
 
@@ -359,8 +373,9 @@ enum drbd_packets {
 	P_DELAY_PROBE         = 0x27, /* is used on BOTH sockets */
 	P_OUT_OF_SYNC         = 0x28, /* Mark as out of sync (Outrunning), data socket */
 	P_RS_CANCEL           = 0x29, /* meta: Used to cancel RS_DATA_REQUEST packet by SyncSource */
+	P_RS_ZEROES           = 0x2A, /* data socket, instead of an all zero P_RS_DATA_REPLY */
 
-	P_MAX_CMD	      = 0x2A,
+	P_MAX_CMD	      = 0x2B,
 	P_MAY_IGNORE	      = 0x100, /* Flag to test if (cmd > P_MAY_IGNORE) ... */
 	P_MAX_OPT_CMD	      = 0x101,
 
@@ -417,6 +432,7 @@ static inline const char *cmdname(enum drbd_packets cmd)
 		[P_COMPRESSED_BITMAP]   = "CBitmap",
 		[P_DELAY_PROBE]         = "DelayProbe",
 		[P_OUT_OF_SYNC]		= "OutOfSync",
+		[P_RS_ZEROES]		= "RSZeroes",
 		[P_MAX_CMD]	        = NULL,
 	};
 
@@ -529,6 +545,15 @@ union p_header {
 #define DP_FUA               16 /* equals REQ_FUA     */
 #define DP_FLUSH             32 /* equals REQ_FLUSH   */
 #define DP_DISCARD           64 /* equals REQ_DISCARD */
+#define DP_COMPRESSED       128 /* payload compressed, see drbd_compress_ee() */
+
+/* Compressed payload (DP_COMPRESSED, protocol 98): a __be32 holding the
+ * uncompressed size, the data digest (if any, of the uncompressed data),
+ * then one chunk per DRBD_COMPRESS_CHUNK of data. Each chunk starts with
+ * a __be16 holding its length on the wire, with DRBD_CHUNK_RAW set if it
+ * was stored uncompressed. */
+#define DRBD_COMPRESS_CHUNK 4096
+#define DRBD_CHUNK_RAW      0x8000
 
 struct p_data {
 	union p_header head;
@@ -629,6 +654,7 @@ struct p_rs_param_95 {
 enum drbd_conn_flags {
 	CF_WANT_LOSE = 1,
 	CF_DRY_RUN = 2,
+	CF_COMPRESS = 4,
 };
 
 struct p_protocol {
@@ -865,6 +891,11 @@ struct drbd_request {
 	struct bio *master_bio;       /* master bio pointer */
 	unsigned long rq_state; /* see comments above _req_mod() */
 	unsigned long start_time;
+
+	/* drbd_lat_now() stamps, for the latency histograms */
+	u64 start_ns;	/* accepted from upper layers */
+	u64 local_ns;	/* private_bio submitted */
+	u64 net_ns;	/* P_DATA handed over to the data socket */
 };
 
 struct drbd_tl_epoch {
@@ -873,10 +904,68 @@ struct drbd_tl_epoch {
 	struct drbd_tl_epoch *next; /* pointer to the next barrier */
 	unsigned int br_number;  /* the barriers identifier. */
 	int n_writes;	/* number of requests attached before this barrier */
+	u64 sent_ns;	/* drbd_lat_now() when P_BARRIER was sent, or 0 */
+};
+
+/* Readahead cache of a diskless (or SyncTarget) node, see drbd_readahead.c.
+ * One entry holds one DRBD_RA_CHUNK aligned chunk, fetched from the peer
+ * with a speculative P_DATA_REQUEST; the entry's address is the block_id.
+ * All members but pages are protected by req_lock. */
+enum drbd_ra_state {
+	RA_EMPTY,
+	RA_PENDING,	/* P_DATA_REQUEST queued or sent, waiting for the reply */
+	RA_VALID,
+};
+
+#define DRBD_RA_CHUNK		(128 << 10) /* == DRBD_MAX_BIO_SIZE, one hash slot */
+#define DRBD_RA_CHUNK_SECT	(DRBD_RA_CHUNK >> 9)
+#define DRBD_RA_CHUNK_PAGES	(DRBD_RA_CHUNK >> PAGE_SHIFT)
+#define DRBD_RA_ENTRIES		8	/* bounds the cache to 1 MiB per device */
+#define DRBD_RA_WINDOW		4	/* chunks requested ahead of the reader */
+#define DRBD_RA_TRIGGER		2	/* sequential reads before we start */
+
+struct drbd_ra_entry {
+	struct drbd_work w;
+	sector_t sector;
+	unsigned int size;
+	enum drbd_ra_state state;
+	unsigned int queued:1;	/* still on the worker queue */
+	unsigned int stale:1;	/* overlapped by a write, do not use */
+	int users;		/* readers copying from pages right now */
+	unsigned long used;	/* ra_clock of the last hit, for eviction */
+	struct page *pages[DRBD_RA_CHUNK_PAGES];
 };
 
 struct drbd_request;
 
+/* Online verify walks up to DRBD_OV_CURSORS_MAX ranges of the device
+ * in parallel, see w_make_ov_request().
+ * Progress is checkpointed to the meta data every DRBD_OV_CKPT_TIME. */
+#define DRBD_OV_CURSORS_MAX	16
+#define DRBD_OV_CKPT_TIME	(30*HZ)
+struct drbd_ov_cursor {
+	sector_t start;		/* lower bound of this range */
+	sector_t position;	/* next sector to request */
+	sector_t end;		/* exclusive */
+	sector_t snap;		/* position at the pending checkpoint */
+};
+
+/* Out of sync ranges found by online verify, merged for reporting. */
+#define DRBD_OV_OOS_RANGES	4
+struct drbd_ov_oos_range {
+	sector_t start;
+	sector_t size;		/* in sectors, 0: unused */
+};
+
+/* Resync extents recently touched by application requests.
+ * Direct mapped by extent number, racy by design: it is a hint only. */
+#define DRBD_APP_HOT_SLOTS	64
+#define DRBD_APP_HOT_TIME	HZ
+struct drbd_app_hot {
+	unsigned int enr;	/* BM_SECT_TO_EXT(), ~0U if unused */
+	unsigned long when;	/* jiffies */
+};
+
 /* These Tl_epoch_entries may be in one of 6 lists:
    active_ee .. data packet being written
    sync_ee   .. syncer block being written
@@ -967,6 +1056,10 @@ enum {
 
 	/* This ee has a pointer to a digest instead of a block id */
 	__EE_HAS_DIGEST,
+
+	/* Outgoing data snapshot, see drbd_alloc_send_ee().
+	 * Its pages are accounted in pp_in_use_by_net right away. */
+	__EE_SEND_BUFFER,
 };
 #define EE_CALL_AL_COMPLETE_IO (1<<__EE_CALL_AL_COMPLETE_IO)
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
@@ -974,6 +1067,7 @@ enum {
 #define	EE_RESUBMITTED         (1<<__EE_RESUBMITTED)
 #define EE_WAS_ERROR           (1<<__EE_WAS_ERROR)
 #define EE_HAS_DIGEST          (1<<__EE_HAS_DIGEST)
+#define EE_SEND_BUFFER         (1<<__EE_SEND_BUFFER)
 
 /* global flag bits */
 enum drbd_flag {
@@ -1018,6 +1112,8 @@ enum drbd_flag {
 	GOT_PING_ACK,		/* set when we receive a ping_ack packet, misc wait gets woken */
 	NEW_CUR_UUID,		/* Create new current UUID when thawing IO */
 	AL_SUSPENDED,		/* Activity logging is currently suspended. */
+	AL_SUBMIT_QUEUED,	/* al_submit_work is queued to the worker */
+	AL_PREFETCH_QUEUED,	/* al_prefetch_work is queued to the worker */
 	AHEAD_TO_SYNC_SOURCE,   /* Ahead -> SyncSource queued */
 	STATE_SENT,		/* Do not change state/UUIDs while this is set */
 
@@ -1027,7 +1123,11 @@ enum drbd_flag {
 				 * so shrink_page_list() would not recurse into,
 				 * and potentially deadlock on, this drbd worker.
 				 */
-	DISCONNECT_SENT,	/* Currently the last bit in this 32bit word */
+	DISCONNECT_SENT,
+	COMPRESS_DATA,		/* Both sides have compress-data set, see receive_protocol() */
+	READ_BALANCE_RR,	/* round robin state of read-balancing */
+	RESUME_OV_PENDING,	/* w_resume_ov() waits for the bitmap IO */
+	RESYNC_FINISHED_QUEUED,	/* resync_finished_work is queued to the worker */
 
 	/* keep last */
 	DRBD_N_FLAGS,
@@ -1094,11 +1194,22 @@ struct drbd_md {
 
 	s32 al_offset;	/* signed relative sector offset to al area */
 	s32 bm_offset;	/* signed relative sector offset to bitmap */
+	u32 al_size_sect;	/* size of the al area, 0: MD_AL_MAX_SIZE */
+	u32 al_extent_shift;	/* 0: AL_EXTENT_SHIFT */
 
 	/* u32 al_nr_extents;	   important for restoring the AL
 	 * is stored into  sync_conf.al_extents, which in turn
 	 * gets applied to act_log->nr_elements
 	 */
+
+	/* online verify checkpoint, see drbd_ov_commit_checkpoint() */
+	u32 ov_ckpt_nr;		/* number of ranges, 0: no checkpoint */
+	u64 ov_ckpt_start;	/* ov_start_sector of the interrupted run */
+	u64 ov_ckpt_stop;	/* ov_stop_sector of the interrupted run */
+	struct {
+		u64 pos;	/* everything below was verified */
+		u64 end;
+	} ov_ckpt[DRBD_OV_CURSORS_MAX];
 };
 
 /* for sync_conf and other types... */
@@ -1118,11 +1229,39 @@ struct drbd_backing_dev {
 	sector_t known_size; /* last known size of that backing device */
 };
 
+/* Meta data IO goes through one of DRBD_MD_IO_BUFFERS page buffers,
+ * see drbd_md_get_buffer(), so a super block update does not have to wait
+ * for an activity log transaction, and vice versa. */
+#define DRBD_MD_IO_BUFFERS 4
+
 struct drbd_md_io {
+	struct drbd_conf *mdev;
+	struct page *page;	/* one page buffer for md_io */
+	struct page *tmpp;	/* for logical_block_size != 512 */
+	atomic_t in_use;	/* protects page and tmpp */
 	unsigned int done;
 	int error;
 };
 
+/* one per cpu and device, summed up by drbd_lat_sum() */
+struct drbd_lat_hist {
+	u64 bucket[LAT_CLASSES][LAT_BUCKETS];
+};
+
+/* one per cpu and device, folded by drbd_lat_avg() and drbd_lat_samples() */
+struct drbd_lat_ewma {
+	unsigned int avg[LAT_CLASSES];	/* running average in 1/8 us */
+	unsigned int samples[LAT_CLASSES];
+	unsigned long stamp[LAT_CLASSES]; /* jiffies of the last sample */
+};
+
+/* one per cpu and device, summed up by drbd_stats_sum() */
+struct drbd_stats {
+	u64 cnt[STAT_COUNTERS];
+	u64 pkt_sent[STAT_PACKET_TYPES];
+	u64 pkt_recv[STAT_PACKET_TYPES];
+};
+
 struct bm_io_work {
 	struct drbd_work w;
 	char *why;
@@ -1170,10 +1309,15 @@ struct drbd_conf {
 			  unplug_work,
 			  go_diskless,
 			  md_sync_work,
-			  start_resync_work;
+			  start_resync_work,
+			  resync_finished_work,
+			  resume_ov_work,
+			  al_submit_work,
+			  al_prefetch_work;
 	struct timer_list resync_timer;
 	struct timer_list md_sync_timer;
 	struct timer_list start_resync_timer;
+	struct timer_list resync_finished_timer;
 	struct timer_list request_timer;
 #ifdef DRBD_DEBUG_MD_SYNC
 	struct {
@@ -1189,17 +1333,16 @@ struct drbd_conf {
 	wait_queue_head_t misc_wait;
 	wait_queue_head_t state_wait;  /* upon each state change. */
 	wait_queue_head_t net_cnt_wait;
-	unsigned int send_cnt;
-	unsigned int recv_cnt;
-	unsigned int read_cnt;
-	unsigned int writ_cnt;
-	unsigned int al_writ_cnt;
-	unsigned int bm_writ_cnt;
+	struct drbd_stats *stats;	/* alloc_percpu() */
+	struct drbd_lat_hist *lat_hist; /* alloc_percpu() */
+	struct drbd_lat_ewma *lat_ewma; /* alloc_percpu() */
+	u64 ping_sent_ns;	/* asender only */
 	atomic_t ap_bio_cnt;	 /* Requests we need to complete */
 	atomic_t ap_pending_cnt; /* AP data packets on the wire, ack expected */
 	atomic_t rs_pending_cnt; /* RS request/data packets on the wire */
 	atomic_t unacked_cnt;	 /* Need to send replies for */
 	atomic_t local_cnt;	 /* Waiting for local completion */
+	atomic_t ap_local_cnt;	 /* AP requests submitted to the local disk */
 	atomic_t net_cnt;	 /* Users of net_conf */
 	spinlock_t req_lock;
 	struct drbd_tl_epoch *unused_spare_tle; /* for pre-allocation */
@@ -1235,11 +1378,18 @@ struct drbd_conf {
 	sector_t ov_stop_sector;
 	/* where are we now? (sector) */
 	sector_t ov_position;
-	/* Start sector of out of sync range (to merge printk reporting). */
-	sector_t ov_last_oos_start;
-	/* size of out-of-sync range in sectors. */
-	sector_t ov_last_oos_size;
+	/* out of sync ranges (to merge printk reporting). */
+	struct drbd_ov_oos_range ov_oos[DRBD_OV_OOS_RANGES];
 	unsigned long ov_left; /* in bits */
+	/* partitioned verify, on C_VERIFY_S only; all of these are
+	 * accessed by the worker only, see w_make_ov_request() */
+	struct drbd_ov_cursor ov_cursor[DRBD_OV_CURSORS_MAX];
+	int ov_nr_cursors;	/* 0: linear verify without checkpoints */
+	int ov_next_cursor;
+	int ov_in_flight;	/* requests sent, reply not yet processed */
+	int ov_snap_in_flight;	/* of those, sent before the snapshot; -1: none */
+	unsigned long ov_snap_time; /* jiffies, last committed checkpoint */
+	bool ov_snap_oos;	/* found out of sync blocks since then */
 	struct crypto_hash *csums_tfm;
 	struct crypto_hash *verify_tfm;
 
@@ -1250,6 +1400,8 @@ struct drbd_conf {
 	struct drbd_thread asender;
 	struct drbd_bitmap *bitmap;
 	unsigned long bm_resync_fo; /* bit offset for drbd_bm_find_next */
+	unsigned long rs_hot_fo; /* first bit skipped as hot, see w_make_resync_request */
+	struct drbd_app_hot app_hot[DRBD_APP_HOT_SLOTS]; /* see drbd_rs_extent_is_hot */
 
 	/* Used to track operations of resync... */
 	struct lru_cache *resync;
@@ -1279,17 +1431,33 @@ struct drbd_conf {
 
 	int next_barrier_nr;
 	struct hlist_head *app_reads_hash; /* is protected by req_lock */
+	struct drbd_ra_entry ra_cache[DRBD_RA_ENTRIES]; /* protected by req_lock */
+	sector_t ra_next;	/* where the sequential reader is expected next */
+	unsigned int ra_seq;	/* number of sequential reads seen so far */
+	unsigned long ra_clock;
+	wait_queue_head_t ra_wait;
 	struct list_head resync_reads;
 	atomic_t pp_in_use;		/* allocated from page pool */
 	atomic_t pp_in_use_by_net;	/* sendpage()d, still referenced by tcp */
 	wait_queue_head_t ee_wait;
-	struct page *md_io_page;	/* one page buffer for md_io */
-	struct page *md_io_tmpp;	/* for logical_block_size != 512 */
-	struct drbd_md_io md_io;
-	atomic_t md_io_in_use;		/* protects the md_io, md_io_page and md_io_tmpp */
+	struct drbd_md_io md_io[DRBD_MD_IO_BUFFERS];
+	struct mutex md_sync_mutex;	/* serializes super block writes */
 	spinlock_t al_lock;
 	wait_queue_head_t al_wait;
+	/* writes waiting for their activity log extent, see
+	 * drbd_al_begin_io_nonblock(), protected by al_lock.
+	 * Any wake_up of al_wait or misc_wait kicks al_submit_work. */
+	struct list_head al_pending;
+	wait_queue_t al_kick_al_wait;
+	wait_queue_t al_kick_misc_wait;
+	/* sequential write stream detection, see al_stream_detect().
+	 * Updated without locks, it is a hint only. */
+	sector_t al_stream_sector;	/* start of the last write */
+	unsigned int al_stream_len;	/* consecutive forward writes */
+	unsigned int al_prefetch_enr;	/* extent al_prefetch_work activates */
+	unsigned int al_prefetched;	/* last extent it did activate, or LC_FREE */
 	struct lru_cache *act_log;	/* activity log */
+	unsigned int al_ext_shift;	/* of the attached meta data */
 	unsigned int al_tr_number;
 	int al_tr_cycle;
 	int al_tr_pos;   /* position of the next transaction in the journal */
@@ -1299,6 +1467,8 @@ struct drbd_conf {
 	void *int_dig_out;
 	void *int_dig_in;
 	void *int_dig_vv;
+	void *compress_buf;   /* worker: lzo work memory and output of one chunk */
+	void *decompress_buf; /* receiver: input of one chunk */
 	wait_queue_head_t seq_wait;
 	atomic_t packet_seq;
 	unsigned int peer_seq;
@@ -1323,6 +1493,9 @@ struct drbd_conf {
 	struct fifo_buffer rs_plan_s; /* correction values of resync planer */
 	int rs_in_flight; /* resync sectors in flight (to proxy, in proxy and from proxy) */
 	int rs_planed;    /* resync sectors already planned */
+	int c_auto_rate;  /* rate ceiling of the c-latency-target controller */
+	unsigned int c_auto_app_samples; /* drbd_lat_samples(LAT_APP) at the last step */
+	unsigned long c_auto_ping; /* jiffies of the last requested ping */
 	atomic_t ap_in_flight; /* App sectors in flight (waiting for ack) */
 	unsigned int peer_max_bio_size;
 	unsigned int local_max_bio_size;
@@ -1353,6 +1526,11 @@ static inline int drbd_test_and_clear_flag(struct drbd_conf *mdev, enum drbd_fla
 	return test_and_clear_bit(f, &mdev->drbd_flags[0]);
 }
 
+static inline int drbd_test_and_change_flag(struct drbd_conf *mdev, enum drbd_flag f)
+{
+	return test_and_change_bit(f, &mdev->drbd_flags[0]);
+}
+
 static inline struct drbd_conf *minor_to_mdev(unsigned int minor)
 {
 	struct drbd_conf *mdev;
@@ -1441,6 +1619,13 @@ extern void tl_release(struct drbd_conf *mdev, unsigned int barrier_nr,
 		       unsigned int set_size);
 extern void tl_clear(struct drbd_conf *mdev);
 extern void _tl_add_barrier(struct drbd_conf *, struct drbd_tl_epoch *);
+extern void drbd_lat_account(struct drbd_conf *mdev, enum drbd_lat_class c, u64 start_ns);
+extern void drbd_lat_sum(struct drbd_conf *mdev, struct drbd_lat_hist *sum);
+extern unsigned int drbd_lat_avg(struct drbd_conf *mdev, enum drbd_lat_class c);
+extern unsigned int drbd_lat_samples(struct drbd_conf *mdev, enum drbd_lat_class c);
+extern void drbd_stats_sum(struct drbd_conf *mdev, struct drbd_stats *sum);
+extern u64 drbd_stat_read(struct drbd_conf *mdev, enum drbd_stat_counter c);
+extern void drbd_stat_reset(struct drbd_conf *mdev, enum drbd_stat_counter c);
 extern void drbd_free_sock(struct drbd_conf *mdev);
 extern int drbd_send(struct drbd_conf *mdev, struct socket *sock,
 			void *buf, size_t size, unsigned msg_flags);
@@ -1478,6 +1663,7 @@ extern int drbd_send_ack_dp(struct drbd_conf *mdev, enum drbd_packets cmd,
 extern int drbd_send_ack_ex(struct drbd_conf *mdev, enum drbd_packets cmd,
 			    sector_t sector, int blksize, u64 block_id);
 extern int drbd_send_oos(struct drbd_conf *mdev, struct drbd_request *req);
+extern int drbd_send_rs_zeroes(struct drbd_conf *mdev, struct drbd_epoch_entry *e);
 extern int drbd_send_block(struct drbd_conf *mdev, enum drbd_packets cmd,
 			   struct drbd_epoch_entry *e);
 extern int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req);
@@ -1537,6 +1723,9 @@ extern void drbd_ldev_destroy(struct drbd_conf *mdev);
 #define MD_AL_MAX_SIZE 64   /* = 32 kb LOG  ~ 3776 extents ~ 14 GB Storage */
 /* Allows up to about 3.8TB */
 #define MD_BM_OFFSET (MD_AL_OFFSET + MD_AL_MAX_SIZE)
+/* Flexible meta data may have a larger AL area, recorded in the super block.
+ * 1088 sectors = 544 kb LOG, room for DRBD_AL_EXTENTS_MAX ~ 256 GB Storage */
+#define MD_AL_SIZE_LIMIT 1088
 
 /* Since the smallest IO unit is usually 512 byte */
 #define MD_SECTOR_SHIFT	 9
@@ -1546,6 +1735,11 @@ extern void drbd_ldev_destroy(struct drbd_conf *mdev);
 #define AL_EXTENTS_PT ((MD_SECTOR_SIZE-12)/8-1) /* 61 ; Extents per 512B sector */
 #define AL_EXTENT_SHIFT 22		 /* One extent represents 4M Storage */
 #define AL_EXTENT_SIZE (1<<AL_EXTENT_SHIFT)
+/* The AL extent size is a property of the meta data, see drbd_md_read().
+ * An extent has to nest within a resync extent, and a single request
+ * (at most DRBD_MAX_BIO_SIZE) must not span two of them. */
+#define AL_EXTENT_SHIFT_MIN 18		 /* 256k */
+#define AL_EXTENT_SHIFT_MAX 24		 /* 16M, BM_EXT_SHIFT */
 
 #if BITS_PER_LONG == 32
 #define LN2_BPL 5
@@ -1610,8 +1804,10 @@ struct bm_extent {
 #define BM_SECT_PER_EXT     BM_EXT_TO_SECT(1)
 
 /* in one sector of the bitmap, we have this many activity_log extents. */
-#define AL_EXT_PER_BM_SECT  (1 << (BM_EXT_SHIFT - AL_EXTENT_SHIFT))
-#define BM_WORDS_PER_AL_EXT (1 << (AL_EXTENT_SHIFT-BM_BLOCK_SHIFT-LN2_BPL))
+#define AL_EXT_PER_BM_SECT(mdev)  (1U << (BM_EXT_SHIFT - (mdev)->al_ext_shift))
+#define BM_WORDS_PER_AL_EXT(mdev) (1UL << ((mdev)->al_ext_shift-BM_BLOCK_SHIFT-LN2_BPL))
+/* in which activity log extent a certain _storage_ sector is located in */
+#define AL_SECT_TO_EXT(mdev, x)   ((unsigned int)((x) >> ((mdev)->al_ext_shift-9)))
 
 #define BM_BLOCKS_PER_BM_EXT_B (BM_EXT_SHIFT - BM_BLOCK_SHIFT)
 #define BM_BLOCKS_PER_BM_EXT_MASK  ((1<<BM_BLOCKS_PER_BM_EXT_B) - 1)
@@ -1689,6 +1885,7 @@ extern int  drbd_bm_read(struct drbd_conf *mdev) __must_hold(local);
 extern int  drbd_bm_write(struct drbd_conf *mdev) __must_hold(local);
 extern int drbd_bm_write_all(struct drbd_conf *mdev) __must_hold(local);
 extern int  drbd_bm_write_copy_pages(struct drbd_conf *mdev) __must_hold(local);
+extern int  drbd_bm_write_lazy(struct drbd_conf *mdev, unsigned upper_idx) __must_hold(local);
 extern unsigned long drbd_bm_ALe_set_all(struct drbd_conf *mdev,
 		unsigned long al_enr);
 extern size_t	     drbd_bm_words(struct drbd_conf *mdev);
@@ -1718,6 +1915,10 @@ extern void drbd_bm_unlock(struct drbd_conf *mdev);
  * because of kmem_cache_t weirdness */
 #include "drbd_wrappers.h"
 
+/* after drbd_wrappers.h, which has struct kvec for old kernels */
+extern int drbd_sendv(struct drbd_conf *mdev, struct socket *sock,
+			struct kvec *iov, int nr, unsigned msg_flags);
+
 extern struct kmem_cache *drbd_request_cache;
 extern struct kmem_cache *drbd_ee_cache;	/* epoch entries */
 extern struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
@@ -1756,6 +1957,7 @@ extern mempool_t *drbd_md_io_page_pool;
 extern struct bio_set *drbd_md_io_bio_set;
 /* to allocate from that set */
 extern struct bio *bio_alloc_drbd(gfp_t gfp_mask);
+extern struct bio *bio_alloc_drbd_vecs(gfp_t gfp_mask, int nr_iovecs);
 
 extern rwlock_t global_state_lock;
 
@@ -1782,6 +1984,8 @@ extern void drbd_suspend_io(struct drbd_conf *mdev);
 extern void drbd_resume_io(struct drbd_conf *mdev);
 extern char *ppsize(char *buf, unsigned long long size);
 extern sector_t drbd_new_dev_size(struct drbd_conf *, struct drbd_backing_dev *, int);
+extern void drbd_md_set_sector_offsets(struct drbd_conf *mdev,
+				       struct drbd_backing_dev *bdev);
 enum determine_dev_size { dev_size_error = -1, unchanged = 0, shrunk = 1, grew = 2 };
 extern enum determine_dev_size drbd_determine_dev_size(struct drbd_conf *, enum dds_flags) __must_hold(local);
 extern void resync_after_online_grow(struct drbd_conf *);
@@ -1802,36 +2006,101 @@ extern void suspend_other_sg(struct drbd_conf *mdev);
 extern int drbd_resync_finished(struct drbd_conf *mdev);
 /* maybe rather drbd_main.c ? */
 extern void *drbd_md_get_buffer(struct drbd_conf *mdev);
-extern void drbd_md_put_buffer(struct drbd_conf *mdev);
-extern int drbd_md_sync_page_io(struct drbd_conf *mdev,
-				struct drbd_backing_dev *bdev, sector_t sector, int rw);
+extern void drbd_md_put_buffer(struct drbd_conf *mdev, void *buffer);
+extern void drbd_md_io_put(struct drbd_md_io *md_io);
+extern int drbd_md_sync_page_io(struct drbd_conf *mdev, struct drbd_backing_dev *bdev,
+				void *buffer, sector_t sector, int rw);
 extern void wait_until_done_or_force_detached(struct drbd_conf *mdev,
 		struct drbd_backing_dev *bdev, unsigned int *done);
 extern void drbd_ov_oos_found(struct drbd_conf*, sector_t, int);
+extern void drbd_ov_init_cursors(struct drbd_conf *mdev);
+extern void drbd_ov_stopped(struct drbd_conf *mdev);
 extern void drbd_rs_controller_reset(struct drbd_conf *mdev);
+extern unsigned int drbd_rs_delay_us(struct drbd_conf *mdev);
 
-static inline void ov_oos_print(struct drbd_conf *mdev)
+static inline void ov_oos_print_range(struct drbd_conf *mdev,
+				      struct drbd_ov_oos_range *r)
 {
-	if (mdev->ov_last_oos_size) {
+	if (r->size) {
 		dev_err(DEV, "Out of sync: start=%llu, size=%lu (sectors)\n",
-		     (unsigned long long)mdev->ov_last_oos_start,
-		     (unsigned long)mdev->ov_last_oos_size);
+		     (unsigned long long)r->start,
+		     (unsigned long)r->size);
 	}
-	mdev->ov_last_oos_size=0;
+	r->size = 0;
+}
+
+static inline void ov_oos_print(struct drbd_conf *mdev)
+{
+	int i;
+
+	for (i = 0; i < DRBD_OV_OOS_RANGES; i++)
+		ov_oos_print_range(mdev, &mdev->ov_oos[i]);
+}
+
+/* The block at @sector is in sync, so a range ending there is complete.
+ * Ranges of other verify cursors stay open. */
+static inline void ov_oos_in_sync(struct drbd_conf *mdev, sector_t sector)
+{
+	int i;
+
+	for (i = 0; i < DRBD_OV_OOS_RANGES; i++)
+		if (mdev->ov_oos[i].start + mdev->ov_oos[i].size == sector)
+			ov_oos_print_range(mdev, &mdev->ov_oos[i]);
 }
 
 
+/* running digest, see drbd_digest_init() */
+struct drbd_digest {
+	struct hash_desc desc;
+	struct scatterlist sg;
+	u32 crc;
+	int native;
+};
+
+extern void drbd_digest_init(struct drbd_digest *, struct crypto_hash *);
+extern void drbd_digest_page(struct drbd_digest *, struct page *,
+			     unsigned int offset, unsigned int len);
+extern void drbd_digest_final(struct drbd_digest *, void *);
 extern void drbd_csum_bio(struct drbd_conf *, struct crypto_hash *, struct bio *, void *);
 extern void drbd_csum_ee(struct drbd_conf *, struct crypto_hash *, struct drbd_epoch_entry *, void *);
+extern void drbd_copy_csum_bio(struct drbd_conf *, struct crypto_hash *, struct bio *,
+			       struct drbd_epoch_entry *, void *);
+extern void move_to_net_ee_or_free(struct drbd_conf *, struct drbd_epoch_entry *);
+
+#if defined(CONFIG_LZO_COMPRESS) || defined(CONFIG_LZO_COMPRESS_MODULE)
+#define DRBD_HAVE_LZO 1
+#include <linux/lzo.h>
+#define DRBD_COMPRESS_BUF_SIZE \
+	(LZO1X_1_MEM_COMPRESS + lzo1x_worst_compress(DRBD_COMPRESS_CHUNK))
+#define DRBD_DECOMPRESS_BUF_SIZE lzo1x_worst_compress(DRBD_COMPRESS_CHUNK)
+#endif
+
+/* drbd_readahead.c */
+extern int drbd_ra_read(struct drbd_conf *mdev, struct bio *bio);
+extern void _drbd_ra_invalidate(struct drbd_conf *mdev, sector_t sector, int size);
+extern void _drbd_ra_invalidate_all(struct drbd_conf *mdev);
+extern void drbd_ra_clear(struct drbd_conf *mdev);
+extern void drbd_ra_free(struct drbd_conf *mdev);
+extern struct drbd_ra_entry *drbd_ra_id_to_entry(struct drbd_conf *mdev, u64 id);
+extern int drbd_ra_receive(struct drbd_conf *mdev, struct drbd_ra_entry *e,
+			   sector_t sector, int data_size);
+extern void drbd_ra_neg_reply(struct drbd_conf *mdev, struct drbd_ra_entry *e,
+			      sector_t sector);
+
+/* drbd_crc32c.c */
+extern u32 drbd_crc32c(u32 crc, const void *data, size_t len);
+extern void drbd_crc32c_init(void);
 /* worker callbacks */
 extern int w_req_cancel_conflict(struct drbd_conf *, struct drbd_work *, int);
 extern int w_read_retry_remote(struct drbd_conf *, struct drbd_work *, int);
+extern int w_send_ra_req(struct drbd_conf *, struct drbd_work *, int);
 extern int w_e_end_data_req(struct drbd_conf *, struct drbd_work *, int);
 extern int w_e_end_rsdata_req(struct drbd_conf *, struct drbd_work *, int);
 extern int w_e_end_csum_rs_req(struct drbd_conf *, struct drbd_work *, int);
 extern int w_e_end_ov_reply(struct drbd_conf *, struct drbd_work *, int);
 extern int w_e_end_ov_req(struct drbd_conf *, struct drbd_work *, int);
 extern int w_ov_finished(struct drbd_conf *, struct drbd_work *, int);
+extern int w_resume_ov(struct drbd_conf *, struct drbd_work *, int);
 extern int w_resync_timer(struct drbd_conf *, struct drbd_work *, int);
 extern int w_resume_next_sg(struct drbd_conf *, struct drbd_work *, int);
 extern int w_send_write_hint(struct drbd_conf *, struct drbd_work *, int);
@@ -1842,11 +2111,15 @@ extern int w_send_read_req(struct drbd_conf *, struct drbd_work *, int);
 extern int w_prev_work_done(struct drbd_conf *, struct drbd_work *, int);
 extern int w_e_reissue(struct drbd_conf *, struct drbd_work *, int);
 extern int w_restart_disk_io(struct drbd_conf *, struct drbd_work *, int);
+extern int w_al_submit_pending(struct drbd_conf *, struct drbd_work *, int);
+extern int w_al_prefetch(struct drbd_conf *, struct drbd_work *, int);
 extern int w_send_oos(struct drbd_conf *, struct drbd_work *, int);
 extern int w_start_resync(struct drbd_conf *, struct drbd_work *, int);
+extern int w_resync_finished(struct drbd_conf *, struct drbd_work *, int);
 
 extern void resync_timer_fn(unsigned long data);
 extern void start_resync_timer_fn(unsigned long data);
+extern void resync_finished_timer_fn(unsigned long data);
 
 /* drbd_receiver.c */
 extern bool drbd_rs_c_min_rate_throttle(struct drbd_conf *mdev);
@@ -1859,8 +2132,11 @@ extern struct drbd_epoch_entry *drbd_alloc_ee(struct drbd_conf *mdev,
 					    sector_t sector,
 					    unsigned int data_size,
 					    gfp_t gfp_mask) __must_hold(local);
+extern struct drbd_epoch_entry *drbd_alloc_send_ee(struct drbd_conf *mdev,
+		u64 id, sector_t sector, unsigned int data_size);
 extern void drbd_free_some_ee(struct drbd_conf *mdev, struct drbd_epoch_entry *e,
 		int is_net);
+extern void drbd_ee_trim_pages(struct drbd_conf *mdev, struct drbd_epoch_entry *e);
 #define drbd_free_ee(m,e)	drbd_free_some_ee(m, e, 0)
 #define drbd_free_net_ee(m,e)	drbd_free_some_ee(m, e, 1)
 extern void drbd_wait_ee_list_empty(struct drbd_conf *mdev,
@@ -1924,10 +2200,13 @@ extern const char *drbd_role_str(enum drbd_role s);
 
 /* drbd_actlog.c */
 extern void drbd_al_begin_io(struct drbd_conf *mdev, sector_t sector);
+extern bool drbd_al_begin_io_nonblock(struct drbd_conf *mdev, struct drbd_request *req);
+extern struct drbd_request *drbd_al_get_pending(struct drbd_conf *mdev);
 extern void drbd_al_complete_io(struct drbd_conf *mdev, sector_t sector);
 extern void drbd_rs_complete_io(struct drbd_conf *mdev, sector_t sector);
 extern int drbd_rs_begin_io(struct drbd_conf *mdev, sector_t sector);
 extern int drbd_try_rs_begin_io(struct drbd_conf *mdev, sector_t sector);
+extern bool drbd_rs_extent_is_hot(struct drbd_conf *mdev, unsigned int enr);
 extern void drbd_rs_cancel_all(struct drbd_conf *mdev);
 extern int drbd_rs_del_all(struct drbd_conf *mdev);
 extern void drbd_rs_failed_io(struct drbd_conf *mdev,
@@ -1947,6 +2226,7 @@ extern void drbd_al_shrink(struct drbd_conf *mdev);
 
 /* drbd_sysfs.c */
 extern struct kobj_type drbd_bdev_kobj_type;
+extern struct kobject *drbd_dev_kobject_create(struct drbd_conf *mdev, struct kobject *parent);
 
 /* drbd_nl.c */
 
@@ -2205,6 +2485,36 @@ static inline sector_t drbd_md_last_sector(struct drbd_backing_dev *bdev)
 	}
 }
 
+/**
+ * drbd_md_al_size() - Return the size of the activity log area, in sectors
+ * @bdev:	Meta data block device.
+ */
+static inline unsigned int drbd_md_al_size(struct drbd_backing_dev *bdev)
+{
+	return bdev->md.al_size_sect ?: MD_AL_MAX_SIZE;
+}
+
+/**
+ * drbd_md_al_ext_shift() - Return the activity log extent size, as shift
+ * @bdev:	Meta data block device.
+ */
+static inline unsigned int drbd_md_al_ext_shift(struct drbd_backing_dev *bdev)
+{
+	return bdev->md.al_extent_shift ?: AL_EXTENT_SHIFT;
+}
+
+/**
+ * drbd_al_extents_max() - Return the number of AL extents the AL area can hold
+ * @bdev:	Meta data block device.
+ *
+ * A full set of extents takes div_ceil(nr_elements, AL_EXTENTS_PT) + 1
+ * transaction sectors, see w_al_write_transaction().
+ */
+static inline unsigned int drbd_al_extents_max(struct drbd_backing_dev *bdev)
+{
+	return (drbd_md_al_size(bdev) - 1) * AL_EXTENTS_PT;
+}
+
 /**
  * drbd_get_max_capacity() - Returns the capacity we announce to out peer
  * @bdev:	Meta data block device.
@@ -2291,6 +2601,12 @@ drbd_queue_work(struct drbd_work_queue *q, struct drbd_work *w)
 	spin_unlock_irqrestore(&q->q_lock, flags);
 }
 
+static inline void drbd_kick_al_pending(struct drbd_conf *mdev)
+{
+	if (!drbd_test_and_set_flag(mdev, AL_SUBMIT_QUEUED))
+		drbd_queue_work(&mdev->data.work, &mdev->al_submit_work);
+}
+
 static inline void wake_asender(struct drbd_conf *mdev)
 {
 	if (drbd_test_flag(mdev, SIGNAL_ASENDER))
@@ -2337,6 +2653,34 @@ static inline void drbd_thread_restart_nowait(struct drbd_thread *thi)
 	_drbd_thread_stop(thi, true, false);
 }
 
+/* Statistics counters are per cpu, so updates neither contend on a
+ * shared cache line nor tear on 32bit. Some are updated from irq
+ * context (local io completion), so disable interrupts around the add. */
+static inline void drbd_stat_add(struct drbd_conf *mdev, enum drbd_stat_counter c, u64 n)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	per_cpu_ptr(mdev->stats, smp_processor_id())->cnt[c] += n;
+	local_irq_restore(flags);
+}
+
+static inline void drbd_stat_packet(struct drbd_conf *mdev, int sent, enum drbd_packets cmd)
+{
+	struct drbd_stats *st;
+	unsigned long flags;
+
+	if (cmd >= STAT_PACKET_TYPES)
+		return;
+	local_irq_save(flags);
+	st = per_cpu_ptr(mdev->stats, smp_processor_id());
+	if (sent)
+		st->pkt_sent[cmd]++;
+	else
+		st->pkt_recv[cmd]++;
+	local_irq_restore(flags);
+}
+
 /* counts how many answer packets packets we expect from our peer,
  * for either explicit application requests,
  * or implicit barrier packets as necessary.
@@ -2698,6 +3042,16 @@ static inline void dec_ap_bio(struct drbd_conf *mdev)
 		wake_up(&mdev->misc_wait);
 }
 
+/* remember that the application uses this area, see drbd_rs_extent_is_hot() */
+static inline void drbd_app_io_mark_hot(struct drbd_conf *mdev, sector_t sector)
+{
+	unsigned int enr = BM_SECT_TO_EXT(sector);
+	struct drbd_app_hot *h = &mdev->app_hot[enr % DRBD_APP_HOT_SLOTS];
+
+	h->enr = enr;
+	h->when = jiffies;
+}
+
 static inline int drbd_set_ed_uuid(struct drbd_conf *mdev, u64 val)
 {
 	int changed = mdev->ed_uuid != val;
@@ -189,14 +189,14 @@ static void bio_destructor_drbd(struct bio *bio)
 }
 #endif
 
-struct bio *bio_alloc_drbd(gfp_t gfp_mask)
+struct bio *bio_alloc_drbd_vecs(gfp_t gfp_mask, int nr_iovecs)
 {
 	struct bio *bio;
 
 	if (!drbd_md_io_bio_set)
-		return bio_alloc(gfp_mask, 1);
+		return bio_alloc(gfp_mask, nr_iovecs);
 
-	bio = bio_alloc_bioset(gfp_mask, 1, drbd_md_io_bio_set);
+	bio = bio_alloc_bioset(gfp_mask, nr_iovecs, drbd_md_io_bio_set);
 #ifdef COMPAT_BIO_HAS_BI_DESTRUCTOR
 	if (!bio)
 		return NULL;
@@ -205,6 +205,11 @@ struct bio *bio_alloc_drbd(gfp_t gfp_mask)
 	return bio;
 }
 
+struct bio *bio_alloc_drbd(gfp_t gfp_mask)
+{
+	return bio_alloc_drbd_vecs(gfp_mask, 1);
+}
+
 #ifdef __CHECKER__
 /* When checking with sparse, and this is an inline function, sparse will
    give tons of false positives. When this is a real functions sparse works.
@@ -247,6 +252,7 @@ STATIC int tl_init(struct drbd_conf *mdev)
 	b->next = NULL;
 	b->br_number = 4711;
 	b->n_writes = 0;
+	b->sent_ns = 0;
 	b->w.cb = NULL; /* if this is != NULL, we need to dec_ap_pending in tl_clear */
 
 	mdev->oldest_tle = b;
@@ -289,6 +295,7 @@ void _tl_add_barrier(struct drbd_conf *mdev, struct drbd_tl_epoch *new)
 	new->w.cb = NULL; /* if this is != NULL, we need to dec_ap_pending in tl_clear */
 	new->next = NULL;
 	new->n_writes = 0;
+	new->sent_ns = 0;
 
 	newest_before = mdev->newest_tle;
 	new->br_number = newest_before->br_number+1;
@@ -336,6 +343,8 @@ void tl_release(struct drbd_conf *mdev, unsigned int barrier_nr,
 		goto bail;
 	}
 
+	drbd_lat_account(mdev, LAT_BARRIER, b->sent_ns);
+
 	/* Clean up list of requests processed during current epoch */
 	list_for_each_safe(le, tle, &b->requests) {
 		r = list_entry(le, struct drbd_request, tl_requests);
@@ -444,6 +453,7 @@ static void _tl_restart(struct drbd_conf *mdev, enum drbd_req_event what)
 				b->w.cb = NULL;
 				b->br_number = net_random();
 				b->n_writes = 0;
+				b->sent_ns = 0;
 
 				*pn = b;
 				break;
@@ -1208,6 +1218,9 @@ static void set_ov_position(struct drbd_conf *mdev, enum drbd_conns cs)
 		 * implicitly in receive_DataRequest once the
 		 * first P_OV_REQUEST is received */
 		mdev->ov_start_sector = ~(sector_t)0;
+	} else if (mdev->agreed_pro_version >= 97) {
+		/* sets rs_total and ov_position */
+		drbd_ov_init_cursors(mdev);
 	} else {
 		unsigned long bit = BM_SECT_TO_BIT(mdev->ov_start_sector);
 		if (bit >= mdev->rs_total) {
@@ -1374,7 +1387,10 @@ __drbd_set_state(struct drbd_conf *mdev, union drbd_state ns,
 
 	/* Aborted verify run, or we reached the stop sector.
 	 * Log the last position, unless end-of-device. */
-	if ((os.conn == C_VERIFY_S || os.conn == C_VERIFY_T) &&
+	if (os.conn == C_VERIFY_S && ns.conn <= C_CONNECTED &&
+	    mdev->ov_nr_cursors) {
+		drbd_ov_stopped(mdev);
+	} else if ((os.conn == C_VERIFY_S || os.conn == C_VERIFY_T) &&
 	    ns.conn <= C_CONNECTED) {
 		mdev->ov_start_sector =
 			BM_BIT_TO_SECT(drbd_bm_bits(mdev) - mdev->ov_left);
@@ -1407,8 +1423,7 @@ __drbd_set_state(struct drbd_conf *mdev, union drbd_state ns,
 		mdev->rs_start = now;
 		mdev->rs_last_events = 0;
 		mdev->rs_last_sect_ev = 0;
-		mdev->ov_last_oos_size = 0;
-		mdev->ov_last_oos_start = 0;
+		memset(mdev->ov_oos, 0, sizeof(mdev->ov_oos));
 
 		for (i = 0; i < DRBD_SYNC_MARKS; i++) {
 			mdev->rs_mark_left[i] = mdev->ov_left;
@@ -1456,6 +1471,10 @@ __drbd_set_state(struct drbd_conf *mdev, union drbd_state ns,
 	    os.peer == R_SECONDARY && ns.peer == R_PRIMARY)
 		drbd_set_flag(mdev, CONSIDER_RESYNC);
 
+	/* The peer may write now, what we read ahead may become stale */
+	if (os.peer != R_PRIMARY && ns.peer == R_PRIMARY)
+		_drbd_ra_invalidate_all(mdev);
+
 	/* Receiver should clean up itself */
 	if (os.conn != C_DISCONNECTING && ns.conn == C_DISCONNECTING)
 		drbd_thread_stop_nowait(&mdev->receiver);
@@ -1863,6 +1882,14 @@ STATIC void after_state_ch(struct drbd_conf *mdev, union drbd_state os,
 	&& mdev->agreed_pro_version >= 97)
 		drbd_send_state(mdev, ns);
 
+	/* Connected, or done with resync: continue an interrupted verify
+	 * run, if we have a checkpoint of it. */
+	if (ns.conn == C_CONNECTED && os.conn != C_CONNECTED &&
+	    os.conn != C_VERIFY_S && os.conn != C_VERIFY_T &&
+	    ns.disk == D_UP_TO_DATE && ns.pdsk == D_UP_TO_DATE &&
+	    mdev->agreed_pro_version >= 97)
+		drbd_queue_work(&mdev->data.work, &mdev->resume_ov_work);
+
 	/* This triggers bitmap writeout of potentially still unwritten pages
 	 * if the resync finished cleanly, or aborted because of peer disk
 	 * failure, or because of connection loss.
@@ -2121,7 +2148,9 @@ int _drbd_send_cmd(struct drbd_conf *mdev, struct socket *sock,
 	sent = drbd_send(mdev, sock, h, size, msg_flags);
 
 	ok = (sent == size);
-	if (!ok && !signal_pending(current))
+	if (ok)
+		drbd_stat_packet(mdev, 1, cmd);
+	else if (!signal_pending(current))
 		dev_warn(DEV, "short sent %s size=%d sent=%d\n",
 		    cmdname(cmd), (int)size, sent);
 	return ok;
@@ -2175,6 +2204,8 @@ int drbd_send_cmd2(struct drbd_conf *mdev, enum drbd_packets cmd, char *data,
 		drbd_send(mdev, mdev->data.socket, &h, sizeof(h), 0));
 	ok = ok && (size ==
 		drbd_send(mdev, mdev->data.socket, data, size, 0));
+	if (ok)
+		drbd_stat_packet(mdev, 1, cmd);
 
 	drbd_put_data_sock(mdev);
 
@@ -2262,6 +2293,9 @@ int drbd_send_protocol(struct drbd_conf *mdev)
 			return -1;
 		}
 	}
+	if (mdev->net_conf->compress_data && mdev->compress_buf &&
+	    mdev->agreed_pro_version >= 98)
+		cf |= CF_COMPRESS;
 	p->conn_flags    = cpu_to_be32(cf);
 
 	if (mdev->agreed_pro_version >= 87)
@@ -2804,6 +2838,8 @@ int drbd_send_drequest_csum(struct drbd_conf *mdev,
 
 	ok = (sizeof(p) == drbd_send(mdev, mdev->data.socket, &p, sizeof(p), 0));
 	ok = ok && (digest_size == drbd_send(mdev, mdev->data.socket, digest, digest_size, 0));
+	if (ok)
+		drbd_stat_packet(mdev, 1, cmd);
 
 	mutex_unlock(&mdev->data.mutex);
 
@@ -2879,7 +2915,7 @@ STATIC int _drbd_no_send_page(struct drbd_conf *mdev, struct page *page,
 	int sent = drbd_send(mdev, mdev->data.socket, kmap(page) + offset, size, msg_flags);
 	kunmap(page);
 	if (sent == size)
-		mdev->send_cnt += size>>9;
+		drbd_stat_add(mdev, STAT_SEND_SECT, size>>9);
 	return sent == size;
 }
 
@@ -2925,23 +2961,62 @@ STATIC int _drbd_send_page(struct drbd_conf *mdev, struct page *page,
 	drbd_clear_flag(mdev, NET_CONGESTED);
 
 	ok = (len == 0);
+	drbd_stat_add(mdev, STAT_DATA_SENT_BYTES, size - len);
 	if (likely(ok))
-		mdev->send_cnt += size>>9;
+		drbd_stat_add(mdev, STAT_SEND_SECT, size>>9);
 	return ok;
 }
 
-static int _drbd_send_bio(struct drbd_conf *mdev, struct bio *bio)
+static int _drbd_sendv_all(struct drbd_conf *mdev, struct kvec *iov, int nr,
+			   unsigned msg_flags)
 {
-	struct bio_vec *bvec;
+	size_t size = 0;
 	int i;
-	/* hint all but last page with MSG_MORE */
+
+	for (i = 0; i < nr; i++)
+		size += iov[i].iov_len;
+	return drbd_sendv(mdev, mdev->data.socket, iov, nr, msg_flags) == size;
+}
+
+/* Copies the bio into the socket, preceded by the @nr buffers in @iov
+ * (header and digest). Up to DRBD_SENDV_MAX buffers go out with one
+ * sendmsg, instead of one sendmsg per bio segment. A batch is cut short
+ * once it holds DRBD_SENDV_KMAPS highmem mappings.
+ * @iov needs room for DRBD_SENDV_MAX entries. */
+static int _drbd_send_bio(struct drbd_conf *mdev, struct kvec *iov, int nr,
+			  struct bio *bio)
+{
+	struct page *mapped[DRBD_SENDV_MAX];
+	struct bio_vec *bvec;
+	unsigned int payload = 0;
+	int i, k, m = 0, highmem = 0, ok = 1;
+
 	bio_for_each_segment(bvec, bio, i) {
-		if (!_drbd_no_send_page(mdev, bvec->bv_page,
-				     bvec->bv_offset, bvec->bv_len,
-				     i == bio->bi_vcnt -1 ? 0 : MSG_MORE))
+		mapped[m++] = bvec->bv_page;
+		if (PageHighMem(bvec->bv_page))
+			highmem++;
+		iov[nr].iov_base = kmap(bvec->bv_page) + bvec->bv_offset;
+		iov[nr].iov_len  = bvec->bv_len;
+		payload += bvec->bv_len;
+		if (++nr < DRBD_SENDV_MAX && highmem < DRBD_SENDV_KMAPS &&
+		    i != bio->bi_vcnt - 1)
+			continue;
+
+		/* hint all but last batch with MSG_MORE */
+		ok = _drbd_sendv_all(mdev, iov, nr,
+				     i == bio->bi_vcnt - 1 ? 0 : MSG_MORE);
+		for (k = 0; k < m; k++)
+			kunmap(mapped[k]);
+		if (!ok)
 			return 0;
+		drbd_stat_add(mdev, STAT_SEND_SECT, payload >> 9);
+		payload = 0;
+		nr = m = highmem = 0;
 	}
-	return 1;
+	/* empty bio, only header and digest */
+	if (nr)
+		ok = _drbd_sendv_all(mdev, iov, nr, 0);
+	return ok;
 }
 
 static int _drbd_send_zc_bio(struct drbd_conf *mdev, struct bio *bio)
@@ -2962,17 +3037,128 @@ static int _drbd_send_zc_ee(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
 {
 	struct page *page = e->pages;
 	unsigned len = e->size;
-	/* hint all but last page with MSG_MORE */
+	/* hint all but last page with MSG_MORE.
+	 * A compressed e may not use all its pages. */
 	page_chain_for_each(page) {
 		unsigned l = min_t(unsigned, len, PAGE_SIZE);
 		if (!_drbd_send_page(mdev, page, 0, l,
-				page_chain_next(page) ? MSG_MORE : 0))
+				len > l ? MSG_MORE : 0))
 			return 0;
 		len -= l;
+		if (!len)
+			break;
 	}
 	return 1;
 }
 
+#ifdef DRBD_HAVE_LZO
+/* appends @len bytes to the page chain at *@page, *@offset */
+static void ee_append(struct page **page, unsigned int *offset,
+		      const void *buf, unsigned int len)
+{
+	while (len) {
+		unsigned int l = min_t(unsigned int, len, PAGE_SIZE - *offset);
+
+		memcpy(kmap(*page) + *offset, buf, l);
+		kunmap(*page);
+		buf += l;
+		len -= l;
+		*offset += l;
+		if (*offset == PAGE_SIZE) {
+			*page = page_chain_next(*page);
+			*offset = 0;
+		}
+	}
+}
+
+/**
+ * drbd_compress_ee() - Compress the payload of an epoch entry for sending
+ * @mdev:	DRBD device.
+ * @e:		Epoch entry holding the data.
+ *
+ * Returns a new epoch entry with the DP_COMPRESSED chunks, its size set
+ * to their size on the wire. Returns NULL if that would not be smaller than
+ * @e->size, or if no send buffer is available right now, see
+ * drbd_alloc_send_ee(); then @e goes out as it is.
+ * Only called from the worker, while holding the data socket, which
+ * serializes the use of mdev->compress_buf.
+ */
+static struct drbd_epoch_entry *
+drbd_compress_ee(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
+{
+	struct drbd_epoch_entry *ce;
+	struct page *page = e->pages;
+	struct page *cpage;
+	unsigned char *wrkmem = mdev->compress_buf;
+	unsigned char *dst = wrkmem + LZO1X_1_MEM_COMPRESS;
+	unsigned int left = e->size, out = 0, coffset = 0;
+	u64 start = drbd_lat_now();
+
+	/* we hold the data socket, must not wait for pages here */
+	ce = drbd_alloc_send_ee(mdev, e->block_id, e->sector, e->size);
+	if (!ce)
+		goto raw;
+
+	cpage = ce->pages;
+
+	page_chain_for_each(page) {
+		unsigned char *src = kmap(page);
+		unsigned int offset;
+
+		for (offset = 0; offset < PAGE_SIZE && left; offset += DRBD_COMPRESS_CHUNK) {
+			unsigned int clen = min_t(unsigned int, left, DRBD_COMPRESS_CHUNK);
+			size_t dlen;
+			__be16 hdr;
+			int err;
+
+			err = lzo1x_1_compress(src + offset, clen, dst, &dlen, wrkmem);
+			if (err != LZO_E_OK || dlen >= clen) {
+				/* store raw */
+				dlen = clen;
+				hdr = cpu_to_be16(DRBD_CHUNK_RAW | clen);
+			} else
+				hdr = cpu_to_be16(dlen);
+
+			/* not worth it, if it does not shrink,
+			 * including the __be32 uncompressed size */
+			if (sizeof(__be32) + out + sizeof(hdr) + dlen >= e->size) {
+				kunmap(page);
+				drbd_free_ee(mdev, ce);
+				goto raw;
+			}
+			ee_append(&cpage, &coffset, &hdr, sizeof(hdr));
+			ee_append(&cpage, &coffset,
+				  hdr & cpu_to_be16(DRBD_CHUNK_RAW) ? src + offset : dst, dlen);
+			out += sizeof(hdr) + dlen;
+			left -= clen;
+		}
+		kunmap(page);
+		if (!left)
+			break;
+	}
+	ce->size = out;
+	drbd_ee_trim_pages(mdev, ce);
+
+	drbd_stat_add(mdev, STAT_COMPRESS_IN_BYTES, e->size);
+	drbd_stat_add(mdev, STAT_COMPRESS_OUT_BYTES, sizeof(__be32) + out);
+	drbd_stat_add(mdev, STAT_COMPRESS_NS, drbd_lat_now() - start);
+	return ce;
+
+raw:
+	drbd_stat_add(mdev, STAT_COMPRESS_IN_BYTES, e->size);
+	drbd_stat_add(mdev, STAT_COMPRESS_OUT_BYTES, e->size);
+	drbd_stat_add(mdev, STAT_COMPRESS_RAW, 1);
+	drbd_stat_add(mdev, STAT_COMPRESS_NS, drbd_lat_now() - start);
+	return NULL;
+}
+#else
+static struct drbd_epoch_entry *
+drbd_compress_ee(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
+{
+	return NULL;
+}
+#endif
+
 /* see also wire_flags_to_bio()
  * DRBD_REQ_*, because we need to semantically map the flags to data packet
  * flags and back. We may replicate to other kernel versions. */
@@ -2996,27 +3182,19 @@ int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req)
 {
 	int ok = 1;
 	struct p_data p;
-	unsigned int dp_flags = 0;
+	struct drbd_epoch_entry *e = NULL, *ce;
+	struct kvec iov[DRBD_SENDV_MAX];
+	unsigned int dp_flags = 0, size;
+	__be32 raw_size;
 	void *dgb;
-	int dgs;
+	int dgs, nr, compress;
 
 	if (!drbd_get_data_sock(mdev))
 		return 0;
 
 	dgs = (mdev->agreed_pro_version >= 87 && mdev->integrity_w_tfm) ?
 		crypto_hash_digestsize(mdev->integrity_w_tfm) : 0;
-
-	if (req->size <= DRBD_MAX_SIZE_H80_PACKET) {
-		p.head.h80.magic   = BE_DRBD_MAGIC;
-		p.head.h80.command = cpu_to_be16(P_DATA);
-		p.head.h80.length  =
-			cpu_to_be16(sizeof(p) - sizeof(union p_header) + dgs + req->size);
-	} else {
-		p.head.h95.magic   = BE_DRBD_MAGIC_BIG;
-		p.head.h95.command = cpu_to_be16(P_DATA);
-		p.head.h95.length  =
-			cpu_to_be32(sizeof(p) - sizeof(union p_header) + dgs + req->size);
-	}
+	compress = req->size && drbd_test_flag(mdev, COMPRESS_DATA);
 
 	p.sector   = cpu_to_be64(req->sector);
 	p.block_id = (unsigned long)req;
@@ -3028,16 +3206,69 @@ int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req)
 	    mdev->state.conn <= C_PAUSED_SYNC_T)
 		dp_flags |= DP_MAY_SET_IN_SYNC;
 
+	dgb = mdev->int_dig_out;
+	if (dgs || compress) {
+		/* Snapshot the payload into pages of our own, and digest it in
+		 * the same pass. Those pages can then go out zero-copy, even
+		 * with protocol A, and the digest matches what is on the wire.
+		 * Should that allocation fail, fall back to the bio itself. */
+		e = drbd_alloc_send_ee(mdev, p.block_id, req->sector, req->size);
+		if (e)
+			drbd_copy_csum_bio(mdev, dgs ? mdev->integrity_w_tfm : NULL,
+					   req->master_bio, e, dgb);
+		else if (dgs)
+			drbd_csum_bio(mdev, mdev->integrity_w_tfm, req->master_bio, dgb);
+	}
+	/* the digest still covers the uncompressed data */
+	if (e && compress) {
+		ce = drbd_compress_ee(mdev, e);
+		if (ce) {
+			drbd_free_ee(mdev, e);
+			e = ce;
+			dp_flags |= DP_COMPRESSED;
+		}
+	}
+	size = e ? e->size : req->size;
+	if (dp_flags & DP_COMPRESSED)
+		size += sizeof(raw_size);
+
+	if (size <= DRBD_MAX_SIZE_H80_PACKET) {
+		p.head.h80.magic   = BE_DRBD_MAGIC;
+		p.head.h80.command = cpu_to_be16(P_DATA);
+		p.head.h80.length  =
+			cpu_to_be16(sizeof(p) - sizeof(union p_header) + dgs + size);
+	} else {
+		p.head.h95.magic   = BE_DRBD_MAGIC_BIG;
+		p.head.h95.command = cpu_to_be16(P_DATA);
+		p.head.h95.length  =
+			cpu_to_be32(sizeof(p) - sizeof(union p_header) + dgs + size);
+	}
+
 	p.dp_flags = cpu_to_be32(dp_flags);
+
 	trace_drbd_packet(mdev, mdev->data.socket, 0, (void *)&p, __FILE__, __LINE__);
-	ok = (sizeof(p) ==
-		drbd_send(mdev, mdev->data.socket, &p, sizeof(p), dgs ? MSG_MORE : 0));
-	if (ok && dgs) {
-		dgb = mdev->int_dig_out;
-		drbd_csum_bio(mdev, mdev->integrity_w_tfm, req->master_bio, dgb);
-		ok = dgs == drbd_send(mdev, mdev->data.socket, dgb, dgs, 0);
+	req->net_ns = drbd_lat_now();
+
+	/* header and digest go out with one sendmsg */
+	iov[0].iov_base = &p;
+	iov[0].iov_len  = sizeof(p);
+	nr = 1;
+	if (dp_flags & DP_COMPRESSED) {
+		raw_size = cpu_to_be32(req->size);
+		iov[nr].iov_base = &raw_size;
+		iov[nr].iov_len  = sizeof(raw_size);
+		nr++;
 	}
-	if (ok) {
+	if (dgs) {
+		iov[nr].iov_base = dgb;
+		iov[nr].iov_len  = dgs;
+		nr++;
+	}
+
+	if (e) {
+		ok = _drbd_sendv_all(mdev, iov, nr, MSG_MORE) &&
+			_drbd_send_zc_ee(mdev, e);
+	} else {
 		/* For protocol A, we have to memcpy the payload into
 		 * socket buffers, as we may complete right away
 		 * as soon as we handed it over to tcp, at which point the data
@@ -3050,12 +3281,13 @@ int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req)
 		 * receiving side, we sure have detected corruption elsewhere.
 		 */
 		if (mdev->net_conf->wire_protocol == DRBD_PROT_A || dgs)
-			ok = _drbd_send_bio(mdev, req->master_bio);
+			ok = _drbd_send_bio(mdev, iov, nr, req->master_bio);
 		else
-			ok = _drbd_send_zc_bio(mdev, req->master_bio);
+			ok = _drbd_sendv_all(mdev, iov, nr, req->size ? MSG_MORE : 0) &&
+				_drbd_send_zc_bio(mdev, req->master_bio);
 
 		/* double check digest, sometimes buffers have been modified in flight. */
-		if (dgs > 0 && dgs <= 64) {
+		if (ok && dgs > 0 && dgs <= 64) {
 			/* 64 byte, 512 bit, is the largest digest size
 			 * currently supported in kernel crypto. */
 			unsigned char digest[64];
@@ -3069,6 +3301,10 @@ int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req)
 		     ... Be noisy about digest too large ...
 		} */
 	}
+	if (ok)
+		drbd_stat_packet(mdev, 1, P_DATA);
+	if (e)
+		move_to_net_ee_or_free(mdev, e);
 
 	drbd_put_data_sock(mdev);
 
@@ -3084,50 +3320,96 @@ int drbd_send_block(struct drbd_conf *mdev, enum drbd_packets cmd,
 {
 	int ok;
 	struct p_data p;
+	struct drbd_epoch_entry *ce = NULL;
+	struct kvec iov[3];
+	__be32 raw_size;
 	void *dgb;
-	int dgs;
+	int dgs, nr;
+	unsigned int size;
 
 	dgs = (mdev->agreed_pro_version >= 87 && mdev->integrity_w_tfm) ?
 		crypto_hash_digestsize(mdev->integrity_w_tfm) : 0;
 
-	if (e->size <= DRBD_MAX_SIZE_H80_PACKET) {
+	/* Only called by our kernel thread.
+	 * This one may be interrupted by DRBD_SIG and/or DRBD_SIGKILL
+	 * in response to admin command or module unload.
+	 */
+	if (!drbd_get_data_sock(mdev))
+		return 0;
+
+	/* P_DATA_REPLY is read into the bio directly, on the receiving
+	 * side, and is never compressed. */
+	if (cmd == P_RS_DATA_REPLY && e->size && drbd_test_flag(mdev, COMPRESS_DATA))
+		ce = drbd_compress_ee(mdev, e);
+	size = ce ? sizeof(raw_size) + ce->size : e->size;
+
+	if (size <= DRBD_MAX_SIZE_H80_PACKET) {
 		p.head.h80.magic   = BE_DRBD_MAGIC;
 		p.head.h80.command = cpu_to_be16(cmd);
 		p.head.h80.length  =
-			cpu_to_be16(sizeof(p) - sizeof(struct p_header80) + dgs + e->size);
+			cpu_to_be16(sizeof(p) - sizeof(struct p_header80) + dgs + size);
 	} else {
 		p.head.h95.magic   = BE_DRBD_MAGIC_BIG;
 		p.head.h95.command = cpu_to_be16(cmd);
 		p.head.h95.length  =
-			cpu_to_be32(sizeof(p) - sizeof(struct p_header80) + dgs + e->size);
+			cpu_to_be32(sizeof(p) - sizeof(struct p_header80) + dgs + size);
 	}
 
 	p.sector   = cpu_to_be64(e->sector);
 	p.block_id = e->block_id;
-	/* p.seq_num  = 0;    No sequence numbers here.. */
-
-	/* Only called by our kernel thread.
-	 * This one may be interrupted by DRBD_SIG and/or DRBD_SIGKILL
-	 * in response to admin command or module unload.
-	 */
-	if (!drbd_get_data_sock(mdev))
-		return 0;
+	p.seq_num  = 0; /* No sequence numbers here.. */
+	p.dp_flags = cpu_to_be32(ce ? DP_COMPRESSED : 0);
 
 	trace_drbd_packet(mdev, mdev->data.socket, 0, (void *)&p, __FILE__, __LINE__);
-	ok = sizeof(p) == drbd_send(mdev, mdev->data.socket, &p, sizeof(p), dgs ? MSG_MORE : 0);
-	if (ok && dgs) {
+	/* header and digest go out with one sendmsg */
+	iov[0].iov_base = &p;
+	iov[0].iov_len  = sizeof(p);
+	nr = 1;
+	if (ce) {
+		raw_size = cpu_to_be32(e->size);
+		iov[nr].iov_base = &raw_size;
+		iov[nr].iov_len  = sizeof(raw_size);
+		nr++;
+	}
+	if (dgs) {
+		/* the digest covers the uncompressed data */
 		dgb = mdev->int_dig_out;
 		drbd_csum_ee(mdev, mdev->integrity_w_tfm, e, dgb);
-		ok = dgs == drbd_send(mdev, mdev->data.socket, dgb, dgs, 0);
+		iov[nr].iov_base = dgb;
+		iov[nr].iov_len  = dgs;
+		nr++;
 	}
+	ok = _drbd_sendv_all(mdev, iov, nr, size ? MSG_MORE : 0);
+	if (ok)
+		ok = _drbd_send_zc_ee(mdev, ce ?: e);
 	if (ok)
-		ok = _drbd_send_zc_ee(mdev, e);
+		drbd_stat_packet(mdev, 1, cmd);
+	if (ok && cmd == P_RS_DATA_REPLY)
+		drbd_stat_add(mdev, STAT_RS_SENT_BYTES, e->size);
+	if (ce)
+		move_to_net_ee_or_free(mdev, ce);
 
 	drbd_put_data_sock(mdev);
 
 	return ok;
 }
 
+/* All zero resync data: only the range goes over the wire.
+ * The peer writes zeroes, see receive_RSZeroes(). */
+int drbd_send_rs_zeroes(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
+{
+	struct p_block_desc p;
+	int ok;
+
+	p.sector  = cpu_to_be64(e->sector);
+	p.blksize = cpu_to_be32(e->size);
+
+	ok = drbd_send_cmd(mdev, USE_DATA_SOCKET, P_RS_ZEROES, &p.head, sizeof(p));
+	if (ok)
+		drbd_stat_add(mdev, STAT_RS_ZERO_BYTES, e->size);
+	return ok;
+}
+
 int drbd_send_oos(struct drbd_conf *mdev, struct drbd_request *req)
 {
 	struct p_block_desc p;
@@ -3156,30 +3438,41 @@ int drbd_send_oos(struct drbd_conf *mdev, struct drbd_request *req)
  */
 int drbd_send(struct drbd_conf *mdev, struct socket *sock,
 	      void *buf, size_t size, unsigned msg_flags)
+{
+	struct kvec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len  = size;
+
+	return drbd_sendv(mdev, sock, &iov, 1, msg_flags);
+}
+
+/*
+ * Like drbd_send(), but gathers @nr buffers into one sendmsg, so that
+ * e.g. header, digest and payload go out in one call and do not get
+ * fragmented into separate TCP segments.
+ * @iov is consumed: on a short send, it is advanced past what was sent.
+ */
+int drbd_sendv(struct drbd_conf *mdev, struct socket *sock,
+	       struct kvec *iov, int nr, unsigned msg_flags)
 {
 #if !HAVE_KERNEL_SENDMSG
 	mm_segment_t oldfs;
-	struct iovec iov;
-#else
-	struct kvec iov;
 #endif
 	struct msghdr msg;
-	int rv, sent = 0;
+	size_t size = 0;
+	int i, rv, sent = 0;
 
 	if (!sock)
 		return -1000;
 
 	/* THINK  if (signal_pending) return ... ? */
 
-	iov.iov_base = buf;
-	iov.iov_len  = size;
+	for (i = 0; i < nr; i++)
+		size += iov[i].iov_len;
 
 	msg.msg_name       = NULL;
 	msg.msg_namelen    = 0;
-#if !HAVE_KERNEL_SENDMSG
-	msg.msg_iov        = &iov;
-	msg.msg_iovlen     = 1;
-#endif
 	msg.msg_control    = NULL;
 	msg.msg_controllen = 0;
 	msg.msg_flags      = msg_flags | MSG_NOSIGNAL;
@@ -3204,9 +3497,11 @@ int drbd_send(struct drbd_conf *mdev, struct socket *sock,
  * otherwise wake_asender() might interrupt some send_*Ack !
  */
 #if !HAVE_KERNEL_SENDMSG
-		rv = sock_sendmsg(sock, &msg, iov.iov_len);
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = nr;
+		rv = sock_sendmsg(sock, &msg, size - sent);
 #else
-		rv = kernel_sendmsg(sock, &msg, &iov, 1, size);
+		rv = kernel_sendmsg(sock, &msg, iov, nr, size - sent);
 #endif
 		if (rv == -EAGAIN) {
 			if (we_should_drop_the_connection(mdev, sock))
@@ -3233,13 +3528,24 @@ int drbd_send(struct drbd_conf *mdev, struct socket *sock,
 		if (rv < 0)
 			break;
 		sent += rv;
-		iov.iov_base += rv;
-		iov.iov_len  -= rv;
+		if (sent == size)
+			break;
+		/* skip what went out, continue within a partially sent kvec */
+		while (rv >= iov->iov_len) {
+			rv -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+		iov->iov_base += rv;
+		iov->iov_len  -= rv;
 	} while (sent < size);
 
 	if (sock == mdev->data.socket)
 		drbd_clear_flag(mdev, NET_CONGESTED);
 
+	drbd_stat_add(mdev, sock == mdev->meta.socket ?
+		      STAT_META_SENT_BYTES : STAT_DATA_SENT_BYTES, sent);
+
 #if !HAVE_KERNEL_SENDMSG
 	set_fs(oldfs);
 #endif
@@ -3357,7 +3663,11 @@ STATIC void drbd_set_defaults(struct drbd_conf *mdev)
 		/* .c_delay_target = */	DRBD_C_DELAY_TARGET_DEF,
 		/* .c_fill_target = */	DRBD_C_FILL_TARGET_DEF,
 		/* .c_max_rate = */	DRBD_C_MAX_RATE_DEF,
-		/* .c_min_rate = */	DRBD_C_MIN_RATE_DEF
+		/* .c_min_rate = */	DRBD_C_MIN_RATE_DEF,
+		/* .read_balancing = */	DRBD_READ_BALANCING_DEF,
+		/* .c_lat_target = */	DRBD_C_LAT_TARGET_DEF,
+		/* .verify_partitions = */ DRBD_VERIFY_PARTITIONS_DEF,
+		/* .al_replacement = */	DRBD_AL_REPLACEMENT_DEF
 	};
 
 	/* Have to use that way, because the layout differs between
@@ -3374,8 +3684,29 @@ STATIC void drbd_set_defaults(struct drbd_conf *mdev)
 		} };
 }
 
+/* Any wake_up() of al_wait or misc_wait may mean that writes parked by
+ * drbd_al_begin_io_nonblock() can make progress now: an extent got
+ * unused, a resync extent got unlocked, or the device resumed IO. */
+static int al_kick_wake_function(wait_queue_t *wait, unsigned mode, int sync, void *key)
+{
+	struct drbd_conf *mdev = wait->private;
+
+	if (!list_empty(&mdev->al_pending))
+		drbd_kick_al_pending(mdev);
+	return 0;
+}
+
+static void drbd_add_al_kick(struct drbd_conf *mdev, wait_queue_head_t *q, wait_queue_t *wait)
+{
+	init_waitqueue_func_entry(wait, al_kick_wake_function);
+	wait->private = mdev;
+	add_wait_queue(q, wait);
+}
+
 void drbd_init_set_defaults(struct drbd_conf *mdev)
 {
+	int i;
+
 	/* the memset(,0,) did most of this.
 	 * note: only assignments, no allocation in here */
 
@@ -3385,11 +3716,18 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 
 	drbd_set_defaults(mdev);
 
+	for (i = 0; i < DRBD_APP_HOT_SLOTS; i++)
+		mdev->app_hot[i].enr = ~0U;
+	mdev->rs_hot_fo = DRBD_END_OF_BITMAP;
+	mdev->al_ext_shift = AL_EXTENT_SHIFT;
+	mdev->al_prefetched = LC_FREE;
+
 	atomic_set(&mdev->ap_bio_cnt, 0);
 	atomic_set(&mdev->ap_pending_cnt, 0);
 	atomic_set(&mdev->rs_pending_cnt, 0);
 	atomic_set(&mdev->unacked_cnt, 0);
 	atomic_set(&mdev->local_cnt, 0);
+	atomic_set(&mdev->ap_local_cnt, 0);
 	atomic_set(&mdev->net_cnt, 0);
 	atomic_set(&mdev->packet_seq, 0);
 	atomic_set(&mdev->pp_in_use, 0);
@@ -3397,13 +3735,17 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	atomic_set(&mdev->rs_sect_in, 0);
 	atomic_set(&mdev->rs_sect_ev, 0);
 	atomic_set(&mdev->ap_in_flight, 0);
-	atomic_set(&mdev->md_io_in_use, 0);
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++) {
+		mdev->md_io[i].mdev = mdev;
+		atomic_set(&mdev->md_io[i].in_use, 0);
+	}
 
 	mutex_init(&mdev->data.mutex);
 	mutex_init(&mdev->meta.mutex);
 	sema_init(&mdev->data.work.s, 0);
 	sema_init(&mdev->meta.work.s, 0);
 	mutex_init(&mdev->state_mutex);
+	mutex_init(&mdev->md_sync_mutex);
 
 	spin_lock_init(&mdev->data.work.q_lock);
 	spin_lock_init(&mdev->meta.work.q_lock);
@@ -3419,6 +3761,7 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	INIT_LIST_HEAD(&mdev->read_ee);
 	INIT_LIST_HEAD(&mdev->net_ee);
 	INIT_LIST_HEAD(&mdev->resync_reads);
+	INIT_LIST_HEAD(&mdev->al_pending);
 	INIT_LIST_HEAD(&mdev->data.work.q);
 	INIT_LIST_HEAD(&mdev->meta.work.q);
 	INIT_LIST_HEAD(&mdev->resync_work.list);
@@ -3426,6 +3769,10 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	INIT_LIST_HEAD(&mdev->go_diskless.list);
 	INIT_LIST_HEAD(&mdev->md_sync_work.list);
 	INIT_LIST_HEAD(&mdev->start_resync_work.list);
+	INIT_LIST_HEAD(&mdev->resync_finished_work.list);
+	INIT_LIST_HEAD(&mdev->resume_ov_work.list);
+	INIT_LIST_HEAD(&mdev->al_submit_work.list);
+	INIT_LIST_HEAD(&mdev->al_prefetch_work.list);
 	INIT_LIST_HEAD(&mdev->bm_io_work.w.list);
 
 	mdev->resync_work.cb  = w_resync_timer;
@@ -3434,9 +3781,14 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	mdev->md_sync_work.cb = w_md_sync;
 	mdev->bm_io_work.w.cb = w_bitmap_io;
 	mdev->start_resync_work.cb = w_start_resync;
+	mdev->resync_finished_work.cb = w_resync_finished;
+	mdev->resume_ov_work.cb = w_resume_ov;
+	mdev->al_submit_work.cb = w_al_submit_pending;
+	mdev->al_prefetch_work.cb = w_al_prefetch;
 	init_timer(&mdev->resync_timer);
 	init_timer(&mdev->md_sync_timer);
 	init_timer(&mdev->start_resync_timer);
+	init_timer(&mdev->resync_finished_timer);
 	init_timer(&mdev->request_timer);
 	mdev->resync_timer.function = resync_timer_fn;
 	mdev->resync_timer.data = (unsigned long) mdev;
@@ -3444,15 +3796,20 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	mdev->md_sync_timer.data = (unsigned long) mdev;
 	mdev->start_resync_timer.function = start_resync_timer_fn;
 	mdev->start_resync_timer.data = (unsigned long) mdev;
+	mdev->resync_finished_timer.function = resync_finished_timer_fn;
+	mdev->resync_finished_timer.data = (unsigned long) mdev;
 	mdev->request_timer.function = request_timer_fn;
 	mdev->request_timer.data = (unsigned long) mdev;
 
 	init_waitqueue_head(&mdev->misc_wait);
+	init_waitqueue_head(&mdev->ra_wait);
 	init_waitqueue_head(&mdev->state_wait);
 	init_waitqueue_head(&mdev->net_cnt_wait);
 	init_waitqueue_head(&mdev->ee_wait);
 	init_waitqueue_head(&mdev->al_wait);
 	init_waitqueue_head(&mdev->seq_wait);
+	drbd_add_al_kick(mdev, &mdev->al_wait, &mdev->al_kick_al_wait);
+	drbd_add_al_kick(mdev, &mdev->misc_wait, &mdev->al_kick_misc_wait);
 
 	drbd_thread_init(mdev, &mdev->receiver, drbdd_init);
 	drbd_thread_init(mdev, &mdev->worker, drbd_worker);
@@ -3465,6 +3822,151 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	mdev->local_max_bio_size = DRBD_MAX_BIO_SIZE_SAFE;
 }
 
+/**
+ * drbd_lat_account() - Account one sample in the latency histograms
+ * @mdev:	DRBD device.
+ * @c:		Which histogram.
+ * @start_ns:	drbd_lat_now() at the start of the operation, 0 if unknown.
+ *
+ * May be called from any context, including irq.
+ */
+void drbd_lat_account(struct drbd_conf *mdev, enum drbd_lat_class c, u64 start_ns)
+{
+	struct drbd_lat_hist *h;
+	struct drbd_lat_ewma *e;
+	unsigned long flags;
+	unsigned int clipped;
+	u64 us;
+	int i;
+
+	if (!start_ns)
+		return;
+
+	/* >> 10: close enough to microseconds for log2 buckets */
+	us = (drbd_lat_now() - start_ns) >> 10;
+	/* for the running average; clipped at ~1s */
+	clipped = (unsigned int)min_t(u64, us, 1 << 20);
+
+	for (i = 0; us && i < LAT_BUCKETS - 1; i++)
+		us >>= 1;
+
+	local_irq_save(flags);
+	h = per_cpu_ptr(mdev->lat_hist, smp_processor_id());
+	h->bucket[c][i]++;
+	/* avg += us - avg/8, in 1/8 us */
+	e = per_cpu_ptr(mdev->lat_ewma, smp_processor_id());
+	e->avg[c] += clipped - (e->avg[c] >> 3);
+	e->samples[c]++;
+	e->stamp[c] = jiffies;
+	local_irq_restore(flags);
+}
+
+/**
+ * drbd_lat_avg() - Running average latency of one class, in us
+ * @mdev:	DRBD device.
+ * @c:		Which class.
+ *
+ * Folds the per cpu averages of the cpus that took a sample during the
+ * last second; those of other cpus are stale.  If there is none, the
+ * average of the cpu with the most recent sample is as good as it gets.
+ * Not synchronized with drbd_lat_account(), good enough for the resync
+ * controller.
+ */
+unsigned int drbd_lat_avg(struct drbd_conf *mdev, enum drbd_lat_class c)
+{
+	struct drbd_lat_ewma *e, *last = NULL;
+	unsigned long sum = 0;
+	int cpu, n = 0;
+
+	for_each_possible_cpu(cpu) {
+		e = per_cpu_ptr(mdev->lat_ewma, cpu);
+		if (!e->samples[c])
+			continue;
+		if (!last || time_after(e->stamp[c], last->stamp[c]))
+			last = e;
+		if (time_after(jiffies, e->stamp[c] + HZ))
+			continue;
+		sum += e->avg[c];
+		n++;
+	}
+	if (n)
+		return (sum / n) >> 3;
+	return last ? last->avg[c] >> 3 : 0;
+}
+
+/* number of samples drbd_lat_avg() saw so far, wraps */
+unsigned int drbd_lat_samples(struct drbd_conf *mdev, enum drbd_lat_class c)
+{
+	unsigned int samples = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		samples += per_cpu_ptr(mdev->lat_ewma, cpu)->samples[c];
+	return samples;
+}
+
+/**
+ * drbd_lat_sum() - Add up the per cpu latency histograms
+ * @mdev:	DRBD device.
+ * @sum:	Result. Reading is not synchronized with drbd_lat_account(),
+ *		counts may be off by a few in flight samples.
+ */
+void drbd_lat_sum(struct drbd_conf *mdev, struct drbd_lat_hist *sum)
+{
+	struct drbd_lat_hist *h;
+	int cpu, c, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		h = per_cpu_ptr(mdev->lat_hist, cpu);
+		for (c = 0; c < LAT_CLASSES; c++)
+			for (i = 0; i < LAT_BUCKETS; i++)
+				sum->bucket[c][i] += h->bucket[c][i];
+	}
+}
+
+/**
+ * drbd_stats_sum() - Add up the per cpu statistics counters
+ * @mdev:	DRBD device.
+ * @sum:	Result.
+ */
+void drbd_stats_sum(struct drbd_conf *mdev, struct drbd_stats *sum)
+{
+	struct drbd_stats *st;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(mdev->stats, cpu);
+		for (i = 0; i < STAT_COUNTERS; i++)
+			sum->cnt[i] += st->cnt[i];
+		for (i = 0; i < STAT_PACKET_TYPES; i++) {
+			sum->pkt_sent[i] += st->pkt_sent[i];
+			sum->pkt_recv[i] += st->pkt_recv[i];
+		}
+	}
+}
+
+u64 drbd_stat_read(struct drbd_conf *mdev, enum drbd_stat_counter c)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(mdev->stats, cpu)->cnt[c];
+	return sum;
+}
+
+/* Not atomic with respect to concurrent drbd_stat_add(),
+ * same as the plain "= 0" of the old unsigned int counters. */
+void drbd_stat_reset(struct drbd_conf *mdev, enum drbd_stat_counter c)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(mdev->stats, cpu)->cnt[c] = 0;
+}
+
 void drbd_mdev_cleanup(struct drbd_conf *mdev)
 {
 	int i;
@@ -3475,18 +3977,17 @@ void drbd_mdev_cleanup(struct drbd_conf *mdev)
 	/* no need to lock it, I'm the only thread alive */
 	if (atomic_read(&mdev->current_epoch->epoch_size) !=  0)
 		dev_err(DEV, "epoch_size:%d\n", atomic_read(&mdev->current_epoch->epoch_size));
-	mdev->al_writ_cnt  =
-	mdev->bm_writ_cnt  =
-	mdev->read_cnt     =
-	mdev->recv_cnt     =
-	mdev->send_cnt     =
-	mdev->writ_cnt     =
 	mdev->p_size       =
 	mdev->rs_start     =
 	mdev->rs_total     =
 	mdev->rs_failed    = 0;
 	mdev->rs_last_events = 0;
 	mdev->rs_last_sect_ev = 0;
+	for_each_possible_cpu(i) {
+		memset(per_cpu_ptr(mdev->stats, i), 0, sizeof(struct drbd_stats));
+		memset(per_cpu_ptr(mdev->lat_hist, i), 0, sizeof(struct drbd_lat_hist));
+		memset(per_cpu_ptr(mdev->lat_ewma, i), 0, sizeof(struct drbd_lat_ewma));
+	}
 	for (i = 0; i < DRBD_SYNC_MARKS; i++) {
 		mdev->rs_mark_left[i] = 0;
 		mdev->rs_mark_time[i] = 0;
@@ -3756,6 +4257,9 @@ static void drbd_delete_device(unsigned int minor)
 	kfree(mdev->int_dig_out);
 	kfree(mdev->int_dig_in);
 	kfree(mdev->int_dig_vv);
+	vfree(mdev->compress_buf);
+	vfree(mdev->decompress_buf);
+	drbd_ra_free(mdev);
 
 	/* cleanup the rest that has been
 	 * allocated from drbd_new_device
@@ -3851,11 +4355,26 @@ out:
 	return r;
 }
 
+static void drbd_free_md_io(struct drbd_conf *mdev)
+{
+	int i;
+
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++) {
+		if (mdev->md_io[i].page)
+			__free_page(mdev->md_io[i].page);
+		if (mdev->md_io[i].tmpp)
+			__free_page(mdev->md_io[i].tmpp);
+		mdev->md_io[i].page = NULL;
+		mdev->md_io[i].tmpp = NULL;
+	}
+}
+
 struct drbd_conf *drbd_new_device(unsigned int minor)
 {
 	struct drbd_conf *mdev;
 	struct gendisk *disk;
 	struct request_queue *q;
+	int i;
 
 	/* GFP_KERNEL, we are outside of all write-out paths */
 	mdev = kzalloc(sizeof(struct drbd_conf), GFP_KERNEL);
@@ -3910,9 +4429,23 @@ struct drbd_conf *drbd_new_device(unsigned int minor)
 	q->unplug_fn = drbd_unplug_fn;
 #endif
 
-	mdev->md_io_page = alloc_page(GFP_KERNEL);
-	if (!mdev->md_io_page)
-		goto out_no_io_page;
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++) {
+		mdev->md_io[i].page = alloc_page(GFP_KERNEL);
+		if (!mdev->md_io[i].page)
+			goto out_no_io_page;
+	}
+
+	mdev->stats = alloc_percpu(struct drbd_stats);
+	if (!mdev->stats)
+		goto out_no_stats;
+
+	mdev->lat_hist = alloc_percpu(struct drbd_lat_hist);
+	if (!mdev->lat_hist)
+		goto out_no_lat_hist;
+
+	mdev->lat_ewma = alloc_percpu(struct drbd_lat_ewma);
+	if (!mdev->lat_ewma)
+		goto out_no_lat_ewma;
 
 	if (drbd_bm_init(mdev))
 		goto out_no_bitmap;
@@ -3942,8 +4475,14 @@ out_no_app_reads:
 out_no_tl:
 	drbd_bm_cleanup(mdev);
 out_no_bitmap:
-	__free_page(mdev->md_io_page);
+	free_percpu(mdev->lat_ewma);
+out_no_lat_ewma:
+	free_percpu(mdev->lat_hist);
+out_no_lat_hist:
+	free_percpu(mdev->stats);
+out_no_stats:
 out_no_io_page:
+	drbd_free_md_io(mdev);
 	put_disk(disk);
 out_no_disk:
 	blk_cleanup_queue(q);
@@ -3965,7 +4504,10 @@ void drbd_free_mdev(struct drbd_conf *mdev)
 	tl_cleanup(mdev);
 	if (mdev->bitmap) /* should no longer be there. */
 		drbd_bm_cleanup(mdev);
-	__free_page(mdev->md_io_page);
+	free_percpu(mdev->lat_ewma);
+	free_percpu(mdev->lat_hist);
+	free_percpu(mdev->stats);
+	drbd_free_md_io(mdev);
 	put_disk(mdev->vdisk);
 	blk_cleanup_queue(mdev->rq_queue);
 	free_cpumask_var(mdev->cpu_mask);
@@ -3978,6 +4520,10 @@ int __init drbd_init(void)
 {
 	int err;
 
+	BUILD_BUG_ON(P_MAX_CMD > STAT_PACKET_TYPES);
+
+	drbd_crc32c_init();
+
 	if (sizeof(struct p_handshake) != 80) {
 		printk(KERN_ERR
 		       "drbd: never change the size or layout "
@@ -4122,7 +4668,19 @@ struct meta_data_on_disk {
 	u32 bm_offset;         /* offset to the bitmap, from here */
 	u32 bm_bytes_per_bit;  /* BM_BLOCK_SIZE */
 	u32 la_peer_max_bio_size;   /* last peer max_bio_size */
-	u32 reserved_u32[3];
+	u32 al_size_sect;      /* size of the al area, 0: MD_AL_MAX_SIZE */
+	u32 al_extent_shift;   /* 0: AL_EXTENT_SHIFT */
+	u32 reserved_u32[1];
+
+	/* online verify checkpoint, ignored unless ov_ckpt_magic matches */
+	u32 ov_ckpt_magic;
+	u32 ov_ckpt_nr;
+	u64 ov_ckpt_start;
+	u64 ov_ckpt_stop;
+	struct {
+		u64 pos;
+		u64 end;
+	} __packed ov_ckpt[DRBD_OV_CURSORS_MAX];
 
 } __packed;
 
@@ -4146,10 +4704,15 @@ void drbd_md_sync(struct drbd_conf *mdev)
 	if (!get_ldev_if_state(mdev, D_FAILED))
 		return;
 
+	/* the buffer pool no longer serializes us against an other
+	 * drbd_md_sync(), which might otherwise overwrite our newer
+	 * super block with its older one */
+	mutex_lock(&mdev->md_sync_mutex);
 	buffer = drbd_md_get_buffer(mdev);
 	if (!buffer)
 		goto out;
 
+	BUILD_BUG_ON(sizeof(*buffer) > 512);
 	memset(buffer, 0, 512);
 
 	trace_drbd_md_io(mdev, WRITE, mdev->ldev);
@@ -4157,7 +4720,9 @@ void drbd_md_sync(struct drbd_conf *mdev)
 	for (i = UI_CURRENT; i < UI_SIZE; i++)
 		buffer->uuid[i] = cpu_to_be64(mdev->ldev->md.uuid[i]);
 	buffer->flags = cpu_to_be32(mdev->ldev->md.flags);
-	buffer->magic = cpu_to_be32(DRBD_MD_MAGIC);
+	buffer->magic = cpu_to_be32(
+		drbd_md_al_ext_shift(mdev->ldev) == AL_EXTENT_SHIFT ?
+		DRBD_MD_MAGIC : DRBD_MD_MAGIC_AL_EXT);
 
 	buffer->md_size_sect  = cpu_to_be32(mdev->ldev->md.md_size_sect);
 	buffer->al_offset     = cpu_to_be32(mdev->ldev->md.al_offset);
@@ -4166,12 +4731,25 @@ void drbd_md_sync(struct drbd_conf *mdev)
 	buffer->device_uuid = cpu_to_be64(mdev->ldev->md.device_uuid);
 
 	buffer->bm_offset = cpu_to_be32(mdev->ldev->md.bm_offset);
+	buffer->al_size_sect = cpu_to_be32(mdev->ldev->md.al_size_sect);
+	buffer->al_extent_shift = cpu_to_be32(mdev->ldev->md.al_extent_shift);
 	buffer->la_peer_max_bio_size = cpu_to_be32(mdev->peer_max_bio_size);
 
+	if (mdev->ldev->md.ov_ckpt_nr) {
+		buffer->ov_ckpt_magic = cpu_to_be32(DRBD_OV_CKPT_MAGIC);
+		buffer->ov_ckpt_nr = cpu_to_be32(mdev->ldev->md.ov_ckpt_nr);
+		buffer->ov_ckpt_start = cpu_to_be64(mdev->ldev->md.ov_ckpt_start);
+		buffer->ov_ckpt_stop = cpu_to_be64(mdev->ldev->md.ov_ckpt_stop);
+		for (i = 0; i < mdev->ldev->md.ov_ckpt_nr; i++) {
+			buffer->ov_ckpt[i].pos = cpu_to_be64(mdev->ldev->md.ov_ckpt[i].pos);
+			buffer->ov_ckpt[i].end = cpu_to_be64(mdev->ldev->md.ov_ckpt[i].end);
+		}
+	}
+
 	D_ASSERT(drbd_md_ss__(mdev, mdev->ldev) == mdev->ldev->md.md_offset);
 	sector = mdev->ldev->md.md_offset;
 
-	if (!drbd_md_sync_page_io(mdev, mdev->ldev, sector, WRITE)) {
+	if (!drbd_md_sync_page_io(mdev, mdev->ldev, buffer, sector, WRITE)) {
 		/* this was a try anyways ... */
 		dev_err(DEV, "meta data update failed!\n");
 		drbd_chk_io_error(mdev, 1, DRBD_META_IO_ERROR);
@@ -4181,8 +4759,9 @@ void drbd_md_sync(struct drbd_conf *mdev)
 	 * since we updated it on metadata. */
 	mdev->ldev->md.la_size_sect = drbd_get_capacity(mdev->this_bdev);
 
-	drbd_md_put_buffer(mdev);
+	drbd_md_put_buffer(mdev, buffer);
 out:
+	mutex_unlock(&mdev->md_sync_mutex);
 	put_ldev(mdev);
 }
 
@@ -4208,7 +4787,7 @@ int drbd_md_read(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 	if (!buffer)
 		goto out;
 
-	if (!drbd_md_sync_page_io(mdev, bdev, bdev->md.md_offset, READ)) {
+	if (!drbd_md_sync_page_io(mdev, bdev, buffer, bdev->md.md_offset, READ)) {
 		/* NOTE: can't do normal error processing here as this is
 		   called BEFORE disk is attached */
 		dev_err(DEV, "Error while reading metadata.\n");
@@ -4216,11 +4795,36 @@ int drbd_md_read(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 		goto err;
 	}
 
-	if (be32_to_cpu(buffer->magic) != DRBD_MD_MAGIC) {
+	if (be32_to_cpu(buffer->magic) != DRBD_MD_MAGIC &&
+	    be32_to_cpu(buffer->magic) != DRBD_MD_MAGIC_AL_EXT) {
 		dev_err(DEV, "Error while reading metadata, magic not found.\n");
 		rv = ERR_MD_INVALID;
 		goto err;
 	}
+
+	/* flexible meta data may have been created with a larger AL area,
+	 * which moves the bitmap; recalculate the offsets we expect */
+	i = be32_to_cpu(buffer->al_size_sect);
+	if (i != bdev->md.al_size_sect) {
+		if (i && i != MD_AL_MAX_SIZE &&
+		    (bdev->dc.meta_dev_idx >= 0 ||
+		     i < MD_AL_MAX_SIZE || i > MD_AL_SIZE_LIMIT || (i & 7))) {
+			dev_err(DEV, "unexpected al_size_sect: %u\n", i);
+			rv = ERR_MD_INVALID;
+			goto err;
+		}
+		bdev->md.al_size_sect = i;
+		drbd_md_set_sector_offsets(mdev, bdev);
+	}
+
+	i = be32_to_cpu(buffer->al_extent_shift);
+	if (i && (i < AL_EXTENT_SHIFT_MIN || i > AL_EXTENT_SHIFT_MAX)) {
+		dev_err(DEV, "unexpected al_extent_shift: %u\n", i);
+		rv = ERR_MD_INVALID;
+		goto err;
+	}
+	bdev->md.al_extent_shift = i;
+
 	if (be32_to_cpu(buffer->al_offset) != bdev->md.al_offset) {
 		dev_err(DEV, "unexpected al_offset: %d (expected %d)\n",
 		    be32_to_cpu(buffer->al_offset), bdev->md.al_offset);
@@ -4254,6 +4858,21 @@ int drbd_md_read(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 	mdev->sync_conf.al_extents = be32_to_cpu(buffer->al_nr_extents);
 	bdev->md.device_uuid = be64_to_cpu(buffer->device_uuid);
 
+	bdev->md.ov_ckpt_nr = 0;
+	if (be32_to_cpu(buffer->ov_ckpt_magic) == DRBD_OV_CKPT_MAGIC &&
+	    be32_to_cpu(buffer->ov_ckpt_nr) <= DRBD_OV_CURSORS_MAX) {
+		bdev->md.ov_ckpt_nr = be32_to_cpu(buffer->ov_ckpt_nr);
+		bdev->md.ov_ckpt_start = be64_to_cpu(buffer->ov_ckpt_start);
+		bdev->md.ov_ckpt_stop = be64_to_cpu(buffer->ov_ckpt_stop);
+		for (i = 0; i < bdev->md.ov_ckpt_nr; i++) {
+			bdev->md.ov_ckpt[i].pos = be64_to_cpu(buffer->ov_ckpt[i].pos);
+			bdev->md.ov_ckpt[i].end = be64_to_cpu(buffer->ov_ckpt[i].end);
+		}
+		/* so a plain "verify" resumes, see drbd_ov_init_cursors() */
+		if (bdev->md.ov_ckpt_nr)
+			mdev->ov_start_sector = bdev->md.ov_ckpt_start;
+	}
+
 	spin_lock_irq(&mdev->req_lock);
 	if (mdev->state.conn < C_CONNECTED) {
 		unsigned int peer;
@@ -4265,9 +4884,11 @@ int drbd_md_read(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 
 	if (mdev->sync_conf.al_extents < 7)
 		mdev->sync_conf.al_extents = 127;
+	if (mdev->sync_conf.al_extents > drbd_al_extents_max(bdev))
+		mdev->sync_conf.al_extents = drbd_al_extents_max(bdev);
 
  err:
-	drbd_md_put_buffer(mdev);
+	drbd_md_put_buffer(mdev, buffer);
  out:
 	put_ldev(mdev);
 
@@ -4460,6 +5081,9 @@ STATIC int w_bitmap_io(struct drbd_conf *mdev, struct drbd_work *w, int unused)
 	smp_mb__after_clear_bit();
 	wake_up(&mdev->misc_wait);
 
+	if (drbd_test_and_clear_flag(mdev, RESUME_OV_PENDING))
+		drbd_queue_work(&mdev->data.work, &mdev->resume_ov_work);
+
 	if (work->done)
 		work->done(mdev, rv);
 
@@ -4472,6 +5096,8 @@ STATIC int w_bitmap_io(struct drbd_conf *mdev, struct drbd_work *w, int unused)
 
 void drbd_ldev_destroy(struct drbd_conf *mdev)
 {
+	int i;
+
 	lc_destroy(mdev->resync);
 	mdev->resync = NULL;
 	lc_destroy(mdev->act_log);
@@ -4480,9 +5106,11 @@ void drbd_ldev_destroy(struct drbd_conf *mdev)
 		drbd_free_bc(mdev->ldev);
 		mdev->ldev = NULL;);
 
-	if (mdev->md_io_tmpp) {
-		__free_page(mdev->md_io_tmpp);
-		mdev->md_io_tmpp = NULL;
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++) {
+		if (mdev->md_io[i].tmpp) {
+			__free_page(mdev->md_io[i].tmpp);
+			mdev->md_io[i].tmpp = NULL;
+		}
 	}
 	drbd_clear_flag(mdev, GO_DISKLESS);
 }
@@ -29,9 +29,11 @@
 #include <linux/fs.h>
 #include <linux/file.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/connector.h>
 #include <linux/blkpg.h>
 #include <linux/cpumask.h>
+#include <linux/rcupdate.h>
 #include "drbd_int.h"
 #include "drbd_tracing.h"
 #include "drbd_wrappers.h"
@@ -477,7 +479,7 @@ STATIC struct drbd_conf *ensure_mdev(int minor, int create)
 
 			add_disk(disk);
 			parent = drbd_kobj_of_disk(disk);
-			mdev->kobj = kobject_create_and_add("drbd", parent);
+			mdev->kobj = drbd_dev_kobject_create(mdev, parent);
 			if (!mdev->kobj) {
 				minor_table[minor] = NULL;
 				del_gendisk(mdev->vdisk);
@@ -519,11 +521,13 @@ STATIC int drbd_nl_secondary(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp
 }
 
 /* initializes the md.*_offset members, so we are able to find
- * the on disk meta data */
-STATIC void drbd_md_set_sector_offsets(struct drbd_conf *mdev,
-				       struct drbd_backing_dev *bdev)
+ * the on disk meta data.  Flexible meta data may have a larger AL area,
+ * drbd_md_read() calls this again once it learned md.al_size_sect */
+void drbd_md_set_sector_offsets(struct drbd_conf *mdev,
+				struct drbd_backing_dev *bdev)
 {
 	sector_t md_size_sect = 0;
+	unsigned int al_size_sect = drbd_md_al_size(bdev);
 	switch (bdev->dc.meta_dev_idx) {
 	default:
 		/* v07 style fixed size indexed meta data */
@@ -537,13 +541,12 @@ STATIC void drbd_md_set_sector_offsets(struct drbd_conf *mdev,
 		bdev->md.md_size_sect = drbd_get_capacity(bdev->md_bdev);
 		bdev->md.md_offset = 0;
 		bdev->md.al_offset = MD_AL_OFFSET;
-		bdev->md.bm_offset = MD_BM_OFFSET;
+		bdev->md.bm_offset = MD_AL_OFFSET + al_size_sect;
 		break;
 	case DRBD_MD_INDEX_INTERNAL:
 	case DRBD_MD_INDEX_FLEX_INT:
 		bdev->md.md_offset = drbd_md_ss__(mdev, bdev);
-		/* al size is still fixed */
-		bdev->md.al_offset = -MD_AL_MAX_SIZE;
+		bdev->md.al_offset = -(s32)al_size_sect;
 		/* we need (slightly less than) ~ this much bitmap sectors: */
 		md_size_sect = drbd_get_capacity(bdev->backing_bdev);
 		md_size_sect = ALIGN(md_size_sect, BM_SECT_PER_EXT);
@@ -552,7 +555,7 @@ STATIC void drbd_md_set_sector_offsets(struct drbd_conf *mdev,
 
 		/* plus the "drbd meta data super block",
 		 * and the activity log; */
-		md_size_sect += MD_BM_OFFSET;
+		md_size_sect += MD_AL_OFFSET + al_size_sect;
 
 		bdev->md.md_size_sect = md_size_sect;
 		/* bitmap offset is adjusted by 'super' block size */
@@ -764,15 +767,23 @@ STATIC int drbd_check_al_size(struct drbd_conf *mdev)
 {
 	struct lru_cache *n, *t;
 	struct lc_element *e;
+	enum lc_policy policy;
 	unsigned int in_use;
 	int i;
 
 	ERR_IF(mdev->sync_conf.al_extents < 7)
 		mdev->sync_conf.al_extents = 127;
 
+	policy = mdev->sync_conf.al_replacement == ALR_2Q ?
+		LC_POLICY_2Q : LC_POLICY_LRU;
+
 	if (mdev->act_log &&
-	    mdev->act_log->nr_elements == mdev->sync_conf.al_extents)
+	    mdev->act_log->nr_elements == mdev->sync_conf.al_extents) {
+		spin_lock_irq(&mdev->al_lock);
+		lc_set_policy(mdev->act_log, policy);
+		spin_unlock_irq(&mdev->al_lock);
 		return 0;
+	}
 
 	in_use = 0;
 	t = mdev->act_log;
@@ -783,26 +794,29 @@ STATIC int drbd_check_al_size(struct drbd_conf *mdev)
 		dev_err(DEV, "Cannot allocate act_log lru!\n");
 		return -ENOMEM;
 	}
+	lc_set_policy(n, policy);
 	spin_lock_irq(&mdev->al_lock);
 	if (t) {
 		for (i = 0; i < t->nr_elements; i++) {
 			e = lc_element_by_index(t, i);
-			if (e->refcnt)
+			if (atomic_read(&e->refcnt))
 				dev_err(DEV, "refcnt(%d)==%d\n",
-				    e->lc_number, e->refcnt);
-			in_use += e->refcnt;
+				    e->lc_number, atomic_read(&e->refcnt));
+			in_use += atomic_read(&e->refcnt);
 		}
 	}
 	if (!in_use)
-		mdev->act_log = n;
+		rcu_assign_pointer(mdev->act_log, n);
 	spin_unlock_irq(&mdev->al_lock);
 	if (in_use) {
 		dev_err(DEV, "Activity log still in use!\n");
 		lc_destroy(n);
 		return -EBUSY;
-	} else {
-		if (t)
-			lc_destroy(t);
+	} else if (t) {
+		/* lockless lookups in _al_get_hot() and al_stream_detect()
+		 * may still walk the hash slots of the old one */
+		synchronize_rcu();
+		lc_destroy(t);
 	}
 	drbd_md_mark_dirty(mdev); /* we changed mdev->act_log->nr_elemens */
 	return 0;
@@ -953,6 +967,7 @@ STATIC int drbd_nl_disk_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp
 	enum drbd_state_rv rv;
 	int cp_discovered = 0;
 	int logical_block_size;
+	int i;
 
 	drbd_reconfig_start(mdev);
 
@@ -1125,16 +1140,18 @@ STATIC int drbd_nl_disk_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp
 		logical_block_size = MD_SECTOR_SIZE;
 
 	if (logical_block_size != MD_SECTOR_SIZE) {
-		if (!mdev->md_io_tmpp) {
-			struct page *page = alloc_page(GFP_NOIO);
-			if (!page)
-				goto force_diskless_dec;
-
+		if (!mdev->md_io[0].tmpp) {
 			dev_warn(DEV, "Meta data's bdev logical_block_size = %d != %d\n",
 			     logical_block_size, MD_SECTOR_SIZE);
 			dev_warn(DEV, "Workaround engaged (has performance impact).\n");
-
-			mdev->md_io_tmpp = page;
+		}
+		for (i = 0; i < DRBD_MD_IO_BUFFERS; i++) {
+			if (!mdev->md_io[i].tmpp) {
+				struct page *page = alloc_page(GFP_NOIO);
+				if (!page)
+					goto force_diskless_dec;
+				mdev->md_io[i].tmpp = page;
+			}
 		}
 	}
 
@@ -1149,6 +1166,21 @@ STATIC int drbd_nl_disk_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp
 	if (retcode != NO_ERROR)
 		goto force_diskless_dec;
 
+	/* With flexible internal meta data, the size of the activity log
+	 * is only known now, and it may have left less room for data. */
+	if (drbd_get_max_capacity(nbc) < nbc->dc.disk_size) {
+		dev_err(DEV, "max capacity %llu smaller than disk size %llu\n",
+			(unsigned long long) drbd_get_max_capacity(nbc),
+			(unsigned long long) nbc->dc.disk_size);
+		retcode = ERR_DISK_TOO_SMALL;
+		goto force_diskless_dec;
+	}
+	if (drbd_get_max_capacity(nbc) <
+	    drbd_get_capacity(mdev->this_bdev)) {
+		retcode = ERR_DISK_TOO_SMALL;
+		goto force_diskless_dec;
+	}
+
 	if (mdev->state.conn < C_CONNECTED &&
 	    mdev->state.role == R_PRIMARY &&
 	    (mdev->ed_uuid & ~((u64)1)) != (nbc->md.uuid[UI_CURRENT] & ~((u64)1))) {
@@ -1163,6 +1195,12 @@ STATIC int drbd_nl_disk_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp
 		retcode = ERR_NOMEM;
 		goto force_diskless_dec;
 	}
+	/* ... and use the extent size the meta data was created with */
+	if (mdev->al_ext_shift != drbd_md_al_ext_shift(nbc)) {
+		dev_info(DEV, "activity log extent size %uk\n",
+			 1U << (drbd_md_al_ext_shift(nbc) - 10));
+		mdev->al_ext_shift = drbd_md_al_ext_shift(nbc);
+	}
 
 	/* Prevent shrinking of consistent devices ! */
 	if (drbd_md_test_flag(nbc, MDF_CONSISTENT) &&
@@ -1213,10 +1251,10 @@ STATIC int drbd_nl_disk_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp
 		cp_discovered = 1;
 	}
 
-	mdev->send_cnt = 0;
-	mdev->recv_cnt = 0;
-	mdev->read_cnt = 0;
-	mdev->writ_cnt = 0;
+	drbd_stat_reset(mdev, STAT_SEND_SECT);
+	drbd_stat_reset(mdev, STAT_RECV_SECT);
+	drbd_stat_reset(mdev, STAT_READ_SECT);
+	drbd_stat_reset(mdev, STAT_WRIT_SECT);
 
 	drbd_reconsider_max_bio_size(mdev);
 
@@ -1374,7 +1412,8 @@ STATIC int drbd_nl_detach(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp,
 			  struct drbd_nl_cfg_reply *reply)
 {
 	enum drbd_ret_code retcode;
-	int ret;
+	int ret, i;
+	void *md_bufs[DRBD_MD_IO_BUFFERS];
 	struct detach dt = {};
 
 	if (!detach_from_tags(mdev, nlp->tag_list, &dt)) {
@@ -1390,9 +1429,13 @@ STATIC int drbd_nl_detach(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp,
 	}
 
 	drbd_suspend_io(mdev); /* so no-one is stuck in drbd_al_begin_io */
-	drbd_md_get_buffer(mdev); /* make sure there is no in-flight meta-data IO */
+	/* make sure there is no in-flight meta-data IO */
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++)
+		md_bufs[i] = drbd_md_get_buffer(mdev);
 	retcode = drbd_request_state(mdev, NS(disk, D_FAILED));
-	drbd_md_put_buffer(mdev);
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++)
+		if (md_bufs[i])
+			drbd_md_put_buffer(mdev, md_bufs[i]);
 	/* D_FAILED will transition to DISKLESS. */
 	ret = wait_event_interruptible(mdev->misc_wait,
 			mdev->state.disk != D_FAILED);
@@ -1423,6 +1466,9 @@ STATIC int drbd_nl_net_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp,
 	void *int_dig_out = NULL;
 	void *int_dig_in = NULL;
 	void *int_dig_vv = NULL;
+	void *compress_buf = NULL;
+	void *decompress_buf = NULL;
+	void *tmp;
 	struct sockaddr *new_my_addr, *new_peer_addr, *taken_addr;
 
 	drbd_reconfig_start(mdev);
@@ -1615,6 +1661,19 @@ STATIC int drbd_nl_net_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp,
 		}
 	}
 
+	if (new_conf->compress_data) {
+#ifdef DRBD_HAVE_LZO
+		compress_buf = vmalloc(DRBD_COMPRESS_BUF_SIZE);
+		decompress_buf = vmalloc(DRBD_DECOMPRESS_BUF_SIZE);
+		if (!compress_buf || !decompress_buf) {
+			retcode = ERR_NOMEM;
+			goto fail;
+		}
+#else
+		dev_warn(DEV, "compress-data: no LZO support in this kernel, ignored\n");
+#endif
+	}
+
 	if (!mdev->bitmap) {
 		if(drbd_bm_init(mdev)) {
 			retcode = ERR_NOMEM;
@@ -1631,8 +1690,8 @@ STATIC int drbd_nl_net_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp,
 	}
 	mdev->net_conf = new_conf;
 
-	mdev->send_cnt = 0;
-	mdev->recv_cnt = 0;
+	drbd_stat_reset(mdev, STAT_SEND_SECT);
+	drbd_stat_reset(mdev, STAT_RECV_SECT);
 
 	if (new_tl_hash) {
 		kfree(mdev->tl_hash);
@@ -1661,9 +1720,19 @@ STATIC int drbd_nl_net_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp,
 	mdev->int_dig_out=int_dig_out;
 	mdev->int_dig_in=int_dig_in;
 	mdev->int_dig_vv=int_dig_vv;
+	/* the old ones get vfree()d below, outside the spinlock */
+	tmp = mdev->compress_buf;
+	mdev->compress_buf = compress_buf;
+	compress_buf = tmp;
+	tmp = mdev->decompress_buf;
+	mdev->decompress_buf = decompress_buf;
+	decompress_buf = tmp;
 	retcode = _drbd_set_state(_NS(mdev, conn, C_UNCONNECTED), CS_VERBOSE, NULL);
 	spin_unlock_irq(&mdev->req_lock);
 
+	vfree(compress_buf);
+	vfree(decompress_buf);
+
 	drbd_kobject_uevent(mdev);
 	reply->ret_code = retcode;
 	drbd_reconfig_done(mdev);
@@ -1673,6 +1742,8 @@ fail:
 	kfree(int_dig_out);
 	kfree(int_dig_in);
 	kfree(int_dig_vv);
+	vfree(compress_buf);
+	vfree(decompress_buf);
 	crypto_free_hash(tfm);
 	crypto_free_hash(integrity_w_tfm);
 	crypto_free_hash(integrity_r_tfm);
@@ -1839,6 +1910,7 @@ STATIC int drbd_nl_syncer_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *n
 	cpumask_var_t new_cpu_mask;
 	int *rs_plan_s = NULL;
 	int fifo_size;
+	int al_max;
 
 	if (!zalloc_cpumask_var(&new_cpu_mask, GFP_KERNEL)) {
 		retcode = ERR_NOMEM;
@@ -1856,6 +1928,10 @@ STATIC int drbd_nl_syncer_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *n
 		sc.c_fill_target = DRBD_C_FILL_TARGET_DEF;
 		sc.c_max_rate = DRBD_C_MAX_RATE_DEF;
 		sc.c_min_rate = DRBD_C_MIN_RATE_DEF;
+		sc.read_balancing = DRBD_READ_BALANCING_DEF;
+		sc.c_lat_target = DRBD_C_LAT_TARGET_DEF;
+		sc.verify_partitions = DRBD_VERIFY_PARTITIONS_DEF;
+		sc.al_replacement = DRBD_AL_REPLACEMENT_DEF;
 	} else
 		memcpy(&sc, &mdev->sync_conf, sizeof(struct syncer_conf));
 
@@ -1926,12 +2002,15 @@ STATIC int drbd_nl_syncer_conf(struct drbd_conf *mdev, struct drbd_nl_cfg_req *n
 
 	ERR_IF (sc.rate < 1) sc.rate = 1;
 	ERR_IF (sc.al_extents < 7) sc.al_extents = 127; /* arbitrary minimum */
-#define AL_MAX ((MD_AL_MAX_SIZE-1) * AL_EXTENTS_PT)
-	if (sc.al_extents > AL_MAX) {
-		dev_err(DEV, "sc.al_extents > %d\n", AL_MAX);
-		sc.al_extents = AL_MAX;
+	al_max = (MD_AL_MAX_SIZE-1) * AL_EXTENTS_PT;
+	if (get_ldev(mdev)) {
+		al_max = drbd_al_extents_max(mdev->ldev);
+		put_ldev(mdev);
+	}
+	if (sc.al_extents > al_max) {
+		dev_err(DEV, "sc.al_extents > %d\n", al_max);
+		sc.al_extents = al_max;
 	}
-#undef AL_MAX
 
 	/* to avoid spurious errors when configuring minors before configuring
 	 * the minors they depend on: if necessary, first create the minor we
@@ -2227,6 +2306,46 @@ STATIC int drbd_nl_get_uuids(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp
 	return (int)((char *)tl - (char *)reply->tag_list);
 }
 
+STATIC int drbd_nl_get_latency(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp,
+			       struct drbd_nl_cfg_reply *reply)
+{
+	struct drbd_lat_hist *h;
+	unsigned short *tl;
+
+	tl = reply->tag_list;
+
+	h = kmalloc(sizeof(*h), GFP_KERNEL);
+	if (h) {
+		drbd_lat_sum(mdev, h);
+		tl = tl_add_blob(tl, T_lat_hist, h, sizeof(*h));
+		kfree(h);
+	}
+	put_unaligned(TT_END, tl++); /* Close the tag list */
+
+	return (int)((char *)tl - (char *)reply->tag_list);
+}
+
+STATIC int drbd_nl_get_stats(struct drbd_conf *mdev, struct drbd_nl_cfg_req *nlp,
+			     struct drbd_nl_cfg_reply *reply)
+{
+	struct drbd_stats *st;
+	unsigned short *tl;
+
+	tl = reply->tag_list;
+
+	st = kmalloc(sizeof(*st), GFP_KERNEL);
+	if (st) {
+		drbd_stats_sum(mdev, st);
+		tl = tl_add_blob(tl, T_stat_counters, st->cnt, sizeof(st->cnt));
+		tl = tl_add_blob(tl, T_stat_pkt_sent, st->pkt_sent, sizeof(st->pkt_sent));
+		tl = tl_add_blob(tl, T_stat_pkt_recv, st->pkt_recv, sizeof(st->pkt_recv));
+		kfree(st);
+	}
+	put_unaligned(TT_END, tl++); /* Close the tag list */
+
+	return (int)((char *)tl - (char *)reply->tag_list);
+}
+
 /**
  * drbd_nl_get_timeout_flag() - Used by drbdsetup to find out which timeout value to use
  * @mdev:	DRBD device.
@@ -2377,6 +2496,10 @@ static struct cn_handler_struct cnd_table[] = {
 				    sizeof(struct get_timeout_flag_tag_len_struct)},
 	[ P_start_ov ]		= { &drbd_nl_start_ov,		0 },
 	[ P_new_c_uuid ]	= { &drbd_nl_new_c_uuid,	0 },
+	[ P_get_latency ]	= { &drbd_nl_get_latency,
+				    sizeof(struct get_latency_tag_len_struct) },
+	[ P_get_stats ]		= { &drbd_nl_get_stats,
+				    sizeof(struct get_stats_tag_len_struct) },
 };
 
 #ifdef KERNEL_HAS_CN_SKB_PARMS
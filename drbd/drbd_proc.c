@@ -164,6 +164,25 @@ STATIC void drbd_syncer_progress(struct drbd_conf *mdev, struct seq_file *seq)
 	}
 	seq_printf(seq, " K/sec%s\n", stalled ? " (stalled)" : "");
 
+	if (mdev->sync_conf.c_min_rate || mdev->sync_conf.c_lat_target)
+		seq_printf(seq, "\tthrottle: hot: %llu cold: %llu\n",
+			   (unsigned long long)drbd_stat_read(mdev, STAT_RS_THROTTLED),
+			   (unsigned long long)drbd_stat_read(mdev, STAT_RS_PASSED));
+
+	if (mdev->sync_conf.c_lat_target &&
+	    (mdev->state.conn == C_SYNC_TARGET || mdev->state.conn == C_VERIFY_S)) {
+		/* state of the c-latency-target controller, see drbd_rs_auto_tune() */
+		seq_printf(seq, "\tlatency target: %u app: %u rtt: %u delay: %u local: %u us"
+			   " ceiling: ",
+			   mdev->sync_conf.c_lat_target * 100,
+			   drbd_lat_avg(mdev, LAT_APP),
+			   drbd_lat_avg(mdev, LAT_PING),
+			   drbd_rs_delay_us(mdev),
+			   drbd_lat_avg(mdev, LAT_LOCAL_WRITE));
+		seq_printf_with_thousands_grouping(seq, mdev->c_auto_rate);
+		seq_printf(seq, " K/sec\n");
+	}
+
 	if (proc_details >= 1) {
 		/* 64 bit:
 		 * we convert to sectors in the display below. */
@@ -186,6 +205,8 @@ STATIC void drbd_syncer_progress(struct drbd_conf *mdev, struct seq_file *seq)
 			(unsigned long long)bm_bits * BM_SECT_PER_BIT);
 		if (stop_sector != 0 && stop_sector != ULLONG_MAX)
 			seq_printf(seq, " stop sector: %llu", stop_sector);
+		if (mdev->state.conn == C_VERIFY_S && mdev->ov_nr_cursors > 1)
+			seq_printf(seq, " ranges: %d", mdev->ov_nr_cursors);
 		seq_printf(seq, "\n");
 	}
 }
@@ -200,6 +221,37 @@ STATIC void resync_dump_detail(struct seq_file *seq, struct lc_element *e)
 		   );
 }
 
+/* Only non-empty histograms and buckets are shown, as "<upper bound:count". */
+STATIC void drbd_lat_seq_show(struct seq_file *seq, struct drbd_conf *mdev)
+{
+	struct drbd_lat_hist *h;
+	u64 n;
+	int c, i;
+
+	h = kmalloc(sizeof(*h), GFP_KERNEL);
+	if (!h)
+		return;
+	drbd_lat_sum(mdev, h);
+
+	for (c = 0; c < LAT_CLASSES; c++) {
+		for (n = 0, i = 0; i < LAT_BUCKETS; i++)
+			n += h->bucket[c][i];
+		if (!n)
+			continue;
+		seq_printf(seq, "\tlat %s [us]:", drbd_lat_class_str(c));
+		for (i = 0; i < LAT_BUCKETS - 1; i++) {
+			if (h->bucket[c][i])
+				seq_printf(seq, " <%u:%llu", 1U << i,
+					   (unsigned long long)h->bucket[c][i]);
+		}
+		if (h->bucket[c][i])
+			seq_printf(seq, " >=%u:%llu", 1U << (i - 1),
+				   (unsigned long long)h->bucket[c][i]);
+		seq_printf(seq, "\n");
+	}
+	kfree(h);
+}
+
 STATIC int drbd_seq_show(struct seq_file *seq, void *v)
 {
 	int i, hole = 0;
@@ -259,7 +311,7 @@ STATIC int drbd_seq_show(struct seq_file *seq, void *v)
 
 			seq_printf(seq,
 			   "%2d: cs:%s ro:%s/%s ds:%s/%s %c %c%c%c%c%c%c\n"
-			   "    ns:%u nr:%u dw:%u dr:%u al:%u bm:%u "
+			   "    ns:%llu nr:%llu dw:%llu dr:%llu al:%llu bm:%llu "
 			   "lo:%d pe:%d ua:%d ap:%d ep:%d wo:%c",
 			   i, sn,
 			   drbd_role_str(mdev->state.role),
@@ -274,12 +326,12 @@ STATIC int drbd_seq_show(struct seq_file *seq, void *v)
 			   mdev->state.user_isp ? 'u' : '-',
 			   mdev->congestion_reason ?: '-',
 			   drbd_test_flag(mdev, AL_SUSPENDED) ? 's' : '-',
-			   mdev->send_cnt/2,
-			   mdev->recv_cnt/2,
-			   mdev->writ_cnt/2,
-			   mdev->read_cnt/2,
-			   mdev->al_writ_cnt,
-			   mdev->bm_writ_cnt,
+			   (unsigned long long)drbd_stat_read(mdev, STAT_SEND_SECT)/2,
+			   (unsigned long long)drbd_stat_read(mdev, STAT_RECV_SECT)/2,
+			   (unsigned long long)drbd_stat_read(mdev, STAT_WRIT_SECT)/2,
+			   (unsigned long long)drbd_stat_read(mdev, STAT_READ_SECT)/2,
+			   (unsigned long long)drbd_stat_read(mdev, STAT_AL_WRITES),
+			   (unsigned long long)drbd_stat_read(mdev, STAT_BM_WRITES),
 			   atomic_read(&mdev->local_cnt),
 			   atomic_read(&mdev->ap_pending_cnt) +
 			   atomic_read(&mdev->rs_pending_cnt),
@@ -301,9 +353,19 @@ STATIC int drbd_seq_show(struct seq_file *seq, void *v)
 		if (proc_details >= 1 && get_ldev(mdev)) {
 			lc_seq_printf_stats(seq, mdev->resync);
 			lc_seq_printf_stats(seq, mdev->act_log);
+			seq_printf(seq, "\tal: writes:%llu hits:%llu misses:%llu "
+				   "prefetches:%llu prefetch_hits:%llu\n",
+				   (unsigned long long)drbd_stat_read(mdev, STAT_AL_WRITES),
+				   (unsigned long long)drbd_stat_read(mdev, STAT_AL_HITS),
+				   (unsigned long long)drbd_stat_read(mdev, STAT_AL_MISSES),
+				   (unsigned long long)drbd_stat_read(mdev, STAT_AL_PREFETCHES),
+				   (unsigned long long)drbd_stat_read(mdev, STAT_AL_PREFETCH_HITS));
 			put_ldev(mdev);
 		}
 
+		if (proc_details >= 1)
+			drbd_lat_seq_show(seq, mdev);
+
 		if (proc_details >= 2) {
 			if (mdev->resync) {
 				lc_seq_dump_details(seq, mdev->resync, "rs_left",
@@ -0,0 +1,409 @@
+/*
+   drbd_readahead.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Copyright (C) 2011, LINBIT Information Technologies GmbH.
+
+   drbd is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   drbd is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with drbd; see the file COPYING.  If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+ */
+
+/*
+ * Reads we cannot serve locally (we are diskless, or SyncTarget and the
+ * area is not yet in sync) cost one round trip each. Once we see a
+ * sequential reader, we request the next DRBD_RA_WINDOW chunks from the
+ * peer ahead of time, and serve the reader from those.
+ *
+ * Consistency:
+ *  - Every local WRITE invalidates overlapping entries, within the same
+ *    req_lock section that registers it in the tl_hash.
+ *  - We do not request a chunk while a write to it is still in the tl_hash,
+ *    the peer may not have written it yet.
+ *  - We bypass the cache while the peer is Primary, and drop it when the
+ *    peer gets promoted, see __drbd_set_state().
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/drbd.h>
+#include "drbd_int.h"
+#include "drbd_req.h"
+
+/* only look at the cache if the peer can serve us, and does not write */
+static int ra_possible(struct drbd_conf *mdev)
+{
+	union drbd_state s = mdev->state;
+
+	return s.conn >= C_CONNECTED && s.pdsk >= D_UP_TO_DATE &&
+		s.peer != R_PRIMARY && mdev->agreed_pro_version >= 95;
+}
+
+static struct drbd_ra_entry *_ra_find(struct drbd_conf *mdev, sector_t chunk)
+{
+	struct drbd_ra_entry *e;
+
+	for (e = mdev->ra_cache; e < mdev->ra_cache + DRBD_RA_ENTRIES; e++)
+		if (e->state != RA_EMPTY && e->sector == chunk)
+			return e;
+	return NULL;
+}
+
+/* Prefer empty entries, then those the reader has already passed,
+ * then the least recently used one. */
+static struct drbd_ra_entry *_ra_victim(struct drbd_conf *mdev, sector_t reader)
+{
+	struct drbd_ra_entry *e, *victim = NULL;
+
+	for (e = mdev->ra_cache; e < mdev->ra_cache + DRBD_RA_ENTRIES; e++) {
+		if (e->queued || e->users || e->state == RA_PENDING)
+			continue;
+		if (e->state == RA_EMPTY || e->stale)
+			return e;
+		if (e->sector + DRBD_RA_CHUNK_SECT <= reader)
+			return e;
+		if (!victim || time_before(e->used, victim->used))
+			victim = e;
+	}
+	return victim;
+}
+
+/* A write to this chunk not yet acknowledged by the peer? */
+static int _ra_write_in_flight(struct drbd_conf *mdev, sector_t chunk, int size)
+{
+	struct drbd_request *i;
+	struct hlist_node *n;
+
+	if (mdev->tl_hash_s == 0)
+		return 1;
+	hlist_for_each_entry(i, n, tl_hash_slot(mdev, chunk), collision)
+		if (overlaps(i->sector, i->size, chunk, size))
+			return 1;
+	return 0;
+}
+
+static void _ra_issue(struct drbd_conf *mdev)
+{
+	sector_t capacity = drbd_get_capacity(mdev->this_bdev);
+	sector_t chunk = mdev->ra_next & ~((sector_t)DRBD_RA_CHUNK_SECT - 1);
+	struct drbd_ra_entry *e;
+	int n, size;
+
+	for (n = 0; n < DRBD_RA_WINDOW; n++, chunk += DRBD_RA_CHUNK_SECT) {
+		if (chunk >= capacity)
+			break;
+		if (_ra_find(mdev, chunk))
+			continue;
+		size = min_t(sector_t, DRBD_RA_CHUNK_SECT, capacity - chunk) << 9;
+		if (_ra_write_in_flight(mdev, chunk, size))
+			continue;
+		e = _ra_victim(mdev, mdev->ra_next);
+		if (!e)
+			break;
+
+		e->sector = chunk;
+		e->size = size;
+		e->state = RA_PENDING;
+		e->stale = 0;
+		e->queued = 1;
+		e->used = mdev->ra_clock;
+		e->w.cb = w_send_ra_req;
+		drbd_queue_work(&mdev->data.work, &e->w);
+		drbd_stat_add(mdev, STAT_RA_REQ_BYTES, size);
+	}
+}
+
+static int ra_settled(struct drbd_conf *mdev, struct drbd_ra_entry *e, sector_t chunk)
+{
+	int settled;
+
+	spin_lock_irq(&mdev->req_lock);
+	settled = e->state != RA_PENDING || e->sector != chunk || e->stale ||
+		!ra_possible(mdev);
+	spin_unlock_irq(&mdev->req_lock);
+	return settled;
+}
+
+static void ra_copy_to_bio(struct drbd_ra_entry *e, struct bio *bio)
+{
+	unsigned int off = (bio->bi_sector - e->sector) << 9;
+	struct bio_vec *bvec;
+	unsigned int len, done;
+	void *dst;
+	int i;
+
+	bio_for_each_segment(bvec, bio, i) {
+		dst = kmap(bvec->bv_page) + bvec->bv_offset;
+		for (done = 0; done < bvec->bv_len; done += len, off += len) {
+			len = min_t(unsigned int, bvec->bv_len - done,
+				    PAGE_SIZE - (off & ~PAGE_MASK));
+			memcpy(dst + done, page_address(e->pages[off >> PAGE_SHIFT]) +
+			       (off & ~PAGE_MASK), len);
+		}
+		kunmap(bvec->bv_page);
+	}
+}
+
+/**
+ * drbd_ra_read() - Serve a READ that would go to the peer from the readahead cache
+ * @bio:	READ or READA bio, not crossing a DRBD_RA_CHUNK boundary.
+ *
+ * Also feeds the sequential read detector, which may request the next
+ * chunks from the peer. Waits for a chunk that is already on its way.
+ * Returns 1 if the bio was filled in, 0 if the caller has to send it.
+ */
+int drbd_ra_read(struct drbd_conf *mdev, struct bio *bio)
+{
+	const sector_t sector = bio->bi_sector;
+	const sector_t chunk = sector & ~((sector_t)DRBD_RA_CHUNK_SECT - 1);
+	struct drbd_ra_entry *e;
+
+	spin_lock_irq(&mdev->req_lock);
+	if (!ra_possible(mdev)) {
+		mdev->ra_seq = 0;
+		spin_unlock_irq(&mdev->req_lock);
+		return 0;
+	}
+	if (sector == mdev->ra_next)
+		mdev->ra_seq++;
+	else
+		mdev->ra_seq = 0;
+	mdev->ra_next = sector + (bio->bi_size >> 9);
+	mdev->ra_clock++;
+	if (mdev->ra_seq >= DRBD_RA_TRIGGER)
+		_ra_issue(mdev);
+
+	for (;;) {
+		e = _ra_find(mdev, chunk);
+		if (!e || e->stale || e->queued || !ra_possible(mdev))
+			break;
+		if (e->state == RA_VALID) {
+			e->users++;
+			e->used = mdev->ra_clock;
+			spin_unlock_irq(&mdev->req_lock);
+
+			ra_copy_to_bio(e, bio);
+			drbd_stat_add(mdev, STAT_RA_HIT_BYTES, bio->bi_size);
+
+			spin_lock_irq(&mdev->req_lock);
+			if (--e->users == 0 && e->stale)
+				e->state = RA_EMPTY;
+			spin_unlock_irq(&mdev->req_lock);
+			return 1;
+		}
+		/* RA_PENDING and already sent. The reply, or
+		 * drbd_disconnect() wakes us. */
+		spin_unlock_irq(&mdev->req_lock);
+		wait_event(mdev->ra_wait, ra_settled(mdev, e, chunk));
+		spin_lock_irq(&mdev->req_lock);
+	}
+	spin_unlock_irq(&mdev->req_lock);
+	return 0;
+}
+
+static void _ra_invalidate_entry(struct drbd_ra_entry *e)
+{
+	e->stale = 1;
+	if (e->state == RA_VALID && !e->users)
+		e->state = RA_EMPTY;
+}
+
+/* called with req_lock held, for each local WRITE */
+void _drbd_ra_invalidate(struct drbd_conf *mdev, sector_t sector, int size)
+{
+	struct drbd_ra_entry *e;
+
+	for (e = mdev->ra_cache; e < mdev->ra_cache + DRBD_RA_ENTRIES; e++)
+		if (e->state != RA_EMPTY && overlaps(e->sector, e->size, sector, size))
+			_ra_invalidate_entry(e);
+}
+
+/* called with req_lock held, when the peer gets promoted */
+void _drbd_ra_invalidate_all(struct drbd_conf *mdev)
+{
+	struct drbd_ra_entry *e;
+
+	for (e = mdev->ra_cache; e < mdev->ra_cache + DRBD_RA_ENTRIES; e++)
+		if (e->state != RA_EMPTY)
+			_ra_invalidate_entry(e);
+	mdev->ra_seq = 0;
+}
+
+/**
+ * drbd_ra_clear() - Forget about all chunks after the connection is gone
+ *
+ * Called from drbd_disconnect(), after the worker queue has been flushed,
+ * so no replies are to be expected, and w_send_ra_req() is not running.
+ * Releases the pages of all entries not currently read from.
+ */
+void drbd_ra_clear(struct drbd_conf *mdev)
+{
+	struct drbd_ra_entry *e;
+	int i;
+
+	spin_lock_irq(&mdev->req_lock);
+	for (e = mdev->ra_cache; e < mdev->ra_cache + DRBD_RA_ENTRIES; e++) {
+		if (e->users || e->queued) {
+			e->stale = 1;
+			continue;
+		}
+		e->state = RA_EMPTY;
+		for (i = 0; i < DRBD_RA_CHUNK_PAGES; i++) {
+			if (e->pages[i])
+				__free_page(e->pages[i]);
+			e->pages[i] = NULL;
+		}
+	}
+	mdev->ra_seq = 0;
+	spin_unlock_irq(&mdev->req_lock);
+	wake_up(&mdev->ra_wait);
+}
+
+/* from drbd_delete_device(), nobody uses the device anymore */
+void drbd_ra_free(struct drbd_conf *mdev)
+{
+	struct drbd_ra_entry *e;
+	int i;
+
+	for (e = mdev->ra_cache; e < mdev->ra_cache + DRBD_RA_ENTRIES; e++)
+		for (i = 0; i < DRBD_RA_CHUNK_PAGES; i++)
+			if (e->pages[i])
+				__free_page(e->pages[i]);
+}
+
+/* The block_id of a speculative P_DATA_REQUEST is the address of its entry */
+struct drbd_ra_entry *drbd_ra_id_to_entry(struct drbd_conf *mdev, u64 id)
+{
+	unsigned long base = (unsigned long)mdev->ra_cache;
+	unsigned long p = (unsigned long)id;
+
+	if ((u64)p != id || p < base || p >= base + sizeof(mdev->ra_cache))
+		return NULL;
+	if ((p - base) % sizeof(struct drbd_ra_entry))
+		return NULL;
+	return (struct drbd_ra_entry *)p;
+}
+
+/* called by the worker, or on cancel from drbd_disconnect() */
+int w_send_ra_req(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
+{
+	struct drbd_ra_entry *e = container_of(w, struct drbd_ra_entry, w);
+	int i, ok = 1;
+
+	spin_lock_irq(&mdev->req_lock);
+	e->queued = 0;
+	if (e->stale || mdev->state.conn < C_CONNECTED)
+		cancel = 1;
+	spin_unlock_irq(&mdev->req_lock);
+
+	for (i = 0; !cancel && i < DIV_ROUND_UP(e->size, PAGE_SIZE); i++) {
+		if (!e->pages[i])
+			e->pages[i] = alloc_page(GFP_NOIO | __GFP_NOWARN);
+		if (!e->pages[i])
+			cancel = 1;
+	}
+
+	if (!cancel)
+		ok = drbd_send_drequest(mdev, P_DATA_REQUEST, e->sector, e->size,
+					(unsigned long)e);
+	if (cancel || !ok) {
+		spin_lock_irq(&mdev->req_lock);
+		e->state = RA_EMPTY;
+		spin_unlock_irq(&mdev->req_lock);
+		wake_up(&mdev->ra_wait);
+	}
+	/* a failed send is noticed by the receiver or asender soon enough */
+	return 1;
+}
+
+/* receiver: P_DATA_REPLY for one of our speculative requests */
+int drbd_ra_receive(struct drbd_conf *mdev, struct drbd_ra_entry *e,
+		    sector_t sector, int data_size)
+{
+	void *dig_in = mdev->int_dig_in;
+	void *dig_vv = mdev->int_dig_vv;
+	struct drbd_digest d;
+	int dgs, rr, i, len, ok;
+
+	spin_lock_irq(&mdev->req_lock);
+	ok = e->state == RA_PENDING && e->sector == sector;
+	spin_unlock_irq(&mdev->req_lock);
+	if (!ok) {
+		dev_err(DEV, "Got a corrupt block_id/sector pair(ra).\n");
+		return false;
+	}
+
+	dgs = (mdev->agreed_pro_version >= 87 && mdev->integrity_r_tfm) ?
+		crypto_hash_digestsize(mdev->integrity_r_tfm) : 0;
+
+	if (dgs) {
+		rr = drbd_recv(mdev, dig_in, dgs);
+		if (rr != dgs) {
+			if (!signal_pending(current))
+				dev_warn(DEV,
+					"short read receiving data reply digest: read %d expected %d\n",
+					rr, dgs);
+			return false;
+		}
+	}
+
+	data_size -= dgs;
+	ERR_IF(data_size != e->size) return false;
+
+	drbd_stat_add(mdev, STAT_RECV_SECT, data_size>>9);
+
+	if (dgs)
+		drbd_digest_init(&d, mdev->integrity_r_tfm);
+	for (i = 0; data_size; i++) {
+		len = min_t(int, data_size, PAGE_SIZE);
+		rr = drbd_recv(mdev, page_address(e->pages[i]), len);
+		if (rr != len) {
+			if (!signal_pending(current))
+				dev_warn(DEV, "short read receiving data reply: "
+					"read %d expected %d\n", rr, len);
+			return false;
+		}
+		if (dgs)
+			drbd_digest_page(&d, e->pages[i], 0, len);
+		data_size -= len;
+	}
+	if (dgs) {
+		drbd_digest_final(&d, dig_vv);
+		if (memcmp(dig_in, dig_vv, dgs)) {
+			dev_err(DEV, "Digest integrity check FAILED. Broken NICs?\n");
+			return false;
+		}
+	}
+
+	spin_lock_irq(&mdev->req_lock);
+	if (e->stale)
+		e->state = RA_EMPTY;
+	else
+		e->state = RA_VALID;
+	spin_unlock_irq(&mdev->req_lock);
+	wake_up(&mdev->ra_wait);
+
+	return true;
+}
+
+/* asender: the peer could not read that chunk */
+void drbd_ra_neg_reply(struct drbd_conf *mdev, struct drbd_ra_entry *e, sector_t sector)
+{
+	spin_lock_irq(&mdev->req_lock);
+	if (e->state == RA_PENDING && e->sector == sector)
+		e->state = RA_EMPTY;
+	spin_unlock_irq(&mdev->req_lock);
+	wake_up(&mdev->ra_wait);
+}
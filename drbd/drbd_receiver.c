@@ -402,12 +402,84 @@ struct drbd_epoch_entry *drbd_alloc_ee(struct drbd_conf *mdev,
 	return NULL;
 }
 
+/**
+ * drbd_alloc_send_ee() - Allocate an epoch entry to snapshot outgoing data into
+ * @mdev:	DRBD device.
+ * @id:		block id.
+ * @sector:	sector.
+ * @data_size:	size of the payload.
+ *
+ * Used by the worker while it holds the data socket. It must not wait for
+ * pages there: those it would wait for may well be resync replies queued
+ * for that same worker to send. So this never sleeps, and returns NULL
+ * instead; the caller then sends from the bio or epoch entry it has.
+ *
+ * The pages do not count against the max_buffers of the receiver, but
+ * go to pp_in_use_by_net right away, which we keep below max_buffers
+ * on its own. Whatever frees an ee knows about EE_SEND_BUFFER.
+ */
+struct drbd_epoch_entry *drbd_alloc_send_ee(struct drbd_conf *mdev,
+		u64 id, sector_t sector, unsigned int data_size)
+{
+	struct drbd_epoch_entry *e;
+	struct page *page = NULL;
+	unsigned nr_pages = (data_size + PAGE_SIZE -1) >> PAGE_SHIFT;
+
+	if (drbd_insert_fault(mdev, DRBD_FAULT_AL_EE))
+		return NULL;
+
+	if (atomic_read(&mdev->pp_in_use_by_net) + nr_pages > mdev->net_conf->max_buffers)
+		return NULL;
+
+	e = mempool_alloc(drbd_ee_mempool, GFP_NOWAIT | __GFP_NOWARN);
+	if (!e)
+		return NULL;
+
+	if (data_size) {
+		page = drbd_pp_first_pages_or_try_alloc(mdev, nr_pages);
+		if (!page) {
+			mempool_free(e, drbd_ee_mempool);
+			return NULL;
+		}
+		atomic_add(nr_pages, &mdev->pp_in_use_by_net);
+	}
+
+	INIT_HLIST_NODE(&e->collision);
+	e->epoch = NULL;
+	e->mdev = mdev;
+	e->pages = page;
+	atomic_set(&e->pending_bios, 0);
+	e->size = data_size;
+	e->flags = EE_SEND_BUFFER;
+	e->sector = sector;
+	e->block_id = id;
+
+	trace_drbd_ee(mdev, e, "allocated");
+	return e;
+}
+
+/* gives back the pages of @e beyond what its reduced e->size needs */
+void drbd_ee_trim_pages(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
+{
+	struct page *page = e->pages;
+	struct page *tail;
+	int n = (e->size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	if (!page || !n)
+		return;
+	while (--n)
+		page = page_chain_next(page);
+	tail = page_chain_next(page);
+	set_page_private(page, 0);
+	drbd_pp_free(mdev, tail, !!(e->flags & EE_SEND_BUFFER));
+}
+
 void drbd_free_some_ee(struct drbd_conf *mdev, struct drbd_epoch_entry *e, int is_net)
 {
 	trace_drbd_ee(mdev, e, "freed");
 	if (e->flags & EE_HAS_DIGEST)
 		kfree(e->digest);
-	drbd_pp_free(mdev, e->pages, is_net);
+	drbd_pp_free(mdev, e->pages, is_net || (e->flags & EE_SEND_BUFFER));
 	D_ASSERT(atomic_read(&e->pending_bios) == 0);
 	D_ASSERT(hlist_unhashed(&e->collision));
 	mempool_free(e, drbd_ee_mempool);
@@ -588,6 +660,9 @@ STATIC int drbd_recv(struct drbd_conf *mdev, void *buf, size_t size)
 	rv = sock_recvmsg(mdev->data.socket, &msg, size, msg.msg_flags);
 	set_fs(oldfs);
 
+	if (rv > 0)
+		drbd_stat_add(mdev, STAT_DATA_RECV_BYTES, rv);
+
 	if (rv < 0) {
 		if (rv == -ECONNRESET)
 			dev_info(DEV, "sock was reset by peer\n");
@@ -1031,6 +1106,7 @@ STATIC int drbd_recv_header(struct drbd_conf *mdev, enum drbd_packets *cmd, unsi
 		return false;
 	}
 	mdev->last_received = jiffies;
+	drbd_stat_packet(mdev, 0, *cmd);
 
 	return true;
 }
@@ -1040,6 +1116,7 @@ STATIC enum finish_epoch drbd_flush_after_epoch(struct drbd_conf *mdev, struct d
 	int rv;
 
 	if (mdev->write_ordering >= WO_bdev_flush && get_ldev(mdev)) {
+		drbd_stat_add(mdev, STAT_FLUSHES, 1);
 		rv = blkdev_issue_flush(mdev->ldev->backing_bdev, GFP_NOIO,
 					NULL);
 		if (rv) {
@@ -1469,14 +1546,111 @@ STATIC int receive_Barrier(struct drbd_conf *mdev, enum drbd_packets cmd, unsign
 	return true;
 }
 
+/* DP_COMPRESSED: the payload starts with the uncompressed size. Receives
+ * that, and turns *data_size into digest plus uncompressed size, which is
+ * what the rest of the receive path expects. *wire_size is set to what is
+ * still to be read from the socket, 0 if the payload is not compressed. */
+STATIC int recv_dp_size(struct drbd_conf *mdev, struct p_data *p,
+			unsigned int *data_size, unsigned int *wire_size)
+{
+	__be32 raw_size;
+	int dgs;
+
+	*wire_size = 0;
+	/* P_RS_DATA_REPLY of older peers has garbage in dp_flags */
+	if (!drbd_test_flag(mdev, COMPRESS_DATA) ||
+	    !(be32_to_cpu(p->dp_flags) & DP_COMPRESSED))
+		return true;
+
+	dgs = (mdev->agreed_pro_version >= 87 && mdev->integrity_r_tfm) ?
+		crypto_hash_digestsize(mdev->integrity_r_tfm) : 0;
+	ERR_IF(*data_size < sizeof(raw_size) + dgs) return false;
+	if (drbd_recv(mdev, &raw_size, sizeof(raw_size)) != sizeof(raw_size))
+		return false;
+
+	*wire_size = *data_size - sizeof(raw_size);
+	*data_size = dgs + be32_to_cpu(raw_size);
+	return true;
+}
+
+#ifdef DRBD_HAVE_LZO
+/* receives the DP_COMPRESSED chunks, see drbd_compress_ee() */
+STATIC int recv_compressed(struct drbd_conf *mdev, struct drbd_epoch_entry *e,
+			   unsigned int wire_size)
+{
+	struct page *page = e->pages;
+	unsigned int left = e->size;
+	u64 ns = 0;
+
+	page_chain_for_each(page) {
+		unsigned int offset;
+
+		for (offset = 0; offset < PAGE_SIZE && left; offset += DRBD_COMPRESS_CHUNK) {
+			unsigned int clen = min_t(unsigned int, left, DRBD_COMPRESS_CHUNK);
+			unsigned int len;
+			size_t dlen = clen;
+			__be16 hdr;
+			u64 start;
+			int err;
+
+			ERR_IF(wire_size < sizeof(hdr)) return false;
+			if (drbd_recv(mdev, &hdr, sizeof(hdr)) != sizeof(hdr))
+				return false;
+			wire_size -= sizeof(hdr);
+			len = be16_to_cpu(hdr) & ~DRBD_CHUNK_RAW;
+			ERR_IF(len > wire_size) return false;
+
+			if (be16_to_cpu(hdr) & DRBD_CHUNK_RAW) {
+				ERR_IF(len != clen) return false;
+				err = drbd_recv(mdev, kmap(page) + offset, len);
+				kunmap(page);
+				if (err != len)
+					return false;
+			} else {
+				ERR_IF(len > DRBD_DECOMPRESS_BUF_SIZE) return false;
+				if (drbd_recv(mdev, mdev->decompress_buf, len) != len)
+					return false;
+				start = drbd_lat_now();
+				err = lzo1x_decompress_safe(mdev->decompress_buf, len,
+							    kmap(page) + offset, &dlen);
+				kunmap(page);
+				ns += drbd_lat_now() - start;
+				if (err != LZO_E_OK || dlen != clen) {
+					dev_err(DEV, "decompression failed: %d, %u of %u bytes\n",
+						err, (unsigned)dlen, clen);
+					return false;
+				}
+			}
+			wire_size -= len;
+			left -= clen;
+		}
+		if (!left)
+			break;
+	}
+	drbd_stat_add(mdev, STAT_DECOMPRESS_NS, ns);
+	ERR_IF(wire_size) return false;
+	return true;
+}
+#else
+STATIC int recv_compressed(struct drbd_conf *mdev, struct drbd_epoch_entry *e,
+			   unsigned int wire_size)
+{
+	/* COMPRESS_DATA is never negotiated */
+	return false;
+}
+#endif
+
 /* used from receive_RSDataReply (recv_resync_read)
- * and from receive_Data */
+ * and from receive_Data.
+ * @wire_size: see recv_dp_size() */
 STATIC struct drbd_epoch_entry *
-read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size) __must_hold(local)
+read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size,
+	      unsigned int wire_size) __must_hold(local)
 {
 	const sector_t capacity = drbd_get_capacity(mdev->this_bdev);
 	struct drbd_epoch_entry *e;
 	struct page *page;
+	struct drbd_digest d;
 	int dgs, ds, rr;
 	void *dig_in = mdev->int_dig_in;
 	void *dig_vv = mdev->int_dig_vv;
@@ -1521,6 +1695,21 @@ read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size) __
 	if (!data_size)
 		return e;
 
+	if (wire_size) {
+		if (!recv_compressed(mdev, e, wire_size - dgs)) {
+			drbd_free_ee(mdev, e);
+			return NULL;
+		}
+		if (dgs)
+			drbd_csum_ee(mdev, mdev->integrity_r_tfm, e, dig_vv);
+		goto check_digest;
+	}
+
+	/* Digest each page right after it came in from the socket,
+	 * while it is still cache hot, instead of in a second pass. */
+	if (dgs)
+		drbd_digest_init(&d, mdev->integrity_r_tfm);
+
 	ds = data_size;
 	page = e->pages;
 	page_chain_for_each(page) {
@@ -1539,11 +1728,15 @@ read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size) __
 				rr, len);
 			return NULL;
 		}
+		if (dgs)
+			drbd_digest_page(&d, page, 0, len);
 		ds -= rr;
 	}
 
+	if (dgs)
+		drbd_digest_final(&d, dig_vv);
+check_digest:
 	if (dgs) {
-		drbd_csum_ee(mdev, mdev->integrity_r_tfm, e, dig_vv);
 		if (memcmp(dig_in, dig_vv, dgs)) {
 			dev_err(DEV, "Digest integrity check FAILED: %llus +%u\n",
 				(unsigned long long)sector, data_size);
@@ -1553,7 +1746,7 @@ read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size) __
 			return NULL;
 		}
 	}
-	mdev->recv_cnt += data_size>>9;
+	drbd_stat_add(mdev, STAT_RECV_SECT, data_size>>9);
 	return e;
 }
 
@@ -1616,7 +1809,7 @@ STATIC int recv_dless_read(struct drbd_conf *mdev, struct drbd_request *req,
 
 	/* optimistically update recv_cnt.  if receiving fails below,
 	 * we disconnect anyways, and counters will be reset. */
-	mdev->recv_cnt += data_size>>9;
+	drbd_stat_add(mdev, STAT_RECV_SECT, data_size>>9);
 
 	bio = req->master_bio;
 	D_ASSERT(sector == bio->bi_sector);
@@ -1673,14 +1866,8 @@ STATIC int e_end_resync_block(struct drbd_conf *mdev, struct drbd_work *w, int u
 	return ok;
 }
 
-STATIC int recv_resync_read(struct drbd_conf *mdev, sector_t sector, int data_size) __releases(local)
+STATIC int submit_resync_ee(struct drbd_conf *mdev, struct drbd_epoch_entry *e) __releases(local)
 {
-	struct drbd_epoch_entry *e;
-
-	e = read_in_block(mdev, ID_SYNCER, sector, data_size);
-	if (!e)
-		goto fail;
-
 	dec_rs_pending(mdev);
 
 	inc_unacked(mdev);
@@ -1693,7 +1880,7 @@ STATIC int recv_resync_read(struct drbd_conf *mdev, sector_t sector, int data_si
 	list_add(&e->w.list, &mdev->sync_ee);
 	spin_unlock_irq(&mdev->req_lock);
 
-	atomic_add(data_size >> 9, &mdev->rs_sect_ev);
+	atomic_add(e->size >> 9, &mdev->rs_sect_ev);
 	if (drbd_submit_ee(mdev, e, WRITE, DRBD_FAULT_RS_WR) == 0)
 		return true;
 
@@ -1704,20 +1891,38 @@ STATIC int recv_resync_read(struct drbd_conf *mdev, sector_t sector, int data_si
 	spin_unlock_irq(&mdev->req_lock);
 
 	drbd_free_ee(mdev, e);
-fail:
 	put_ldev(mdev);
 	return false;
 }
 
+STATIC int recv_resync_read(struct drbd_conf *mdev, sector_t sector, int data_size,
+			    unsigned int wire_size) __releases(local)
+{
+	struct drbd_epoch_entry *e;
+
+	e = read_in_block(mdev, ID_SYNCER, sector, data_size, wire_size);
+	if (!e) {
+		put_ldev(mdev);
+		return false;
+	}
+	drbd_stat_add(mdev, STAT_RS_RECV_BYTES, e->size);
+	return submit_resync_ee(mdev, e);
+}
+
 STATIC int receive_DataReply(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned int data_size)
 {
 	struct drbd_request *req;
+	struct drbd_ra_entry *ra;
 	sector_t sector;
 	int ok;
 	struct p_data *p = &mdev->data.rbuf.data;
 
 	sector = be64_to_cpu(p->sector);
 
+	ra = drbd_ra_id_to_entry(mdev, p->block_id);
+	if (ra)
+		return drbd_ra_receive(mdev, ra, sector, data_size);
+
 	spin_lock_irq(&mdev->req_lock);
 	req = _ar_id_to_req(mdev, p->block_id, sector);
 	spin_unlock_irq(&mdev->req_lock);
@@ -1745,20 +1950,24 @@ STATIC int receive_RSDataReply(struct drbd_conf *mdev, enum drbd_packets cmd, un
 	sector_t sector;
 	int ok;
 	struct p_data *p = &mdev->data.rbuf.data;
+	unsigned int wire_size;
 
 	sector = be64_to_cpu(p->sector);
 	D_ASSERT(p->block_id == ID_SYNCER);
 
+	if (!recv_dp_size(mdev, p, &data_size, &wire_size))
+		return false;
+
 	if (get_ldev(mdev)) {
 		/* data is submitted to disk within recv_resync_read.
 		 * corresponding put_ldev done below on error,
 		 * or in drbd_endio_write_sec. */
-		ok = recv_resync_read(mdev, sector, data_size);
+		ok = recv_resync_read(mdev, sector, data_size, wire_size);
 	} else {
 		if (DRBD_ratelimit(5*HZ, 5))
 			dev_err(DEV, "Can not write resync data to local disk.\n");
 
-		ok = drbd_drain_block(mdev, data_size);
+		ok = drbd_drain_block(mdev, wire_size ?: data_size);
 
 		drbd_send_ack_dp(mdev, P_NEG_ACK, p, data_size);
 	}
@@ -1929,6 +2138,10 @@ STATIC int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned
 	struct p_data *p = &mdev->data.rbuf.data;
 	int rw = WRITE;
 	u32 dp_flags;
+	unsigned int wire_size;
+
+	if (!recv_dp_size(mdev, p, &data_size, &wire_size))
+		return false;
 
 	if (!get_ldev(mdev)) {
 		spin_lock(&mdev->peer_seq_lock);
@@ -1938,7 +2151,7 @@ STATIC int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned
 
 		drbd_send_ack_dp(mdev, P_NEG_ACK, p, data_size);
 		atomic_inc(&mdev->current_epoch->epoch_size);
-		return drbd_drain_block(mdev, data_size);
+		return drbd_drain_block(mdev, wire_size ?: data_size);
 	}
 
 	/* get_ldev(mdev) successful.
@@ -1947,7 +2160,7 @@ STATIC int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned
 	 * the end of this function. */
 
 	sector = be64_to_cpu(p->sector);
-	e = read_in_block(mdev, p->block_id, sector, data_size);
+	e = read_in_block(mdev, p->block_id, sector, data_size, wire_size);
 	if (!e) {
 		put_ldev(mdev);
 		return false;
@@ -2184,8 +2397,18 @@ out_interrupted:
 	return false;
 }
 
+/* Application requests are in flight, and on average take longer than
+ * c-latency-target. On the SyncTarget, drbd_rs_auto_tune() lowers the rate;
+ * this is what lets a SyncSource step aside as well. */
+STATIC bool drbd_rs_over_lat_target(struct drbd_conf *mdev)
+{
+	return mdev->sync_conf.c_lat_target && atomic_read(&mdev->ap_bio_cnt) &&
+		drbd_lat_avg(mdev, LAT_APP) > mdev->sync_conf.c_lat_target * 100;
+}
+
 /* We may throttle resync, if the lower device seems to be busy,
- * and current sync rate is above c_min_rate.
+ * and current sync rate is above c_min_rate, but only for resync extents
+ * currently used by the application.
  *
  * To decide whether or not the lower device is busy, we use a scheme similar
  * to MD RAID is_mddev_idle(): if the partition stats reveal "significant"
@@ -2197,21 +2420,15 @@ out_interrupted:
  */
 bool drbd_rs_should_slow_down(struct drbd_conf *mdev, sector_t sector)
 {
-	struct lc_element *tmp;
-	bool throttle = true;
+	bool throttle;
 
-	if (!drbd_rs_c_min_rate_throttle(mdev))
+	if (!drbd_rs_c_min_rate_throttle(mdev) && !drbd_rs_over_lat_target(mdev))
 		return false;
 
-	spin_lock_irq(&mdev->al_lock);
-	tmp = lc_find(mdev->resync, BM_SECT_TO_EXT(sector));
-	if (tmp) {
-		struct bm_extent *bm_ext = lc_entry(tmp, struct bm_extent, lce);
-		if (test_bit(BME_PRIORITY, &bm_ext->flags))
-			throttle = false;
-		/* Do not slow down if app IO is already waiting for this extent */
-	}
-	spin_unlock_irq(&mdev->al_lock);
+	/* Something is busy. Only step aside where the application
+	 * actually is, and keep going at full speed elsewhere. */
+	throttle = drbd_rs_extent_is_hot(mdev, BM_SECT_TO_EXT(sector));
+	drbd_stat_add(mdev, throttle ? STAT_RS_THROTTLED : STAT_RS_PASSED, 1);
 
 	return throttle;
 }
@@ -3000,10 +3217,19 @@ STATIC int receive_protocol(struct drbd_conf *mdev, enum drbd_packets cmd, unsig
 	p_want_lose = cf & CF_WANT_LOSE;
 
 	drbd_clear_flag(mdev, CONN_DRY_RUN);
+	drbd_clear_flag(mdev, COMPRESS_DATA);
 
 	if (cf & CF_DRY_RUN)
 		drbd_set_flag(mdev, CONN_DRY_RUN);
 
+	/* compress only if both sides asked for it, see drbd_send_protocol() */
+	if (mdev->net_conf->compress_data) {
+		if ((cf & CF_COMPRESS) && mdev->compress_buf)
+			drbd_set_flag(mdev, COMPRESS_DATA);
+		dev_info(DEV, "compress-data: %s\n",
+			 drbd_test_flag(mdev, COMPRESS_DATA) ? "on" : "not supported or disabled by peer");
+	}
+
 	if (p_proto != mdev->net_conf->wire_protocol) {
 		dev_err(DEV, "incompatible communication protocols\n");
 		goto disconnect;
@@ -3978,6 +4204,48 @@ STATIC int receive_UnplugRemote(struct drbd_conf *mdev, enum drbd_packets cmd, u
 	return true;
 }
 
+/* The resync source found the block to be all zero. Instead of the data,
+ * it only sent the range. We write zeroes, as if we had received them. */
+STATIC int receive_RSZeroes(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned int data_size)
+{
+	struct p_block_desc *p = &mdev->data.rbuf.block_desc;
+	struct drbd_epoch_entry *e;
+	struct page *page;
+	sector_t sector = be64_to_cpu(p->sector);
+	unsigned int size = be32_to_cpu(p->blksize);
+
+	ERR_IF(size == 0 || (size & 0x1ff)) return false;
+	ERR_IF(size > DRBD_MAX_BIO_SIZE) return false;
+
+	if (!get_ldev(mdev)) {
+		if (DRBD_ratelimit(5*HZ, 5))
+			dev_err(DEV, "Can not write resync data to local disk.\n");
+		drbd_send_ack_ex(mdev, P_NEG_ACK, sector, size, ID_SYNCER);
+		atomic_add(size >> 9, &mdev->rs_sect_in);
+		return true;
+	}
+
+	if (sector + (size>>9) > drbd_get_capacity(mdev->this_bdev)) {
+		dev_err(DEV, "resync zeroes beyond end of local disk: %llus +%u\n",
+			(unsigned long long)sector, size);
+		put_ldev(mdev);
+		return false;
+	}
+
+	e = drbd_alloc_ee(mdev, ID_SYNCER, sector, size, GFP_NOIO);
+	if (!e) {
+		put_ldev(mdev);
+		return false;
+	}
+	page = e->pages;
+	page_chain_for_each(page)
+		clear_highpage(page);
+
+	drbd_stat_add(mdev, STAT_RS_ZERO_BYTES, size);
+	atomic_add(size >> 9, &mdev->rs_sect_in);
+	return submit_resync_ee(mdev, e);
+}
+
 STATIC int receive_out_of_sync(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned int data_size)
 {
 	struct p_block_desc *p = &mdev->data.rbuf.block_desc;
@@ -4028,6 +4296,7 @@ static struct data_cmd drbd_cmd_handler[] = {
 	[P_CSUM_RS_REQUEST] = { 1, sizeof(struct p_block_req), receive_DataRequest },
 	[P_DELAY_PROBE]     = { 0, sizeof(struct p_delay_probe93), receive_skip },
 	[P_OUT_OF_SYNC]     = { 0, sizeof(struct p_block_desc), receive_out_of_sync },
+	[P_RS_ZEROES]       = { 0, sizeof(struct p_block_desc), receive_RSZeroes },
 	/* anything missing from this table is in
 	 * the asender_tbl, see get_asender_cmd */
 	[P_MAX_CMD]	    = { 0, 0, NULL },
@@ -4168,6 +4437,9 @@ STATIC void drbd_disconnect(struct drbd_conf *mdev)
 	drbd_thread_stop(&mdev->asender);
 	drbd_free_sock(mdev);
 
+	/* readers waiting for readahead replies that will not come */
+	wake_up(&mdev->ra_wait);
+
 	/* wait for current activity to cease. */
 	spin_lock_irq(&mdev->req_lock);
 	_drbd_wait_ee_list_empty(mdev, &mdev->active_ee);
@@ -4193,6 +4465,7 @@ STATIC void drbd_disconnect(struct drbd_conf *mdev)
 
 	/* make sure syncer is stopped and w_resume_next_sg queued */
 	del_timer_sync(&mdev->resync_timer);
+	del_timer_sync(&mdev->resync_finished_timer);
 	resync_timer_fn((unsigned long)mdev);
 
 	/* wait for all w_e_end_data_req, w_e_end_rsdata_req, w_send_barrier,
@@ -4200,6 +4473,8 @@ STATIC void drbd_disconnect(struct drbd_conf *mdev)
 	 * to be "canceled" */
 	drbd_flush_workqueue(mdev);
 
+	drbd_ra_clear(mdev);
+
 	/* This also does reclaim_net_ee().  If we do this too early, we might
 	 * miss some resync ee and pages.*/
 	drbd_process_done_ee(mdev);
@@ -4605,6 +4880,9 @@ STATIC int got_Ping(struct drbd_conf *mdev, struct p_header80 *h)
 
 STATIC int got_PingAck(struct drbd_conf *mdev, struct p_header80 *h)
 {
+	drbd_lat_account(mdev, LAT_PING, mdev->ping_sent_ns);
+	mdev->ping_sent_ns = 0;
+
 	/* restore idle timeout */
 	mdev->meta.socket->sk->sk_rcvtimeo = mdev->net_conf->ping_int*HZ;
 	if (!drbd_test_and_set_flag(mdev, GOT_PING_ACK))
@@ -4775,8 +5053,17 @@ STATIC int got_NegDReply(struct drbd_conf *mdev, struct p_header80 *h)
 {
 	struct p_block_ack *p = (struct p_block_ack *)h;
 	sector_t sector = be64_to_cpu(p->sector);
+	struct drbd_ra_entry *ra;
 
 	update_peer_seq(mdev, be32_to_cpu(p->seq_num));
+
+	ra = drbd_ra_id_to_entry(mdev, p->block_id);
+	if (ra) {
+		/* only speculative, the reader will ask again */
+		drbd_ra_neg_reply(mdev, ra, sector);
+		return true;
+	}
+
 	dev_err(DEV, "Got NegDReply; Sector %llus, len %u; Fail original request.\n",
 	    (unsigned long long)sector, be32_to_cpu(p->blksize));
 
@@ -4846,7 +5133,7 @@ STATIC int got_OVResult(struct drbd_conf *mdev, struct p_header80 *h)
 	if (be64_to_cpu(p->block_id) == ID_OUT_OF_SYNC)
 		drbd_ov_oos_found(mdev, sector, size);
 	else
-		ov_oos_print(mdev);
+		ov_oos_in_sync(mdev, sector);
 
 	if (!get_ldev(mdev))
 		return true;
@@ -4941,6 +5228,7 @@ int drbd_asender(struct drbd_thread *thi)
 	while (get_t_state(thi) == Running) {
 		drbd_thread_current_set_cpu(mdev);
 		if (drbd_test_and_clear_flag(mdev, SEND_PING)) {
+			mdev->ping_sent_ns = drbd_lat_now();
 			ERR_IF(!drbd_send_ping(mdev)) goto reconnect;
 			mdev->meta.socket->sk->sk_rcvtimeo =
 				mdev->net_conf->ping_timeo*HZ/10;
@@ -4993,6 +5281,7 @@ int drbd_asender(struct drbd_thread *thi)
 		 * rv == 0	 : "connection shut down by peer"
 		 */
 		if (likely(rv > 0)) {
+			drbd_stat_add(mdev, STAT_META_RECV_BYTES, rv);
 			received += rv;
 			buf	 += rv;
 		} else if (rv == 0) {
@@ -5051,6 +5340,7 @@ int drbd_asender(struct drbd_thread *thi)
 		if (received == expect) {
 			mdev->last_received = jiffies;
 			D_ASSERT(cmd != NULL);
+			drbd_stat_packet(mdev, 0, be16_to_cpu(h->command));
 			trace_drbd_packet(mdev, mdev->meta.socket, 1, (void *)h, __FILE__, __LINE__);
 			if (!cmd->process(mdev, h))
 				goto reconnect;
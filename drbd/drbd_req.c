@@ -305,6 +305,7 @@ void _req_may_be_done(struct drbd_request *req, struct bio_and_error *m)
 
 		/* Update disk stats */
 		_drbd_end_io_acct(mdev, req);
+		drbd_lat_account(mdev, LAT_APP, req->start_ns);
 
 		m->error = ok ? 0 : (error ?: -EIO);
 		m->bio = req->master_bio;
@@ -482,10 +483,11 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		break;
 
 	case completed_ok:
-		if (req->rq_state & RQ_WRITE)
-			mdev->writ_cnt += req->size>>9;
-		else
-			mdev->read_cnt += req->size>>9;
+		if (req->rq_state & RQ_WRITE) {
+			drbd_stat_add(mdev, STAT_WRIT_SECT, req->size>>9);
+			drbd_lat_account(mdev, LAT_LOCAL_WRITE, req->local_ns);
+		} else
+			drbd_stat_add(mdev, STAT_READ_SECT, req->size>>9);
 
 		req->rq_state |= (RQ_LOCAL_COMPLETED|RQ_LOCAL_OK);
 		req->rq_state &= ~RQ_LOCAL_PENDING;
@@ -705,6 +707,7 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		 * protocol != C */
 		req->rq_state |= RQ_NET_OK;
 		D_ASSERT(req->rq_state & RQ_NET_PENDING);
+		drbd_lat_account(mdev, LAT_PEER_ACK, req->net_ns);
 		dec_ap_pending(mdev);
 		atomic_sub(req->size>>9, &mdev->ap_in_flight);
 		req->rq_state &= ~RQ_NET_PENDING;
@@ -834,6 +837,51 @@ STATIC int drbd_may_do_local_read(struct drbd_conf *mdev, sector_t sector, int s
 	return 0 == drbd_bm_count_bits(mdev, sbnr, ebnr);
 }
 
+/* Only called for READs we could serve locally, while the peer has
+ * UpToDate data as well.  Returns true if the configured read-balancing
+ * policy wants this one to be served by the peer instead. */
+STATIC bool remote_due_to_read_balancing(struct drbd_conf *mdev, sector_t sector)
+{
+	enum drbd_read_balancing rbm = mdev->sync_conf.read_balancing;
+	struct request_queue *q;
+	int stripe_shift, proto;
+
+	/* With protocol A or B, a write is completed to the application
+	 * before the peer has it on disk.  Reading it back from the peer
+	 * right after that could return the old data. */
+	if (!get_net_conf(mdev))
+		return false;
+	proto = mdev->net_conf->wire_protocol;
+	put_net_conf(mdev);
+	if (proto != DRBD_PROT_C)
+		return false;
+
+	switch (rbm) {
+	case RB_CONGESTED_REMOTE:
+		q = bdev_get_queue(mdev->ldev->backing_bdev);
+		return bdi_read_congested(&q->backing_dev_info);
+	case RB_LEAST_PENDING:
+		/* application requests in flight, on either side */
+		return atomic_read(&mdev->ap_local_cnt) >
+			atomic_read(&mdev->ap_pending_cnt);
+	case RB_32K_STRIPING:  /* stripe_shift = 15 */
+	case RB_64K_STRIPING:
+	case RB_128K_STRIPING:
+	case RB_256K_STRIPING:
+	case RB_512K_STRIPING:
+	case RB_1M_STRIPING:   /* stripe_shift = 20 */
+		stripe_shift = (rbm - RB_32K_STRIPING + 15);
+		return (sector >> (stripe_shift - 9)) & 1;
+	case RB_ROUND_ROBIN:
+		return drbd_test_and_change_flag(mdev, READ_BALANCE_RR);
+	case RB_PREFER_REMOTE:
+		return true;
+	case RB_PREFER_LOCAL:
+	default:
+		return false;
+	}
+}
+
 STATIC void maybe_pull_ahead(struct drbd_conf *mdev)
 {
 	int congested = 0;
@@ -868,90 +916,31 @@ STATIC void maybe_pull_ahead(struct drbd_conf *mdev)
 	put_ldev(mdev);
 }
 
-STATIC int drbd_make_request_common(struct drbd_conf *mdev, struct bio *bio, unsigned long start_time)
+/**
+ * drbd_send_and_submit() - Second half of drbd_make_request_common()
+ * @mdev:	DRBD device.
+ * @req:	The request, holding its activity log extent, if it needs one.
+ * @local:	Whether to submit it to the local disk.
+ * @remote:	Whether it may go to the peer.
+ *
+ * Adds @req to the transfer log, queues it for the peer and submits it
+ * locally.  Also called by the worker for writes that had to wait for their
+ * activity log extent.  Returns 1 if the device got suspended in the mean
+ * time; nothing has been done then, and the caller still owns @req.
+ */
+STATIC int drbd_send_and_submit(struct drbd_conf *mdev, struct drbd_request *req,
+				int local, int remote)
 {
+	struct bio *bio = req->master_bio;
 	const int rw = bio_rw(bio);
 	const int is_flush = (bio->bi_rw & DRBD_REQ_FLUSH);
 	const int size = bio->bi_size;
-	const sector_t sector = bio->bi_sector;
+	const sector_t sector = req->sector;
 	struct drbd_tl_epoch *b = NULL;
-	struct drbd_request *req;
-	int local, remote, send_oos = 0;
+	int send_oos = 0;
 	int err = -EIO;
-	int ret = 0;
 	union drbd_state s;
 
-	/* allocate outside of all locks; */
-	req = drbd_req_new(mdev, bio);
-	if (!req) {
-		dec_ap_bio(mdev);
-		/* only pass the error to the upper layers.
-		 * if user cannot handle io errors, that's not our business. */
-		dev_err(DEV, "could not kmalloc() req\n");
-		bio_endio(bio, -ENOMEM);
-		return 0;
-	}
-	req->start_time = start_time;
-
-	trace_drbd_bio(mdev, "Rq", bio, 0, req);
-
-	local = get_ldev(mdev);
-	if (!local) {
-		bio_put(req->private_bio); /* or we get a bio leak */
-		req->private_bio = NULL;
-	}
-	if (rw == WRITE) {
-		/* Need to replicate writes.  Unless it is an empty flush,
-		 * which is better mapped to a DRBD P_BARRIER packet,
-		 * also for drbd wire protocol compatibility reasons. */
-		if (unlikely(size == 0))
-			/* The only size==0 bios we expect are empty flushes. */
-			D_ASSERT(is_flush);
-		remote = 1;
-	} else {
-		/* READ || READA */
-		if (local) {
-			if (!drbd_may_do_local_read(mdev, sector, size)) {
-				/* we could kick the syncer to
-				 * sync this extent asap, wait for
-				 * it, then continue locally.
-				 * Or just issue the request remotely.
-				 */
-				local = 0;
-				bio_put(req->private_bio);
-				req->private_bio = NULL;
-				put_ldev(mdev);
-			}
-		}
-		remote = !local && mdev->state.pdsk >= D_UP_TO_DATE;
-	}
-
-	/* If we have a disk, but a READA request is mapped to remote,
-	 * we are R_PRIMARY, D_INCONSISTENT, SyncTarget.
-	 * Just fail that READA request right here.
-	 *
-	 * THINK: maybe fail all READA when not local?
-	 *        or make this configurable...
-	 *        if network is slow, READA won't do any good.
-	 */
-	if (rw == READA && mdev->state.disk >= D_INCONSISTENT && !local) {
-		err = -EWOULDBLOCK;
-		goto fail_and_free_req;
-	}
-
-	/* For WRITES going to the local disk, grab a reference on the target
-	 * extent.  This waits for any resync activity in the corresponding
-	 * resync extent to finish, and, if necessary, pulls in the target
-	 * extent into the activity log, which involves further disk io because
-	 * of transactional on-disk meta data updates.
-	 * Empty flushes don't need to go into the activity log, they can only
-	 * flush data for pending writes which are already in there. */
-	if (rw == WRITE && local && size
-	&& !drbd_test_flag(mdev, AL_SUSPENDED)) {
-		req->rq_state |= RQ_IN_ACT_LOG;
-		drbd_al_begin_io(mdev, sector);
-	}
-
 	s = mdev->state;
 	remote = remote && drbd_should_do_remote(s);
 	send_oos = rw == WRITE && drbd_should_send_oos(s);
@@ -986,13 +975,11 @@ allocate_barrier:
 	spin_lock_irq(&mdev->req_lock);
 
 	if (is_susp(mdev->state)) {
-		/* If we got suspended, use the retry mechanism of
-		   drbd_make_request() to restart processing of this
-		   bio. In the next call to drbd_make_request
-		   we sleep in inc_ap_bio() */
-		ret = 1;
+		/* Nothing done yet, let the caller decide
+		 * how to restart processing of this request. */
 		spin_unlock_irq(&mdev->req_lock);
-		goto fail_free_complete;
+		kfree(b);
+		return 1;
 	}
 
 	if (remote || send_oos) {
@@ -1083,6 +1070,10 @@ allocate_barrier:
 	if (rw == WRITE && _req_conflicts(req))
 		goto fail_conflicting;
 
+	/* the peer will have new data there, drop what we read ahead */
+	if (rw == WRITE)
+		_drbd_ra_invalidate(mdev, sector, size);
+
 	/* no point in adding empty flushes to the transfer log,
 	 * they are mapped to drbd barriers already. */
 	list_add_tail(&req->tl_requests, &mdev->newest_tle->requests);
@@ -1122,6 +1113,9 @@ queue_barrier:
 
 		trace_drbd_bio(mdev, "Pri", req->private_bio, 0, NULL);
 
+		/* every way on ends in drbd_endio_pri() */
+		atomic_inc(&mdev->ap_local_cnt);
+
 		/* State may have changed since we grabbed our reference on the
 		 * mdev->ldev member. Double check, and short-circuit to endio.
 		 * In case the last activity log transaction failed to get on
@@ -1132,8 +1126,10 @@ queue_barrier:
 						    : rw == READ  ? DRBD_FAULT_DT_RD
 						    :               DRBD_FAULT_DT_RA))
 				bio_endio(req->private_bio, -EIO);
-			else
+			else {
+				req->local_ns = drbd_lat_now();
 				generic_make_request(req->private_bio);
+			}
 			put_ldev(mdev);
 		} else
 			bio_endio(req->private_bio, -EIO);
@@ -1163,6 +1159,166 @@ fail_conflicting:
 fail_free_complete:
 	if (req->rq_state & RQ_IN_ACT_LOG)
 		drbd_al_complete_io(mdev, sector);
+	if (local) {
+		bio_put(req->private_bio);
+		req->private_bio = NULL;
+		put_ldev(mdev);
+	}
+	bio_endio(bio, err);
+
+	drbd_req_free(req);
+	dec_ap_bio(mdev);
+	kfree(b);
+
+	return 0;
+}
+
+
+/* Submits the writes parked by drbd_al_begin_io_nonblock(), in order,
+ * as their activity log extents become active. */
+int w_al_submit_pending(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
+{
+	struct drbd_request *req;
+
+	/* kicks from now on queue us again */
+	drbd_clear_flag(mdev, AL_SUBMIT_QUEUED);
+
+	while (!is_susp(mdev->state)) {
+		req = drbd_al_get_pending(mdev);
+		if (!req)
+			break;
+		if (drbd_send_and_submit(mdev, req, 1, 1)) {
+			/* Got suspended after all.  Give the extent back, and
+			 * park it again; resuming wakes misc_wait, which kicks us. */
+			drbd_al_complete_io(mdev, req->sector);
+			spin_lock_irq(&mdev->al_lock);
+			list_add(&req->tl_requests, &mdev->al_pending);
+			spin_unlock_irq(&mdev->al_lock);
+			break;
+		}
+	}
+
+	return 1;
+}
+
+STATIC int drbd_make_request_common(struct drbd_conf *mdev, struct bio *bio, unsigned long start_time)
+{
+	const int rw = bio_rw(bio);
+	const int is_flush = (bio->bi_rw & DRBD_REQ_FLUSH);
+	const int size = bio->bi_size;
+	const sector_t sector = bio->bi_sector;
+	struct drbd_request *req;
+	int local, remote;
+	int err = -EIO;
+	int ret = 0;
+
+	/* allocate outside of all locks; */
+	req = drbd_req_new(mdev, bio);
+	if (!req) {
+		dec_ap_bio(mdev);
+		/* only pass the error to the upper layers.
+		 * if user cannot handle io errors, that's not our business. */
+		dev_err(DEV, "could not kmalloc() req\n");
+		bio_endio(bio, -ENOMEM);
+		return 0;
+	}
+	req->start_time = start_time;
+
+	trace_drbd_bio(mdev, "Rq", bio, 0, req);
+
+	if (size)
+		drbd_app_io_mark_hot(mdev, sector);
+
+	local = get_ldev(mdev);
+	if (!local) {
+		bio_put(req->private_bio); /* or we get a bio leak */
+		req->private_bio = NULL;
+	}
+	if (rw == WRITE) {
+		/* Need to replicate writes.  Unless it is an empty flush,
+		 * which is better mapped to a DRBD P_BARRIER packet,
+		 * also for drbd wire protocol compatibility reasons. */
+		if (unlikely(size == 0))
+			/* The only size==0 bios we expect are empty flushes. */
+			D_ASSERT(is_flush);
+		remote = 1;
+	} else {
+		/* READ || READA */
+		if (local) {
+			if (!drbd_may_do_local_read(mdev, sector, size)) {
+				/* we could kick the syncer to
+				 * sync this extent asap, wait for
+				 * it, then continue locally.
+				 * Or just issue the request remotely.
+				 */
+				local = 0;
+				bio_put(req->private_bio);
+				req->private_bio = NULL;
+				put_ldev(mdev);
+			}
+		}
+		/* Both sides could serve it.  Ask the read-balancing policy.
+		 * READA is not worth a round trip, keep that local. */
+		if (local && rw == READ && mdev->state.pdsk == D_UP_TO_DATE &&
+		    mdev->sync_conf.read_balancing != RB_PREFER_LOCAL) {
+			if (remote_due_to_read_balancing(mdev, sector)) {
+				local = 0;
+				bio_put(req->private_bio);
+				req->private_bio = NULL;
+				put_ldev(mdev);
+				drbd_stat_add(mdev, STAT_RB_REMOTE_READS, 1);
+			} else
+				drbd_stat_add(mdev, STAT_RB_LOCAL_READS, 1);
+		}
+		remote = !local && mdev->state.pdsk >= D_UP_TO_DATE;
+
+		/* sequential reads from the peer: readahead cache */
+		if (remote && drbd_ra_read(mdev, bio)) {
+			err = 0;
+			goto fail_and_free_req;
+		}
+	}
+
+	/* If we have a disk, but a READA request is mapped to remote,
+	 * we are R_PRIMARY, D_INCONSISTENT, SyncTarget.
+	 * Just fail that READA request right here.
+	 *
+	 * THINK: maybe fail all READA when not local?
+	 *        or make this configurable...
+	 *        if network is slow, READA won't do any good.
+	 */
+	if (rw == READA && mdev->state.disk >= D_INCONSISTENT && !local) {
+		err = -EWOULDBLOCK;
+		goto fail_and_free_req;
+	}
+
+	/* For WRITES going to the local disk, grab a reference on the target
+	 * extent.  If it is not in the activity log yet, or the corresponding
+	 * resync extent is locked, we do not wait for that here: the request
+	 * is parked, and the worker continues with it once the extent is
+	 * active, which involves further disk io because of transactional
+	 * on-disk meta data updates.  So one cold extent does not stall the
+	 * submitter for all its other IO.
+	 * Empty flushes don't need to go into the activity log, they can only
+	 * flush data for pending writes which are already in there. */
+	if (rw == WRITE && local && size
+	&& !drbd_test_flag(mdev, AL_SUSPENDED)) {
+		req->rq_state |= RQ_IN_ACT_LOG;
+		if (!drbd_al_begin_io_nonblock(mdev, req))
+			return 0;
+	}
+
+	if (!drbd_send_and_submit(mdev, req, local, remote))
+		return 0;
+
+	/* If we got suspended, use the retry mechanism of
+	   drbd_make_request() to restart processing of this
+	   bio. In the next call to drbd_make_request
+	   we sleep in inc_ap_bio() */
+	ret = 1;
+	if (req->rq_state & RQ_IN_ACT_LOG)
+		drbd_al_complete_io(mdev, sector);
+
 fail_and_free_req:
 	if (local) {
 		bio_put(req->private_bio);
@@ -1174,11 +1330,11 @@ fail_and_free_req:
 
 	drbd_req_free(req);
 	dec_ap_bio(mdev);
-	kfree(b);
 
 	return ret;
 }
 
+
 /* helper function for drbd_make_request
  * if we can determine just by the mdev (state) that this request will fail,
  * return 1
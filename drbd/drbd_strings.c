@@ -70,6 +70,48 @@ static const char *drbd_disk_s_names[] = {
 	[D_UP_TO_DATE]   = "UpToDate",
 };
 
+static const char *drbd_lat_class_s_names[] = {
+	[LAT_LOCAL_WRITE] = "local-write",
+	[LAT_PEER_ACK]    = "peer-ack",
+	[LAT_AL_WRITE]    = "al-write",
+	[LAT_BARRIER]     = "barrier-ack",
+	[LAT_APP]         = "app-request",
+	[LAT_PING]        = "ping-rtt",
+};
+
+static const char *drbd_stat_s_names[] = {
+	[STAT_SEND_SECT]       = "send_sectors",
+	[STAT_RECV_SECT]       = "recv_sectors",
+	[STAT_WRIT_SECT]       = "disk_write_sectors",
+	[STAT_READ_SECT]       = "disk_read_sectors",
+	[STAT_AL_WRITES]       = "al_writes",
+	[STAT_BM_WRITES]       = "bm_writes",
+	[STAT_DATA_SENT_BYTES] = "data_sock_sent_bytes",
+	[STAT_DATA_RECV_BYTES] = "data_sock_recv_bytes",
+	[STAT_META_SENT_BYTES] = "meta_sock_sent_bytes",
+	[STAT_META_RECV_BYTES] = "meta_sock_recv_bytes",
+	[STAT_EPOCHS]          = "epochs",
+	[STAT_FLUSHES]         = "flushes",
+	[STAT_AL_HITS]         = "al_hits",
+	[STAT_AL_MISSES]       = "al_misses",
+	[STAT_RS_SENT_BYTES]   = "resync_sent_bytes",
+	[STAT_RS_RECV_BYTES]   = "resync_recv_bytes",
+	[STAT_COMPRESS_IN_BYTES]  = "compress_in_bytes",
+	[STAT_COMPRESS_OUT_BYTES] = "compress_out_bytes",
+	[STAT_COMPRESS_RAW]       = "compress_raw",
+	[STAT_COMPRESS_NS]        = "compress_ns",
+	[STAT_DECOMPRESS_NS]      = "decompress_ns",
+	[STAT_RS_ZERO_BYTES]      = "resync_zero_bytes",
+	[STAT_RB_LOCAL_READS]     = "rb_local_reads",
+	[STAT_RB_REMOTE_READS]    = "rb_remote_reads",
+	[STAT_RA_REQ_BYTES]       = "ra_requested_bytes",
+	[STAT_RA_HIT_BYTES]       = "ra_hit_bytes",
+	[STAT_RS_THROTTLED]       = "resync_throttled",
+	[STAT_RS_PASSED]          = "resync_passed",
+	[STAT_AL_PREFETCHES]      = "al_prefetches",
+	[STAT_AL_PREFETCH_HITS]   = "al_prefetch_hits",
+};
+
 static const char *drbd_state_sw_errors[] = {
 	[-SS_TWO_PRIMARIES] = "Multiple primaries not allowed by config",
 	[-SS_NO_UP_TO_DATE_DISK] = "Need access to UpToDate data",
@@ -107,6 +149,16 @@ const char *drbd_disk_str(enum drbd_disk_state s)
 	return s > D_UP_TO_DATE    ? "TOO_LARGE" : drbd_disk_s_names[s];
 }
 
+const char *drbd_lat_class_str(enum drbd_lat_class c)
+{
+	return c >= LAT_CLASSES ? "TOO_LARGE" : drbd_lat_class_s_names[c];
+}
+
+const char *drbd_stat_str(enum drbd_stat_counter c)
+{
+	return c >= STAT_COUNTERS ? "TOO_LARGE" : drbd_stat_s_names[c];
+}
+
 const char *drbd_set_st_err_str(enum drbd_state_rv err)
 {
 	return err <= SS_AFTER_LAST_ERROR ? "TOO_SMALL" :
@@ -37,9 +37,23 @@ struct drbd_md_attribute {
 	/* ssize_t (*store)(struct drbd_backing_dev *bdev, const char *buf, size_t count); */
 };
 
+/* the "drbd" directory below the block device, mdev->kobj */
+struct drbd_dev_kobject {
+	struct kobject kobject;
+	struct drbd_conf *mdev;
+};
+
+struct drbd_dev_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct drbd_conf *mdev, char *buf);
+};
+
 static ssize_t drbd_md_attr_show(struct kobject *, struct attribute *, char *);
 static ssize_t data_gen_id_show(struct drbd_backing_dev *, char *);
 static void backing_dev_release(struct kobject *kobj);
+static ssize_t drbd_dev_attr_show(struct kobject *, struct attribute *, char *);
+static ssize_t statistics_show(struct drbd_conf *, char *);
+static void drbd_dev_release(struct kobject *kobj);
 
 #define DRBD_MD_ATTR(_name) struct drbd_md_attribute drbd_md_attr_##_name = __ATTR_RO(_name)
 static DRBD_MD_ATTR(data_gen_id);
@@ -58,6 +72,23 @@ struct kobj_type drbd_bdev_kobj_type = {
 	.default_attrs = bdev_attrs,
 };
 
+#define DRBD_DEV_ATTR(_name) struct drbd_dev_attribute drbd_dev_attr_##_name = __ATTR_RO(_name)
+static DRBD_DEV_ATTR(statistics);
+
+static struct attribute *dev_attrs[] = {
+	&drbd_dev_attr_statistics.attr,
+	NULL
+};
+
+static struct kobj_type drbd_dev_kobj_type = {
+	.release = drbd_dev_release,
+	.sysfs_ops = &(struct sysfs_ops) {
+		.show = drbd_dev_attr_show,
+		.store = NULL,
+	},
+	.default_attrs = dev_attrs,
+};
+
 
 static ssize_t drbd_md_attr_show(struct kobject *kobj, struct attribute *attr, char *buffer)
 {
@@ -88,3 +119,62 @@ static void backing_dev_release(struct kobject *kobj)
 	struct drbd_backing_dev *bdev = container_of(kobj, struct drbd_backing_dev, kobject);
 	kfree(bdev);
 }
+
+struct kobject *drbd_dev_kobject_create(struct drbd_conf *mdev, struct kobject *parent)
+{
+	struct drbd_dev_kobject *dk;
+
+	dk = kzalloc(sizeof(*dk), GFP_KERNEL);
+	if (!dk)
+		return NULL;
+	dk->mdev = mdev;
+
+	if (kobject_init_and_add(&dk->kobject, &drbd_dev_kobj_type, parent, "drbd")) {
+		kobject_put(&dk->kobject);
+		return NULL;
+	}
+	return &dk->kobject;
+}
+
+static ssize_t drbd_dev_attr_show(struct kobject *kobj, struct attribute *attr, char *buffer)
+{
+	struct drbd_dev_kobject *dk = container_of(kobj, struct drbd_dev_kobject, kobject);
+	struct drbd_dev_attribute *drbd_dev_attr = container_of(attr, struct drbd_dev_attribute, attr);
+
+	return drbd_dev_attr->show(dk->mdev, buffer);
+}
+
+/* One "name value" line per counter, then one
+ * "packet_<name> sent received" line per packet type. */
+static ssize_t statistics_show(struct drbd_conf *mdev, char *buf)
+{
+	struct drbd_stats *st;
+	const char *name;
+	int i, n = 0;
+
+	st = kmalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+	drbd_stats_sum(mdev, st);
+
+	for (i = 0; i < STAT_COUNTERS; i++)
+		n += scnprintf(buf + n, PAGE_SIZE - n, "%s %llu\n", drbd_stat_str(i),
+			       (unsigned long long)st->cnt[i]);
+	for (i = 0; i < P_MAX_CMD; i++) {
+		name = cmdname(i);
+		if (!name)
+			continue;
+		n += scnprintf(buf + n, PAGE_SIZE - n, "packet_%s %llu %llu\n", name,
+			       (unsigned long long)st->pkt_sent[i],
+			       (unsigned long long)st->pkt_recv[i]);
+	}
+	kfree(st);
+
+	return n;
+}
+
+static void drbd_dev_release(struct kobject *kobj)
+{
+	struct drbd_dev_kobject *dk = container_of(kobj, struct drbd_dev_kobject, kobject);
+	kfree(dk);
+}
@@ -26,6 +26,10 @@
 #include <linux/module.h>
 #include <linux/drbd.h>
 #include <linux/ctype.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <asm/uaccess.h>
 #include "drbd_int.h"
 #include "drbd_tracing.h"
 #include <linux/drbd_tag_magic.h>
@@ -36,14 +40,17 @@ MODULE_DESCRIPTION("DRBD tracepoint probes");
 MODULE_PARM_DESC(trace_mask, "Bitmap of events to trace see drbd_tracing.c");
 MODULE_PARM_DESC(trace_level, "Current tracing level (changeable in /sys)");
 MODULE_PARM_DESC(trace_devs, "Bitmap of devices to trace (changeable in /sys)");
+MODULE_PARM_DESC(trace_ring_events, "Events per cpu trace ring, 0 logs via printk");
 
 unsigned int trace_mask = 0;  /* Bitmap of events to trace */
 int trace_level;              /* Current trace level */
 int trace_devs;		      /* Bitmap of devices to trace */
+unsigned int trace_ring_events = 16384; /* power of two, 0: printk */
 
 module_param(trace_mask, uint, 0444);
 module_param(trace_level, int, 0644);
 module_param(trace_devs, int, 0644);
+module_param(trace_ring_events, uint, 0444);
 
 enum {
 	TRACE_PACKET  = 0x0001,
@@ -96,6 +103,154 @@ static inline int is_mdev_trace(struct drbd_conf *mdev, unsigned int level)
 	return trace_level >= level && ((1 << mdev_to_minor(mdev)) & trace_devs);
 }
 
+/* Binary trace rings.
+ *
+ * The hot probes (packets, requests, bios, epoch entries, activity log
+ * and epochs) do not printk, but store a fixed size struct
+ * drbd_trace_event into a ring of their own cpu. Only that cpu writes
+ * into it, with interrupts disabled, so there is no lock at all.
+ * head counts the events ever written; readers copy events out and then
+ * re-check head, to drop those that got overwritten meanwhile.
+ * The rings are read through <debugfs>/drbd_trace/cpuN, and decoded by
+ * benchmark/drbd-trace-decode. */
+struct drbd_trace_ring {
+	struct drbd_trace_event *ev;
+	unsigned long head;
+};
+
+static DEFINE_PER_CPU(struct drbd_trace_ring, trace_rings);
+static struct dentry *trace_dir;
+
+static void trace_ev(struct drbd_conf *mdev, int type, int sub,
+		     u64 sector, u32 size, u64 block_id)
+{
+	struct drbd_trace_ring *ring;
+	struct drbd_trace_event *ev;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	ring = &per_cpu(trace_rings, smp_processor_id());
+	/* head must be visible before we start to overwrite the slot */
+	smp_wmb();
+	ev = ring->ev + (ring->head & (trace_ring_events - 1));
+	ev->ts_ns = drbd_lat_now();
+	ev->sector = sector;
+	ev->block_id = block_id;
+	ev->size = size;
+	ev->minor = mdev_to_minor(mdev);
+	ev->type = type;
+	ev->sub = sub;
+	smp_wmb();
+	ring->head++;
+	local_irq_restore(flags);
+}
+
+static int trace_ring_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+/* *ppos counts events, not bytes. A reader that fell behind more than
+ * one ring size silently skips ahead to the oldest event still there.
+ * Returns 0 once it caught up with the writer. */
+static ssize_t trace_ring_read(struct file *file, char __user *ubuf,
+			       size_t count, loff_t *ppos)
+{
+	struct drbd_trace_ring *ring =
+		&per_cpu(trace_rings, (long)file->private_data);
+	struct drbd_trace_event *buf;
+	unsigned long head, pos, n, skip, i;
+	ssize_t ret;
+
+	if (count < sizeof(*buf))
+		return -EINVAL;
+
+	buf = (struct drbd_trace_event *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	pos = *ppos;
+	do {
+		head = ACCESS_ONCE(ring->head);
+		smp_rmb();
+		if (head - pos > trace_ring_events)
+			pos = head - trace_ring_events;
+		n = min_t(unsigned long, head - pos,
+			  min_t(size_t, count, PAGE_SIZE) / sizeof(*buf));
+		for (i = 0; i < n; i++)
+			buf[i] = ring->ev[(pos + i) & (trace_ring_events - 1)];
+		smp_rmb();
+		/* the writer may be busy with event number head right now,
+		 * so events before head + 1 - trace_ring_events are garbage */
+		head = ACCESS_ONCE(ring->head) + 1;
+		skip = 0;
+		if (head - pos > trace_ring_events)
+			skip = min(n, head - pos - trace_ring_events);
+		pos += n;
+	} while (n && skip == n);
+
+	ret = (n - skip) * sizeof(*buf);
+	if (copy_to_user(ubuf, buf + skip, ret))
+		ret = -EFAULT;
+	else
+		*ppos = pos;
+
+	free_page((unsigned long)buf);
+	return ret;
+}
+
+static const struct file_operations trace_ring_fops = {
+	.owner = THIS_MODULE,
+	.open  = trace_ring_open,
+	.read  = trace_ring_read,
+};
+
+static void trace_rings_free(void)
+{
+	int cpu;
+
+	if (trace_dir && !IS_ERR(trace_dir))
+		debugfs_remove_recursive(trace_dir);
+	trace_dir = NULL;
+	for_each_possible_cpu(cpu) {
+		vfree(per_cpu(trace_rings, cpu).ev);
+		per_cpu(trace_rings, cpu).ev = NULL;
+	}
+}
+
+static int trace_rings_alloc(void)
+{
+	char name[16];
+	int cpu;
+
+	if (!is_power_of_2(trace_ring_events))
+		trace_ring_events = roundup_pow_of_two(trace_ring_events);
+
+	trace_dir = debugfs_create_dir("drbd_trace", NULL);
+	if (!trace_dir || IS_ERR(trace_dir))
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_trace_ring *ring = &per_cpu(trace_rings, cpu);
+
+		ring->ev = vmalloc(trace_ring_events * sizeof(*ring->ev));
+		if (!ring->ev)
+			goto fail;
+		ring->head = 0;
+
+		snprintf(name, sizeof(name), "cpu%d", cpu);
+		if (!debugfs_create_file(name, 0400, trace_dir,
+					 (void *)(long)cpu, &trace_ring_fops))
+			goto fail;
+	}
+	return 0;
+
+fail:
+	trace_rings_free();
+	return -ENOMEM;
+}
+
 static void probe_drbd_unplug(struct drbd_conf *mdev, char *msg)
 {
 	if (!is_mdev_trace(mdev, TRACE_LVL_ALWAYS))
@@ -138,11 +293,35 @@ static void probe_drbd_md_io(struct drbd_conf *mdev, int rw,
 		 rw == READ ? "Reading" : "Writing");
 }
 
+/* maps the messages of the trace_drbd_ee() call sites */
+static int ee_stage(const char *msg)
+{
+	static const struct { const char *msg; int stage; } stages[] = {
+		{ "allocated", TEE_ALLOC },
+		{ "submitted", TEE_SUBMIT },
+		{ "read completed", TEE_DONE },
+		{ "write completed", TEE_DONE },
+		{ "process_done_ee", TEE_ACKED },
+		{ "freed", TEE_FREE },
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(stages); i++)
+		if (!strcmp(msg, stages[i].msg))
+			return stages[i].stage;
+	return TEE_OTHER;
+}
+
 static void probe_drbd_ee(struct drbd_conf *mdev, struct drbd_epoch_entry *e, char* msg)
 {
 	if (!is_mdev_trace(mdev, TRACE_LVL_ALWAYS))
 		return;
 
+	if (trace_ring_events) {
+		trace_ev(mdev, TEV_EE, ee_stage(msg), e->sector, e->size, e->block_id);
+		return;
+	}
+
 	dev_info(DEV, "EE %s sec=%llus size=%u e=%p\n",
 		 msg, (unsigned long long)e->sector, e->size, e);
 }
@@ -165,6 +344,13 @@ static void probe_drbd_epoch(struct drbd_conf *mdev, struct drbd_epoch *epoch,
 
 	ev &= ~EV_CLEANUP;
 
+	if (trace_ring_events) {
+		trace_ev(mdev, TEV_EPOCH, ev, 0,
+			 atomic_read(&epoch->epoch_size),
+			 ev == EV_TRACE_ALLOC ? 0 : epoch->barrier_nr);
+		return;
+	}
+
 	switch (ev) {
 	case EV_TRACE_ALLOC:
 		dev_info(DEV, "Allocate epoch %p/xxxx { } nr_epochs=%d\n", epoch, mdev->epochs);
@@ -213,11 +399,19 @@ static void probe_drbd_netlink(void *data, int is_req)
 
 static void probe_drbd_actlog(struct drbd_conf *mdev, sector_t sector, char* msg)
 {
-	unsigned int enr = (sector >> (AL_EXTENT_SHIFT-9));
+	unsigned int enr = AL_SECT_TO_EXT(mdev, sector);
 
 	if (!is_mdev_trace(mdev, TRACE_LVL_ALWAYS))
 		return;
 
+	if (trace_ring_events) {
+		/* "al_begin_io" and "al_begin_io_nonblock" are begins,
+		 * anything else is a complete */
+		trace_ev(mdev, TEV_AL, strncmp(msg, "al_begin_io", 11) != 0,
+			 sector, 0, enr);
+		return;
+	}
+
 	dev_info(DEV, "%s (sec=%llus, al_enr=%u, rs_enr=%d)\n",
 		 msg, (unsigned long long) sector, enr,
 		 (int)BM_SECT_TO_EXT(sector));
@@ -396,6 +590,27 @@ static void probe_drbd_bio(struct drbd_conf *mdev, const char *pfx, struct bio *
 	if (!is_mdev_trace(mdev, TRACE_LVL_ALWAYS))
 		return;
 
+	if (trace_ring_events) {
+		int sub = (complete ? TBIO_COMPLETE : 0) |
+			  (biorw == WRITE ? TBIO_WRITE : 0);
+
+		if (r) {
+			/* the master bio, as it enters drbd_make_request */
+			trace_ev(mdev, TEV_REQ, TRQ_START, bio->bi_sector,
+				 bio->bi_size, (unsigned long)r);
+			return;
+		}
+		switch (pfx[0]) {
+		case 'R': sub |= TBIO_MASTER; break;
+		case 'P': sub |= TBIO_PRIVATE; break;
+		case 'S': sub |= TBIO_PEER; break;
+		case 'M': sub |= TBIO_MD; break;
+		}
+		trace_ev(mdev, TEV_BIO, sub, bio->bi_sector, bio->bi_size,
+			 (unsigned long)bio);
+		return;
+	}
+
 	if (r)
 		sprintf(rb, "Req:%p ", r);
 
@@ -441,6 +656,44 @@ static void probe_drbd_bio(struct drbd_conf *mdev, const char *pfx, struct bio *
 	}
 }
 
+static int req_stage(struct drbd_request *req, enum drbd_req_event what)
+{
+	const unsigned long s = req->rq_state;
+
+	switch (what) {
+	case to_be_submitted:
+		return TRQ_LOCAL_SUBMIT;
+	case queue_for_net_write:
+	case queue_for_net_read:
+		return TRQ_NET_QUEUED;
+	case handed_over_to_network:
+		return TRQ_NET_SENT;
+	case completed_ok:
+		return TRQ_LOCAL_DONE;
+	case recv_acked_by_peer:
+	case write_acked_by_peer:
+	case write_acked_by_peer_and_sis:
+	case data_received:
+		return TRQ_NET_ACKED;
+	case send_failed:
+	case neg_acked:
+	case read_completed_with_error:
+	case write_completed_with_error:
+	case connection_lost_while_pending:
+		return TRQ_FAILED;
+	case nothing:
+		/* _req_may_be_done(), only of interest if it is about
+		 * to complete the master bio. Same condition as there. */
+		if (!req->master_bio || s & (RQ_NET_QUEUED|RQ_NET_PENDING))
+			return TRQ_OTHER;
+		if (s & RQ_LOCAL_PENDING && !(s & RQ_LOCAL_ABORTED))
+			return TRQ_OTHER;
+		return TRQ_COMPLETED;
+	default:
+		return TRQ_OTHER;
+	}
+}
+
 static void probe_drbd_req(struct drbd_request *req, enum drbd_req_event what, char *msg)
 {
 	static const char *rq_event_names[] = {
@@ -473,6 +726,15 @@ static void probe_drbd_req(struct drbd_request *req, enum drbd_req_event what, c
 		'W' : 'R';
 	const unsigned long s = req->rq_state;
 
+	if (trace_ring_events) {
+		int stage = req_stage(req, what);
+
+		if (stage != TRQ_OTHER && is_mdev_trace(mdev, TRACE_LVL_ALWAYS))
+			trace_ev(mdev, TEV_REQ, stage, req->sector, req->size,
+				 (unsigned long)req);
+		return;
+	}
+
 	if (what != nothing) {
 		dev_info(DEV, "__req_mod(%p %c ,%s)\n", req, rw, rq_event_names[what]);
 	} else {
@@ -546,6 +808,61 @@ STATIC char *_dump_block_id(u64 block_id, char *buff)
 	return buff;
 }
 
+static void trace_ev_packet(struct drbd_conf *mdev, int recv, union p_polymorph *p)
+{
+	u64 sector = 0, block_id = 0;
+	u32 size;
+	int cmd;
+
+	if (p->header.h80.magic == BE_DRBD_MAGIC) {
+		cmd = be16_to_cpu(p->header.h80.command);
+		size = be16_to_cpu(p->header.h80.length);
+	} else {
+		cmd = be16_to_cpu(p->header.h95.command);
+		size = be32_to_cpu(p->header.h95.length) & 0x00ffffff;
+	}
+
+	switch (cmd) {
+	case P_DATA:
+	case P_DATA_REPLY:
+	case P_RS_DATA_REPLY:
+		/* payload bytes, including an integrity digest, if any */
+		size -= sizeof(struct p_data) - sizeof(union p_header);
+		sector = be64_to_cpu(p->data.sector);
+		block_id = p->data.block_id;
+		break;
+	case P_RECV_ACK:
+	case P_WRITE_ACK:
+	case P_RS_WRITE_ACK:
+	case P_DISCARD_ACK:
+	case P_NEG_ACK:
+	case P_NEG_DREPLY:
+	case P_NEG_RS_DREPLY:
+	case P_RS_IS_IN_SYNC:
+	case P_OV_RESULT:
+		sector = be64_to_cpu(p->block_ack.sector);
+		size = be32_to_cpu(p->block_ack.blksize);
+		block_id = p->block_ack.block_id;
+		break;
+	case P_DATA_REQUEST:
+	case P_RS_DATA_REQUEST:
+	case P_CSUM_RS_REQUEST:
+	case P_OV_REQUEST:
+	case P_OV_REPLY:
+		sector = be64_to_cpu(p->block_req.sector);
+		size = be32_to_cpu(p->block_req.blksize);
+		block_id = p->block_req.block_id;
+		break;
+	case P_BARRIER:
+	case P_BARRIER_ACK:
+		block_id = p->barrier.barrier;
+		break;
+	}
+
+	trace_ev(mdev, recv ? TEV_PACKET_RECV : TEV_PACKET_SEND, cmd,
+		 sector, size, block_id);
+}
+
 static void probe_drbd_packet(struct drbd_conf *mdev, struct socket *sock,
 			      int recv, union p_polymorph *p, char *file, int line)
 {
@@ -554,6 +871,12 @@ static void probe_drbd_packet(struct drbd_conf *mdev, struct socket *sock,
 	char tmp[300];
 	union drbd_state m, v;
 
+	if (trace_ring_events) {
+		if (is_mdev_trace(mdev, TRACE_LVL_ALWAYS))
+			trace_ev_packet(mdev, recv, p);
+		return;
+	}
+
 	cmd = be16_to_cpu(p->header.h80.magic == BE_DRBD_MAGIC ?
 			  p->header.h80.command : p->header.h95.command);
 
@@ -680,6 +1003,12 @@ static int __init drbd_trace_init(void)
 {
 	int ret;
 
+	if (trace_mask && trace_ring_events && trace_rings_alloc()) {
+		printk(KERN_WARNING "drbd_trace: no trace rings, "
+		       "falling back to printk\n");
+		trace_ring_events = 0;
+	}
+
 	if (trace_mask & TRACE_UNPLUG) {
 		ret = register_trace_drbd_unplug(probe_drbd_unplug);
 		WARN_ON(ret);
@@ -755,6 +1084,9 @@ static void __exit drbd_trace_exit(void)
 		unregister_trace__drbd_resync(probe_drbd_resync);
 
 	tracepoint_synchronize_unregister();
+
+	if (trace_ring_events)
+		trace_rings_free();
 }
 
 module_exit(drbd_trace_exit);
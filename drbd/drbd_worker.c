@@ -80,7 +80,7 @@ BIO_ENDIO_TYPE drbd_md_io_complete BIO_ENDIO_ARGS(struct bio *bio, int error)
 	BIO_ENDIO_FN_START;
 
 	md_io = (struct drbd_md_io *)bio->bi_private;
-	mdev = container_of(md_io, struct drbd_conf, md_io);
+	mdev = md_io->mdev;
 
 	md_io->error = error;
 
@@ -89,15 +89,15 @@ BIO_ENDIO_TYPE drbd_md_io_complete BIO_ENDIO_ARGS(struct bio *bio, int error)
 	/* We grabbed an extra reference in _drbd_md_sync_page_io() to be able
 	 * to timeout on the lower level device, and eventually detach from it.
 	 * If this io completion runs after that timeout expired, this
-	 * drbd_md_put_buffer() may allow us to finally try and re-attach.
+	 * drbd_md_io_put() may allow us to finally try and re-attach.
 	 * During normal operation, this only puts that extra reference
 	 * down to 1 again.
 	 * Make sure we first drop the reference, and only then signal
 	 * completion, or we may (in drbd_al_read_log()) cycle so fast into the
 	 * next drbd_md_sync_page_io(), that we trigger the
-	 * ASSERT(atomic_read(&mdev->md_io_in_use) == 1) there.
+	 * ASSERT(atomic_read(&md_io->in_use) == 1) there.
 	 */
-	drbd_md_put_buffer(mdev);
+	drbd_md_io_put(md_io);
 	md_io->done = 1;
 	wake_up(&mdev->misc_wait);
 	bio_put(bio);
@@ -117,7 +117,7 @@ void drbd_endio_read_sec_final(struct drbd_epoch_entry *e) __releases(local)
 	D_ASSERT(e->block_id != ID_VACANT);
 
 	spin_lock_irqsave(&mdev->req_lock, flags);
-	mdev->read_cnt += e->size >> 9;
+	drbd_stat_add(mdev, STAT_READ_SECT, e->size >> 9);
 	list_del(&e->w.list);
 	if (list_empty(&mdev->read_ee))
 		wake_up(&mdev->ee_wait);
@@ -173,7 +173,7 @@ static void drbd_endio_write_sec_final(struct drbd_epoch_entry *e) __releases(lo
 	is_syncer_req = is_syncer_block_id(e->block_id);
 
 	spin_lock_irqsave(&mdev->req_lock, flags);
-	mdev->writ_cnt += e->size >> 9;
+	drbd_stat_add(mdev, STAT_WRIT_SECT, e->size >> 9);
 	list_move_tail(&e->w.list, &mdev->done_ee);
 
 	trace_drbd_ee(mdev, e, "write completed");
@@ -315,6 +315,7 @@ BIO_ENDIO_TYPE drbd_endio_pri BIO_ENDIO_ARGS(struct bio *bio, int error)
 
 	bio_put(req->private_bio);
 	req->private_bio = ERR_PTR(error);
+	atomic_dec(&mdev->ap_local_cnt);
 
 	/* not req_mod(), we need irqsave here! */
 	spin_lock_irqsave(&mdev->req_lock, flags);
@@ -346,51 +347,125 @@ int w_read_retry_remote(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 	return w_send_read_req(mdev, w, 0);
 }
 
+/* "crc32c" is computed by drbd_crc32c() directly, saving the per page
+ * scatterlist round trip through the crypto API. Same digest either way. */
+void drbd_digest_init(struct drbd_digest *d, struct crypto_hash *tfm)
+{
+	d->native = !strcmp(crypto_tfm_alg_name(crypto_hash_tfm(tfm)), "crc32c");
+	if (d->native) {
+		d->crc = ~0;
+		return;
+	}
+	d->desc.tfm = tfm;
+	d->desc.flags = 0;
+	sg_init_table(&d->sg, 1);
+	crypto_hash_init(&d->desc);
+}
+
+void drbd_digest_page(struct drbd_digest *d, struct page *page,
+		      unsigned int offset, unsigned int len)
+{
+	if (d->native) {
+		d->crc = drbd_crc32c(d->crc, kmap(page) + offset, len);
+		kunmap(page);
+		return;
+	}
+	sg_set_page(&d->sg, page, len, offset);
+	crypto_hash_update(&d->desc, &d->sg, len);
+}
+
+void drbd_digest_final(struct drbd_digest *d, void *digest)
+{
+	if (d->native) {
+		__le32 crc = cpu_to_le32(~d->crc);
+		memcpy(digest, &crc, sizeof(crc));
+		return;
+	}
+	crypto_hash_final(&d->desc, digest);
+}
+
 void drbd_csum_ee(struct drbd_conf *mdev, struct crypto_hash *tfm, struct drbd_epoch_entry *e, void *digest)
 {
-	struct hash_desc desc;
-	struct scatterlist sg;
+	struct drbd_digest d;
 	struct page *page = e->pages;
 	struct page *tmp;
 	unsigned len;
 
-	desc.tfm = tfm;
-	desc.flags = 0;
-
-	sg_init_table(&sg, 1);
-	crypto_hash_init(&desc);
+	drbd_digest_init(&d, tfm);
 
 	while ((tmp = page_chain_next(page))) {
 		/* all but the last page will be fully used */
-		sg_set_page(&sg, page, PAGE_SIZE, 0);
-		crypto_hash_update(&desc, &sg, sg.length);
+		drbd_digest_page(&d, page, 0, PAGE_SIZE);
 		page = tmp;
 	}
 	/* and now the last, possibly only partially used page */
 	len = e->size & (PAGE_SIZE - 1);
-	sg_set_page(&sg, page, len ?: PAGE_SIZE, 0);
-	crypto_hash_update(&desc, &sg, sg.length);
-	crypto_hash_final(&desc, digest);
+	drbd_digest_page(&d, page, 0, len ?: PAGE_SIZE);
+	drbd_digest_final(&d, digest);
 }
 
 void drbd_csum_bio(struct drbd_conf *mdev, struct crypto_hash *tfm, struct bio *bio, void *digest)
 {
-	struct hash_desc desc;
-	struct scatterlist sg;
+	struct drbd_digest d;
 	struct bio_vec *bvec;
 	int i;
 
-	desc.tfm = tfm;
-	desc.flags = 0;
+	drbd_digest_init(&d, tfm);
+
+	bio_for_each_segment(bvec, bio, i)
+		drbd_digest_page(&d, bvec->bv_page, bvec->bv_offset, bvec->bv_len);
+	drbd_digest_final(&d, digest);
+}
+
+/**
+ * drbd_copy_csum_bio() - Snapshot the payload of a bio, and digest it
+ * @mdev:	DRBD device.
+ * @tfm:	Digest algorithm, or NULL to only copy.
+ * @bio:	Source bio.
+ * @e:		Epoch entry with at least bio->bi_size bytes worth of pages.
+ * @digest:	Result.
+ *
+ * Each chunk is hashed right after it was copied into the pages of @e,
+ * while it is still cache hot, so the bio's data is read only once.
+ * The digest describes the snapshot, whatever upper layers do to their
+ * buffers meanwhile.
+ */
+void drbd_copy_csum_bio(struct drbd_conf *mdev, struct crypto_hash *tfm, struct bio *bio,
+			struct drbd_epoch_entry *e, void *digest)
+{
+	struct drbd_digest d;
+	struct bio_vec *bvec;
+	struct page *page = e->pages;
+	unsigned int offset = 0;
+	int i;
 
-	sg_init_table(&sg, 1);
-	crypto_hash_init(&desc);
+	if (tfm)
+		drbd_digest_init(&d, tfm);
 
 	bio_for_each_segment(bvec, bio, i) {
-		sg_set_page(&sg, bvec->bv_page, bvec->bv_len, bvec->bv_offset);
-		crypto_hash_update(&desc, &sg, sg.length);
+		unsigned int len = bvec->bv_len;
+		char *src = kmap(bvec->bv_page) + bvec->bv_offset;
+
+		while (len) {
+			unsigned int l = min_t(unsigned int, len, PAGE_SIZE - offset);
+
+			memcpy(kmap(page) + offset, src, l);
+			kunmap(page);
+			if (tfm)
+				drbd_digest_page(&d, page, offset, l);
+
+			src += l;
+			len -= l;
+			offset += l;
+			if (offset == PAGE_SIZE) {
+				page = page_chain_next(page);
+				offset = 0;
+			}
+		}
+		kunmap(bvec->bv_page);
 	}
-	crypto_hash_final(&desc, digest);
+	if (tfm)
+		drbd_digest_final(&d, digest);
 }
 
 /* TODO merge common code with w_e_end_ov_req */
@@ -533,6 +608,45 @@ static void fifo_add_val(struct fifo_buffer *fb, int value)
 		fb->values[i] += value;
 }
 
+/* The time resync data needs to come in after we asked for it, as far as we
+ * can tell: network round trip, plus what the peer's disk takes beyond that.
+ * We only see the peer's disk through the acks of application writes. */
+unsigned int drbd_rs_delay_us(struct drbd_conf *mdev)
+{
+	unsigned int rtt = drbd_lat_avg(mdev, LAT_PING);
+	unsigned int ack = drbd_lat_avg(mdev, LAT_PEER_ACK);
+
+	return max(rtt, ack);
+}
+
+/* Steer the resync rate ceiling so that application requests stay within
+ * c-latency-target: cut it by 1/8 whenever their average completion time is
+ * above the target, otherwise grow it by 1/32 of the maximum. Never go below
+ * c-min-rate, we have to make progress. Called once per SLEEP_TIME. */
+STATIC void drbd_rs_auto_tune(struct drbd_conf *mdev)
+{
+	unsigned int target_us = mdev->sync_conf.c_lat_target * 100;
+	unsigned int samples = drbd_lat_samples(mdev, LAT_APP);
+	int max_rate, min_rate, rate = mdev->c_auto_rate;
+
+	max_rate = mdev->rs_plan_s.size ? mdev->sync_conf.c_max_rate : mdev->sync_conf.rate;
+	min_rate = max(min(mdev->sync_conf.c_min_rate, max_rate), DRBD_C_MAX_RATE_MIN);
+
+	if (samples != mdev->c_auto_app_samples &&
+	    drbd_lat_avg(mdev, LAT_APP) > target_us)
+		rate -= rate / 8;
+	else
+		rate += max(max_rate / 32, 1);
+	mdev->c_auto_rate = max(min(rate, max_rate), min_rate);
+	mdev->c_auto_app_samples = samples;
+
+	/* keep the round trip measurement fresh, the asender pings only when idle */
+	if (time_after(jiffies, mdev->c_auto_ping + HZ)) {
+		mdev->c_auto_ping = jiffies;
+		request_ping(mdev);
+	}
+}
+
 STATIC int drbd_rs_controller(struct drbd_conf *mdev, unsigned int sect_in)
 {
 	unsigned int want;     /* The number of sectors we want in the proxy */
@@ -549,9 +663,17 @@ STATIC int drbd_rs_controller(struct drbd_conf *mdev, unsigned int sect_in)
 
 	if (mdev->rs_in_flight + sect_in == 0) { /* At start of resync */
 		want = ((mdev->sync_conf.rate * 2 * SLEEP_TIME) / HZ) * steps;
+	} else if (mdev->sync_conf.c_fill_target) {
+		want = mdev->sync_conf.c_fill_target;
+	} else if (mdev->sync_conf.c_lat_target && drbd_lat_samples(mdev, LAT_PING)) {
+		/* one step worth, plus twice what is on the way during
+		 * the measured delay. f: 2 * delay in 1/1024 steps */
+		unsigned int f = drbd_rs_delay_us(mdev) * 2048 /
+			(1000000 / HZ * SLEEP_TIME);
+
+		want = sect_in + (((u64)sect_in * f) >> 10);
 	} else { /* normal path */
-		want = mdev->sync_conf.c_fill_target ? mdev->sync_conf.c_fill_target :
-			sect_in * mdev->sync_conf.c_delay_target * HZ / (SLEEP_TIME * 10);
+		want = sect_in * mdev->sync_conf.c_delay_target * HZ / (SLEEP_TIME * 10);
 	}
 
 	correction = want - mdev->rs_in_flight - mdev->rs_planed;
@@ -570,7 +692,10 @@ STATIC int drbd_rs_controller(struct drbd_conf *mdev, unsigned int sect_in)
 	if (req_sect < 0)
 		req_sect = 0;
 
-	max_sect = (mdev->sync_conf.c_max_rate * 2 * SLEEP_TIME) / HZ;
+	max_sect = mdev->sync_conf.c_lat_target ?
+		min(mdev->c_auto_rate, mdev->sync_conf.c_max_rate) :
+		mdev->sync_conf.c_max_rate;
+	max_sect = (max_sect * 2 * SLEEP_TIME) / HZ;
 	if (req_sect > max_sect)
 		req_sect = max_sect;
 
@@ -591,11 +716,16 @@ STATIC int drbd_rs_number_requests(struct drbd_conf *mdev)
 	sect_in = atomic_xchg(&mdev->rs_sect_in, 0);
 	mdev->rs_in_flight -= sect_in;
 
+	if (mdev->sync_conf.c_lat_target)
+		drbd_rs_auto_tune(mdev);
+
 	if (mdev->rs_plan_s.size) { /* mdev->sync_conf.c_plan_ahead */
 		number = drbd_rs_controller(mdev, sect_in) >> (BM_BLOCK_SHIFT - 9);
 		mdev->c_sync_rate = number * HZ * (BM_BLOCK_SIZE / 1024) / SLEEP_TIME;
 	} else {
 		mdev->c_sync_rate = mdev->sync_conf.rate;
+		if (mdev->sync_conf.c_lat_target)
+			mdev->c_sync_rate = min(mdev->c_sync_rate, mdev->c_auto_rate);
 		number = SLEEP_TIME * mdev->c_sync_rate  / ((BM_BLOCK_SIZE / 1024) * HZ);
 	}
 
@@ -666,6 +796,12 @@ next_sector:
 		bit  = drbd_bm_find_next(mdev, mdev->bm_resync_fo);
 
 		if (bit == DRBD_END_OF_BITMAP) {
+			if (mdev->rs_hot_fo != DRBD_END_OF_BITMAP) {
+				/* another pass over what we skipped as hot */
+				mdev->bm_resync_fo = mdev->rs_hot_fo;
+				mdev->rs_hot_fo = DRBD_END_OF_BITMAP;
+				goto requeue;
+			}
 			mdev->bm_resync_fo = drbd_bm_bits(mdev);
 			put_ldev(mdev);
 			return 1;
@@ -673,8 +809,19 @@ next_sector:
 
 		sector = BM_BIT_TO_SECT(bit);
 
-		if (drbd_rs_should_slow_down(mdev, sector) ||
-		    drbd_try_rs_begin_io(mdev, sector)) {
+		if (drbd_rs_should_slow_down(mdev, sector)) {
+			/* skip the rest of this hot resync extent for now */
+			if (mdev->rs_hot_fo == DRBD_END_OF_BITMAP)
+				mdev->rs_hot_fo = bit;
+			mdev->bm_resync_fo = min_t(unsigned long, drbd_bm_bits(mdev),
+				(bit | ((1UL << BM_BLOCKS_PER_BM_EXT_B) - 1)) + 1);
+			/* charge the skip against this turn, so that one turn
+			 * does not walk all the rest of the bitmap */
+			if (--number <= i)
+				goto requeue;
+			goto next_sector;
+		}
+		if (drbd_try_rs_begin_io(mdev, sector)) {
 			mdev->bm_resync_fo = bit;
 			goto requeue;
 		}
@@ -773,6 +920,282 @@ next_sector:
 	return 1;
 }
 
+/* Partitioned online verify.
+ *
+ * The verify source walks up to DRBD_OV_CURSORS_MAX ranges of the device,
+ * handing out requests round robin. Every DRBD_OV_CKPT_TIME we take a
+ * snapshot of the cursor positions. Once all requests sent before the
+ * snapshot are answered, it is a safe resume point, and goes to the meta
+ * data, after the out of sync bits found so far went to the bitmap.
+ *
+ * The verify target is unaware of all this, it only answers requests.
+ * We need protocol 97 for that, so we can tell it when we are done. */
+
+STATIC sector_t ov_cursor_limit(struct drbd_conf *mdev, struct drbd_ov_cursor *c,
+				sector_t capacity)
+{
+	sector_t limit = min_t(sector_t, c->end, capacity);
+
+	/* the stop sector may be changed while verify is running */
+	if (mdev->ov_stop_sector < limit)
+		limit = mdev->ov_stop_sector;
+	return limit;
+}
+
+STATIC bool ov_cursors_through(struct drbd_conf *mdev)
+{
+	const sector_t capacity = drbd_get_capacity(mdev->this_bdev);
+	int i;
+
+	for (i = 0; i < mdev->ov_nr_cursors; i++)
+		if (mdev->ov_cursor[i].position <
+		    ov_cursor_limit(mdev, &mdev->ov_cursor[i], capacity))
+			return false;
+	return true;
+}
+
+/* next cursor with something left to do, NULL if all are through */
+STATIC struct drbd_ov_cursor *ov_next_cursor(struct drbd_conf *mdev, sector_t capacity)
+{
+	struct drbd_ov_cursor *c;
+	int i, k;
+
+	for (i = 0; i < mdev->ov_nr_cursors; i++) {
+		k = (mdev->ov_next_cursor + i) % mdev->ov_nr_cursors;
+		c = &mdev->ov_cursor[k];
+		if (c->position < ov_cursor_limit(mdev, c, capacity)) {
+			mdev->ov_next_cursor = (k + 1) % mdev->ov_nr_cursors;
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/* copy the snapshot to the super block, drbd_md_sync() will write it */
+STATIC void ov_ckpt_store(struct drbd_conf *mdev, struct drbd_md *md)
+{
+	int i;
+
+	md->ov_ckpt_start = mdev->ov_start_sector;
+	md->ov_ckpt_stop = mdev->ov_stop_sector;
+	for (i = 0; i < mdev->ov_nr_cursors; i++) {
+		md->ov_ckpt[i].pos = mdev->ov_cursor[i].snap;
+		md->ov_ckpt[i].end = mdev->ov_cursor[i].end;
+	}
+	md->ov_ckpt_nr = mdev->ov_nr_cursors;
+	drbd_md_mark_dirty(mdev);
+}
+
+STATIC void ov_commit_checkpoint(struct drbd_conf *mdev)
+{
+	mdev->ov_snap_in_flight = -1;
+	mdev->ov_snap_time = jiffies;
+
+	if (!get_ldev(mdev))
+		return;
+
+	/* the bits found before the snapshot must be on disk before it */
+	if (mdev->ov_snap_oos) {
+		mdev->ov_snap_oos = false;
+		if (drbd_bm_write_lazy(mdev, 0)) {
+			put_ldev(mdev);
+			return;
+		}
+	}
+	ov_ckpt_store(mdev, &mdev->ldev->md);
+	put_ldev(mdev);
+}
+
+STATIC void ov_maybe_snapshot(struct drbd_conf *mdev)
+{
+	int i;
+
+	if (mdev->ov_snap_in_flight >= 0 ||
+	    time_before(jiffies, mdev->ov_snap_time + DRBD_OV_CKPT_TIME))
+		return;
+
+	for (i = 0; i < mdev->ov_nr_cursors; i++)
+		mdev->ov_cursor[i].snap = mdev->ov_cursor[i].position;
+	mdev->ov_snap_in_flight = mdev->ov_in_flight;
+	if (mdev->ov_snap_in_flight == 0)
+		ov_commit_checkpoint(mdev);
+}
+
+/* the reply for the verify request at @sector has been processed */
+STATIC void ov_request_done(struct drbd_conf *mdev, sector_t sector)
+{
+	struct drbd_ov_cursor *c;
+
+	mdev->ov_in_flight--;
+	if (mdev->ov_snap_in_flight <= 0)
+		return;
+
+	for (c = mdev->ov_cursor; c < mdev->ov_cursor + mdev->ov_nr_cursors; c++) {
+		if (sector < c->start || sector >= c->end)
+			continue;
+		if (sector < c->snap && --mdev->ov_snap_in_flight == 0)
+			ov_commit_checkpoint(mdev);
+		break;
+	}
+}
+
+/**
+ * drbd_ov_init_cursors() - Set up the cursors for a verify run
+ * @mdev:	DRBD device.
+ *
+ * Helper for set_ov_position(), called with req_lock held.
+ * Resumes from the checkpoint, if there is one for this ov_start_sector.
+ * Otherwise splits ov_start_sector to ov_stop_sector into
+ * sync_conf.verify_partitions ranges of whole resync extents.
+ */
+void drbd_ov_init_cursors(struct drbd_conf *mdev)
+{
+	const unsigned long bits = drbd_bm_bits(mdev);
+	unsigned long sb, eb, b, per, left = 0;
+	struct drbd_ov_cursor *c;
+	struct drbd_md *md;
+	int i, n;
+
+	memset(mdev->ov_cursor, 0, sizeof(mdev->ov_cursor));
+	mdev->ov_nr_cursors = 0;
+	mdev->ov_next_cursor = 0;
+	mdev->ov_in_flight = 0;
+	mdev->ov_snap_in_flight = -1;
+	mdev->ov_snap_time = jiffies;
+	mdev->ov_snap_oos = false;
+	mdev->rs_total = 0;
+
+	if (!get_ldev(mdev))
+		return;
+	md = &mdev->ldev->md;
+
+	if (md->ov_ckpt_nr && md->ov_ckpt_start == mdev->ov_start_sector) {
+		n = md->ov_ckpt_nr;
+		for (i = 0; i < n; i++) {
+			c = &mdev->ov_cursor[i];
+			c->start = c->position = md->ov_ckpt[i].pos;
+			c->end = md->ov_ckpt[i].end;
+		}
+		dev_info(DEV, "Online Verify resumes from checkpoint (%d ranges)\n", n);
+	} else {
+		sb = BM_SECT_TO_BIT(mdev->ov_start_sector);
+		if (sb >= bits)
+			sb = bits - 1;
+		if (mdev->ov_stop_sector >= BM_BIT_TO_SECT(bits))
+			eb = bits;
+		else
+			eb = BM_SECT_TO_BIT(mdev->ov_stop_sector + BM_SECT_PER_BIT - 1);
+		if (eb <= sb)
+			eb = sb + 1;
+
+		n = max(1, min(mdev->sync_conf.verify_partitions, DRBD_OV_CURSORS_MAX));
+		per = ALIGN((eb - sb + n - 1) / n, 1UL << BM_BLOCKS_PER_BM_EXT_B);
+		for (i = 0, b = sb; i < n && b < eb; i++, b += per) {
+			c = &mdev->ov_cursor[i];
+			c->start = c->position = c->snap = BM_BIT_TO_SECT(b);
+			c->end = BM_BIT_TO_SECT(min(b + per, eb));
+		}
+		n = i;
+		/* the stop sector may still be moved up while we run */
+		mdev->ov_cursor[n - 1].end = BM_BIT_TO_SECT(bits);
+		mdev->ov_nr_cursors = n;
+
+		/* a new run replaces the checkpoint of any earlier one */
+		ov_ckpt_store(mdev, md);
+	}
+	mdev->ov_nr_cursors = n;
+	put_ldev(mdev);
+
+	for (i = 0; i < n; i++) {
+		c = &mdev->ov_cursor[i];
+		if (c->end > c->position)
+			left += BM_SECT_TO_BIT(c->end - c->position);
+	}
+	mdev->rs_total = left;
+	mdev->ov_position = mdev->ov_cursor[0].position;
+}
+
+/**
+ * drbd_ov_stopped() - A verify run with cursors ended
+ * @mdev:	DRBD device.
+ *
+ * Helper for __drbd_set_state(), called with req_lock held.
+ * If it was interrupted, keep ov_start_sector, so the checkpoint
+ * matches when verify is started again.
+ */
+void drbd_ov_stopped(struct drbd_conf *mdev)
+{
+	if (ov_cursors_through(mdev) && mdev->ov_in_flight == 0) {
+		if (get_ldev(mdev)) {
+			mdev->ldev->md.ov_ckpt_nr = 0;
+			drbd_md_mark_dirty(mdev);
+			put_ldev(mdev);
+		}
+		/* with one cursor, continue after the stop sector next time */
+		if (mdev->ov_nr_cursors == 1) {
+			mdev->ov_start_sector = mdev->ov_cursor[0].position;
+			if (mdev->ov_left)
+				dev_info(DEV, "Online Verify reached sector %llu\n",
+					(unsigned long long)mdev->ov_start_sector);
+		} else
+			mdev->ov_start_sector = 0;
+	} else
+		dev_info(DEV, "Online Verify interrupted, %lu bits left, "
+			 "will resume from checkpoint\n", mdev->ov_left);
+	mdev->ov_nr_cursors = 0;
+}
+
+STATIC int make_ov_cursor_requests(struct drbd_conf *mdev, int number)
+{
+	const sector_t capacity = drbd_get_capacity(mdev->this_bdev);
+	struct drbd_ov_cursor *c = NULL;
+	sector_t sector;
+	int i, size;
+
+	ov_maybe_snapshot(mdev);
+
+	for (i = 0; i < number; i++) {
+		c = ov_next_cursor(mdev, capacity);
+		if (!c)
+			break;
+
+		sector = c->position;
+		size = BM_BLOCK_SIZE;
+
+		if (drbd_rs_should_slow_down(mdev, sector) ||
+		    drbd_try_rs_begin_io(mdev, sector)) {
+			/* retry this one first */
+			mdev->ov_next_cursor = c - mdev->ov_cursor;
+			goto requeue;
+		}
+
+		if (sector + (size>>9) > capacity)
+			size = (capacity-sector)<<9;
+
+		inc_rs_pending(mdev);
+		if (!drbd_send_ov_request(mdev, sector, size)) {
+			dec_rs_pending(mdev);
+			return 0;
+		}
+		c->position = sector + BM_SECT_PER_BIT;
+		mdev->ov_in_flight++;
+		mdev->ov_position = c->position;
+	}
+
+ requeue:
+	mdev->rs_in_flight += (i << (BM_BLOCK_SHIFT - 9));
+	/* c is also NULL if the controller gave us no requests this turn */
+	if (!ov_cursors_through(mdev))
+		mod_timer(&mdev->resync_timer, jiffies + SLEEP_TIME);
+	else if (mdev->ov_in_flight == 0) {
+		/* nothing left to wait for, e.g. the stop sector was moved
+		 * below our position; otherwise w_e_end_ov_reply() finishes */
+		ov_oos_print(mdev);
+		drbd_resync_finished(mdev);
+	}
+	return 1;
+}
+
 STATIC int w_make_ov_request(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 {
 	int number, i, size;
@@ -785,6 +1208,9 @@ STATIC int w_make_ov_request(struct drbd_conf *mdev, struct drbd_work *w, int ca
 
 	number = drbd_rs_number_requests(mdev);
 
+	if (mdev->ov_nr_cursors)
+		return make_ov_cursor_requests(mdev, number);
+
 	sector = mdev->ov_position;
 	for (i = 0; i < number; i++) {
 		if (sector >= capacity)
@@ -848,6 +1274,45 @@ int w_start_resync(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 	return 1;
 }
 
+/**
+ * w_resume_ov() - Continue an interrupted online verify from its checkpoint
+ * @mdev:	DRBD device.
+ * @w:		work object.
+ * @cancel:	The connection will be closed anyways (unused in this callback)
+ *
+ * Queued by after_state_ch() once we are connected and up to date.
+ */
+int w_resume_ov(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
+{
+	bool resume = false;
+
+	if (unlikely(cancel))
+		return 1;
+
+	if (get_ldev(mdev)) {
+		resume = mdev->ldev->md.ov_ckpt_nr &&
+			mdev->ldev->md.ov_ckpt_start == mdev->ov_start_sector;
+		if (resume)
+			mdev->ov_stop_sector = mdev->ldev->md.ov_ckpt_stop;
+		put_ldev(mdev);
+	}
+	if (!resume || mdev->state.conn != C_CONNECTED)
+		return 1;
+
+	/* drbd_nl_start_ov() waits for the bitmap IO, we cannot, it is done
+	 * by this very thread.  w_bitmap_io() queues us again once it is. */
+	if (drbd_test_flag(mdev, BITMAP_IO)) {
+		drbd_set_flag(mdev, RESUME_OV_PENDING);
+		return 1;
+	}
+
+	dev_info(DEV, "Resuming interrupted online verify\n");
+	/* not CS_ORDERED, that would wait for after_state_ch(),
+	 * which is queued for this very thread as well */
+	_drbd_request_state(mdev, NS(conn, C_VERIFY_S), CS_VERBOSE);
+	return 1;
+}
+
 int w_ov_finished(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 {
 	kfree(w);
@@ -857,9 +1322,19 @@ int w_ov_finished(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 	return 1;
 }
 
-STATIC int w_resync_finished(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
+void resync_finished_timer_fn(unsigned long data)
 {
-	kfree(w);
+	struct drbd_conf *mdev = (struct drbd_conf *) data;
+
+	if (!drbd_test_and_set_flag(mdev, RESYNC_FINISHED_QUEUED))
+		drbd_queue_work(&mdev->data.work, &mdev->resync_finished_work);
+}
+
+int w_resync_finished(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
+{
+	drbd_clear_flag(mdev, RESYNC_FINISHED_QUEUED);
+	if (unlikely(cancel))
+		return 1;
 
 	drbd_resync_finished(mdev);
 
@@ -879,7 +1354,6 @@ int drbd_resync_finished(struct drbd_conf *mdev)
 	unsigned long db, dt, dbdt;
 	unsigned long n_oos;
 	union drbd_state os, ns;
-	struct drbd_work *w;
 	char *khelper_cmd = NULL;
 	int verify_done = 0;
 
@@ -890,17 +1364,12 @@ int drbd_resync_finished(struct drbd_conf *mdev)
 		/* In case this is not possible now, most probably because
 		 * there are P_RS_DATA_REPLY Packets lingering on the worker's
 		 * queue (or even the read operations for those packets
-		 * is not finished by now).   Retry in 100ms. */
+		 * is not finished by now).   Retry in 100ms.
+		 * Do not sleep here, the worker may have to send those. */
 
 		drbd_kick_lo(mdev);
-		schedule_timeout_interruptible(HZ / 10);
-		w = kmalloc(sizeof(struct drbd_work), GFP_ATOMIC);
-		if (w) {
-			w->cb = w_resync_finished;
-			drbd_queue_work(&mdev->data.work, w);
-			return 1;
-		}
-		dev_err(DEV, "Warn failed to drbd_rs_del_all() and to kmalloc(w).\n");
+		mod_timer(&mdev->resync_finished_timer, jiffies + HZ / 10);
+		return 1;
 	}
 
 	dt = (jiffies - mdev->rs_start - mdev->rs_paused) / HZ;
@@ -1029,14 +1498,16 @@ out:
 	return 1;
 }
 
-/* helper */
-static void move_to_net_ee_or_free(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
+/* helper, also used by drbd_send_dblock() */
+void move_to_net_ee_or_free(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
 {
 	if (drbd_ee_has_active_page(e)) {
 		/* This might happen if sendpage() has not finished */
 		int i = (e->size + PAGE_SIZE -1) >> PAGE_SHIFT;
-		atomic_add(i, &mdev->pp_in_use_by_net);
-		atomic_sub(i, &mdev->pp_in_use);
+		if (!(e->flags & EE_SEND_BUFFER)) {
+			atomic_add(i, &mdev->pp_in_use_by_net);
+			atomic_sub(i, &mdev->pp_in_use);
+		}
 		spin_lock_irq(&mdev->req_lock);
 		list_add_tail(&e->w.list, &mdev->net_ee);
 		spin_unlock_irq(&mdev->req_lock);
@@ -1081,6 +1552,40 @@ int w_e_end_data_req(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 	return ok;
 }
 
+/* The ee holds data from the local disk, so e->size is a multiple of
+ * 512 bytes, and each page but the last is full. */
+static int drbd_ee_is_zero(struct drbd_epoch_entry *e)
+{
+	struct page *page = e->pages;
+	unsigned int left = e->size;
+
+	page_chain_for_each(page) {
+		unsigned int len = min_t(unsigned int, left, PAGE_SIZE);
+		unsigned long *p = kmap(page);
+		unsigned long *end = p + len / sizeof(*p);
+		unsigned long any = 0;
+
+		/* or together a few words at a time, test once per cache line */
+		for (; p < end && !any; p += 8)
+			any = p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7];
+		kunmap(page);
+		if (any)
+			return 0;
+		left -= len;
+		if (!left)
+			break;
+	}
+	return 1;
+}
+
+/* P_RS_DATA_REPLY, or just P_RS_ZEROES if the block is all zero */
+static int drbd_send_rs_block(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
+{
+	if (mdev->agreed_pro_version >= 99 && drbd_ee_is_zero(e))
+		return drbd_send_rs_zeroes(mdev, e);
+	return drbd_send_block(mdev, P_RS_DATA_REPLY, e);
+}
+
 /**
  * w_e_end_rsdata_req() - Worker callback to send a P_RS_DATA_REPLY packet in response to a P_RS_DATA_REQUESTRS
  * @mdev:	DRBD device.
@@ -1108,7 +1613,7 @@ int w_e_end_rsdata_req(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 	} else if (likely((e->flags & EE_WAS_ERROR) == 0)) {
 		if (likely(mdev->state.pdsk >= D_INCONSISTENT)) {
 			inc_rs_pending(mdev);
-			ok = drbd_send_block(mdev, P_RS_DATA_REPLY, e);
+			ok = drbd_send_rs_block(mdev, e);
 		} else {
 			if (DRBD_ratelimit(5*HZ, 5))
 				dev_err(DEV, "Not sending RSDataReply, "
@@ -1181,7 +1686,7 @@ int w_e_end_csum_rs_req(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 			e->block_id = ID_SYNCER; /* By setting block_id, digest pointer becomes invalid! */
 			e->flags &= ~EE_HAS_DIGEST; /* This e no longer has a digest pointer */
 			kfree(di);
-			ok = drbd_send_block(mdev, P_RS_DATA_REPLY, e);
+			ok = drbd_send_rs_block(mdev, e);
 		}
 	} else {
 		ok = drbd_send_ack(mdev, P_NEG_RS_DREPLY, e);
@@ -1246,12 +1751,27 @@ out:
 
 void drbd_ov_oos_found(struct drbd_conf *mdev, sector_t sector, int size)
 {
-	if (mdev->ov_last_oos_start + mdev->ov_last_oos_size == sector) {
-		mdev->ov_last_oos_size += size>>9;
-	} else {
-		mdev->ov_last_oos_start = sector;
-		mdev->ov_last_oos_size = size>>9;
+	struct drbd_ov_oos_range *r, *unused = NULL;
+	int i;
+
+	/* with several verify cursors, results of different ranges interleave */
+	for (i = 0; i < DRBD_OV_OOS_RANGES; i++) {
+		r = &mdev->ov_oos[i];
+		if (r->size && r->start + r->size == sector) {
+			r->size += size>>9;
+			goto out;
+		}
+		if (!r->size && !unused)
+			unused = r;
+	}
+	if (!unused) {
+		unused = &mdev->ov_oos[0];
+		ov_oos_print_range(mdev, unused);
 	}
+	unused->start = sector;
+	unused->size = size>>9;
+out:
+	mdev->ov_snap_oos = true;
 	drbd_set_out_of_sync(mdev, sector, size);
 }
 
@@ -1302,7 +1822,7 @@ int w_e_end_ov_reply(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 	if (!eq)
 		drbd_ov_oos_found(mdev, sector, size);
 	else
-		ov_oos_print(mdev);
+		ov_oos_in_sync(mdev, sector);
 
 	ok = drbd_send_ack_ex(mdev, P_OV_RESULT, sector, size,
 			      eq ? ID_IN_SYNC : ID_OUT_OF_SYNC);
@@ -1315,8 +1835,13 @@ int w_e_end_ov_reply(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 	if ((mdev->ov_left & 0x200) == 0x200)
 		drbd_advance_rs_marks(mdev, mdev->ov_left);
 
-	stop_sector_reached = mdev->agreed_pro_version >= 97 &&
-		(sector + (size>>9)) >= mdev->ov_stop_sector;
+	if (mdev->ov_nr_cursors) {
+		ov_request_done(mdev, sector);
+		stop_sector_reached = mdev->ov_in_flight == 0 &&
+			ov_cursors_through(mdev);
+	} else
+		stop_sector_reached = mdev->agreed_pro_version >= 97 &&
+			(sector + (size>>9)) >= mdev->ov_stop_sector;
 
 	if (mdev->ov_left == 0 || stop_sector_reached) {
 		ov_oos_print(mdev);
@@ -1354,11 +1879,14 @@ int w_send_barrier(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 	if (!drbd_get_data_sock(mdev))
 		return 0;
 	p->barrier = b->br_number;
+	b->sent_ns = drbd_lat_now();
 	/* inc_ap_pending was done where this was queued.
 	 * dec_ap_pending will be done in got_BarrierAck
 	 * or (on connection loss) in w_clear_epoch.  */
 	ok = _drbd_send_cmd(mdev, mdev->data.socket, P_BARRIER,
 				(struct p_header80 *)p, sizeof(*p), 0);
+	if (ok)
+		drbd_stat_add(mdev, STAT_EPOCHS, 1);
 	drbd_put_data_sock(mdev);
 
 	return ok;
@@ -1452,6 +1980,7 @@ int w_restart_disk_io(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 
 	drbd_req_make_private_bio(req, req->master_bio);
 	req->private_bio->bi_bdev = mdev->ldev->backing_bdev;
+	atomic_inc(&mdev->ap_local_cnt);
 	generic_make_request(req->private_bio);
 
 	return 1;
@@ -1588,6 +2117,10 @@ void drbd_rs_controller_reset(struct drbd_conf *mdev)
 	atomic_set(&mdev->rs_sect_ev, 0);
 	mdev->rs_in_flight = 0;
 	mdev->rs_planed = 0;
+	/* start at the top, drbd_rs_auto_tune() backs off quickly */
+	mdev->c_auto_rate = mdev->sync_conf.c_plan_ahead ?
+		mdev->sync_conf.c_max_rate : mdev->sync_conf.rate;
+	mdev->c_auto_app_samples = drbd_lat_samples(mdev, LAT_APP);
 	spin_lock(&mdev->peer_seq_lock);
 	fifo_set(&mdev->rs_plan_s, 0);
 	spin_unlock(&mdev->peer_seq_lock);
@@ -1699,8 +2232,10 @@ void drbd_start_resync(struct drbd_conf *mdev, enum drbd_conns side)
 		     drbd_conn_str(ns.conn),
 		     (unsigned long) mdev->rs_total << (BM_BLOCK_SHIFT-10),
 		     (unsigned long) mdev->rs_total);
-		if (side == C_SYNC_TARGET)
+		if (side == C_SYNC_TARGET) {
 			mdev->bm_resync_fo = 0;
+			mdev->rs_hot_fo = DRBD_END_OF_BITMAP;
+		}
 
 		/* Since protocol 96, we must serialize drbd_gen_and_send_sync_uuid
 		 * with w_send_oos, or the sync target will get confused as to
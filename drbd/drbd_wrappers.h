@@ -426,6 +426,11 @@ static __inline__ int atomic_sub_return(int i, atomic_t *v)
 
 #endif
 
+#ifndef spin_lock_nest_lock
+/* lockdep annotation only, introduced with 2.6.27 */
+#define spin_lock_nest_lock(lock, nest_lock) spin_lock(lock)
+#endif
+
 #if !defined(CRYPTO_ALG_ASYNC)
 /* With Linux-2.6.19 the crypto API changed! */
 /* This is not a generic backport of the new api, it just implements
@@ -1186,4 +1191,23 @@ static inline void *__drbd_vmalloc(unsigned long size, gfp_t gfp_mask, pgprot_t
 #define __vmalloc(SIZE, GFP, PROT) __drbd_vmalloc(SIZE, GFP, PROT)
 #endif
 
+#ifndef for_each_possible_cpu
+/* introduced in 2.6.16, for_each_cpu() used to mean the same */
+#define for_each_possible_cpu(cpu) for_each_cpu(cpu)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
+/* no ktime_get() yet, jiffies resolution has to do for the latency histograms */
+static inline u64 drbd_lat_now(void)
+{
+	return (u64)jiffies * (1000000000ULL / HZ);
+}
+#else
+#include <linux/ktime.h>
+static inline u64 drbd_lat_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+#endif
+
 #endif
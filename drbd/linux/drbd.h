@@ -96,6 +96,25 @@ enum drbd_on_congestion {
 	OC_DISCONNECT,
 };
 
+enum drbd_read_balancing {
+	RB_PREFER_LOCAL,
+	RB_PREFER_REMOTE,
+	RB_ROUND_ROBIN,
+	RB_LEAST_PENDING,
+	RB_CONGESTED_REMOTE,
+	RB_32K_STRIPING,
+	RB_64K_STRIPING,
+	RB_128K_STRIPING,
+	RB_256K_STRIPING,
+	RB_512K_STRIPING,
+	RB_1M_STRIPING,
+};
+
+enum drbd_al_replacement {
+	ALR_LRU,
+	ALR_2Q,
+};
+
 /* KEEP the order, do not delete or insert. Only append. */
 enum drbd_ret_code {
 	ERR_CODE_BASE		= 100,
@@ -331,6 +350,115 @@ enum drbd_uuid_index {
 	UI_EXTENDED_SIZE   /* Everything. */
 };
 
+/* latency histograms, see drbd_lat_account() */
+enum drbd_lat_class {
+	LAT_LOCAL_WRITE, /* local disk write: submit -> completion */
+	LAT_PEER_ACK,    /* P_DATA sent -> P_WRITE_ACK/P_RECV_ACK */
+	LAT_AL_WRITE,    /* activity log transaction */
+	LAT_BARRIER,     /* P_BARRIER sent -> P_BARRIER_ACK */
+	LAT_APP,         /* application request: submit -> completion */
+	LAT_PING,        /* P_PING sent -> P_PING_ACK, the network round trip */
+	LAT_CLASSES      /* nl-packet: number of histograms */
+};
+
+/* Bucket 0 counts latencies below 1us, bucket i those in [2^(i-1), 2^i) us.
+ * The last bucket also gets everything above. */
+#define LAT_BUCKETS 24
+
+/* statistics counters, see drbd_stat_add().
+ * KEEP the order, do not delete or insert. Only append. */
+enum drbd_stat_counter {
+	STAT_SEND_SECT,       /* "ns" in /proc/drbd, in sectors */
+	STAT_RECV_SECT,       /* "nr" */
+	STAT_WRIT_SECT,       /* "dw" */
+	STAT_READ_SECT,       /* "dr" */
+	STAT_AL_WRITES,       /* "al" */
+	STAT_BM_WRITES,       /* "bm" */
+	STAT_DATA_SENT_BYTES,
+	STAT_DATA_RECV_BYTES,
+	STAT_META_SENT_BYTES,
+	STAT_META_RECV_BYTES,
+	STAT_EPOCHS,          /* P_BARRIER packets sent */
+	STAT_FLUSHES,         /* flushes issued to the backing device */
+	STAT_AL_HITS,
+	STAT_AL_MISSES,
+	STAT_RS_SENT_BYTES,   /* resync data sent */
+	STAT_RS_RECV_BYTES,   /* resync data received */
+	STAT_COMPRESS_IN_BYTES,  /* payload offered to compression */
+	STAT_COMPRESS_OUT_BYTES, /* what went on the wire for it */
+	STAT_COMPRESS_RAW,       /* packets sent raw, as they did not shrink */
+	STAT_COMPRESS_NS,        /* cpu time spent compressing */
+	STAT_DECOMPRESS_NS,      /* cpu time spent decompressing */
+	STAT_RS_ZERO_BYTES,      /* resync data sent or received as P_RS_ZEROES */
+	STAT_RB_LOCAL_READS,     /* balanceable reads the policy kept local */
+	STAT_RB_REMOTE_READS,    /* balanceable reads the policy sent to the peer */
+	STAT_RA_REQ_BYTES,       /* requested from the peer speculatively */
+	STAT_RA_HIT_BYTES,       /* reads served from the readahead cache */
+	STAT_RS_THROTTLED,       /* resync requests deferred, their extent was hot */
+	STAT_RS_PASSED,          /* resync requests let through while busy, cold extent */
+	STAT_AL_PREFETCHES,      /* extents activated ahead of a sequential write stream */
+	STAT_AL_PREFETCH_HITS,   /* writes that found such an extent active */
+	STAT_COUNTERS         /* nl-packet: number of counters */
+};
+
+/* nl-packet: slots for the per packet type counters, indexed by
+ * enum drbd_packets. Packet types above that are not counted. */
+#define STAT_PACKET_TYPES 64
+
+/* binary trace events, written into the per cpu rings of drbd_trace.ko
+ * and read from <debugfs>/drbd_trace/cpuN. Only append. */
+enum drbd_trace_type {
+	TEV_PACKET_SEND, /* sub: enum drbd_packets */
+	TEV_PACKET_RECV, /* sub: enum drbd_packets */
+	TEV_REQ,         /* sub: enum drbd_trace_req_stage, block_id: request */
+	TEV_BIO,         /* sub: TBIO_* flags */
+	TEV_EE,          /* sub: enum drbd_trace_ee_stage, block_id: peer's id */
+	TEV_AL,          /* sub: 0 al_begin_io, 1 al_complete_io */
+	TEV_EPOCH,       /* sub: enum epoch_event, block_id: barrier number */
+};
+
+enum drbd_trace_req_stage {
+	TRQ_OTHER,
+	TRQ_START,        /* master bio entered drbd_make_request */
+	TRQ_LOCAL_SUBMIT,
+	TRQ_NET_QUEUED,
+	TRQ_NET_SENT,     /* P_DATA handed over to the network */
+	TRQ_LOCAL_DONE,
+	TRQ_NET_ACKED,    /* P_RECV_ACK or P_WRITE_ACK */
+	TRQ_FAILED,
+	TRQ_COMPLETED,    /* master bio about to be completed */
+};
+
+enum drbd_trace_ee_stage {
+	TEE_OTHER,
+	TEE_ALLOC,
+	TEE_SUBMIT,
+	TEE_DONE,  /* local read or write completed */
+	TEE_ACKED, /* ack queued in process_done_ee */
+	TEE_FREE,
+};
+
+#define TBIO_COMPLETE 0x01
+#define TBIO_WRITE    0x02
+#define TBIO_MASTER   0x04 /* "Rq" */
+#define TBIO_PRIVATE  0x08 /* "Pri" */
+#define TBIO_PEER     0x10 /* "Sec" */
+#define TBIO_MD       0x20 /* "Md" */
+
+struct drbd_trace_event {
+	__u64 ts_ns;    /* monotonic, see drbd_lat_now() */
+	__u64 sector;
+	__u64 block_id;
+	__u32 size;
+	__u16 minor;
+	__u8 type;      /* enum drbd_trace_type */
+	__u8 sub;
+};
+
+/* from drbd_strings.c */
+extern const char *drbd_lat_class_str(enum drbd_lat_class);
+extern const char *drbd_stat_str(enum drbd_stat_counter);
+
 enum drbd_timeout_flag {
 	UT_DEFAULT      = 0,
 	UT_DEGRADED     = 1,
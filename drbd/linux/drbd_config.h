@@ -35,7 +35,7 @@ extern const char *drbd_buildtag(void);
 #define REL_VERSION "8.3.16"
 #define API_VERSION 88
 #define PRO_VERSION_MIN 86
-#define PRO_VERSION_MAX 97
+#define PRO_VERSION_MAX 99
 
 #ifndef __CHECKER__   /* for a sparse run, we need all STATICs */
 #define DBG_ALL_SYMBOLS /* no static functs, improves quality of OOPS traces */
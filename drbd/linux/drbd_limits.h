@@ -108,9 +108,11 @@
 
   /* less than 7 would hit performance unnecessarily.
    * 3833 is the largest prime that still does fit
-   * into 64 sectors of activity log */
+   * into the default 64 sectors of activity log,
+   * 65521 needs meta data created with a larger al area,
+   * see drbdmeta create-md --al-size */
 #define DRBD_AL_EXTENTS_MIN  7
-#define DRBD_AL_EXTENTS_MAX  3833
+#define DRBD_AL_EXTENTS_MAX  65521
 #define DRBD_AL_EXTENTS_DEF  127
 
 #define DRBD_AFTER_MIN  -1
@@ -136,6 +138,8 @@
 #define DRBD_RR_CONFLICT_DEF ASB_DISCONNECT
 #define DRBD_ON_NO_DATA_DEF OND_IO_ERROR
 #define DRBD_ON_CONGESTION_DEF OC_BLOCK
+#define DRBD_READ_BALANCING_DEF RB_PREFER_LOCAL
+#define DRBD_AL_REPLACEMENT_DEF ALR_LRU
 
 #define DRBD_MAX_BIO_BVECS_MIN 0
 #define DRBD_MAX_BIO_BVECS_MAX 128
@@ -161,6 +165,14 @@
 #define DRBD_C_MIN_RATE_MAX     (4 << 20)
 #define DRBD_C_MIN_RATE_DEF     4096
 
+#define DRBD_C_LAT_TARGET_MIN   0 /* 1/10 milliseconds */
+#define DRBD_C_LAT_TARGET_MAX   100000
+#define DRBD_C_LAT_TARGET_DEF   0 /* By default disabled */
+
+#define DRBD_VERIFY_PARTITIONS_MIN 1
+#define DRBD_VERIFY_PARTITIONS_MAX 16 /* DRBD_OV_CURSORS_MAX */
+#define DRBD_VERIFY_PARTITIONS_DEF 1
+
 #define DRBD_CONG_FILL_MIN	0
 #define DRBD_CONG_FILL_MAX	(10<<21) /* 10GByte in sectors */
 #define DRBD_CONG_FILL_DEF	0
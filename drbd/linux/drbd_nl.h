@@ -70,6 +70,7 @@ NL_PACKET(net_conf, 5,
 	NL_BIT(		61,	T_MAY_IGNORE,	no_cork)
 	NL_BIT(		62,	T_MANDATORY,	auto_sndbuf_size)
 	NL_BIT(		70,	T_MANDATORY,	dry_run)
+	NL_BIT(		95,	T_MAY_IGNORE,	compress_data)
 )
 
 NL_PACKET(disconnect, 6,
@@ -100,6 +101,10 @@ NL_PACKET(syncer_conf, 8,
 	NL_INTEGER(     78,	T_MAY_IGNORE,	c_fill_target)
 	NL_INTEGER(     79,	T_MAY_IGNORE,	c_max_rate)
 	NL_INTEGER(     80,	T_MAY_IGNORE,	c_min_rate)
+	NL_INTEGER(     96,	T_MAY_IGNORE,	read_balancing)
+	NL_INTEGER(     97,	T_MAY_IGNORE,	c_lat_target)
+	NL_INTEGER(     98,	T_MAY_IGNORE,	verify_partitions)
+	NL_INTEGER(     99,	T_MAY_IGNORE,	al_replacement)
 )
 
 NL_PACKET(invalidate, 9, )
@@ -155,6 +160,16 @@ NL_PACKET(new_c_uuid, 26,
 NL_RESPONSE(return_code_only, 27)
 #endif
 
+NL_PACKET(get_latency, 28,
+	NL_STRING(	91,	T_MAY_IGNORE,	lat_hist, (LAT_CLASSES*LAT_BUCKETS*sizeof(__u64)))
+)
+
+NL_PACKET(get_stats, 29,
+	NL_STRING(	92,	T_MAY_IGNORE,	stat_counters, (STAT_COUNTERS*sizeof(__u64)))
+	NL_STRING(	93,	T_MAY_IGNORE,	stat_pkt_sent, (STAT_PACKET_TYPES*sizeof(__u64)))
+	NL_STRING(	94,	T_MAY_IGNORE,	stat_pkt_recv, (STAT_PACKET_TYPES*sizeof(__u64)))
+)
+
 #undef NL_PACKET
 #undef NL_INTEGER
 #undef NL_INT64
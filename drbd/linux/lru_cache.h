@@ -26,7 +26,11 @@
 #ifndef LRU_CACHE_H
 #define LRU_CACHE_H
 
+#include <linux/version.h>
 #include <linux/list.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#include <linux/rculist.h>
+#endif
 #include <linux/slab.h>
 #include <linux/bitops.h>
 #include <linux/string.h> /* for memset */
@@ -66,6 +70,8 @@ This header file (and its .c file; kernel-doc of functions see there)
   the active set before we can "heat" a previously unused region.
 
   Because of this later property, it is called "lru_cache".
+  Optionally, a scan resistant 2Q like policy picks the region to cool down
+  instead, see lc_set_policy().
   As it actually Tracks Objects in an Active SeT, we could also call it
   toast (incidentally that is what may happen to the data on the
   backend storage uppon next resync, if we don't get it right).
@@ -160,10 +166,11 @@ write intent log information, three of which are mentioned here.
  * region number (label) easily.  To do the label -> object lookup without a
  * full list walk, we use a simple hash table.
  *
- * .list is on one of three lists:
+ * .list is on one of four lists:
  *  in_use: currently in use (refcnt > 0, lc_number != LC_FREE)
  *     lru: unused but ready to be reused or recycled
  *          (lc_refcnt == 0, lc_number != LC_FREE),
+ * lru_once: like lru, but only referenced once (LC_POLICY_2Q only),
  *    free: unused but ready to be recycled
  *          (lc_refcnt == 0, lc_number == LC_FREE),
  *
@@ -183,21 +190,37 @@ write intent log information, three of which are mentioned here.
 struct lc_element {
 	struct hlist_node colision;
 	struct list_head list;		 /* LRU list or free list */
-	unsigned refcnt;
+	/* only changed under the user's lock, except for the
+	 * lc_try_get_lockless() / lc_put_lockless() fast path */
+	atomic_t refcnt;
 	/* back "pointer" into lc_cache->element[index],
 	 * for paranoia, and for "lc_element_to_index" */
 	unsigned lc_index;
 	/* if we want to track a larger set of objects,
 	 * it needs to become arch independend u64 */
 	unsigned lc_number;
+	/* LC_POLICY_2Q: when the label was set, in units of lru_cache.changed,
+	 * and whether it was not referenced again since, counted in .once */
+	unsigned lc_birth;
+	unsigned lc_once;
+	/* see below: flag-bits for lc_element */
+	unsigned long lc_flags;
 
 	/* special label when on free list */
 #define LC_FREE (~0U)
 };
 
+/* replacement policies, see lc_set_policy() */
+enum lc_policy {
+	LC_POLICY_LRU,
+	LC_POLICY_2Q,
+	LC_NR_POLICIES
+};
+
 struct lru_cache {
 	/* the least recently used item is kept at lru->prev */
 	struct list_head lru;
+	struct list_head lru_once;
 	struct list_head free;
 	struct list_head in_use;
 
@@ -221,6 +244,18 @@ struct lru_cache {
 	/* statistics */
 	unsigned used; /* number of lelements currently on in_use list */
 	unsigned long hits, misses, starving, dirty, changed;
+	/* per replacement policy, and how it decided */
+	unsigned long policy_hits[LC_NR_POLICIES], policy_misses[LC_NR_POLICIES];
+	unsigned long promoted, ghost_hits, evicted_once, evicted;
+
+	/* see lc_set_policy() */
+	unsigned policy;
+	/* number of elements in the active set with .lc_once set */
+	unsigned once;
+	/* labels recently evicted from lru_once, the "ghost" list of 2Q.
+	 * Direct mapped by label, colliding labels overwrite each other. */
+	unsigned *ghost;
+	unsigned nr_ghost;
 
 	/* see below: flag-bits for lru_cache */
 	unsigned long flags;
@@ -262,10 +297,18 @@ enum {
 #define LC_DIRTY    (1<<__LC_DIRTY)
 #define LC_STARVING (1<<__LC_STARVING)
 
+/* flag-bits for lc_element */
+enum {
+	/* LC_POLICY_2Q: referenced again by a lockless hit, past the
+	 * correlated reference period.  See lc_touch_lockless(). */
+	__LC_REFERENCED,
+};
+
 extern struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 		unsigned e_count, size_t e_size, size_t e_off);
 extern void lc_reset(struct lru_cache *lc);
 extern void lc_destroy(struct lru_cache *lc);
+extern void lc_set_policy(struct lru_cache *lc, enum lc_policy policy);
 extern void lc_set(struct lru_cache *lc, unsigned int enr, int index);
 extern void lc_del(struct lru_cache *lc, struct lc_element *element);
 
@@ -275,6 +318,10 @@ extern struct lc_element *lc_get(struct lru_cache *lc, unsigned int enr);
 extern unsigned int lc_put(struct lru_cache *lc, struct lc_element *e);
 extern void lc_changed(struct lru_cache *lc, struct lc_element *e);
 
+extern struct lc_element *lc_find_lockless(struct lru_cache *lc, unsigned int enr);
+extern struct lc_element *lc_try_get_lockless(struct lru_cache *lc, unsigned int enr);
+extern int lc_put_lockless(struct lru_cache *lc, struct lc_element *e);
+
 struct seq_file;
 extern size_t lc_seq_printf_stats(struct seq_file *seq, struct lru_cache *lc);
 
@@ -306,7 +353,48 @@ static inline void lc_unlock(struct lru_cache *lc)
 static inline int lc_is_used(struct lru_cache *lc, unsigned int enr)
 {
 	struct lc_element *e = lc_find(lc, enr);
-	return e && e->refcnt;
+	return e && atomic_read(&e->refcnt);
+}
+
+/**
+ * lc_lockless_hit - check a reference gotten by lc_try_get_lockless()
+ * @lc: the lru cache to operate on
+ * @e: the element returned by lc_try_get_lockless()
+ * @enr: the label it was looked up by
+ *
+ * We did not hold the lock, so the element may have been recycled under us,
+ * or be in the middle of a label change.  Also refuse to hand out further
+ * references while @lc is starving, as lc_get() does.
+ * If this returns false, drop the reference again.
+ */
+static inline int lc_lockless_hit(struct lru_cache *lc, struct lc_element *e,
+				  unsigned int enr)
+{
+	/* atomic_inc_not_zero() in lc_try_get_lockless() implies a full
+	 * barrier, pairs with the smp_wmb() in lc_get() and lc_changed() */
+	if (ACCESS_ONCE(lc->changing_element) == e)
+		return 0;
+	smp_rmb();
+	return ACCESS_ONCE(e->lc_number) == enr &&
+		!(ACCESS_ONCE(lc->flags) & LC_STARVING);
+}
+
+/**
+ * lc_touch_lockless - record a hit verified by lc_lockless_hit()
+ * @lc: the lru cache to operate on
+ * @e: the element
+ *
+ * Lockless hits do not move elements between the lists, so without this
+ * the replacement policy would not see them.  The caller holds a reference,
+ * so .lc_birth is stable.  lc_put() or the next lc_get() under the lock
+ * fold it in.
+ */
+static inline void lc_touch_lockless(struct lru_cache *lc, struct lc_element *e)
+{
+	if (ACCESS_ONCE(e->lc_once) &&
+	    ACCESS_ONCE(lc->changed) - e->lc_birth > lc->nr_elements / 4 &&
+	    !test_bit(__LC_REFERENCED, &e->lc_flags))
+		set_bit(__LC_REFERENCED, &e->lc_flags);
 }
 
 #define lc_entry(ptr, type, member) \
@@ -26,8 +26,10 @@
 #include <linux/module.h>
 #include <linux/bitops.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/string.h> /* for memset */
 #include <linux/seq_file.h> /* for seq_printf */
+#include <linux/rcupdate.h>
 #include <linux/lru_cache.h>
 
 /* this is developers aid only.
@@ -50,6 +52,26 @@
 	BUG_ON(i >= lc_->nr_elements);	\
 	BUG_ON(lc_->lc_element[i] != e_); } while (0)
 
+/* With large al-extents, the per index arrays no longer fit into a few
+ * pages, and kmalloc would need high order allocations.
+ * Whether an array is vmalloced follows from its size alone,
+ * so lc_destroy() does not need to remember it. */
+static void *lc_alloc_array(size_t bytes)
+{
+	if (bytes <= PAGE_SIZE)
+		return kzalloc(bytes, GFP_KERNEL);
+	return __vmalloc(bytes, GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO,
+			PAGE_KERNEL);
+}
+
+static void lc_free_array(void *ptr, size_t bytes)
+{
+	if (bytes <= PAGE_SIZE)
+		kfree(ptr);
+	else
+		vfree(ptr);
+}
+
 /**
  * lc_create - prepares to track objects in an active set
  * @name: descriptive name only used in lc_seq_printf_stats and lc_seq_dump_details
@@ -65,6 +87,8 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 {
 	struct hlist_head *slot = NULL;
 	struct lc_element **element = NULL;
+	unsigned *ghost = NULL;
+	unsigned nr_ghost;
 	struct lru_cache *lc;
 	struct lc_element *e;
 	unsigned cache_obj_size = kmem_cache_size(cache);
@@ -79,12 +103,16 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	if (e_count > LC_MAX_ACTIVE)
 		return NULL;
 
-	slot = kzalloc(e_count * sizeof(struct hlist_head*), GFP_KERNEL);
+	nr_ghost = e_count / 2 ?: 1;
+	slot = lc_alloc_array(e_count * sizeof(struct hlist_head));
 	if (!slot)
 		goto out_fail;
-	element = kzalloc(e_count * sizeof(struct lc_element *), GFP_KERNEL);
+	element = lc_alloc_array(e_count * sizeof(struct lc_element *));
 	if (!element)
 		goto out_fail;
+	ghost = lc_alloc_array(nr_ghost * sizeof(unsigned));
+	if (!ghost)
+		goto out_fail;
 
 	lc = kzalloc(sizeof(*lc), GFP_KERNEL);
 	if (!lc)
@@ -92,6 +120,7 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 
 	INIT_LIST_HEAD(&lc->in_use);
 	INIT_LIST_HEAD(&lc->lru);
+	INIT_LIST_HEAD(&lc->lru_once);
 	INIT_LIST_HEAD(&lc->free);
 
 	lc->name = name;
@@ -102,6 +131,10 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	lc->lc_cache = cache;
 	lc->lc_element = element;
 	lc->lc_slot = slot;
+	lc->ghost = ghost;
+	lc->nr_ghost = nr_ghost;
+	for (i = 0; i < nr_ghost; i++)
+		ghost[i] = LC_FREE;
 
 	/* preallocate all objects */
 	for (i = 0; i < e_count; i++) {
@@ -125,8 +158,9 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	}
 	kfree(lc);
 out_fail:
-	kfree(element);
-	kfree(slot);
+	lc_free_array(ghost, nr_ghost * sizeof(unsigned));
+	lc_free_array(element, e_count * sizeof(struct lc_element *));
+	lc_free_array(slot, e_count * sizeof(struct hlist_head));
 	return NULL;
 }
 
@@ -151,11 +185,56 @@ void lc_destroy(struct lru_cache *lc)
 		return;
 	for (i = 0; i < lc->nr_elements; i++)
 		lc_free_by_index(lc, i);
-	kfree(lc->lc_element);
-	kfree(lc->lc_slot);
+	lc_free_array(lc->lc_element,
+		      lc->nr_elements * sizeof(struct lc_element *));
+	lc_free_array(lc->lc_slot, lc->nr_elements * sizeof(struct hlist_head));
+	lc_free_array(lc->ghost, lc->nr_ghost * sizeof(unsigned));
 	kfree(lc);
 }
 
+/**
+ * lc_set_policy - choose how @lc picks the unused element to recycle
+ * @lc: the lru cache to operate on
+ * @policy: %LC_POLICY_LRU or %LC_POLICY_2Q
+ *
+ * %LC_POLICY_LRU, the default, always recycles the least recently used one.
+ *
+ * %LC_POLICY_2Q keeps elements that were referenced only once apart from the
+ * frequently used ones.  References within nr_elements/4 label changes of
+ * the activation are considered correlated, and do not count.  As long as
+ * more than a quarter of the active set was referenced only once, those are
+ * recycled first, so a single large scan does not flush the hot set.
+ * Labels recycled that way are remembered in a ghost list; if they are
+ * wanted again soon, they are frequently used right away.
+ *
+ * May be called at any time, with the same locking as lc_get().
+ */
+void lc_set_policy(struct lru_cache *lc, enum lc_policy policy)
+{
+	struct lc_element *e;
+	unsigned i;
+
+	PARANOIA_ENTRY();
+	if (policy >= LC_NR_POLICIES || policy == lc->policy)
+		RETURN();
+	lc->policy = policy;
+	if (policy == LC_POLICY_2Q)
+		RETURN();
+
+	/* back to plain LRU: forget about referenced once,
+	 * those are older than anything on the lru list */
+	while (!list_empty(&lc->lru_once))
+		list_move_tail(lc->lru_once.next, &lc->lru);
+	for (i = 0; i < lc->nr_elements; i++) {
+		e = lc->lc_element[i];
+		e->lc_once = 0;
+	}
+	lc->once = 0;
+	for (i = 0; i < lc->nr_ghost; i++)
+		lc->ghost[i] = LC_FREE;
+	RETURN();
+}
+
 /**
  * lc_reset - does a full reset for @lc and the hash table slots.
  * @lc: the lru cache to operate on
@@ -169,6 +248,7 @@ void lc_reset(struct lru_cache *lc)
 
 	INIT_LIST_HEAD(&lc->in_use);
 	INIT_LIST_HEAD(&lc->lru);
+	INIT_LIST_HEAD(&lc->lru_once);
 	INIT_LIST_HEAD(&lc->free);
 	lc->used = 0;
 	lc->hits = 0;
@@ -176,10 +256,19 @@ void lc_reset(struct lru_cache *lc)
 	lc->starving = 0;
 	lc->dirty = 0;
 	lc->changed = 0;
+	memset(lc->policy_hits, 0, sizeof(lc->policy_hits));
+	memset(lc->policy_misses, 0, sizeof(lc->policy_misses));
+	lc->promoted = 0;
+	lc->ghost_hits = 0;
+	lc->evicted_once = 0;
+	lc->evicted = 0;
+	lc->once = 0;
 	lc->flags = 0;
 	lc->changing_element = NULL;
 	lc->new_number = LC_FREE;
 	memset(lc->lc_slot, 0, sizeof(struct hlist_head) * lc->nr_elements);
+	for (i = 0; i < lc->nr_ghost; i++)
+		lc->ghost[i] = LC_FREE;
 
 	for (i = 0; i < lc->nr_elements; i++) {
 		struct lc_element *e = lc->lc_element[i];
@@ -207,10 +296,36 @@ size_t lc_seq_printf_stats(struct seq_file *seq, struct lru_cache *lc)
 	 * progress) and "changed", when this in fact lead to an successful
 	 * update of the cache.
 	 */
-	return seq_printf(seq, "\t%s: used:%u/%u "
+	static const char *policy_names[LC_NR_POLICIES] = {
+		[LC_POLICY_LRU] = "lru",
+		[LC_POLICY_2Q] = "2q",
+	};
+	unsigned long h, t;
+	int p;
+
+	seq_printf(seq, "\t%s: used:%u/%u "
 		"hits:%lu misses:%lu starving:%lu dirty:%lu changed:%lu\n",
 		lc->name, lc->used, lc->nr_elements,
 		lc->hits, lc->misses, lc->starving, lc->dirty, lc->changed);
+
+	/* hit rate per policy that was in effect for some lc_get() */
+	seq_printf(seq, "\t%s: policy:%s once:%u promoted:%lu ghost_hits:%lu "
+		"evicted_once:%lu evicted:%lu hit_rate",
+		lc->name, policy_names[lc->policy], lc->once, lc->promoted,
+		lc->ghost_hits, lc->evicted_once, lc->evicted);
+	for (p = 0; p < LC_NR_POLICIES; p++) {
+		h = lc->policy_hits[p];
+		t = h + lc->policy_misses[p];
+		if (!t && p != lc->policy)
+			continue;
+		while (t > ULONG_MAX / 1000) {
+			h >>= 1;
+			t >>= 1;
+		}
+		h = t ? h * 1000 / t : 0;
+		seq_printf(seq, " %s:%lu.%lu%%", policy_names[p], h / 10, h % 10);
+	}
+	return seq_printf(seq, "\n");
 }
 
 static struct hlist_head *lc_hash_slot(struct lru_cache *lc, unsigned int enr)
@@ -242,22 +357,145 @@ struct lc_element *lc_find(struct lru_cache *lc, unsigned int enr)
 	return NULL;
 }
 
+/* The hash chains are modified with the _rcu list primitives, so lockless
+ * readers always see properly terminated chains.  Elements are never freed
+ * before lc_destroy(), but they are recycled without waiting for a grace
+ * period: a lockless reader may end up in a different chain, and miss the
+ * element it was looking for.  That is fine, it then takes the locked path.
+ * Whoever replaces a cache that lockless readers may still see has to wait
+ * for a grace period before lc_destroy(), and those readers have to look
+ * it up under rcu_read_lock().
+ */
+static void lc_unhash(struct lc_element *e)
+{
+	if (!hlist_unhashed(&e->colision)) {
+		hlist_del_rcu(&e->colision);
+		e->colision.pprev = NULL;
+	}
+}
+
+/**
+ * lc_find_lockless - find element by label, without holding the lock
+ * @lc: The lru_cache object
+ * @enr: element number
+ *
+ * Like lc_find(), but may be called without the lock the user serializes
+ * all other operations with.  It may miss the element, and the returned
+ * element may have been recycled in the mean time; unless the caller holds
+ * a reference on the element with label @enr, which pins it.
+ */
+struct lc_element *lc_find_lockless(struct lru_cache *lc, unsigned int enr)
+{
+	struct hlist_node *n;
+	struct lc_element *e;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(e, n, lc_hash_slot(lc, enr), colision) {
+		if (ACCESS_ONCE(e->lc_number) == enr)
+			goto out;
+	}
+	e = NULL;
+out:
+	rcu_read_unlock();
+	return e;
+}
+
+/**
+ * lc_try_get_lockless - get a reference on an element in use, without the lock
+ * @lc: the lru cache to operate on
+ * @enr: the label to look up
+ *
+ * Only elements that are in use already (refcnt > 0) are considered,
+ * so we never have to move elements between the lists, and never change
+ * the active set.  Does not count in the hits statistics.
+ *
+ * Returns NULL if there was no such element, nothing changed then.
+ * Otherwise we got a new reference on the returned element, which the
+ * caller has to verify with lc_lockless_hit().  If that fails, the
+ * reference has to be dropped again with lc_put_lockless(), or lc_put().
+ */
+struct lc_element *lc_try_get_lockless(struct lru_cache *lc, unsigned int enr)
+{
+	struct lc_element *e = lc_find_lockless(lc, enr);
+
+	if (e && atomic_inc_not_zero(&e->refcnt))
+		return e;
+	return NULL;
+}
+
+/**
+ * lc_put_lockless - give up refcnt of @e, without the lock
+ * @lc: the lru cache to operate on
+ * @e: the element to put
+ *
+ * Only drops the reference if it is not the last one.
+ * Returns 1 if it did, 0 if the caller needs to lc_put() under the lock,
+ * which then moves @e to the lru list.
+ */
+int lc_put_lockless(struct lru_cache *lc, struct lc_element *e)
+{
+	return atomic_add_unless(&e->refcnt, -1, 1);
+}
+
+/* a label recycled from lru_once is wanted again */
+static int lc_ghost_hit(struct lru_cache *lc, unsigned int enr)
+{
+	unsigned *g = lc->ghost + (enr % lc->nr_ghost);
+
+	if (*g != enr)
+		return 0;
+	*g = LC_FREE;
+	++lc->ghost_hits;
+	return 1;
+}
+
+static void lc_promote(struct lru_cache *lc, struct lc_element *e)
+{
+	if (e->lc_once) {
+		e->lc_once = 0;
+		lc->once--;
+		++lc->promoted;
+	}
+}
+
+/* 2Q: referenced again, after the correlated reference period;
+ * now, or by a lockless hit since the last time we looked */
+static void lc_touch(struct lru_cache *lc, struct lc_element *e)
+{
+	if (test_and_clear_bit(__LC_REFERENCED, &e->lc_flags) ||
+	    lc->changed - e->lc_birth > lc->nr_elements / 4)
+		lc_promote(lc, e);
+}
+
 /* returned element will be "recycled" immediately */
 static struct lc_element *lc_evict(struct lru_cache *lc)
 {
 	struct list_head  *n;
 	struct lc_element *e;
 
-	if (list_empty(&lc->lru))
+	/* With LC_POLICY_LRU, lru_once is always empty. */
+	if (!list_empty(&lc->lru_once) &&
+	    (lc->once > lc->nr_elements / 4 || list_empty(&lc->lru)))
+		n = lc->lru_once.prev;
+	else if (!list_empty(&lc->lru))
+		n = lc->lru.prev;
+	else
 		return NULL;
 
-	n = lc->lru.prev;
 	e = list_entry(n, struct lc_element, list);
 
 	PARANOIA_LC_ELEMENT(lc, e);
 
+	if (e->lc_once) {
+		e->lc_once = 0;
+		lc->once--;
+		lc->ghost[e->lc_number % lc->nr_ghost] = e->lc_number;
+		++lc->evicted_once;
+	} else
+		++lc->evicted;
+
 	list_del(&e->list);
-	hlist_del(&e->colision);
+	lc_unhash(e);
 	return e;
 }
 
@@ -273,10 +511,14 @@ void lc_del(struct lru_cache *lc, struct lc_element *e)
 {
 	PARANOIA_ENTRY();
 	PARANOIA_LC_ELEMENT(lc, e);
-	BUG_ON(e->refcnt);
+	BUG_ON(atomic_read(&e->refcnt));
 
+	if (e->lc_once) {
+		e->lc_once = 0;
+		lc->once--;
+	}
 	e->lc_number = LC_FREE;
-	hlist_del_init(&e->colision);
+	lc_unhash(e);
 	list_move(&e->list, &lc->free);
 	RETURN();
 }
@@ -297,7 +539,7 @@ static int lc_unused_element_available(struct lru_cache *lc)
 {
 	if (!list_empty(&lc->free))
 		return 1; /* something on the free list */
-	if (!list_empty(&lc->lru))
+	if (!list_empty(&lc->lru) || !list_empty(&lc->lru_once))
 		return 1;  /* something to evict */
 
 	return 0;
@@ -354,13 +596,16 @@ struct lc_element *lc_get(struct lru_cache *lc, unsigned int enr)
 	e = lc_find(lc, enr);
 	if (e) {
 		++lc->hits;
-		if (e->refcnt++ == 0)
+		++lc->policy_hits[lc->policy];
+		lc_touch(lc, e);
+		if (atomic_inc_return(&e->refcnt) == 1)
 			lc->used++;
 		list_move(&e->list, &lc->in_use); /* Not evictable... */
 		RETURN(e);
 	}
 
 	++lc->misses;
+	++lc->policy_misses[lc->policy];
 
 	/* In case there is nothing available and we can not kick out
 	 * the LRU element, we have to wait ...
@@ -383,11 +628,19 @@ struct lc_element *lc_get(struct lru_cache *lc, unsigned int enr)
 	BUG_ON(!e);
 
 	clear_bit(__LC_STARVING, &lc->flags);
-	BUG_ON(++e->refcnt != 1);
-	lc->used++;
 
+	e->lc_birth = lc->changed;
+	clear_bit(__LC_REFERENCED, &e->lc_flags);
+	e->lc_once = lc->policy == LC_POLICY_2Q && !lc_ghost_hit(lc, enr);
+	lc->once += e->lc_once;
+
+	/* publish the change before the reference, so lockless users that
+	 * still found this element by its old label will notice */
 	lc->changing_element = e;
 	lc->new_number = enr;
+	smp_wmb();
+	BUG_ON(atomic_inc_return(&e->refcnt) != 1);
+	lc->used++;
 
 	RETURN(e);
 }
@@ -410,7 +663,9 @@ struct lc_element *lc_try_get(struct lru_cache *lc, unsigned int enr)
 	e = lc_find(lc, enr);
 	if (e) {
 		++lc->hits;
-		if (e->refcnt++ == 0)
+		++lc->policy_hits[lc->policy];
+		lc_touch(lc, e);
+		if (atomic_inc_return(&e->refcnt) == 1)
 			lc->used++;
 		list_move(&e->list, &lc->in_use); /* Not evictable... */
 	}
@@ -430,7 +685,8 @@ void lc_changed(struct lru_cache *lc, struct lc_element *e)
 	++lc->changed;
 	e->lc_number = lc->new_number;
 	list_add(&e->list, &lc->in_use);
-	hlist_add_head(&e->colision, lc_hash_slot(lc, lc->new_number));
+	hlist_add_head_rcu(&e->colision, lc_hash_slot(lc, lc->new_number));
+	smp_wmb();
 	lc->changing_element = NULL;
 	lc->new_number = LC_FREE;
 	clear_bit(__LC_DIRTY, &lc->flags);
@@ -444,24 +700,27 @@ void lc_changed(struct lru_cache *lc, struct lc_element *e)
  * @lc: the lru cache to operate on
  * @e: the element to put
  *
- * If refcnt reaches zero, the element is moved to the lru list,
- * and a %LC_STARVING (if set) is cleared.
+ * If refcnt reaches zero, the element is moved to the lru list (or the
+ * lru_once list, see lc_set_policy()), and a %LC_STARVING (if set) is cleared.
  * Returns the new (post-decrement) refcnt.
  */
 unsigned int lc_put(struct lru_cache *lc, struct lc_element *e)
 {
 	PARANOIA_ENTRY();
 	PARANOIA_LC_ELEMENT(lc, e);
-	BUG_ON(e->refcnt == 0);
+	BUG_ON(atomic_read(&e->refcnt) == 0);
 	BUG_ON(e == lc->changing_element);
-	if (--e->refcnt == 0) {
+	if (atomic_dec_and_test(&e->refcnt)) {
+		/* lockless hits, see lc_touch_lockless() */
+		if (test_and_clear_bit(__LC_REFERENCED, &e->lc_flags))
+			lc_promote(lc, e);
 		/* move it to the front of LRU. */
-		list_move(&e->list, &lc->lru);
+		list_move(&e->list, e->lc_once ? &lc->lru_once : &lc->lru);
 		lc->used--;
 		clear_bit(__LC_STARVING, &lc->flags);
 		smp_mb__after_clear_bit();
 	}
-	RETURN(e->refcnt);
+	RETURN(atomic_read(&e->refcnt));
 }
 
 /**
@@ -505,10 +764,15 @@ void lc_set(struct lru_cache *lc, unsigned int enr, int index)
 
 	e = lc_element_by_index(lc, index);
 	e->lc_number = enr;
-
-	hlist_del_init(&e->colision);
-	hlist_add_head(&e->colision, lc_hash_slot(lc, enr));
-	list_move(&e->list, e->refcnt ? &lc->in_use : &lc->lru);
+	lc->once -= e->lc_once;
+	e->lc_birth = lc->changed;
+	e->lc_once = lc->policy == LC_POLICY_2Q && enr != LC_FREE;
+	lc->once += e->lc_once;
+
+	lc_unhash(e);
+	hlist_add_head_rcu(&e->colision, lc_hash_slot(lc, enr));
+	list_move(&e->list, atomic_read(&e->refcnt) ? &lc->in_use :
+		  e->lc_once ? &lc->lru_once : &lc->lru);
 }
 
 /**
@@ -533,7 +797,7 @@ void lc_seq_dump_details(struct seq_file *seq, struct lru_cache *lc, char *utext
 			seq_printf(seq, "\t%2d: FREE\n", i);
 		} else {
 			seq_printf(seq, "\t%2d: %4u %4u    ", i,
-				   e->lc_number, e->refcnt);
+				   e->lc_number, atomic_read(&e->refcnt));
 			detail(seq, e);
 		}
 	}
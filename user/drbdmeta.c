@@ -68,6 +68,8 @@ int	verbose = 0;
 int	ignore_sanity_checks = 0;
 int	dry_run = 0;
 int     option_peer_max_bio_size = 0;
+unsigned option_al_size_sect = 0;
+unsigned option_al_extent_shift = 0;
 
 struct option metaopt[] = {
     { "ignore-sanity-checks",  no_argument, &ignore_sanity_checks, 1000 },
@@ -75,6 +77,8 @@ struct option metaopt[] = {
     { "force",  no_argument,    0, 'f' },
     { "verbose",  no_argument,    0, 'v' },
     { "peer-max-bio-size",  required_argument, NULL, 'p' },
+    { "al-size",  required_argument, NULL, 'a' },
+    { "al-extent-size",  required_argument, NULL, 'x' },
     { NULL,     0,              0, 0 },
 };
 
@@ -155,6 +159,12 @@ struct option metaopt[] = {
 #define MD_AL_OFFSET_07        8
 #define MD_AL_MAX_SECT_07     64
 #define MD_BM_OFFSET_07        (MD_AL_OFFSET_07 + MD_AL_MAX_SECT_07)
+/* v08 flexible meta data may have a larger AL area, up to */
+#define MD_AL_SIZE_LIMIT_08  1088
+/* v08 meta data may use an other AL extent size than 4M */
+#define AL_EXTENT_SHIFT_07   22
+#define AL_EXTENT_SHIFT_MIN_08 18
+#define AL_EXTENT_SHIFT_MAX_08 24
 #define MD_RESERVED_SECT_07    ( (uint64_t)(128ULL << 11) )
 #define MD_BM_MAX_BYTE_07      ( (uint64_t)(MD_RESERVED_SECT_07 - MD_BM_OFFSET_07)*512 )
 #if BITS_PER_LONG == 32
@@ -168,6 +178,9 @@ struct option metaopt[] = {
 #define DRBD_MD_MAGIC_06   (DRBD_MAGIC+2)
 #define DRBD_MD_MAGIC_07   (DRBD_MAGIC+3)
 #define DRBD_MD_MAGIC_08   (DRBD_MAGIC+4)
+/* v08 with al_extent_shift != AL_EXTENT_SHIFT_07, keeps older modules out.
+ * Only used on disk, in core this is DRBD_MD_MAGIC_08 as well. */
+#define DRBD_MD_MAGIC_08_AL_EXT (DRBD_MAGIC+0x41)
 
 /*
  * }
@@ -223,6 +236,8 @@ struct md_cpu {
 	uint64_t device_uuid;
 	uint32_t bm_bytes_per_bit;
 	uint32_t la_peer_max_bio_size;
+	uint32_t al_size_sect;	/* 0: MD_AL_MAX_SECT_07 */
+	uint32_t al_extent_shift;	/* 0: AL_EXTENT_SHIFT_07 */
 };
 
 /*
@@ -377,6 +392,16 @@ void md_cpu_to_disk_07(struct md_on_disk_07 *disk, const struct md_cpu const *cp
 	memset(disk->reserved, 0, sizeof(disk->reserved));
 }
 
+static inline uint32_t al_size_sect(const struct md_cpu *md)
+{
+	return md->al_size_sect ?: MD_AL_MAX_SECT_07;
+}
+
+static inline uint32_t al_extent_shift(const struct md_cpu *md)
+{
+	return md->al_extent_shift ?: AL_EXTENT_SHIFT_07;
+}
+
 int is_valid_md(int f,
 	const struct md_cpu const *md, const int md_index, const uint64_t ll_size)
 {
@@ -393,6 +418,23 @@ int is_valid_md(int f,
 		return 0;
 	}
 
+	if (al_size_sect(md) != MD_AL_MAX_SECT_07 &&
+	    (md_index >= 0 || md_index == DRBD_MD_INDEX_INTERNAL ||
+	     al_size_sect(md) < MD_AL_MAX_SECT_07 ||
+	     al_size_sect(md) > MD_AL_SIZE_LIMIT_08 ||
+	     al_size_sect(md) & 7)) {
+		fprintf(stderr, "%s unexpected al_size_sect %u\n",
+				v, md->al_size_sect);
+		return 0;
+	}
+	if (md->al_extent_shift &&
+	    (md->al_extent_shift < AL_EXTENT_SHIFT_MIN_08 ||
+	     md->al_extent_shift > AL_EXTENT_SHIFT_MAX_08)) {
+		fprintf(stderr, "%s unexpected al_extent_shift %u\n",
+				v, md->al_extent_shift);
+		return 0;
+	}
+
 	switch(md_index) {
 	default:
 	case DRBD_MD_INDEX_INTERNAL:
@@ -403,16 +445,16 @@ int is_valid_md(int f,
 				MD_AL_OFFSET_07, md->al_offset);
 			return 0;
 		}
-		if (md->bm_offset != MD_BM_OFFSET_07) {
+		if (md->bm_offset != MD_AL_OFFSET_07 + (int)al_size_sect(md)) {
 			fprintf(stderr, "%s Magic number (bm_offset) not found\n", v);
 			return 0;
 		}
 		break;
 	case DRBD_MD_INDEX_FLEX_INT:
-		if (md->al_offset != -MD_AL_MAX_SECT_07) {
+		if (md->al_offset != -(int)al_size_sect(md)) {
 			fprintf(stderr, "%s Magic number (al_offset) not found\n", v);
 			fprintf(stderr, "\texpected: %d, found %d\n",
-				-MD_AL_MAX_SECT_07, md->al_offset);
+				-(int)al_size_sect(md), md->al_offset);
 			return 0;
 		}
 
@@ -421,7 +463,7 @@ int is_valid_md(int f,
 		md_size_sect = (md_size_sect + 7) & ~7ULL;    /* align on 4K blocks */
 		/* plus the "drbd meta data super block",
 		 * and the activity log; unit still sectors */
-		md_size_sect += MD_BM_OFFSET_07;
+		md_size_sect += MD_AL_OFFSET_07 + al_size_sect(md);
 
 		if (md->bm_offset != -(int64_t)md_size_sect + MD_AL_OFFSET_07) {
 			fprintf(stderr, "strange bm_offset %d (expected: "D64")\n",
@@ -505,7 +547,9 @@ struct __packed md_on_disk_08 {
 	be_s32 bm_offset;	/* signed sector offset to the bitmap, from here */
 	be_u32 bm_bytes_per_bit;
 	be_u32 la_peer_max_bio_size; /* last peer max_bio_size */
-	be_u32 reserved_u32[3];
+	be_u32 al_size_sect;	/* size of the al area, 0: MD_AL_MAX_SECT_07 */
+	be_u32 al_extent_shift;	/* 0: AL_EXTENT_SHIFT_07 */
+	be_u32 reserved_u32[1];
 
 	char reserved[8 * 512 - (8*(UI_SIZE+3)+4*11)];
 };
@@ -521,12 +565,16 @@ void md_disk_08_to_cpu(struct md_cpu *cpu, const struct md_on_disk_08 *disk)
 	cpu->device_uuid = be64_to_cpu(disk->device_uuid.be);
 	cpu->flags = be32_to_cpu(disk->flags.be);
 	cpu->magic = be32_to_cpu(disk->magic.be);
+	if (cpu->magic == DRBD_MD_MAGIC_08_AL_EXT)
+		cpu->magic = DRBD_MD_MAGIC_08;
 	cpu->md_size_sect = be32_to_cpu(disk->md_size_sect.be);
 	cpu->al_offset = be32_to_cpu(disk->al_offset.be);
 	cpu->al_nr_extents = be32_to_cpu(disk->al_nr_extents.be);
 	cpu->bm_offset = be32_to_cpu(disk->bm_offset.be);
 	cpu->bm_bytes_per_bit = be32_to_cpu(disk->bm_bytes_per_bit.be);
 	cpu->la_peer_max_bio_size = be32_to_cpu(disk->la_peer_max_bio_size.be);
+	cpu->al_size_sect = be32_to_cpu(disk->al_size_sect.be);
+	cpu->al_extent_shift = be32_to_cpu(disk->al_extent_shift.be);
 }
 
 void md_cpu_to_disk_08(struct md_on_disk_08 *disk, const struct md_cpu *cpu)
@@ -538,13 +586,18 @@ void md_cpu_to_disk_08(struct md_on_disk_08 *disk, const struct md_cpu *cpu)
 	}
 	disk->device_uuid.be = cpu_to_be64(cpu->device_uuid);
 	disk->flags.be = cpu_to_be32(cpu->flags);
-	disk->magic.be = cpu_to_be32(cpu->magic);
+	disk->magic.be = cpu_to_be32(
+		cpu->magic == DRBD_MD_MAGIC_08 &&
+		al_extent_shift(cpu) != AL_EXTENT_SHIFT_07 ?
+		DRBD_MD_MAGIC_08_AL_EXT : cpu->magic);
 	disk->md_size_sect.be = cpu_to_be32(cpu->md_size_sect);
 	disk->al_offset.be = cpu_to_be32(cpu->al_offset);
 	disk->al_nr_extents.be = cpu_to_be32(cpu->al_nr_extents);
 	disk->bm_offset.be = cpu_to_be32(cpu->bm_offset);
 	disk->bm_bytes_per_bit.be = cpu_to_be32(cpu->bm_bytes_per_bit);
 	disk->la_peer_max_bio_size.be = cpu_to_be32(cpu->la_peer_max_bio_size);
+	disk->al_size_sect.be = cpu_to_be32(cpu->al_size_sect);
+	disk->al_extent_shift.be = cpu_to_be32(cpu->al_extent_shift);
 	memset(disk->reserved, 0, sizeof(disk->reserved));
 }
 
@@ -686,7 +739,7 @@ struct meta_cmd cmds[] = {
 	{"dump-md", 0, meta_dump_md, 1},
 	{"restore-md", "file", meta_restore_md, 1},
 	{"verify-dump", "file", meta_verify_dump_file, 1},
-	{"create-md", "[--peer-max-bio-size {val}]", meta_create_md, 1},
+	{"create-md", "[--peer-max-bio-size {val}] [--al-size {val}] [--al-extent-size {val}]", meta_create_md, 1},
 	{"wipe-md", 0, meta_wipe_md, 1},
 	{"outdate", 0, meta_outdate, 1},
 	{"invalidate", 0, meta_invalidate, 1},
@@ -1060,7 +1113,7 @@ void re_initialize_md_offsets(struct format *cfg)
 		/* just occupy the full device; unit: sectors */
 		cfg->md.md_size_sect = cfg->bd_size >> 9;
 		cfg->md.al_offset = MD_AL_OFFSET_07;
-		cfg->md.bm_offset = MD_BM_OFFSET_07;
+		cfg->md.bm_offset = MD_AL_OFFSET_07 + al_size_sect(&cfg->md);
 		break;
 	case DRBD_MD_INDEX_INTERNAL:
 		cfg->md.md_size_sect = MD_RESERVED_SECT_07;
@@ -1068,8 +1121,7 @@ void re_initialize_md_offsets(struct format *cfg)
 		cfg->md.bm_offset = MD_BM_OFFSET_07;
 		break;
 	case DRBD_MD_INDEX_FLEX_INT:
-		/* al size is still fixed */
-		cfg->md.al_offset = -MD_AL_MAX_SECT_07;
+		cfg->md.al_offset = -(int)al_size_sect(&cfg->md);
 
 		/* we need (slightly less than) ~ this much bitmap sectors: */
 		md_size_sect = (cfg->bd_size + (1UL<<24)-1) >> 24; /* BM_EXT_SIZE_B */
@@ -1085,7 +1137,7 @@ void re_initialize_md_offsets(struct format *cfg)
 		}
 		/* plus the "drbd meta data super block",
 		 * and the activity log; unit still sectors */
-		md_size_sect += MD_BM_OFFSET_07;
+		md_size_sect += MD_AL_OFFSET_07 + al_size_sect(&cfg->md);
 		cfg->md.md_size_sect = md_size_sect;
 		cfg->md.bm_offset = -md_size_sect + MD_AL_OFFSET_07;
 		break;
@@ -1097,6 +1149,9 @@ void re_initialize_md_offsets(struct format *cfg)
 /* MAYBE DOES DISK WRITES!! */
 int md_initialize_common(struct format *cfg, int do_disk_writes)
 {
+	off_t al_on_disk_off;
+	size_t al_bytes;
+
 	/* no need to re-initialize the offset of md
 	 * FIXME we need to, if we convert, or resize, in case we allow/implement that...
 	 */
@@ -1117,13 +1172,17 @@ int md_initialize_common(struct format *cfg, int do_disk_writes)
 
 	/* do you want to initialize al to something more useful? */
 	printf("initializing activity log\n");
-	if (MD_AL_MAX_SECT_07*512 > buffer_size) {
-		fprintf(stderr, "%s:%u: LOGIC BUG\n" , __FILE__ , __LINE__ );
-		exit(111);
+	al_on_disk_off = cfg->al_offset;
+	al_bytes = al_size_sect(&cfg->md) * 512;
+	/* a larger AL area may not fit into the buffer in one go */
+	memset(on_disk_buffer, 0x00, buffer_size);
+	while (al_bytes) {
+		size_t chunk = al_bytes > buffer_size ? buffer_size : al_bytes;
+		pwrite_or_die(cfg->md_fd, on_disk_buffer, chunk, al_on_disk_off,
+			"md_initialize_common:AL");
+		al_on_disk_off += chunk;
+		al_bytes -= chunk;
 	}
-	memset(on_disk_buffer, 0x00, MD_AL_MAX_SECT_07*512);
-	pwrite_or_die(cfg->md_fd, on_disk_buffer, MD_AL_MAX_SECT_07*512, cfg->al_offset,
-		"md_initialize_common:AL");
 
 	/* THINK
 	 * do we really need to initialize the bitmap? */
@@ -1197,22 +1256,37 @@ void printf_al(struct format *cfg)
 {
 	struct al_sector_cpu al_cpu;
 	off_t al_on_disk_off = cfg->al_offset;
-	off_t al_size = MD_AL_MAX_SECT_07 * 512;
+	const unsigned al_sect = al_size_sect(&cfg->md);
+	const unsigned sect_per_buffer = buffer_size / 512;
 	struct al_sector_on_disk *al_disk = on_disk_buffer;
 	unsigned s, i;
 	unsigned max_slot_nr = 0;
 
 	printf("# al {\n");
-	pread_or_die(cfg->md_fd, on_disk_buffer, al_size, al_on_disk_off, "printf_al");
-	for (s = 0; s < MD_AL_MAX_SECT_07; s++) {
-		int ok = v07_al_disk_to_cpu(&al_cpu, al_disk + s);
+	printf("# \textent size: %uk\n", 1U << (al_extent_shift(&cfg->md) - 10));
+	for (s = 0; s < al_sect; s++) {
+		int ok;
+		/* a larger AL area is read in buffer sized chunks */
+		if (s % sect_per_buffer == 0) {
+			unsigned n = al_sect - s;
+			if (n > sect_per_buffer)
+				n = sect_per_buffer;
+			pread_or_die(cfg->md_fd, on_disk_buffer, n * 512,
+				al_on_disk_off + s * 512LL, "printf_al");
+		}
+		ok = v07_al_disk_to_cpu(&al_cpu, al_disk + s % sect_per_buffer);
 		printf("#     sector %2u { %s\n", s, ok ? "valid" : "invalid");
 		printf("# \tmagic: 0x%08x\n", al_cpu.magic);
 		printf("# \ttr: %10u\n", al_cpu.tr_number);
 		for (i = 0; i < 62; i++) {
-			printf("# \t%2u: %10u %10u\n", i,
+			printf("# \t%2u: %10u %10u", i,
 				al_cpu.updates[i].pos,
 				al_cpu.updates[i].extent);
+			if (al_cpu.updates[i].extent != -1U)
+				printf(" (at %llukB)",
+					(unsigned long long)al_cpu.updates[i].extent
+					<< (al_extent_shift(&cfg->md) - 10));
+			printf("\n");
 			if (al_cpu.updates[i].pos > max_slot_nr &&
 			    al_cpu.updates[i].pos != -1U)
 				max_slot_nr = al_cpu.updates[i].pos;
@@ -1652,6 +1726,8 @@ int _v08_md_initialize(struct format *cfg, int do_disk_writes)
 	}
 	cfg->md.flags = 0;
 	cfg->md.magic = DRBD_MD_MAGIC_08;
+	cfg->md.al_size_sect = option_al_size_sect;
+	cfg->md.al_extent_shift = option_al_extent_shift;
 
 	return md_initialize_common(cfg, do_disk_writes);
 }
@@ -1876,6 +1952,12 @@ int meta_dump_md(struct format *cfg, char **argv __attribute((unused)), int argc
 			       cfg->md.device_uuid);
 			printf("la-peer-max-bio-size %d;\n",
 			       cfg->md.la_peer_max_bio_size);
+			if (cfg->md.al_size_sect)
+				printf("al-size-sect %u;\n",
+				       cfg->md.al_size_sect);
+			if (cfg->md.al_extent_shift)
+				printf("al-extent-shift %u;\n",
+				       cfg->md.al_extent_shift);
 		}
 		printf("# bm-bytes %u;\n", cfg->bm_bytes);
 		printf_bm(cfg); /* pretty prints the whole bitmap */
@@ -2036,17 +2118,30 @@ int verify_dumpfile_or_restore(struct format *cfg, char **argv, int argc, int pa
 		cfg->md.bm_bytes_per_bit = yylval.u64;
 		EXP(TK_DEVICE_UUID); EXP(TK_U64); EXP(';');
 		cfg->md.device_uuid = yylval.u64;
+		/* optional keywords, in this order */
 		int tok = yylex();
-		switch(tok) {
-		case TK_LA_BIO_SIZE:
+		if (tok == TK_LA_BIO_SIZE) {
 			EXP(TK_NUM); EXP(';');
 			cfg->md.la_peer_max_bio_size = yylval.u64;
-			break;
-		case TK_BM:
-			goto start_of_bm;
-		default:
-			md_parse_error(TK_BM, 0, "keyword 'bm' or 'la-peer-max-bio-size'");
+			tok = yylex();
 		}
+		if (tok == TK_AL_SIZE) {
+			EXP(TK_NUM); EXP(';');
+			cfg->md.al_size_sect = yylval.u64;
+			/* the bitmap follows the larger AL area */
+			if (!parse_only)
+				re_initialize_md_offsets(cfg);
+			tok = yylex();
+		}
+		if (tok == TK_AL_EXT_SHIFT) {
+			EXP(TK_NUM); EXP(';');
+			cfg->md.al_extent_shift = yylval.u64;
+			tok = yylex();
+		}
+		if (tok != TK_BM)
+			md_parse_error(TK_BM, 0, "keyword 'bm', 'la-peer-max-bio-size', "
+				       "'al-size-sect' or 'al-extent-shift'");
+		goto start_of_bm;
 	} else {
 		cfg->md.bm_bytes_per_bit = 4096;
 	}
@@ -3260,6 +3355,33 @@ int main(int argc, char **argv)
 			    exit(10);
 		    }
 		    break;
+	    case 'a':
+		    /* unit: sectors; the default al size is 32k */
+		    option_al_size_sect = m_strtoll(optarg, 's');
+		    if (option_al_size_sect < MD_AL_MAX_SECT_07 ||
+			option_al_size_sect > MD_AL_SIZE_LIMIT_08 ||
+			option_al_size_sect & 7) {
+			    fprintf(stderr, "al-size out of range (32k...544k, multiple of 4k)\n");
+			    exit(10);
+		    }
+		    if (option_al_size_sect == MD_AL_MAX_SECT_07)
+			    option_al_size_sect = 0;
+		    break;
+	    case 'x':
+		    {
+			    /* unit: kB; a power of two, the default is 4M */
+			    unsigned long long kb = m_strtoll(optarg, 'k');
+			    unsigned shift = 10;
+			    while (shift < AL_EXTENT_SHIFT_MAX_08 && (1ULL << (shift - 10)) < kb)
+				    shift++;
+			    if ((1ULL << (shift - 10)) != kb ||
+				shift < AL_EXTENT_SHIFT_MIN_08) {
+				    fprintf(stderr, "al-extent-size out of range (256k...16M, power of two)\n");
+				    exit(10);
+			    }
+			    option_al_extent_shift = shift == AL_EXTENT_SHIFT_07 ? 0 : shift;
+		    }
+		    break;
 	    default:
 		print_usage_and_exit();
 		break;
@@ -3316,6 +3438,23 @@ int main(int argc, char **argv)
 		exit(10);
 	}
 
+	if (option_al_size_sect &&
+	    (command->function != &meta_create_md ||
+	     !is_v08(cfg) ||
+	     (cfg->md_index != DRBD_MD_INDEX_FLEX_EXT &&
+	      cfg->md_index != DRBD_MD_INDEX_FLEX_INT))) {
+		fprintf(stderr, "The --al-size option is only allowed with create-md\n"
+				"of v08 flexible meta data\n");
+		exit(10);
+	}
+
+	if (option_al_extent_shift &&
+	    (command->function != &meta_create_md || !is_v08(cfg))) {
+		fprintf(stderr, "The --al-extent-size option is only allowed with create-md\n"
+				"of v08 meta data\n");
+		exit(10);
+	}
+
 	return command->function(cfg, argv + ai, argc - ai);
 	/* and if we want an explicit free,
 	 * this would be the place for it.
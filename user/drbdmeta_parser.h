@@ -27,6 +27,8 @@ enum yytokentype {
 	TK_INVALID,
 	TK_INVALID_CHAR,
 	TK_LA_BIO_SIZE,
+	TK_AL_SIZE,
+	TK_AL_EXT_SHIFT,
 };
 
 /* avoid compiler warnings about implicit declaration */
@@ -182,6 +182,8 @@ static int sh_status_scmd(struct drbd_cmd *cm, unsigned minor, unsigned short *r
 static int cstate_scmd(struct drbd_cmd *cm, unsigned minor, unsigned short *rtl);
 static int dstate_scmd(struct drbd_cmd *cm, unsigned minor, unsigned short *rtl);
 static int uuids_scmd(struct drbd_cmd *cm, unsigned minor, unsigned short *rtl);
+static int latency_scmd(struct drbd_cmd *cm, unsigned minor, unsigned short *rtl);
+static int stats_scmd(struct drbd_cmd *cm, unsigned minor, unsigned short *rtl);
 static int lk_bdev_scmd(struct drbd_cmd *cm, unsigned minor, unsigned short *rtl);
 
 // convert functions for arguments
@@ -261,6 +263,25 @@ const char *on_congestion_n[] = {
 	[OC_DISCONNECT]         = "disconnect"
 };
 
+const char *read_balancing_n[] = {
+	[RB_PREFER_LOCAL]	= "prefer-local",
+	[RB_PREFER_REMOTE]	= "prefer-remote",
+	[RB_ROUND_ROBIN]	= "round-robin",
+	[RB_LEAST_PENDING]	= "least-pending",
+	[RB_CONGESTED_REMOTE]	= "when-congested-remote",
+	[RB_32K_STRIPING]	= "32K-striping",
+	[RB_64K_STRIPING]	= "64K-striping",
+	[RB_128K_STRIPING]	= "128K-striping",
+	[RB_256K_STRIPING]	= "256K-striping",
+	[RB_512K_STRIPING]	= "512K-striping",
+	[RB_1M_STRIPING]	= "1M-striping"
+};
+
+const char *al_replacement_n[] = {
+	[ALR_LRU]		= "lru",
+	[ALR_2Q]		= "2q"
+};
+
 struct option wait_cmds_options[] = {
 	{ "wfc-timeout",required_argument, 0, 't' },
 	{ "degr-wfc-timeout",required_argument,0,'d'},
@@ -350,6 +371,7 @@ struct drbd_cmd commands[] = {
 		 { "discard-my-data",'D', T_want_lose,     EB },
 		 { "data-integrity-alg",'d', T_integrity_alg,     ES },
 		 { "no-tcp-cork",'o',   T_no_cork,         EB },
+		 { "compress-data",'z', T_compress_data,   EB },
 		 { "dry-run",'n',   T_dry_run,		   EB },
 		 { "on-congestion", 'g', T_on_congestion, EH(on_congestion_n,ON_CONGESTION) },
 		 { "congestion-fill", 'f', T_cong_fill,    EN(CONG_FILL,'s',"byte") },
@@ -383,6 +405,10 @@ struct drbd_cmd commands[] = {
 		 { "c-fill-target", 's',        T_c_fill_target, EN(C_FILL_TARGET,'s',"bytes") },
 		 { "c-max-rate", 'M',		T_c_max_rate, EN(C_MAX_RATE,'k',"bytes/second") },
 		 { "c-min-rate", 'm',	        T_c_min_rate, EN(C_MIN_RATE,'k',"bytes/second") },
+		 { "read-balancing", 'b',	T_read_balancing, EH(read_balancing_n,READ_BALANCING) },
+		 { "c-latency-target", 'l',	T_c_lat_target, EN(C_LAT_TARGET,1,"1/10 milliseconds") },
+		 { "verify-partitions", 'V',	T_verify_partitions, EN(VERIFY_PARTITIONS,1,NULL) },
+		 { "al-replacement", 'L',	T_al_replacement, EH(al_replacement_n,AL_REPLACEMENT) },
 		 CLOSE_OPTIONS }} }, },
 
 	{"new-current-uuid", P_new_c_uuid, F_CONFIG_CMD, {{NULL,
@@ -412,6 +438,8 @@ struct drbd_cmd commands[] = {
 	{"dstate", P_get_state, F_GET_CMD, {.gp={ dstate_scmd} } },
 	{"show-gi", P_get_uuids, F_GET_CMD, {.gp={ uuids_scmd} }},
 	{"get-gi", P_get_uuids, F_GET_CMD, {.gp={ uuids_scmd} } },
+	{"show-latency", P_get_latency, F_GET_CMD, {.gp={ latency_scmd} } },
+	{"show-stats", P_get_stats, F_GET_CMD, {.gp={ stats_scmd} } },
 	{"show", P_get_config, F_GET_CMD, {.gp={ show_scmd} } },
 	{"check-resize", P_get_config, F_GET_CMD, {.gp={ lk_bdev_scmd} } },
 	{"events",          0, F_EVENTS_CMD, { .ep = {
@@ -1786,6 +1814,88 @@ static int uuids_scmd(struct drbd_cmd *cm,
 	return 0;
 }
 
+/* one line per non-empty histogram: sample count,
+ * then "<upper bound:count" for each non-empty bucket, in microseconds */
+static int latency_scmd(struct drbd_cmd *cm __attribute((unused)),
+	       unsigned minor __attribute((unused)),
+	       unsigned short *rtl)
+{
+	uint64_t hist[LAT_CLASSES][LAT_BUCKETS];
+	uint64_t n;
+	char *tl_hist;
+	unsigned int len;
+	int c, i;
+
+	if (!consume_tag_blob(T_lat_hist, rtl, &tl_hist, &len)) {
+		fprintf(stderr,"Reply payload did not carry a lat_hist tag.\n");
+		return 1;
+	}
+	/* classes are only ever appended, a newer module may send more */
+	if (len < sizeof(hist)) {
+		fprintf(stderr, "Unexpected length of T_lat_hist tag. "
+			"You should upgrade your userland tools\n");
+		return 1;
+	}
+	memcpy(hist, tl_hist, sizeof(hist));
+
+	for (c = 0; c < LAT_CLASSES; c++) {
+		for (n = 0, i = 0; i < LAT_BUCKETS; i++)
+			n += hist[c][i];
+		printf("%s: n:%llu", drbd_lat_class_str(c), (unsigned long long)n);
+		for (i = 0; i < LAT_BUCKETS - 1; i++) {
+			if (hist[c][i])
+				printf(" <%u:%llu", 1U << i,
+				       (unsigned long long)hist[c][i]);
+		}
+		if (hist[c][i])
+			printf(" >=%u:%llu", 1U << (i - 1),
+			       (unsigned long long)hist[c][i]);
+		printf("\n");
+	}
+	return 0;
+}
+
+/* "name: value" per counter, then "packet-0x<type>: sent received"
+ * for each packet type seen at all */
+static int stats_scmd(struct drbd_cmd *cm __attribute((unused)),
+	       unsigned minor __attribute((unused)),
+	       unsigned short *rtl)
+{
+	uint64_t cnt[STAT_COUNTERS];
+	uint64_t sent[STAT_PACKET_TYPES];
+	uint64_t recv[STAT_PACKET_TYPES];
+	char *tl_cnt, *tl_sent, *tl_recv;
+	unsigned int len_cnt, len_sent, len_recv;
+	int i;
+
+	if (!consume_tag_blob(T_stat_counters, rtl, &tl_cnt, &len_cnt) ||
+	    !consume_tag_blob(T_stat_pkt_sent, rtl, &tl_sent, &len_sent) ||
+	    !consume_tag_blob(T_stat_pkt_recv, rtl, &tl_recv, &len_recv)) {
+		fprintf(stderr,"Reply payload did not carry the stat tags.\n");
+		return 1;
+	}
+	/* counters are only ever appended, ignore what we do not know */
+	if (len_cnt < sizeof(cnt) || len_sent < sizeof(sent) ||
+	    len_recv < sizeof(recv)) {
+		fprintf(stderr, "Unexpected length of T_stat_* tags. "
+			"You should upgrade your userland tools\n");
+		return 1;
+	}
+	memcpy(cnt, tl_cnt, sizeof(cnt));
+	memcpy(sent, tl_sent, sizeof(sent));
+	memcpy(recv, tl_recv, sizeof(recv));
+
+	for (i = 0; i < STAT_COUNTERS; i++)
+		printf("%s: %llu\n", drbd_stat_str(i), (unsigned long long)cnt[i]);
+	for (i = 0; i < STAT_PACKET_TYPES; i++) {
+		if (sent[i] || recv[i])
+			printf("packet-0x%02x: %llu %llu\n", i,
+			       (unsigned long long)sent[i],
+			       (unsigned long long)recv[i]);
+	}
+	return 0;
+}
+
 static struct drbd_cmd *find_cmd_by_name(char *name)
 {
 	unsigned int i;